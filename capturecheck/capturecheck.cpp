@@ -0,0 +1,351 @@
+// capturecheck.cpp : Checks serial data capture against simulated lines.
+//
+// usage: capturecheck
+//
+// Feeds simulated lines with modem_line_sim_write() while a capture runs,
+// then parses the capture file back, with both the stdio and the mapped
+// output. Three lines fed at a pace a large ring absorbs must come back byte
+// for byte with no overrun records. One line flooding the smallest ring must
+// overrun: walking its records, each data record must carry the bytes that
+// follow the last one plus any gap an overrun record before it accounts for,
+// and the gaps must add up to the overrun bytes in the stats. Either way the
+// file must be exactly as long as the stats say. Prints each failed check and
+// exits with 1 if there were any, 0 otherwise.
+
+#include "pch.h"
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "capture.h"
+#include "compat.h"
+#include "modemmon.h"
+
+#define kCapturePath		"capturecheck.cap"
+#define kNameSize		32		/* per port, after the header */
+
+#define kPacedPorts		3
+#define kPacedWrites		300		/* of 1 to 3000 bytes each, per port */
+#define kPacedRing		(1024 * 1024)
+
+#define kFloodRing		0		/* rounded up to the smallest ring */
+#define kFloodBytes		(32ull * 1024 * 1024)
+#define kFloodChunk		(256 * 1024)
+
+#define kDrainTimeoutMs		10000
+
+/* what a port's capture file records added up to */
+struct PortTotals {
+	uint64_t	bytes;		/* in data records */
+	uint64_t	records;
+	uint64_t	overrunBytes;	/* lengths of overrun records */
+	uint64_t	overruns;
+};
+
+static int failures;
+
+/* byte number pos of the stream fed to port */
+static uint8_t StreamByte(uint32_t port, uint64_t pos)
+{
+	return (uint8_t)(pos * 131 + (pos >> 9) + port * 71);
+}
+
+static void Feed(struct modem_line *line, uint32_t port, uint64_t pos, uint32_t len)
+{
+	std::vector<uint8_t>	data(len);
+
+	for (uint32_t i = 0; i < len; i++)
+		data[i] = StreamByte(port, pos + i);
+	modem_line_sim_write(line, data.data(), len);
+}
+
+/* wait until the readers have taken total bytes off the lines, kept or dropped */
+static bool WaitTaken(struct capture *capture, uint64_t total)
+{
+	struct capture_stats	stats;
+	uint64_t		deadline = modem_time_us() + kDrainTimeoutMs * 1000ull;
+
+	for (;;) {
+		capture_get_stats(capture, &stats);
+		if (stats.bytes + stats.overrunBytes >= total)
+			return true;
+		if (modem_time_us() > deadline)
+			return false;
+		std::this_thread::yield();
+	}
+}
+
+/*
+ * Parse the capture file at kCapturePath: the header, the names, then every
+ * record, checking each data record against StreamByte from where that
+ * port's stream has got to. An overrun record moves the stream on by its
+ * length. The file must be written bytes long and end on a record.
+ */
+static void ExpectFile(const char *step, uint32_t portCount, const char *const *names, uint64_t written,
+		       struct PortTotals *totals)
+{
+	struct capture_file_header	header;
+	struct capture_record		record;
+	std::vector<uint8_t>		data;
+	std::vector<uint64_t>		pos(portCount, 0), last(portCount, 0);
+	uint8_t				buf[65536];
+	size_t				count, offset;
+	FILE				*fp;
+
+	memset(totals, 0, portCount * sizeof(*totals));
+
+	fp = compat_fopen(kCapturePath, "rb");
+	if (fp == NULL) {
+		printf("FAIL: %s: can't open %s\n", step, kCapturePath);
+		failures++;
+		return;
+	}
+	while ((count = fread(buf, 1, sizeof(buf), fp)) > 0)
+		data.insert(data.end(), buf, buf + count);
+	fclose(fp);
+
+	if (data.size() != written) {
+		printf("FAIL: %s: file is %zu bytes, stats say %llu written\n", step, data.size(),
+		       (unsigned long long)written);
+		failures++;
+	}
+
+	if (data.size() < sizeof(header) + (size_t)portCount * kNameSize) {
+		printf("FAIL: %s: file too short for its header\n", step);
+		failures++;
+		return;
+	}
+	memcpy(&header, data.data(), sizeof(header));
+	if (header.magic != kCaptureMagic || header.portCount != portCount) {
+		printf("FAIL: %s: header magic 0x%08x with %u ports\n", step, header.magic, header.portCount);
+		failures++;
+		return;
+	}
+	for (uint32_t port = 0; port < portCount; port++) {
+		const char *name = (const char *)data.data() + sizeof(header) + (size_t)port * kNameSize;
+		if (strncmp(name, names[port], kNameSize) != 0) {
+			printf("FAIL: %s: port %u is named \"%.32s\", expected \"%s\"\n", step, port, name, names[port]);
+			failures++;
+		}
+	}
+
+	for (offset = sizeof(header) + (size_t)portCount * kNameSize; offset < data.size(); ) {
+		if (data.size() - offset < sizeof(record)) {
+			printf("FAIL: %s: %zu bytes after the last record\n", step, data.size() - offset);
+			failures++;
+			return;
+		}
+		memcpy(&record, &data[offset], sizeof(record));
+		offset += sizeof(record);
+
+		if (record.port >= portCount || (record.flags & ~CAPTURE_RECORD_OVERRUN) != 0 || record.length == 0) {
+			printf("FAIL: %s: bad record at %zu: port %u flags 0x%x length %u\n", step, offset - sizeof(record),
+			       record.port, record.flags, record.length);
+			failures++;
+			return;
+		}
+		if (record.timestamp < last[record.port]) {
+			printf("FAIL: %s: port %u record at %zu goes back in time\n", step, record.port,
+			       offset - sizeof(record));
+			failures++;
+		}
+		last[record.port] = record.timestamp;
+
+		if ((record.flags & CAPTURE_RECORD_OVERRUN) != 0) {
+			pos[record.port] += record.length;
+			totals[record.port].overrunBytes += record.length;
+			totals[record.port].overruns++;
+			continue;
+		}
+
+		if (data.size() - offset < ((record.length + 7) & ~7u)) {
+			printf("FAIL: %s: record at %zu runs off the end of the file\n", step, offset - sizeof(record));
+			failures++;
+			return;
+		}
+		for (uint32_t i = 0; i < record.length; i++) {
+			if (data[offset + i] != StreamByte(record.port, pos[record.port] + i)) {
+				printf("FAIL: %s: port %u byte %llu is 0x%02x, expected 0x%02x\n", step, record.port,
+				       (unsigned long long)(pos[record.port] + i), data[offset + i],
+				       StreamByte(record.port, pos[record.port] + i));
+				failures++;
+				return;
+			}
+		}
+		pos[record.port] += record.length;
+		totals[record.port].bytes += record.length;
+		totals[record.port].records++;
+		offset += (record.length + 7) & ~7u;
+	}
+}
+
+/* three lines, each fed a little at a time into a ring with room to spare */
+static void CheckPaced(const char *step, uint32_t flags)
+{
+	static const char *const	names[kPacedPorts] = { "COM1", "COM2", "COM3" };
+	struct modem_line		*lines[kPacedPorts];
+	struct capture			*capture;
+	struct capture_stats		stats;
+	struct PortTotals		totals[kPacedPorts];
+	uint64_t			fed[kPacedPorts] = { 0 }, total = 0, rng = 1;
+	uint32_t			len;
+
+	capture = capture_create(kCapturePath, kPacedRing, flags);
+	for (uint32_t port = 0; port < kPacedPorts; port++) {
+		lines[port] = modem_line_create_sim(names[port]);
+		capture_add(capture, lines[port]);
+	}
+	if (capture_start(capture) != 0) {
+		printf("FAIL: %s: can't start\n", step);
+		failures++;
+		capture_free(capture);
+		for (uint32_t port = 0; port < kPacedPorts; port++)
+			modem_line_close(lines[port]);
+		return;
+	}
+
+	for (int i = 0; i < kPacedWrites; i++) {
+		for (uint32_t port = 0; port < kPacedPorts; port++) {
+			rng = rng * 6364136223846793005ull + 1442695040888963407ull;
+			len = 1 + (uint32_t)(rng >> 33) % 3000;
+			Feed(lines[port], port, fed[port], len);
+			fed[port] += len;
+			total += len;
+		}
+		if (!WaitTaken(capture, total)) {
+			printf("FAIL: %s: the readers stalled\n", step);
+			failures++;
+			break;
+		}
+	}
+
+	if (capture_stop(capture) != 0) {
+		printf("FAIL: %s: capture_stop failed\n", step);
+		failures++;
+	}
+	capture_get_stats(capture, &stats);
+	if (stats.bytes != total || stats.overrunBytes != 0 || stats.overruns != 0 || stats.failedPorts != 0) {
+		printf("FAIL: %s: stats show %llu bytes, %llu overrun in %llu, %u failed ports; expected %llu, none, none\n",
+		       step, (unsigned long long)stats.bytes, (unsigned long long)stats.overrunBytes,
+		       (unsigned long long)stats.overruns, stats.failedPorts, (unsigned long long)total);
+		failures++;
+	}
+
+	ExpectFile(step, kPacedPorts, names, stats.written, totals);
+	for (uint32_t port = 0; port < kPacedPorts; port++) {
+		if (totals[port].bytes != fed[port] || totals[port].overruns != 0) {
+			printf("FAIL: %s: port %u has %llu bytes and %llu overruns in the file, expected %llu and none\n",
+			       step, port, (unsigned long long)totals[port].bytes, (unsigned long long)totals[port].overruns,
+			       (unsigned long long)fed[port]);
+			failures++;
+		}
+	}
+	if (totals[0].records + totals[1].records + totals[2].records != stats.chunks) {
+		printf("FAIL: %s: %llu data records, stats say %llu chunks\n", step,
+		       (unsigned long long)(totals[0].records + totals[1].records + totals[2].records),
+		       (unsigned long long)stats.chunks);
+		failures++;
+	}
+
+	capture_free(capture);
+	for (uint32_t port = 0; port < kPacedPorts; port++)
+		modem_line_close(lines[port]);
+}
+
+/*
+ * One line fed faster than the writer drains the smallest ring. The reader
+ * is kept within a couple of chunks of the feed, so the line's own queue
+ * stays small and only the ring overflows.
+ */
+static void CheckFlood(const char *step, uint32_t flags)
+{
+	static const char *const	names[1] = { "FLOOD" };
+	struct modem_line		*line;
+	struct capture			*capture;
+	struct capture_stats		stats;
+	struct PortTotals		totals;
+	uint64_t			fed;
+
+	capture = capture_create(kCapturePath, kFloodRing, flags);
+	line = modem_line_create_sim(names[0]);
+	capture_add(capture, line);
+	if (capture_start(capture) != 0) {
+		printf("FAIL: %s: can't start\n", step);
+		failures++;
+		capture_free(capture);
+		modem_line_close(line);
+		return;
+	}
+
+	for (fed = 0; fed < kFloodBytes; fed += kFloodChunk) {
+		if (!WaitTaken(capture, fed > kFloodChunk ? fed - kFloodChunk : 0)) {
+			printf("FAIL: %s: the reader stalled\n", step);
+			failures++;
+			break;
+		}
+		Feed(line, 0, fed, kFloodChunk);
+	}
+	if (!WaitTaken(capture, fed)) {
+		printf("FAIL: %s: the reader stalled\n", step);
+		failures++;
+	}
+
+	if (capture_stop(capture) != 0) {
+		printf("FAIL: %s: capture_stop failed\n", step);
+		failures++;
+	}
+	capture_get_stats(capture, &stats);
+	if (stats.bytes + stats.overrunBytes != fed || stats.failedPorts != 0) {
+		printf("FAIL: %s: stats show %llu bytes kept and %llu dropped, %u failed ports; expected %llu in all\n",
+		       step, (unsigned long long)stats.bytes, (unsigned long long)stats.overrunBytes, stats.failedPorts,
+		       (unsigned long long)fed);
+		failures++;
+	}
+	if (stats.overruns == 0) {
+		printf("FAIL: %s: %llu bytes through a %u byte ring without an overrun\n", step, (unsigned long long)fed,
+		       stats.ringSize);
+		failures++;
+	}
+
+	ExpectFile(step, 1, names, stats.written, &totals);
+	if (totals.bytes != stats.bytes || totals.records != stats.chunks) {
+		printf("FAIL: %s: %llu bytes in %llu data records in the file, stats say %llu in %llu\n", step,
+		       (unsigned long long)totals.bytes, (unsigned long long)totals.records,
+		       (unsigned long long)stats.bytes, (unsigned long long)stats.chunks);
+		failures++;
+	}
+	/* consecutive lost reads share one overrun record */
+	if (totals.overrunBytes != stats.overrunBytes || totals.overruns == 0 || totals.overruns > stats.overruns) {
+		printf("FAIL: %s: %llu bytes in %llu overrun records in the file, stats say %llu in %llu reads\n", step,
+		       (unsigned long long)totals.overrunBytes, (unsigned long long)totals.overruns,
+		       (unsigned long long)stats.overrunBytes, (unsigned long long)stats.overruns);
+		failures++;
+	}
+
+	capture_free(capture);
+	modem_line_close(line);
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argv;
+	if (argc > 1) {
+		printf("usage: capturecheck\n");
+		return 1;
+	}
+
+	CheckPaced("paced, stdio", 0);
+	CheckPaced("paced, mapped", CAPTURE_MMAP);
+	CheckFlood("flood, stdio", 0);
+	CheckFlood("flood, mapped", CAPTURE_MMAP);
+
+	remove(kCapturePath);
+
+	if (failures != 0) {
+		printf("capturecheck: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("capturecheck: all checks passed\n");
+	return 0;
+}
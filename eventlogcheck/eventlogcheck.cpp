@@ -0,0 +1,483 @@
+// eventlogcheck.cpp : Checks the modem event log writer against its reader.
+//
+// usage: eventlogcheck
+//
+// Writes logs of known events to the current directory and reads them back:
+// every event through a full replay and the summary, and random queries by
+// time range, port, changed lines and levels against the same filter applied
+// to the events written. The logs span many blocks that overlap in time, so
+// the time search has to use the running bounds, not each block's own. A copy
+// with a block damaged shows that a port query skips, rather than decodes,
+// the blocks whose bitmap leaves the port out. Snapshots of a log that was
+// never closed, one of them cut short mid-block, show the index rebuilt from
+// the blocks that are whole. Prints each failed check and exits with 1 if
+// there were any, 0 otherwise.
+
+#include "pch.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "compat.h"
+#include "eventlog.h"
+#include "fourcc.h"
+
+#define kLogPath		"eventlogcheck.log"
+#define kDamagedPath		"eventlogcheck-damaged.log"
+#define kOpenPath		"eventlogcheck-open.log"
+#define kCrashPath		"eventlogcheck-crash.log"
+#define kTornPath		"eventlogcheck-torn.log"
+
+#define kQueries		500
+
+/* the file layout from eventlog.cpp, for finding a block to damage */
+#define kHeaderSize		32
+#define kNameSize		32
+#define kBlockHeaderSize	40
+#define kBlockMagic		fourcc("SCeb")
+
+/* the events a log should hold, with the lines each port is at as they are made */
+struct Script {
+	std::vector<struct modem_event>	events;
+	uint32_t			lines[3];
+	uint64_t			clock;
+	uint64_t			rng;
+};
+
+static int failures;
+
+static uint32_t Random(struct Script *script)
+{
+	script->rng = script->rng * 6364136223846793005ull + 1442695040888963407ull;
+	return (uint32_t)(script->rng >> 33);
+}
+
+/*
+ * Append one event for port, stamped lag and up to jitter more microseconds
+ * before the clock, toggling a random non-empty set of lines.
+ */
+static void Append(struct event_log *log, struct Script *script, uint32_t port, uint32_t lag, uint32_t jitter)
+{
+	struct modem_event	event;
+
+	script->clock += 1 + Random(script) % 1000;
+	event.timestamp = script->clock - lag - (jitter != 0 ? Random(script) % jitter : 0);
+	event.changed = 1 + Random(script) % MODEM_LINE_ALL;
+	event.lines = script->lines[port] ^ event.changed;
+	event.port = port;
+	script->lines[port] = event.lines;
+
+	if (event_log_append(log, &event) != 0) {
+		printf("FAIL: append of event %zu failed\n", script->events.size());
+		failures++;
+	}
+	script->events.push_back(event);
+}
+
+static bool Matches(const struct event_log_query *query, const struct modem_event *event)
+{
+	return event->timestamp >= query->start && event->timestamp < query->end &&
+	       (query->port < 0 || event->port == (uint32_t)query->port) &&
+	       (query->changed == 0 || (event->changed & query->changed) != 0) &&
+	       (event->lines & query->levelMask) == (query->levelValue & query->levelMask);
+}
+
+static bool Collect(void *refcon, const struct modem_event *event)
+{
+	((std::vector<struct modem_event> *)refcon)->push_back(*event);
+	return true;
+}
+
+static bool StopAfterTen(void *refcon, const struct modem_event *event)
+{
+	(void)event;
+	return ++*(int *)refcon < 10;
+}
+
+/* replay query and check it delivers exactly the events of expected that match, in log order */
+static void ExpectReplay(struct event_log_reader *reader, const char *step, const struct event_log_query *query,
+			 const std::vector<struct modem_event> &expected)
+{
+	std::vector<struct modem_event>	got;
+	size_t				next = 0;
+	int64_t				count;
+
+	count = event_log_replay(reader, query, Collect, &got);
+	if (count != (int64_t)got.size()) {
+		printf("FAIL: %s: replay returned %lld after delivering %zu events\n", step, (long long)count, got.size());
+		failures++;
+		return;
+	}
+
+	for (const struct modem_event &event : expected) {
+		if (!Matches(query, &event))
+			continue;
+		if (next == got.size()) {
+			printf("FAIL: %s: event at %llu on port %u missing\n", step, (unsigned long long)event.timestamp,
+			       event.port);
+			failures++;
+			return;
+		}
+		if (got[next].timestamp != event.timestamp || got[next].port != event.port ||
+		    got[next].lines != event.lines || got[next].changed != event.changed) {
+			printf("FAIL: %s: event %zu is at %llu on port %u, lines 0x%x changed 0x%x; expected at %llu on port %u, lines 0x%x changed 0x%x\n",
+			       step, next, (unsigned long long)got[next].timestamp, got[next].port, got[next].lines,
+			       got[next].changed, (unsigned long long)event.timestamp, event.port, event.lines, event.changed);
+			failures++;
+			return;
+		}
+		next++;
+	}
+	if (next != got.size()) {
+		printf("FAIL: %s: %zu events delivered, expected %zu\n", step, got.size(), next);
+		failures++;
+	}
+}
+
+/* random queries: a time range around events of the log, sometimes narrowed by port, change or level */
+static void ExpectQueries(struct event_log_reader *reader, const char *step, struct Script *script,
+			  const std::vector<struct modem_event> &expected)
+{
+	struct event_log_query	query;
+	char			what[128];
+	uint64_t		a, b;
+
+	for (int i = 0; i < kQueries; i++) {
+		event_log_query_all(&query);
+
+		/* an event's own timestamp, or one either side of it */
+		a = expected[Random(script) % expected.size()].timestamp + Random(script) % 3 - 1ull;
+		b = expected[Random(script) % expected.size()].timestamp + Random(script) % 3 - 1ull;
+		switch (Random(script) % 4) {
+		case 0:
+			query.start = a;
+			break;
+		case 1:
+			query.end = a;
+			break;
+		default:
+			query.start = a < b ? a : b;
+			query.end = a < b ? b : a;
+			break;
+		}
+		if (Random(script) % 2 == 0)
+			query.port = (int32_t)(Random(script) % event_log_port_count(reader));
+		if (Random(script) % 4 == 0)
+			query.changed = 1 + Random(script) % MODEM_LINE_ALL;
+		if (Random(script) % 4 == 0) {
+			query.levelMask = Random(script) % (MODEM_LINE_ALL + 1);
+			query.levelValue = Random(script) % (MODEM_LINE_ALL + 1);
+		}
+
+		snprintf(what, sizeof(what), "%s: query %d, [%llu, %llu) port %d changed 0x%x level 0x%x/0x%x", step, i,
+			 (unsigned long long)query.start, (unsigned long long)query.end, query.port, query.changed,
+			 query.levelValue, query.levelMask);
+		ExpectReplay(reader, what, &query, expected);
+	}
+}
+
+static void ExpectSummary(struct event_log_reader *reader, const std::vector<struct modem_event> &expected)
+{
+	struct event_log_query		query;
+	struct event_log_summary	summary, want;
+
+	memset(&want, 0, sizeof(want));
+	for (const struct modem_event &event : expected) {
+		if (want.events == 0 || event.timestamp < want.first)
+			want.first = event.timestamp;
+		if (event.timestamp > want.last)
+			want.last = event.timestamp;
+		want.events++;
+		for (int line = 0; line < 4; line++) {
+			if ((event.changed & (1 << line)) == 0)
+				continue;
+			if ((event.lines & (1 << line)) != 0)
+				want.rises[line]++;
+			else
+				want.falls[line]++;
+		}
+	}
+
+	event_log_query_all(&query);
+	if (event_log_summarize(reader, &query, &summary) != 0) {
+		printf("FAIL: summary: log damaged\n");
+		failures++;
+	}
+	else if (memcmp(&summary, &want, sizeof(summary)) != 0) {
+		printf("FAIL: summary: %llu events from %llu to %llu, expected %llu from %llu to %llu, or rises and falls differ\n",
+		       (unsigned long long)summary.events, (unsigned long long)summary.first, (unsigned long long)summary.last,
+		       (unsigned long long)want.events, (unsigned long long)want.first, (unsigned long long)want.last);
+		failures++;
+	}
+}
+
+static bool ReadAll(const char *path, std::vector<uint8_t> &data)
+{
+	FILE	*fp = compat_fopen(path, "rb");
+	uint8_t	buf[65536];
+	size_t	count;
+
+	if (fp == NULL)
+		return false;
+	data.clear();
+	while ((count = fread(buf, 1, sizeof(buf), fp)) > 0)
+		data.insert(data.end(), buf, buf + count);
+	fclose(fp);
+	return true;
+}
+
+static bool WriteAll(const char *path, const uint8_t *data, size_t len)
+{
+	FILE	*fp = compat_fopen(path, "wb");
+	bool	ok;
+
+	if (fp == NULL)
+		return false;
+	ok = fwrite(data, 1, len, fp) == len;
+	return fclose(fp) == 0 && ok;
+}
+
+/* offset of block number index in a log of portCount ports, walking the block headers; 0 if there is none */
+static size_t FindBlock(const std::vector<uint8_t> &data, uint32_t portCount, uint32_t index)
+{
+	size_t		offset = kHeaderSize + (size_t)portCount * kNameSize;
+	size_t		bitmap = (portCount + 63) / 64 * sizeof(uint64_t);
+	uint32_t	magic, length;
+
+	for (;;) {
+		if (offset + kBlockHeaderSize + bitmap > data.size())
+			return 0;
+		memcpy(&magic, &data[offset], sizeof(magic));
+		memcpy(&length, &data[offset + 4], sizeof(length));
+		if (magic != kBlockMagic)
+			return 0;
+		if (index-- == 0)
+			return offset;
+		offset += kBlockHeaderSize + bitmap + ((length + 7) & ~7u);
+	}
+}
+
+/*
+ * A closed log of three ports, in blocks of:
+ *	4096 and 904 events on ports 0 and 1, split by the writer and by a flush
+ *	300 events on port 2
+ *	200 of 25 events on every port, jittered by up to 50us; every tenth is
+ *	stamped 20ms late, so that its max is below the max of the blocks before
+ */
+static void CheckClosed(struct Script *script)
+{
+	static const char *const	names[3] = { "COM1", "COM2", NULL };
+	struct event_log		*log;
+	struct event_log_reader		*reader;
+	struct event_log_query		query;
+	std::vector<uint8_t>		data;
+	std::vector<struct modem_event>	none, got;
+	size_t				offset;
+	uint32_t			length;
+	int				stopped = 0;
+	int64_t				count;
+
+	log = event_log_create(kLogPath, 3, names);
+	if (log == NULL) {
+		printf("FAIL: can't create %s\n", kLogPath);
+		failures++;
+		return;
+	}
+	for (int i = 0; i < 5000; i++)
+		Append(log, script, Random(script) % 2, 0, 0);
+	event_log_flush(log);
+	for (int i = 0; i < 300; i++)
+		Append(log, script, 2, 0, 0);
+	event_log_flush(log);
+	for (int block = 0; block < 200; block++) {
+		for (int i = 0; i < 25; i++)
+			Append(log, script, Random(script) % 3, block % 10 == 9 ? 20000 : 0, 50);
+		event_log_flush(log);
+	}
+	if (event_log_close(log) != 0) {
+		printf("FAIL: closing %s failed\n", kLogPath);
+		failures++;
+	}
+
+	reader = event_log_open(kLogPath);
+	if (reader == NULL) {
+		printf("FAIL: can't open %s\n", kLogPath);
+		failures++;
+		return;
+	}
+
+	if (event_log_port_count(reader) != 3) {
+		printf("FAIL: closed: %u ports, expected 3\n", event_log_port_count(reader));
+		failures++;
+	}
+	else {
+		for (uint32_t port = 0; port < 3; port++) {
+			const char *name = event_log_port_name(reader, port);
+			if (strcmp(name, names[port] != NULL ? names[port] : "") != 0) {
+				printf("FAIL: closed: port %u is named \"%s\"\n", port, name);
+				failures++;
+			}
+		}
+	}
+
+	event_log_query_all(&query);
+	ExpectReplay(reader, "closed: every event", &query, script->events);
+	ExpectSummary(reader, script->events);
+	ExpectQueries(reader, "closed", script, script->events);
+
+	query.start = 5;
+	query.end = 5;
+	ExpectReplay(reader, "closed: empty range", &query, none);
+
+	event_log_query_all(&query);
+	count = event_log_replay(reader, &query, StopAfterTen, &stopped);
+	if (count != 10) {
+		printf("FAIL: closed: replay stopped after the tenth event returned %lld\n", (long long)count);
+		failures++;
+	}
+	event_log_close_reader(reader);
+
+	/* block 1 is ports 0 and 1 only: garbage there must not trouble a query for port 2 */
+	if (!ReadAll(kLogPath, data) || (offset = FindBlock(data, 3, 1)) == 0) {
+		printf("FAIL: damaged: can't find block 1 in %s\n", kLogPath);
+		failures++;
+		return;
+	}
+	memcpy(&length, &data[offset + 4], sizeof(length));
+	memset(&data[offset + kBlockHeaderSize + sizeof(uint64_t)], 0x80, length);
+	if (!WriteAll(kDamagedPath, data.data(), data.size()) || (reader = event_log_open(kDamagedPath)) == NULL) {
+		printf("FAIL: damaged: can't write and open %s\n", kDamagedPath);
+		failures++;
+		return;
+	}
+
+	event_log_query_all(&query);
+	query.port = 2;
+	ExpectReplay(reader, "damaged: port 2, outside the damage", &query, script->events);
+
+	query.port = 0;
+	count = event_log_replay(reader, &query, Collect, &got);
+	if (count != -1) {
+		printf("FAIL: damaged: port 0, through the damage, returned %lld, expected -1\n", (long long)count);
+		failures++;
+	}
+	event_log_close_reader(reader);
+}
+
+/*
+ * A log snapshotted after three flushed blocks, while still open: read as
+ * is, the index comes from all three; cut short inside the third, from the
+ * first two. The log is closed afterwards and then reads back in full.
+ */
+static void CheckUnclosed(struct Script *script)
+{
+	struct event_log		*log;
+	struct event_log_reader		*reader;
+	struct event_log_query		query;
+	std::vector<uint8_t>		data;
+	std::vector<struct modem_event>	written, whole;
+	size_t				blocks[3];
+
+	script->events.clear();
+	script->lines[0] = script->lines[1] = script->lines[2] = 0;
+
+	log = event_log_create(kOpenPath, 2, NULL);
+	if (log == NULL) {
+		printf("FAIL: can't create %s\n", kOpenPath);
+		failures++;
+		return;
+	}
+	for (int block = 0; block < 3; block++) {
+		for (int i = 0; i < 700; i++)
+			Append(log, script, Random(script) % 2, 0, 20);
+		event_log_flush(log);
+		blocks[block] = script->events.size();
+	}
+	written = script->events;
+
+	/* more events, still in the block being built when the copy is taken */
+	for (int i = 0; i < 100; i++)
+		Append(log, script, Random(script) % 2, 0, 20);
+
+	if (!ReadAll(kOpenPath, data) || !WriteAll(kCrashPath, data.data(), data.size()) ||
+	    !WriteAll(kTornPath, data.data(), data.size() - 5)) {
+		printf("FAIL: can't copy %s\n", kOpenPath);
+		failures++;
+		event_log_close(log);
+		return;
+	}
+	if (event_log_close(log) != 0) {
+		printf("FAIL: closing %s failed\n", kOpenPath);
+		failures++;
+	}
+
+	reader = event_log_open(kCrashPath);
+	if (reader == NULL) {
+		printf("FAIL: can't open %s\n", kCrashPath);
+		failures++;
+	}
+	else {
+		if (event_log_port_count(reader) != 2 || strcmp(event_log_port_name(reader, 1), "") != 0) {
+			printf("FAIL: unclosed: ports lost\n");
+			failures++;
+		}
+		event_log_query_all(&query);
+		ExpectReplay(reader, "unclosed: every flushed event", &query, written);
+		ExpectQueries(reader, "unclosed", script, written);
+		event_log_close_reader(reader);
+	}
+
+	reader = event_log_open(kTornPath);
+	if (reader == NULL) {
+		printf("FAIL: can't open %s\n", kTornPath);
+		failures++;
+	}
+	else {
+		whole.assign(written.begin(), written.begin() + blocks[1]);
+		event_log_query_all(&query);
+		ExpectReplay(reader, "torn: the blocks before the torn one", &query, whole);
+		event_log_close_reader(reader);
+	}
+
+	reader = event_log_open(kOpenPath);
+	if (reader == NULL) {
+		printf("FAIL: can't open %s\n", kOpenPath);
+		failures++;
+	}
+	else {
+		event_log_query_all(&query);
+		ExpectReplay(reader, "unclosed, then closed: every event", &query, script->events);
+		event_log_close_reader(reader);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct Script	script;
+
+	(void)argv;
+	if (argc > 1) {
+		printf("usage: eventlogcheck\n");
+		return 1;
+	}
+
+	script.lines[0] = script.lines[1] = script.lines[2] = 0;
+	script.clock = 1000000;
+	script.rng = 1;
+
+	CheckClosed(&script);
+	CheckUnclosed(&script);
+
+	remove(kLogPath);
+	remove(kDamagedPath);
+	remove(kOpenPath);
+	remove(kCrashPath);
+	remove(kTornPath);
+
+	if (failures != 0) {
+		printf("eventlogcheck: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("eventlogcheck: all checks passed\n");
+	return 0;
+}
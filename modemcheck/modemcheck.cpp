@@ -0,0 +1,193 @@
+// modemcheck.cpp : Checks modem_monitor against a simulated modem line.
+//
+// usage: modemcheck
+//
+// Drives a line from modem_line_create_sim through a fixed script of
+// transitions and checks every event modem_monitor reports: the lines after
+// it, the lines that toggled, and that its timestamp falls between the change
+// being made and the event arriving, in order. Prints each failed check and
+// exits with 1 if there were any, 0 otherwise.
+
+#include "pch.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "modemmon.h"
+
+/* how long to wait for an event that should come, or make sure one that shouldn't doesn't */
+#define kEventTimeoutMs		2000
+#define kQuietMs		50
+
+struct Recorder {
+	std::mutex				lock;
+	std::condition_variable			cond;
+	std::vector<struct modem_event>		events;
+	std::vector<uint64_t>			arrived;	/* modem_time_us() as each event reached the callback */
+};
+
+static int failures;
+
+static void Fail(const char *what, uint32_t got, uint32_t expected)
+{
+	char gotLines[32], expectedLines[32];
+
+	printf("FAIL: %s: got %s (0x%x), expected %s (0x%x)\n", what,
+	       modem_lines_string(got, gotLines, sizeof(gotLines)), got,
+	       modem_lines_string(expected, expectedLines, sizeof(expectedLines)), expected);
+	failures++;
+}
+
+static bool Record(void *refcon, struct modem_line *line, const struct modem_event *event)
+{
+	Recorder	*recorder = (Recorder *)refcon;
+	uint64_t	now = modem_time_us();
+
+	(void)line;
+
+	std::lock_guard<std::mutex> guard(recorder->lock);
+	recorder->events.push_back(*event);
+	recorder->arrived.push_back(now);
+	recorder->cond.notify_all();
+	return true;
+}
+
+/* wait for event number index, up to timeoutMs; false if it didn't come */
+static bool WaitEvent(Recorder *recorder, size_t index, unsigned timeoutMs, struct modem_event *event, uint64_t *arrived)
+{
+	std::unique_lock<std::mutex> guard(recorder->lock);
+
+	if (!recorder->cond.wait_for(guard, std::chrono::milliseconds(timeoutMs),
+				     [&]() { return recorder->events.size() > index; }))
+		return false;
+
+	*event = recorder->events[index];
+	*arrived = recorder->arrived[index];
+	return true;
+}
+
+/*
+ * Check event number index: after the lines are set at (or, for an initial
+ * state, before) changedAt, it must show lines and changed, with a timestamp
+ * no earlier than changedAt or the previous event, and no later than its arrival.
+ */
+static void ExpectEvent(Recorder *recorder, size_t index, const char *step, uint32_t lines, uint32_t changed,
+			uint64_t changedAt, uint64_t *previous)
+{
+	struct modem_event	event;
+	uint64_t		arrived;
+	char			what[128];
+
+	if (!WaitEvent(recorder, index, kEventTimeoutMs, &event, &arrived)) {
+		printf("FAIL: %s: no event within %u ms\n", step, kEventTimeoutMs);
+		failures++;
+		return;
+	}
+
+	snprintf(what, sizeof(what), "%s: lines", step);
+	if (event.lines != lines)
+		Fail(what, event.lines, lines);
+	snprintf(what, sizeof(what), "%s: changed", step);
+	if (event.changed != changed)
+		Fail(what, event.changed, changed);
+	if (event.port != 0) {
+		printf("FAIL: %s: port %u, expected 0\n", step, event.port);
+		failures++;
+	}
+
+	if (event.timestamp < changedAt || event.timestamp < *previous || event.timestamp > arrived) {
+		printf("FAIL: %s: timestamp %llu outside [%llu, %llu]\n", step, (unsigned long long)event.timestamp,
+		       (unsigned long long)(changedAt > *previous ? changedAt : *previous), (unsigned long long)arrived);
+		failures++;
+	}
+	*previous = event.timestamp;
+}
+
+/* the next event must not come: a change outside the mask, or no change at all */
+static void ExpectQuiet(Recorder *recorder, size_t index, const char *step)
+{
+	struct modem_event	event;
+	uint64_t		arrived;
+
+	if (WaitEvent(recorder, index, kQuietMs, &event, &arrived)) {
+		printf("FAIL: %s: unexpected event, changed 0x%x lines 0x%x\n", step, event.changed, event.lines);
+		failures++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct modem_line	*line;
+	Recorder		recorder;
+	uint64_t		start, changedAt, previous = 0;
+	uint32_t		mask = MODEM_LINE_CTS | MODEM_LINE_DSR | MODEM_LINE_DCD;
+	size_t			index = 0;
+	int			result = -1;
+
+	(void)argv;
+	if (argc > 1) {
+		printf("usage: modemcheck\n");
+		return 1;
+	}
+
+	line = modem_line_create_sim("sim");
+	if (line == NULL) {
+		printf("FAIL: can't create a simulated line\n");
+		return 1;
+	}
+
+	/* a pulse before monitoring starts is over by the initial state, but still reported by the first wait */
+	start = modem_time_us();
+	modem_line_sim_set(line, MODEM_LINE_DSR);
+	modem_line_sim_set(line, MODEM_LINE_DSR | MODEM_LINE_CTS);
+	modem_line_sim_set(line, MODEM_LINE_DSR);
+
+	std::thread monitor([&]() {
+		result = modem_monitor(line, mask, Record, &recorder);
+	});
+
+	ExpectEvent(&recorder, index++, "initial state", MODEM_LINE_DSR, 0, start, &previous);
+	ExpectEvent(&recorder, index++, "CTS pulse", MODEM_LINE_DSR, MODEM_LINE_CTS | MODEM_LINE_DSR, start, &previous);
+
+	changedAt = modem_time_us();
+	modem_line_sim_set(line, MODEM_LINE_DSR | MODEM_LINE_DCD);
+	ExpectEvent(&recorder, index++, "DCD up", MODEM_LINE_DSR | MODEM_LINE_DCD, MODEM_LINE_DCD, changedAt, &previous);
+
+	changedAt = modem_time_us();
+	modem_line_sim_set(line, MODEM_LINE_CTS);
+	ExpectEvent(&recorder, index++, "CTS up, DSR and DCD down", MODEM_LINE_CTS,
+		    MODEM_LINE_CTS | MODEM_LINE_DSR | MODEM_LINE_DCD, changedAt, &previous);
+
+	/* RI is outside the mask: no event, and the line state it leaves shows up only with the next one */
+	modem_line_sim_set(line, MODEM_LINE_CTS | MODEM_LINE_RI);
+	ExpectQuiet(&recorder, index, "RI up, outside the mask");
+
+	changedAt = modem_time_us();
+	modem_line_sim_set(line, MODEM_LINE_CTS | MODEM_LINE_RI | MODEM_LINE_DSR);
+	ExpectEvent(&recorder, index++, "DSR up", MODEM_LINE_CTS | MODEM_LINE_RI | MODEM_LINE_DSR, MODEM_LINE_DSR,
+		    changedAt, &previous);
+
+	/* setting the lines already there is not a transition */
+	modem_line_sim_set(line, MODEM_LINE_CTS | MODEM_LINE_RI | MODEM_LINE_DSR);
+	ExpectQuiet(&recorder, index, "no change");
+
+	modem_monitor_stop(line);
+	monitor.join();
+	if (result != 0) {
+		printf("FAIL: modem_monitor returned %d after being stopped, expected 0\n", result);
+		failures++;
+	}
+
+	modem_line_close(line);
+
+	if (failures != 0) {
+		printf("modemcheck: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("modemcheck: all checks passed\n");
+	return 0;
+}
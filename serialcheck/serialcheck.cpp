@@ -0,0 +1,396 @@
+// serialcheck.cpp : Checks serial_blockdev against its own responder over simulated lines.
+//
+// usage: serialcheck
+//
+// Serves a memory blockdev with serial_blockdev_serve() and reads it through
+// create_serial_blockdev(), with a relay between the two: each end is crossed
+// with one of the relay's own simulated lines, and the relay can lose or damage
+// a reply on its way to the client. Checks that every block reads back as
+// served, that writes land, that a syscfg image on the device opens through
+// it, that noise ahead of a reply costs a bad frame but no retransmit, and
+// that a damaged or lost reply is sent for again. Then, where there are
+// pseudo-terminals, the same reads over one. Prints each failed check and
+// exits with 1 if there were any, 0 otherwise.
+
+#include "pch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "blockdev.h"
+#include "modemmon.h"
+#include "serial_blockdev.h"
+#include "fourcc.h"
+#include "syscfg.h"
+#include "syscfg_private.h"
+
+#define kBlockSize		512
+#define kBlockCount		256
+#define kTimeoutMs		200		/* short, so a lost reply is sent for again quickly */
+
+/* a tag and the 16 bytes it holds inline */
+struct CheckEntry {
+	u_int32_t	tag;
+	uint8_t		fill;
+};
+
+static const struct CheckEntry kEntries[] = {
+	{ fourcc("SrNm"), 0x11 },
+	{ fourcc("Mod#"), 0x22 },
+	{ fourcc("Regn"), 0x33 },
+};
+
+#define kEntryCount		(sizeof(kEntries) / sizeof(kEntries[0]))
+
+/*
+ * Forwards bytes between the relay's end of the client's line and its end of
+ * the server's. Replies pass one frame per read, since the responder writes
+ * each frame at once and the checks below keep one request in flight when
+ * they tamper with its reply.
+ */
+struct Relay {
+	struct modem_line	*client;
+	struct modem_line	*server;
+	std::atomic<int>	drop;		/* replies to lose */
+	std::atomic<int>	damage;		/* replies to pass on with a payload byte flipped */
+};
+
+static int failures;
+
+/* consecutive bytes never spell the frame magic, so a damaged reply resyncs only on a real frame */
+static void FillBlocks(uint8_t *data, uint32_t block, uint32_t count, uint8_t seed)
+{
+	for (uint32_t i = 0; i < count; i++)
+		for (uint32_t j = 0; j < kBlockSize; j++)
+			data[(size_t)i * kBlockSize + j] = (uint8_t)((block + i) * 31 + j + seed);
+}
+
+static void ForwardRequests(Relay *relay)
+{
+	uint8_t	buf[4096];
+	int	count;
+
+	while ((count = relay->client->read_hook(relay->client, buf, sizeof(buf))) > 0) {
+		if (relay->server->write_hook(relay->server, buf, count) <= 0)
+			break;
+	}
+}
+
+static void ForwardReplies(Relay *relay)
+{
+	uint8_t	buf[4096];
+	int	count;
+
+	while ((count = relay->server->read_hook(relay->server, buf, sizeof(buf))) > 0) {
+		if (relay->drop.load() > 0) {
+			relay->drop.fetch_sub(1);
+			continue;
+		}
+		if (relay->damage.load() > 0 && count > (int)sizeof(struct serial_bdev_frame)) {
+			relay->damage.fetch_sub(1);
+			buf[sizeof(struct serial_bdev_frame)] ^= 0x01;
+		}
+		if (relay->client->write_hook(relay->client, buf, count) <= 0)
+			break;
+	}
+}
+
+/* read count blocks from block through dev and check them against the same blocks of image */
+static void ExpectRead(struct blockdev *dev, const char *step, const std::vector<uint8_t> &image, uint32_t block,
+		       uint32_t count)
+{
+	std::vector<uint8_t>	got((size_t)count * kBlockSize);
+	int			result;
+
+	result = blockdev_read_block(dev, got.data(), block, count);
+	if (result != (int)count) {
+		printf("FAIL: %s: read of %u blocks at %u returned %d\n", step, count, block, result);
+		failures++;
+		return;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (memcmp(got.data() + (size_t)i * kBlockSize, image.data() + (size_t)(block + i) * kBlockSize,
+			   kBlockSize) != 0) {
+			printf("FAIL: %s: block %u differs from the one served\n", step, block + i);
+			failures++;
+			return;
+		}
+	}
+}
+
+/* the stats must have moved by exactly badFrames and retransmits since before */
+static void ExpectStats(struct blockdev *dev, const char *step, struct serial_blockdev_stats *before,
+			uint64_t badFrames, uint64_t retransmits)
+{
+	struct serial_blockdev_stats	stats;
+
+	serial_blockdev_get_stats(dev, &stats);
+	if (stats.badFrames - before->badFrames != badFrames) {
+		printf("FAIL: %s: %llu bad frames, expected %llu\n", step,
+		       (unsigned long long)(stats.badFrames - before->badFrames), (unsigned long long)badFrames);
+		failures++;
+	}
+	if (stats.retransmits - before->retransmits != retransmits) {
+		printf("FAIL: %s: %llu retransmits, expected %llu\n", step,
+		       (unsigned long long)(stats.retransmits - before->retransmits), (unsigned long long)retransmits);
+		failures++;
+	}
+	*before = stats;
+}
+
+/* a header and kEntries, inline, in a 4K image at the offset syscfg looks first */
+static void WriteSyscfg(std::vector<uint8_t> &disk)
+{
+	struct syscfgHeader	hdr;
+	struct syscfgEntry	entry;
+	uint8_t			*image = disk.data() + kSysCfgBdevOffset;
+
+	memset(image, 0, 0x1000);
+	hdr.shMagic = kSysCfgHeaderMagic;
+	hdr.shSize = (u_int32_t)(sizeof(hdr) + kEntryCount * sizeof(entry));
+	hdr.shMaxSize = 0x1000;
+	hdr.shVersion = 0x00020002;
+	hdr.shBigEndian = 0;
+	hdr.shKeyCount = kEntryCount;
+	memcpy(image, &hdr, sizeof(hdr));
+
+	for (size_t i = 0; i < kEntryCount; i++) {
+		entry.seTag = kEntries[i].tag;
+		memset(entry.seData, kEntries[i].fill, sizeof(entry.seData));
+		memcpy(image + sizeof(hdr) + i * sizeof(entry), &entry, sizeof(entry));
+	}
+}
+
+static void ExpectSyscfg(struct blockdev *dev)
+{
+	struct syscfg_ctx	*ctx;
+	void			*data;
+	uint32_t		size;
+	uint8_t			expected[16];
+
+	if (register_blockdev(dev) != 0) {
+		printf("FAIL: syscfg: can't register %s\n", dev->name);
+		failures++;
+		return;
+	}
+
+	ctx = syscfg_ctx_open_bdev(dev->name);
+	if (ctx == NULL) {
+		printf("FAIL: syscfg: no image found through %s\n", dev->name);
+		failures++;
+		unregister_blockdev(dev);
+		return;
+	}
+
+	if (syscfg_ctx_key_count(ctx) != kEntryCount) {
+		printf("FAIL: syscfg: %u keys, expected %u\n", syscfg_ctx_key_count(ctx), (unsigned)kEntryCount);
+		failures++;
+	}
+	for (size_t i = 0; i < kEntryCount; i++) {
+		memset(expected, kEntries[i].fill, sizeof(expected));
+		if (!syscfg_ctx_find_tag(ctx, kEntries[i].tag, &data, &size)) {
+			printf("FAIL: syscfg: entry %zu not found\n", i);
+			failures++;
+		}
+		else if (size != sizeof(expected) || memcmp(data, expected, sizeof(expected)) != 0) {
+			printf("FAIL: syscfg: entry %zu has the wrong data\n", i);
+			failures++;
+		}
+	}
+
+	syscfg_ctx_close(ctx);
+	unregister_blockdev(dev);
+}
+
+/*
+ * The simulated lines, with the relay between client and responder. served
+ * is backed by disk, and image is what it should hold.
+ */
+static void CheckSim(struct blockdev *served, const std::vector<uint8_t> &disk, std::vector<uint8_t> &image)
+{
+	struct modem_line		*client, *relayClient, *relayServer, *server;
+	struct blockdev			*dev;
+	struct serial_blockdev_stats	stats;
+	Relay				relay;
+	std::vector<uint8_t>		data(16 * kBlockSize);
+	int				result, serveResult = -1;
+
+	/* a frame header cut short: its magic is found, and its CRC fails over the reply behind it */
+	static const uint8_t noise[] = { 0x53, 0x42, SERIAL_BDEV_READ | SERIAL_BDEV_REPLY, 0, 7, 0, 0, 2 };
+
+	client = modem_line_create_sim("client");
+	relayClient = modem_line_create_sim("relay-client");
+	relayServer = modem_line_create_sim("relay-server");
+	server = modem_line_create_sim("server");
+	modem_line_sim_connect(client, relayClient);
+	modem_line_sim_connect(relayServer, server);
+
+	relay.client = relayClient;
+	relay.server = relayServer;
+	relay.drop = 0;
+	relay.damage = 0;
+
+	std::thread responder([&]() {
+		serveResult = serial_blockdev_serve(server, served);
+	});
+	std::thread requests(ForwardRequests, &relay);
+	std::thread replies(ForwardReplies, &relay);
+
+	dev = create_serial_blockdev("serial", client);
+	if (dev == NULL) {
+		printf("FAIL: sim: no device over the simulated lines\n");
+		failures++;
+	}
+	else if (dev->block_size != kBlockSize || dev->block_count != kBlockCount) {
+		printf("FAIL: sim: geometry %u blocks of %u bytes, expected %u of %u\n", (unsigned)dev->block_count,
+		       dev->block_size, kBlockCount, kBlockSize);
+		failures++;
+	}
+	else {
+		serial_blockdev_set_timeout(dev, kTimeoutMs);
+		memset(&stats, 0, sizeof(stats));
+
+		ExpectRead(dev, "sim: whole device", image, 0, kBlockCount);
+		ExpectRead(dev, "sim: one block", image, 37, 1);
+		ExpectStats(dev, "sim: clean line", &stats, 0, 0);
+
+		FillBlocks(data.data(), 100, 16, 0x80);
+		result = blockdev_write_block(dev, data.data(), 100, 16);
+		if (result != 16) {
+			printf("FAIL: sim: write of 16 blocks returned %d\n", result);
+			failures++;
+		}
+		else if (memcmp(disk.data() + 100 * kBlockSize, data.data(), data.size()) != 0) {
+			printf("FAIL: sim: written blocks did not reach the served device\n");
+			failures++;
+		}
+		memcpy(image.data() + 100 * kBlockSize, data.data(), data.size());
+		ExpectRead(dev, "sim: after the write", image, 100, 16);
+		ExpectStats(dev, "sim: write", &stats, 0, 0);
+
+		ExpectSyscfg(dev);
+
+		modem_line_sim_write(client, noise, sizeof(noise));
+		ExpectRead(dev, "sim: noise before a reply", image, 0, 16);
+		ExpectStats(dev, "sim: noise before a reply", &stats, 1, 0);
+
+		relay.damage = 1;
+		ExpectRead(dev, "sim: damaged reply", image, 200, 1);
+		ExpectStats(dev, "sim: damaged reply", &stats, 1, 1);
+
+		relay.drop = 1;
+		ExpectRead(dev, "sim: lost reply", image, 201, 1);
+		ExpectStats(dev, "sim: lost reply", &stats, 0, 1);
+
+		ExpectRead(dev, "sim: after recovery", image, 0, kBlockCount);
+	}
+
+	/* stop everything reading the lines before any of them is closed */
+	relayClient->cancel_hook(relayClient);
+	relayServer->cancel_hook(relayServer);
+	server->cancel_hook(server);
+	requests.join();
+	replies.join();
+	responder.join();
+	if (serveResult != 0) {
+		printf("FAIL: sim: serial_blockdev_serve returned %d after being cancelled, expected 0\n", serveResult);
+		failures++;
+	}
+
+	if (dev != NULL)
+		free_serial_blockdev(dev);
+	else
+		modem_line_close(client);
+	modem_line_close(relayClient);
+	modem_line_close(relayServer);
+	modem_line_close(server);
+}
+
+/* a pseudo-terminal, responder on the master; skipped where there are none */
+static void CheckPty(struct blockdev *served, const std::vector<uint8_t> &image)
+{
+	struct modem_line	*master, *slave;
+	struct blockdev		*dev;
+	char			peer[64];
+	int			serveResult = -1;
+
+	master = modem_line_open_pty(peer, sizeof(peer));
+	if (master == NULL) {
+		printf("serialcheck: no pseudo-terminal, skipping the pty checks\n");
+		return;
+	}
+	slave = modem_line_open(peer);
+	if (slave == NULL || slave->raw_hook(slave, 0) != 0) {
+		printf("FAIL: pty: can't open %s raw\n", peer);
+		failures++;
+		if (slave != NULL)
+			modem_line_close(slave);
+		modem_line_close(master);
+		return;
+	}
+
+	std::thread responder([&]() {
+		serveResult = serial_blockdev_serve(master, served);
+	});
+
+	dev = create_serial_blockdev("pty", slave);
+	if (dev == NULL) {
+		printf("FAIL: pty: no device over %s\n", peer);
+		failures++;
+	}
+	else {
+		ExpectRead(dev, "pty: whole device", image, 0, kBlockCount);
+		ExpectRead(dev, "pty: one block", image, 201, 1);
+	}
+
+	master->cancel_hook(master);
+	responder.join();
+	if (serveResult != 0) {
+		printf("FAIL: pty: serial_blockdev_serve returned %d after being cancelled, expected 0\n", serveResult);
+		failures++;
+	}
+
+	if (dev != NULL)
+		free_serial_blockdev(dev);
+	else
+		modem_line_close(slave);
+	modem_line_close(master);
+}
+
+int main(int argc, char *argv[])
+{
+	struct blockdev		*served;
+	std::vector<uint8_t>	disk((size_t)kBlockCount * kBlockSize), image;
+
+	(void)argv;
+	if (argc > 1) {
+		printf("usage: serialcheck\n");
+		return 1;
+	}
+
+	FillBlocks(disk.data(), 0, kBlockCount, 0);
+	WriteSyscfg(disk);
+	image = disk;
+
+	served = create_mem_blockdev("served", disk.data(), disk.size(), kBlockSize);
+	if (served == NULL) {
+		printf("FAIL: can't create the served device\n");
+		return 1;
+	}
+
+	CheckSim(served, disk, image);
+	CheckPty(served, image);
+
+	free(served);
+
+	if (failures != 0) {
+		printf("serialcheck: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("serialcheck: all checks passed\n");
+	return 0;
+}
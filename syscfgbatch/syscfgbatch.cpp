@@ -0,0 +1,502 @@
+// syscfgbatch.cpp : Extracts the SysCfg entries of many device images in parallel.
+//
+// usage: syscfgbatch [-j threads] [-f jsonl|csv] [-r] [-l listfile] [-d reference] [-t trace.json] [image|directory ...]
+//
+// Every image becomes one batch of lines on stdout, one line per entry:
+//   jsonl: {"image":"...","tag":"SrNm","size":16,"data":"c0ffee..."}
+//   csv:   image,tag,size,data
+// With -d, each image is instead diffed against the reference, one line per differing tag:
+//   jsonl: {"image":"...","tag":"SrNm","change":"changed","size":16,"ranges":[[0,4]],"data":"c0ffee..."}
+//   csv:   image,tag,change,size,ranges,data    (ranges as offset+length;...)
+// Images that can't be parsed produce a single error line and the run carries on.
+// A throughput summary goes to stderr.
+// With -t, a build with WITH_TRACE=1 also writes a Chrome trace timeline of opening
+// and walking each image.
+
+#include "pch.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "syscfg.h"
+#include "syscfg_diff.h"
+#include "syscfg_private.h"
+#include "trace.h"
+
+namespace fs = std::filesystem;
+
+enum OutputFormat {
+	kFormatJSONL,
+	kFormatCSV,
+};
+
+struct BatchStats {
+	std::atomic<uint64_t>	images{ 0 };
+	std::atomic<uint64_t>	failed{ 0 };
+	std::atomic<uint64_t>	entries{ 0 };
+	std::atomic<uint64_t>	bytes{ 0 };
+};
+
+/*
+ * Work-stealing queue set: each worker pops from the back of its own deque and,
+ * when that runs dry, steals from the front of the others. Images are all queued
+ * up front, so a worker that finds every deque empty is done.
+ */
+class WorkQueues {
+public:
+	explicit WorkQueues(size_t workers) : queues(workers) {}
+
+	void push(size_t worker, fs::path path)
+	{
+		Queue &q = queues[worker % queues.size()];
+		std::lock_guard<std::mutex> guard(q.lock);
+		q.items.push_back(std::move(path));
+	}
+
+	bool pop(size_t worker, fs::path &path)
+	{
+		Queue &own = queues[worker];
+		{
+			std::lock_guard<std::mutex> guard(own.lock);
+			if (!own.items.empty()) {
+				path = std::move(own.items.back());
+				own.items.pop_back();
+				return true;
+			}
+		}
+
+		for (size_t i = 1; i < queues.size(); i++) {
+			Queue &victim = queues[(worker + i) % queues.size()];
+			std::lock_guard<std::mutex> guard(victim.lock);
+			if (!victim.items.empty()) {
+				path = std::move(victim.items.front());
+				victim.items.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	struct Queue {
+		std::mutex		lock;
+		std::deque<fs::path>	items;
+	};
+	std::vector<Queue> queues;
+};
+
+static const char hexDigits[] = "0123456789abcdef";
+
+static void AppendHex(std::string &out, const uint8_t *data, size_t len)
+{
+	size_t base = out.size();
+
+	out.resize(base + len * 2);
+	for (size_t i = 0; i < len; i++) {
+		out[base + i * 2] = hexDigits[data[i] >> 4];
+		out[base + i * 2 + 1] = hexDigits[data[i] & 0xf];
+	}
+}
+
+static void AppendTag(std::string &out, uint32_t tag)
+{
+	char chars[4];
+
+	syscfgTagChars(tag, chars);
+	for (char c : chars)
+		out += (c >= 0x20 && c < 0x7f && c != '"' && c != '\\' && c != ',') ? c : '?';
+}
+
+static void AppendQuoted(std::string &out, const std::string &s, OutputFormat format)
+{
+	out += '"';
+	for (char c : s) {
+		if (format == kFormatJSONL) {
+			if (c == '"' || c == '\\') {
+				out += '\\';
+				out += c;
+			}
+			else if ((unsigned char)c < 0x20) {
+				char esc[8];
+				snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)c);
+				out += esc;
+			}
+			else {
+				out += c;
+			}
+		}
+		else {
+			if (c == '"')
+				out += '"';
+			out += c;
+		}
+	}
+	out += '"';
+}
+
+static void AppendRecord(std::string &out, OutputFormat format, const std::string &image,
+			 uint32_t tag, uint32_t size, const uint8_t *data)
+{
+	if (format == kFormatJSONL) {
+		out += "{\"image\":";
+		AppendQuoted(out, image, format);
+		out += ",\"tag\":\"";
+		AppendTag(out, tag);
+		out += "\",\"size\":";
+		out += std::to_string(size);
+		out += ",\"data\":\"";
+		AppendHex(out, data, size);
+		out += "\"}\n";
+	}
+	else {
+		AppendQuoted(out, image, format);
+		out += ',';
+		AppendTag(out, tag);
+		out += ',';
+		out += std::to_string(size);
+		out += ',';
+		AppendHex(out, data, size);
+		out += '\n';
+	}
+}
+
+static const char *changeNames[] = { "added", "removed", "changed" };
+
+static void AppendChange(std::string &out, OutputFormat format, const std::string &image,
+			 const struct syscfgDiffItem *item)
+{
+	const uint8_t	*data = item->newData ? item->newData : item->oldData;
+	uint32_t	size = item->newData ? item->newSize : item->oldSize;
+
+	if (format == kFormatJSONL) {
+		out += "{\"image\":";
+		AppendQuoted(out, image, format);
+		out += ",\"tag\":\"";
+		AppendTag(out, item->tag);
+		out += "\",\"change\":\"";
+		out += changeNames[item->kind];
+		out += "\",\"size\":";
+		out += std::to_string(size);
+		out += ",\"ranges\":[";
+		for (uint32_t i = 0; i < item->rangeCount; i++) {
+			out += i ? ",[" : "[";
+			out += std::to_string(item->ranges[i].offset);
+			out += ',';
+			out += std::to_string(item->ranges[i].length);
+			out += ']';
+		}
+		out += "],\"data\":\"";
+		AppendHex(out, data, size);
+		out += "\"}\n";
+	}
+	else {
+		AppendQuoted(out, image, format);
+		out += ',';
+		AppendTag(out, item->tag);
+		out += ',';
+		out += changeNames[item->kind];
+		out += ',';
+		out += std::to_string(size);
+		out += ',';
+		for (uint32_t i = 0; i < item->rangeCount; i++) {
+			if (i)
+				out += ';';
+			out += std::to_string(item->ranges[i].offset);
+			out += '+';
+			out += std::to_string(item->ranges[i].length);
+		}
+		out += ',';
+		AppendHex(out, data, size);
+		out += '\n';
+	}
+}
+
+static void AppendError(std::string &out, OutputFormat format, const std::string &image, const char *error)
+{
+	if (format == kFormatJSONL) {
+		out += "{\"image\":";
+		AppendQuoted(out, image, format);
+		out += ",\"error\":";
+		AppendQuoted(out, error, format);
+		out += "}\n";
+	}
+	else {
+		AppendQuoted(out, image, format);
+		out += ",#error,0,";
+		AppendQuoted(out, error, format);
+		out += '\n';
+	}
+}
+
+/*
+ * Accept either a bare SysCfg region or a whole device dump with the region at
+ * its usual offset, in either byte order. The magic is checked here so the
+ * library has nothing to complain about on stdout.
+ */
+static const uint8_t *LocateSysCfg(const std::vector<uint8_t> &image, size_t *len)
+{
+	static const size_t offsets[] = { 0, kSysCfgBdevOffset };
+	uint32_t magic;
+
+	for (size_t offset : offsets) {
+		if (image.size() < offset + sizeof(struct syscfgHeader))
+			continue;
+		memcpy(&magic, image.data() + offset, sizeof(magic));
+		if (magic == kSysCfgHeaderMagic || magic == kSysCfgHeaderMagicSwapped) {
+			*len = image.size() - offset;
+			return image.data() + offset;
+		}
+	}
+	return NULL;
+}
+
+struct DiffContext {
+	std::string		*out;
+	const std::string	*image;
+	OutputFormat		format;
+};
+
+static bool DiffItem(void *refcon, const struct syscfgDiffItem *item)
+{
+	DiffContext *dc = (DiffContext *)refcon;
+
+	AppendChange(*dc->out, dc->format, *dc->image, item);
+	return true;
+}
+
+static bool ReadImage(const fs::path &path, std::vector<uint8_t> &image)
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file)
+		return false;
+
+	std::streamsize size = file.tellg();
+	file.seekg(0, std::ios::beg);
+	image.resize((size_t)size);
+	return size == 0 || (bool)file.read((char *)image.data(), size);
+}
+
+static void ProcessImage(const fs::path &path, OutputFormat format, struct syscfg_ctx *reference,
+			 BatchStats &stats, std::string &out)
+{
+	std::string		name = path.u8string();
+	std::vector<uint8_t>	image;
+	struct syscfg_ctx	*ctx;
+	struct syscfgIterator	it;
+	struct syscfgEntryView	view;
+	const uint8_t		*region;
+	size_t			regionLen;
+
+	stats.images++;
+
+	if (!ReadImage(path, image)) {
+		AppendError(out, format, name, "can't read");
+		stats.failed++;
+		return;
+	}
+	stats.bytes += image.size();
+
+	region = LocateSysCfg(image, &regionLen);
+	if (region == NULL || (ctx = syscfg_ctx_open_buffer(region, regionLen)) == NULL) {
+		AppendError(out, format, name, "no syscfg found");
+		stats.failed++;
+		return;
+	}
+
+	if (reference != NULL) {
+		DiffContext dc = { &out, &name, format };
+		int changes = syscfg_ctx_diff(reference, ctx, DiffItem, &dc);
+		if (changes < 0) {
+			AppendError(out, format, name, "entry data out of bounds");
+			stats.failed++;
+		}
+		else {
+			stats.entries += (uint64_t)changes;
+		}
+		syscfg_ctx_close(ctx);
+		return;
+	}
+
+	if (!syscfg_ctx_iter_begin(ctx, &it)) {
+		AppendError(out, format, name, "entry data out of bounds");
+		stats.failed++;
+		syscfg_ctx_close(ctx);
+		return;
+	}
+
+	while (syscfg_ctx_iter_next(&it, &view)) {
+		AppendRecord(out, format, name, view.tag, view.size, view.data);
+		stats.entries++;
+	}
+
+	syscfg_ctx_close(ctx);
+}
+
+static void CollectImages(const fs::path &path, bool recurse, std::vector<fs::path> &images)
+{
+	std::error_code ec;
+
+	if (fs::is_directory(path, ec)) {
+		if (recurse) {
+			for (const auto &item : fs::recursive_directory_iterator(path, ec))
+				if (item.is_regular_file(ec))
+					images.push_back(item.path());
+		}
+		else {
+			for (const auto &item : fs::directory_iterator(path, ec))
+				if (item.is_regular_file(ec))
+					images.push_back(item.path());
+		}
+	}
+	else {
+		images.push_back(path);
+	}
+}
+
+static void Usage(void)
+{
+	fprintf(stderr, "usage: syscfgbatch [-j threads] [-f jsonl|csv] [-r] [-l listfile] [-d reference] [-t trace.json] [image|directory ...]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<fs::path>	images;
+	OutputFormat		format = kFormatJSONL;
+	unsigned		threads = std::thread::hardware_concurrency();
+	bool			recurse = false;
+	std::vector<fs::path>	roots;
+	BatchStats		stats;
+	std::mutex		outputLock;
+	const char		*referencePath = NULL;
+	const char		*tracePath = NULL;
+	std::vector<uint8_t>	referenceImage;
+	struct syscfg_ctx	*reference = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = (unsigned)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "csv") == 0)
+				format = kFormatCSV;
+			else if (strcmp(argv[i], "jsonl") == 0)
+				format = kFormatJSONL;
+			else {
+				Usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			referencePath = argv[++i];
+		}
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			tracePath = argv[++i];
+		}
+		else if (strcmp(argv[i], "-r") == 0) {
+			recurse = true;
+		}
+		else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			std::ifstream list(argv[++i]);
+			std::string line;
+			if (!list) {
+				fprintf(stderr, "syscfgbatch: can't open list \"%s\"\n", argv[i]);
+				return 1;
+			}
+			while (std::getline(list, line)) {
+				if (!line.empty() && line.back() == '\r')
+					line.pop_back();
+				if (!line.empty())
+					roots.push_back(fs::u8path(line));
+			}
+		}
+		else if (argv[i][0] == '-') {
+			Usage();
+			return 1;
+		}
+		else {
+			roots.push_back(fs::u8path(argv[i]));
+		}
+	}
+
+	if (roots.empty()) {
+		Usage();
+		return 1;
+	}
+	if (threads == 0)
+		threads = 1;
+
+	/* the reference is shared read-only by every worker */
+	if (referencePath != NULL) {
+		const uint8_t	*region;
+		size_t		regionLen;
+
+		if (!ReadImage(fs::u8path(referencePath), referenceImage) ||
+		    (region = LocateSysCfg(referenceImage, &regionLen)) == NULL ||
+		    (reference = syscfg_ctx_open_buffer(region, regionLen)) == NULL) {
+			fprintf(stderr, "syscfgbatch: can't load reference \"%s\"\n", referencePath);
+			return 1;
+		}
+	}
+
+	for (const auto &root : roots)
+		CollectImages(root, recurse, images);
+	if (threads > images.size() && !images.empty())
+		threads = (unsigned)images.size();
+
+	WorkQueues queues(threads);
+	for (size_t i = 0; i < images.size(); i++)
+		queues.push(i, images[i]);
+
+	if (format == kFormatCSV)
+		fputs(reference ? "image,tag,change,size,ranges,data\n" : "image,tag,size,data\n", stdout);
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (unsigned w = 0; w < threads; w++) {
+		workers.emplace_back([&, w]() {
+			fs::path	path;
+			std::string	out;
+
+			while (queues.pop(w, path)) {
+				out.clear();
+				ProcessImage(path, format, reference, stats, out);
+
+				/* one write per image keeps each image's lines together */
+				std::lock_guard<std::mutex> guard(outputLock);
+				fwrite(out.data(), 1, out.size(), stdout);
+			}
+		});
+	}
+	for (auto &worker : workers)
+		worker.join();
+	fflush(stdout);
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (seconds <= 0)
+		seconds = 1e-9;
+
+	fprintf(stderr, "syscfgbatch: %llu images (%llu failed), %llu %s, %.1f MB in %.3f s with %u threads: "
+		"%.0f images/s, %.1f MB/s\n",
+		(unsigned long long)stats.images.load(), (unsigned long long)stats.failed.load(),
+		(unsigned long long)stats.entries.load(), reference ? "changes" : "entries",
+		stats.bytes.load() / 1e6, seconds, threads,
+		stats.images.load() / seconds, stats.bytes.load() / 1e6 / seconds);
+
+	syscfg_ctx_close(reference);
+
+	if (tracePath != NULL && trace_dump_json(tracePath) != 0)
+		return 1;
+
+	return stats.failed.load() == 0 ? 0 : 2;
+}
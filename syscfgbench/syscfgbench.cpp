@@ -0,0 +1,838 @@
+// syscfgbench.cpp : Benchmarks and fuzzes the SysCfg parser on synthetic images.
+//
+// usage: syscfgbench [-k keys,...] [-x percent,...] [-m ms] [-s seed]
+//        syscfgbench -z [-n iterations] [-s seed] [-o crashfile] [image ...]
+//
+// Benchmark mode generates an image for every key count (-k) and share of CNTB
+// entries (-x), and prints one line per image:
+//   init      syscfg_init on the image in memory, microseconds per load
+//   bdev      syscfgInitWithBdev from a memory blockdev, microseconds per load
+//   hit/miss  syscfgFindByTag for tags that are and aren't present, ns per lookup
+//   known     syscfgFindByTag for the well-known tags of syscfg_tags.h, which
+//             the first entries carry, ns per lookup
+//   iter      syscfgFindByIndex and syscfgGetData over every entry, ns per entry
+//   dump      do_syscfg with stdout on the null device, MB of text per second
+//   reload    syscfg_watch_poll on the blockdev after a one-byte write to the
+//             entry table, microseconds per reload
+// Each figure is timed over at least -m milliseconds (default 200).
+//
+// Fuzz mode mutates a corpus of generated images, plus any raw SysCfg regions
+// named on the command line, and runs every mutant through the same entry
+// points and the context API. The image under test ends at an inaccessible
+// page, so a read past its end faults even without a sanitizer. Every entry
+// returned must have its data inside the image (or inside the entry, for
+// inline data). An input that crashes or breaks that rule is written to the
+// crash file (default syscfgbench-crash.bin) and the run stops.
+
+#include "pch.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "blockdev.h"
+#include "compat.h"
+#include "syscfg.h"
+#include "syscfg_output.h"
+#include "syscfg_private.h"
+#include "syscfg_tags.h"
+#include "syscfg_watch.h"
+
+#define kMaxKeys		65536
+#define kFuzzMaxImage		(1024 * 1024)
+#define kBenchBdevName		"syscfgbench"
+
+typedef std::chrono::steady_clock Clock;
+
+static uint64_t Random(uint64_t *state)
+{
+	/* xorshift64* */
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ull;
+}
+
+/*
+ * Four letters, different for every n below 26 * 52^3. The first is lower
+ * case, which keeps them clear of CNTB and of the well-known tags.
+ */
+static uint32_t MakeTag(uint32_t n)
+{
+	static const char letters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	uint32_t tag = (uint8_t)letters[26 + n % 26];
+
+	n /= 26;
+	for (int i = 1; i < 4; i++) {
+		tag = (tag << 8) | (uint8_t)letters[n % 52];
+		n /= 52;
+	}
+	return tag;
+}
+
+/* the tag of entry n in a generated image: the well-known tags come first */
+static uint32_t EntryTag(uint32_t n)
+{
+	return n < SYSCFG_WELL_KNOWN_COUNT ? kSyscfgWellKnownTags[n] : MakeTag(n);
+}
+
+/*
+ * A well-formed image: the header, keys entries of which about cntbPercent are
+ * CNTB with 17 to 256 bytes of extended data each, then the extended data.
+ * shMaxSize, and the image, are rounded up to 4K as on a real device.
+ */
+static void BuildImage(std::vector<uint8_t> &image, uint32_t keys, uint32_t cntbPercent, uint64_t seed)
+{
+	struct syscfgHeader	hdr;
+	struct syscfgEntryCNTB	cntb;
+	std::vector<uint32_t>	sizes(keys);
+	uint64_t		rng = seed * 2 + 1;
+	size_t			tableEnd, ext, i;
+
+	tableEnd = sizeof(hdr) + (size_t)keys * sizeof(struct syscfgEntry);
+	ext = tableEnd;
+	for (i = 0; i < keys; i++) {
+		sizes[i] = (Random(&rng) % 100 < cntbPercent) ? 17 + (uint32_t)(Random(&rng) % 240) : 0;
+		ext += sizes[i];
+	}
+
+	image.assign((ext + 0xfff) & ~(size_t)0xfff, 0);
+
+	hdr.shMagic = kSysCfgHeaderMagic;
+	hdr.shSize = (u_int32_t)tableEnd;
+	hdr.shMaxSize = (u_int32_t)image.size();
+	hdr.shVersion = 0x00020002;
+	hdr.shBigEndian = 0;
+	hdr.shKeyCount = keys;
+	memcpy(image.data(), &hdr, sizeof(hdr));
+
+	ext = tableEnd;
+	for (i = 0; i < keys; i++) {
+		uint8_t *p = image.data() + sizeof(hdr) + i * sizeof(struct syscfgEntry);
+
+		if (sizes[i] == 0) {
+			u_int32_t tag = EntryTag((uint32_t)i);
+			memcpy(p, &tag, sizeof(tag));
+			for (size_t j = 0; j < sizeof(((struct syscfgEntry *)0)->seData); j++)
+				p[sizeof(tag) + j] = (uint8_t)Random(&rng);
+			continue;
+		}
+
+		cntb.seTag = kSyscfgTagCNTB;
+		cntb.seRealTag = EntryTag((uint32_t)i);
+		cntb.seDataSize = sizes[i];
+		cntb.seDataOffset = (u_int32_t)ext;
+		cntb.reserved = 0;
+		memcpy(p, &cntb, sizeof(cntb));
+		for (uint32_t j = 0; j < sizes[i]; j++)
+			image[ext + j] = (uint8_t)Random(&rng);
+		ext += sizes[i];
+	}
+}
+
+static uint32_t Swap32(uint32_t v)
+{
+	return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+/* the same image as a big-endian host would have written it; inline data is bytes and stays put */
+static void SwapImage(std::vector<uint8_t> &image)
+{
+	struct syscfgHeader	hdr;
+	uint32_t		word, tag;
+	size_t			tableEnd, offset;
+
+	memcpy(&hdr, image.data(), sizeof(hdr));
+	tableEnd = sizeof(hdr) + (size_t)hdr.shKeyCount * sizeof(struct syscfgEntry);
+
+	for (offset = sizeof(hdr); offset < tableEnd; offset += sizeof(struct syscfgEntry)) {
+		memcpy(&tag, &image[offset], sizeof(tag));
+		for (size_t w = 0; w < sizeof(struct syscfgEntry); w += sizeof(word)) {
+			if (tag != kSyscfgTagCNTB && w != 0)
+				break;
+			memcpy(&word, &image[offset + w], sizeof(word));
+			word = Swap32(word);
+			memcpy(&image[offset + w], &word, sizeof(word));
+		}
+	}
+	for (offset = 0; offset < sizeof(hdr); offset += sizeof(word)) {
+		memcpy(&word, &image[offset], sizeof(word));
+		word = Swap32(word);
+		memcpy(&image[offset], &word, sizeof(word));
+	}
+}
+
+/* a blockdev holding image where syscfgInitWithBdev looks first */
+static struct blockdev *CreateImageBdev(const std::vector<uint8_t> &image, std::vector<uint8_t> &disk)
+{
+	struct blockdev *bdev;
+
+	disk.assign(kSysCfgBdevOffset + ((image.size() + 511) & ~(size_t)511), 0);
+	memcpy(disk.data() + kSysCfgBdevOffset, image.data(), image.size());
+
+	bdev = create_mem_blockdev(kBenchBdevName, disk.data(), disk.size(), 512);
+	if (bdev != NULL)
+		register_blockdev(bdev);
+	return bdev;
+}
+
+static void FreeImageBdev(struct blockdev *bdev)
+{
+	unregister_blockdev(bdev);
+	free(bdev);
+}
+
+/* call fn until minMs have passed; returns nanoseconds per op */
+template <typename Fn>
+static double TimeOps(double minMs, uint64_t opsPerCall, Fn fn)
+{
+	Clock::time_point	start = Clock::now();
+	uint64_t		calls = 0;
+	double			ns;
+
+	do {
+		fn();
+		calls++;
+		ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	} while (ns < minMs * 1e6);
+
+	return ns / ((double)calls * (opsPerCall ? opsPerCall : 1));
+}
+
+static bool ParseList(const char *arg, std::vector<uint32_t> &list)
+{
+	char *end;
+
+	list.clear();
+	while (*arg != 0) {
+		list.push_back((uint32_t)strtoul(arg, &end, 0));
+		if (end == arg || (*end != ',' && *end != 0))
+			return false;
+		arg = *end == ',' ? end + 1 : end;
+	}
+	return !list.empty();
+}
+
+static int RunBenchmark(const std::vector<uint32_t> &keyCounts, const std::vector<uint32_t> &percents,
+			double minMs, uint64_t seed)
+{
+	struct cmd_arg	args[1];
+	volatile int	sink = 0;
+
+	memset(args, 0, sizeof(args));
+
+	printf("%7s %5s %9s %9s %8s %8s %8s %8s %9s %9s\n", "keys", "cntb%", "init us", "bdev us", "hit ns", "miss ns",
+	       "known ns", "iter ns", "dump MB/s", "reload us");
+
+	for (uint32_t keys : keyCounts) {
+		for (uint32_t percent : percents) {
+			std::vector<uint8_t>	image, disk;
+			std::vector<uint32_t>	hits, misses;
+			struct blockdev		*bdev;
+			struct syscfg_ctx	*ctx;
+			FILE			*fp;
+			long			dumpBytes = 0;
+			struct syscfg_watch	*watch;
+			double			init, load, hit, miss, known, iter, dump, reload;
+			uint8_t			flip = 0;
+			uint64_t		rng = seed * 2 + 1;
+			int			quiet;
+
+			BuildImage(image, keys, percent, seed + keys * 131 + percent);
+
+			for (uint32_t i = 0; i < keys; i++) {
+				hits.push_back(EntryTag(i));
+				misses.push_back(MakeTag(keys + i));
+			}
+			/* visit the tags out of table order, as a caller would */
+			for (size_t i = hits.size(); i > 1; i--) {
+				std::swap(hits[i - 1], hits[(size_t)(Random(&rng) % i)]);
+				std::swap(misses[i - 1], misses[(size_t)(Random(&rng) % i)]);
+			}
+			if (hits.empty()) {
+				hits.push_back(EntryTag(0));
+				misses.push_back(MakeTag(0));
+			}
+
+			/* what do_syscfg prints for this image, to turn dump time into a rate */
+			ctx = syscfg_ctx_open_buffer(image.data(), image.size());
+			fp = compat_tmpfile();
+			if (ctx != NULL && fp != NULL) {
+				syscfg_ctx_dump_format(ctx, 0, args, kSyscfgOutputText, fp);
+				dumpBytes = ftell(fp);
+			}
+			if (fp != NULL)
+				fclose(fp);
+			syscfg_ctx_close(ctx);
+
+			/* loads and dumps print, so stdout is quiet while anything is timed */
+			quiet = compat_quiet_stream(stdout);
+
+			bdev = CreateImageBdev(image, disk);
+			if (bdev == NULL) {
+				compat_restore_stream(stdout, quiet);
+				fprintf(stderr, "syscfgbench: can't create a blockdev\n");
+				return 1;
+			}
+
+			init = TimeOps(minMs, 1, [&]() {
+				syscfg_init(image.data(), image.size());
+			});
+			syscfg_reinit();
+
+			load = TimeOps(minMs, 1, [&]() {
+				syscfg_reinit();
+				sink += syscfgInitWithBdev(kBenchBdevName);
+			});
+
+			hit = TimeOps(minMs, hits.size(), [&]() {
+				struct syscfgMemEntry entry;
+				for (uint32_t tag : hits)
+					sink += syscfgFindByTag(tag, &entry);
+			});
+
+			miss = TimeOps(minMs, misses.size(), [&]() {
+				struct syscfgMemEntry entry;
+				for (uint32_t tag : misses)
+					sink += syscfgFindByTag(tag, &entry);
+			});
+
+			known = TimeOps(minMs, SYSCFG_WELL_KNOWN_COUNT, [&]() {
+				struct syscfgMemEntry entry;
+				for (uint32_t tag : kSyscfgWellKnownTags)
+					sink += syscfgFindByTag(tag, &entry);
+			});
+
+			iter = TimeOps(minMs, keys, [&]() {
+				struct syscfgMemEntry entry;
+				for (uint32_t i = 0; syscfgFindByIndex(i, &entry); i++)
+					sink += syscfgGetData(&entry) != NULL;
+			});
+
+			dump = TimeOps(minMs, 1, [&]() {
+				do_syscfg(0, args);
+			});
+
+			syscfg_reinit();
+
+			/* the last byte of the first entry: inline data, or a CNTB entry's reserved word */
+			reload = 0;
+			if (keys != 0 && (watch = syscfg_watch_bdev(kBenchBdevName)) != NULL) {
+				reload = TimeOps(minMs, 1, [&]() {
+					/* loading the image protects it; the writes here go around that */
+					bdev->protect_start = bdev->protect_end = 0;
+					flip ^= 1;
+					blockdev_write(bdev, &flip, kSysCfgBdevOffset + sizeof(struct syscfgHeader) + sizeof(struct syscfgEntry) - 1, 1);
+					sink += syscfg_watch_poll(watch);
+				});
+				syscfg_watch_close(watch);
+			}
+
+			FreeImageBdev(bdev);
+			compat_restore_stream(stdout, quiet);
+
+			printf("%7u %5u %9.2f %9.2f %8.1f %8.1f %8.1f %8.1f %9.1f %9.2f\n", keys, percent,
+				init / 1000.0, load / 1000.0, hit, miss, known, iter, dump > 0 ? dumpBytes * 1000.0 / dump : 0.0,
+				reload / 1000.0);
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Fuzzing.
+ */
+
+static const char	*fuzzCrashPath = "syscfgbench-crash.bin";
+static const uint8_t	*fuzzInput;
+static size_t		fuzzInputLen;
+static int		fuzzQuietStderr = -1;	/* where stderr went while the parser's complaints are hidden */
+
+static bool WriteInput(const char *path, const uint8_t *data, size_t len)
+{
+	FILE	*fp;
+	bool	ok;
+
+	fp = compat_fopen(path, "wb");
+	if (fp == NULL)
+		return false;
+	ok = fwrite(data, 1, len, fp) == len;
+	return fclose(fp) == 0 && ok;
+}
+
+/* keep the input that brought us down; nothing else is safe to rely on by now */
+static void FuzzCrashHandler(int sig)
+{
+	signal(sig, SIG_DFL);
+	compat_restore_stream(stderr, fuzzQuietStderr);
+	if (fuzzInput != NULL && WriteInput(fuzzCrashPath, fuzzInput, fuzzInputLen))
+		fprintf(stderr, "\nsyscfgbench: signal %d, input written to %s\n", sig, fuzzCrashPath);
+	raise(sig);
+}
+
+/* the end of a buffer is butted against a page that can't be touched */
+struct GuardedBuffer {
+	uint8_t	*base;
+	size_t	size;		/* usable bytes before the guard */
+};
+
+static bool GuardedBufferInit(struct GuardedBuffer *buf, size_t size)
+{
+	size_t page;
+
+#ifdef _WIN32
+	SYSTEM_INFO	info;
+	DWORD		old;
+
+	GetSystemInfo(&info);
+	page = info.dwPageSize;
+	size = (size + page - 1) & ~(page - 1);
+	buf->base = (uint8_t *)VirtualAlloc(NULL, size + page, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (buf->base == NULL || !VirtualProtect(buf->base + size, page, PAGE_NOACCESS, &old))
+		return false;
+#else
+	page = (size_t)sysconf(_SC_PAGESIZE);
+	size = (size + page - 1) & ~(page - 1);
+	buf->base = (uint8_t *)mmap(NULL, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf->base == MAP_FAILED || mprotect(buf->base + size, page, PROT_NONE) != 0)
+		return false;
+#endif
+	buf->size = size;
+	return true;
+}
+
+/* copy len bytes in so that they end right at the guard */
+static uint8_t *GuardedBufferFill(struct GuardedBuffer *buf, const uint8_t *data, size_t len)
+{
+	uint8_t *p = buf->base + buf->size - len;
+
+	memcpy(p, data, len);
+	return p;
+}
+
+struct FuzzStats {
+	uint64_t	runs;
+	uint64_t	loaded;		/* contexts opened on a mutant */
+	uint64_t	validated;	/* ...that iter_begin accepted too */
+	uint64_t	entries;
+};
+
+/*
+ * An entry's data must lie inside the image, or inside the entry for data
+ * held inline. Region is how much of the image the loader could have read;
+ * where an empty payload points doesn't matter.
+ */
+static bool CheckEntry(const struct syscfgMemEntry *entry, const void *data, size_t region)
+{
+	if (data == NULL || entry->seDataSize == 0)
+		return true;
+	if (entry->seDataOffset == 0)
+		return entry->seDataSize <= sizeof(entry->seData);
+	return (uint64_t)entry->seDataOffset + entry->seDataSize <= region;
+}
+
+static const char *FuzzDefaultContext(size_t region, uint32_t maxIndex)
+{
+	struct syscfgMemEntry	entry, byTag;
+	uint8_t			copy[64];
+	void			*data;
+	uint32_t		size, i;
+
+	for (i = 0; i <= maxIndex; i++) {
+		if (!syscfgFindByIndex(i, &entry))
+			continue;
+		if (!CheckEntry(&entry, syscfgGetData(&entry), region))
+			return "syscfgGetData out of bounds";
+		if (!syscfgFindByTag(entry.seTag, &byTag))
+			return "syscfgFindByTag misses a tag syscfgFindByIndex returned";
+		syscfgCopyDataForTag(entry.seTag, copy, sizeof(copy));
+		if (syscfg_find_tag(entry.seTag, &data, &size) && data != NULL && size != 0)
+			copy[0] ^= ((volatile uint8_t *)data)[size - 1];
+	}
+	return NULL;
+}
+
+static const char *FuzzContext(struct syscfg_ctx *ctx, const uint8_t *image, size_t region, bool borrowed,
+			       FILE *null, struct FuzzStats *stats)
+{
+	struct syscfgIterator	it;
+	struct syscfgEntryView	view;
+	struct syscfgMemEntry	entry, byTag;
+	struct cmd_arg		args[1];
+	uint32_t		keys, i;
+
+	keys = syscfg_ctx_key_count(ctx);
+	for (i = 0; i < keys + 4 && i < kMaxKeys; i++) {
+		if (!syscfg_ctx_find_by_index(ctx, i, &entry))
+			continue;
+		stats->entries++;
+		if (!CheckEntry(&entry, syscfg_ctx_get_data(ctx, &entry), region))
+			return "syscfg_ctx_get_data out of bounds";
+		if (!syscfg_ctx_find_by_tag(ctx, entry.seTag, &byTag))
+			return "syscfg_ctx_find_by_tag misses a tag syscfg_ctx_find_by_index returned";
+	}
+
+	if (syscfg_ctx_iter_begin(ctx, &it)) {
+		stats->validated++;
+		while (syscfg_ctx_iter_next(&it, &view)) {
+			/* views into a borrowed image must stay inside it */
+			if (borrowed && view.data != NULL &&
+			    (view.data < image || view.data + view.size > image + region))
+				return "iterator view out of bounds";
+			if (view.data != NULL && view.size != 0)
+				(void)((volatile const uint8_t *)view.data)[view.size - 1];
+		}
+	}
+
+	memset(args, 0, sizeof(args));
+	syscfg_ctx_dump_format(ctx, 0, args, kSyscfgOutputText, null);
+	syscfg_ctx_dump_format(ctx, 0, args, kSyscfgOutputJSON, null);
+	syscfg_ctx_dump_format(ctx, 0, args, kSyscfgOutputBinary, null);
+	return NULL;
+}
+
+/* run one input through every entry point; returns what went wrong, or NULL */
+static const char *FuzzOne(const std::vector<uint8_t> &input, struct GuardedBuffer *guarded, FILE *null,
+			   struct FuzzStats *stats)
+{
+	std::vector<uint8_t>	disk;
+	struct syscfgHeader	hdr;
+	struct blockdev		*bdev;
+	struct syscfg_ctx	*ctx;
+	struct cmd_arg		args[1];
+	const char		*failure = NULL;
+	uint8_t			*image;
+	uint32_t		maxIndex;
+	bool			swapped;
+
+	stats->runs++;
+	image = GuardedBufferFill(guarded, input.data(), input.size());
+	memset(args, 0, sizeof(args));
+
+	/* a byte-swapped image is copied on load, so its views don't point into ours */
+	swapped = input.size() >= sizeof(hdr) && (memcpy(&hdr, image, sizeof(hdr)), hdr.shMagic == kSysCfgHeaderMagicSwapped);
+
+	/* walk a few indexes past what the header claims, but no further than a table could reach */
+	maxIndex = 8;
+	if (input.size() >= sizeof(hdr)) {
+		maxIndex += (uint32_t)__min((size_t)(swapped ? Swap32(hdr.shKeyCount) : hdr.shKeyCount),
+					    (input.size() - sizeof(hdr)) / sizeof(struct syscfgEntry));
+	}
+
+	/* the original API on the borrowed image */
+	syscfg_init(image, input.size());
+	failure = FuzzDefaultContext(input.size(), maxIndex);
+	if (failure == NULL)
+		do_syscfg(0, args);
+	syscfg_reinit();
+	if (failure != NULL)
+		return failure;
+
+	ctx = syscfg_ctx_open_buffer(image, input.size());
+	if (ctx != NULL) {
+		stats->loaded++;
+		failure = FuzzContext(ctx, image, input.size(), !swapped, null, stats);
+		syscfg_ctx_close(ctx);
+		if (failure != NULL)
+			return failure;
+	}
+
+	/* and from a blockdev, whole and lazily */
+	bdev = CreateImageBdev(input, disk);
+	if (bdev == NULL)
+		return NULL;
+
+	if (syscfgInitWithBdev(kBenchBdevName)) {
+		failure = FuzzDefaultContext(disk.size() - kSysCfgBdevOffset, 70);
+		syscfg_reinit();
+	}
+	if (failure == NULL && (ctx = syscfg_ctx_open_bdev_lazy(kBenchBdevName)) != NULL) {
+		stats->loaded++;
+		failure = FuzzContext(ctx, NULL, disk.size() - kSysCfgBdevOffset, false, null, stats);
+		syscfg_ctx_close(ctx);
+	}
+
+	FreeImageBdev(bdev);
+	return failure;
+}
+
+static const uint32_t kInterestingWords[] = {
+	0, 1, 4, 15, 16, 17, 20, 24, 0x7f, 0x80, 0xff, 0x1000, 0x4000,
+	0x7fffffff, 0x80000000, 0xfffffff0, 0xfffffffc, 0xffffffff,
+	kSyscfgTagCNTB, kSysCfgHeaderMagic, kSysCfgHeaderMagicSwapped,
+};
+
+/* a word that means something to this image: a boundary, or one just past it */
+static uint32_t PickWord(const std::vector<uint8_t> &image, uint64_t *rng)
+{
+	size_t tableEnd = image.size() >= sizeof(struct syscfgHeader) ?
+		sizeof(struct syscfgHeader) + (size_t)((const struct syscfgHeader *)image.data())->shKeyCount * sizeof(struct syscfgEntry) : 0;
+
+	switch (Random(rng) % 4) {
+	case 0:
+		return (uint32_t)image.size() + (uint32_t)(Random(rng) % 3) - 1;
+	case 1:
+		return (uint32_t)tableEnd + (uint32_t)(Random(rng) % 3) - 1;
+	case 2:
+		return (uint32_t)Random(rng);
+	default:
+		return kInterestingWords[Random(rng) % (sizeof(kInterestingWords) / sizeof(kInterestingWords[0]))];
+	}
+}
+
+static void PutWord(std::vector<uint8_t> &image, size_t offset, uint32_t word)
+{
+	if (offset + sizeof(word) <= image.size())
+		memcpy(&image[offset], &word, sizeof(word));
+}
+
+/* one to four edits, most of them aimed at the header and the entry table */
+static void Mutate(std::vector<uint8_t> &image, uint64_t *rng)
+{
+	struct syscfgHeader	hdr;
+	size_t			table, entries, a, b, len;
+	int			edits = 1 + (int)(Random(rng) % 4);
+
+	while (edits-- > 0) {
+		if (image.size() < sizeof(hdr))
+			return;
+		memcpy(&hdr, image.data(), sizeof(hdr));
+		entries = __min((size_t)hdr.shKeyCount, (image.size() - sizeof(hdr)) / sizeof(struct syscfgEntry));
+		table = sizeof(hdr) + entries * sizeof(struct syscfgEntry);
+
+		switch (Random(rng) % 8) {
+		case 0:		/* flip a bit anywhere */
+			a = (size_t)(Random(rng) % image.size());
+			image[a] ^= (uint8_t)(1 << (Random(rng) % 8));
+			break;
+		case 1:		/* scribble a byte in the table */
+			image[(size_t)(Random(rng) % table)] = (uint8_t)Random(rng);
+			break;
+		case 2:		/* a boundary word somewhere in the table */
+			PutWord(image, (size_t)(Random(rng) % (table / 4)) * 4, PickWord(image, rng));
+			break;
+		case 3:		/* a header field: size, max size, version, endianness or key count */
+			PutWord(image, 4 * (1 + (size_t)(Random(rng) % 5)), PickWord(image, rng));
+			break;
+		case 4:		/* an entry's real tag, size or offset */
+			if (entries == 0)
+				break;
+			a = sizeof(hdr) + (size_t)(Random(rng) % entries) * sizeof(struct syscfgEntry);
+			if (Random(rng) % 2)
+				PutWord(image, a, kSyscfgTagCNTB);
+			PutWord(image, a + 4 * (1 + (size_t)(Random(rng) % 3)), PickWord(image, rng));
+			break;
+		case 5:		/* one entry over another, for shared and overlapping payloads */
+			if (entries < 2)
+				break;
+			a = sizeof(hdr) + (size_t)(Random(rng) % entries) * sizeof(struct syscfgEntry);
+			b = sizeof(hdr) + (size_t)(Random(rng) % entries) * sizeof(struct syscfgEntry);
+			memcpy(&image[b], &image[a], sizeof(struct syscfgEntry) - (Random(rng) % 2) * 4);
+			break;
+		case 6:		/* cut the image short */
+			len = (size_t)(Random(rng) % (image.size() + 1));
+			if (Random(rng) % 2)
+				len = __max(len, table - (size_t)(Random(rng) % (sizeof(struct syscfgEntry) + 1)));
+			image.resize(len);
+			break;
+		default:	/* grow the image */
+			image.resize(__min(image.size() + 1 + (size_t)(Random(rng) % 4096), (size_t)kFuzzMaxImage), 0);
+			break;
+		}
+	}
+}
+
+static bool ReadInput(const char *path, std::vector<uint8_t> &data)
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file)
+		return false;
+
+	std::streamsize size = file.tellg();
+	file.seekg(0, std::ios::beg);
+	data.resize((size_t)size);
+	return size == 0 || (bool)file.read((char *)data.data(), size);
+}
+
+static int RunFuzz(uint64_t iterations, uint64_t seed, const std::vector<const char *> &seedPaths)
+{
+	static const uint32_t		seedKeys[] = { 0, 1, 3, 16, 61, 62, 63, 200 };
+	static const uint32_t		seedPercents[] = { 0, 50, 100 };
+	std::vector<std::vector<uint8_t>> corpus;
+	std::vector<uint8_t>		input;
+	struct GuardedBuffer		guarded;
+	struct FuzzStats		stats;
+	const char			*failure;
+	FILE				*null;
+	uint64_t			rng = seed * 2 + 1, i;
+	int				quietStdout;
+
+	for (uint32_t keys : seedKeys) {
+		for (uint32_t percent : seedPercents) {
+			corpus.emplace_back();
+			BuildImage(corpus.back(), keys, percent, seed + keys + percent);
+			if (keys == 16 || keys == 62) {
+				corpus.push_back(corpus.back());
+				SwapImage(corpus.back());
+			}
+		}
+	}
+	for (const char *path : seedPaths) {
+		corpus.emplace_back();
+		if (!ReadInput(path, corpus.back()) || corpus.back().size() > kFuzzMaxImage) {
+			fprintf(stderr, "syscfgbench: can't use seed \"%s\"\n", path);
+			return 1;
+		}
+	}
+
+	if (!GuardedBufferInit(&guarded, kFuzzMaxImage)) {
+		fprintf(stderr, "syscfgbench: can't set up the guard page\n");
+		return 1;
+	}
+	null = compat_fopen(
+#ifdef _WIN32
+		"NUL",
+#else
+		"/dev/null",
+#endif
+		"wb");
+	if (null == NULL) {
+		fprintf(stderr, "syscfgbench: can't open the null device\n");
+		return 1;
+	}
+
+	signal(SIGSEGV, FuzzCrashHandler);
+	signal(SIGABRT, FuzzCrashHandler);
+	signal(SIGFPE, FuzzCrashHandler);
+	signal(SIGILL, FuzzCrashHandler);
+
+	memset(&stats, 0, sizeof(stats));
+	fprintf(stderr, "syscfgbench: fuzzing %llu inputs from %zu seeds, seed %llu\n",
+		(unsigned long long)iterations, corpus.size(), (unsigned long long)seed);
+
+	/* damaged images make the loaders and the dumps complain on both streams */
+	auto start = Clock::now();
+	quietStdout = compat_quiet_stream(stdout);
+	fuzzQuietStderr = compat_quiet_stream(stderr);
+
+	for (i = 0; i < iterations; i++) {
+		/* the seeds go through once as they are */
+		if (i < corpus.size()) {
+			input = corpus[(size_t)i];
+		}
+		else {
+			input = corpus[(size_t)(Random(&rng) % corpus.size())];
+			Mutate(input, &rng);
+		}
+
+		fuzzInput = input.data();
+		fuzzInputLen = input.size();
+		failure = FuzzOne(input, &guarded, null, &stats);
+		if (failure != NULL) {
+			compat_restore_stream(stdout, quietStdout);
+			compat_restore_stream(stderr, fuzzQuietStderr);
+			WriteInput(fuzzCrashPath, input.data(), input.size());
+			fprintf(stderr, "syscfgbench: input %llu: %s, written to %s\n",
+				(unsigned long long)i, failure, fuzzCrashPath);
+			return 2;
+		}
+
+		if ((i + 1) % 10000 == 0) {
+			compat_restore_stream(stderr, fuzzQuietStderr);
+			fprintf(stderr, "  %llu inputs, %llu loaded, %llu validated\n", (unsigned long long)(i + 1),
+				(unsigned long long)stats.loaded, (unsigned long long)stats.validated);
+			fuzzQuietStderr = compat_quiet_stream(stderr);
+		}
+	}
+
+	compat_restore_stream(stdout, quietStdout);
+	compat_restore_stream(stderr, fuzzQuietStderr);
+	fuzzQuietStderr = -1;
+	fuzzInput = NULL;
+
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	fprintf(stderr, "syscfgbench: %llu inputs, %llu loaded, %llu validated, %llu entries checked, %.0f inputs/s\n",
+		(unsigned long long)stats.runs, (unsigned long long)stats.loaded, (unsigned long long)stats.validated,
+		(unsigned long long)stats.entries, seconds > 0 ? stats.runs / seconds : 0.0);
+	fclose(null);
+	return 0;
+}
+
+static void Usage(void)
+{
+	fprintf(stderr, "usage: syscfgbench [-k keys,...] [-x percent,...] [-m ms] [-s seed]\n");
+	fprintf(stderr, "       syscfgbench -z [-n iterations] [-s seed] [-o crashfile] [image ...]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<uint32_t>		keyCounts = { 16, 62, 256, 1024, 4096 };
+	std::vector<uint32_t>		percents = { 0, 25, 100 };
+	std::vector<const char *>	seedPaths;
+	double				minMs = 200;
+	uint64_t			seed = 1;
+	uint64_t			iterations = 100000;
+	bool				fuzz = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+			if (!ParseList(argv[++i], keyCounts)) {
+				Usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+			if (!ParseList(argv[++i], percents)) {
+				Usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			minMs = strtod(argv[++i], NULL);
+		}
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			seed = strtoull(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			iterations = strtoull(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			fuzzCrashPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "-z") == 0) {
+			fuzz = true;
+		}
+		else if (argv[i][0] == '-' || !fuzz) {
+			Usage();
+			return 1;
+		}
+		else {
+			seedPaths.push_back(argv[i]);
+		}
+	}
+
+	if (fuzz)
+		return RunFuzz(iterations, seed, seedPaths);
+
+	for (uint32_t &keys : keyCounts)
+		keys = __min(keys, (uint32_t)kMaxKeys);
+	for (uint32_t &percent : percents)
+		percent = __min(percent, 100u);
+	return RunBenchmark(keyCounts, percents, minMs, seed);
+}
@@ -0,0 +1,505 @@
+#include "pch.h"
+#include <string.h>
+#include "aes.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#define AES_NI 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AES_NI_TARGET
+#else
+#include <cpuid.h>
+/* GCC and clang only emit AES-NI in functions built for it; nothing calls them before cpuid says so */
+#define AES_NI_TARGET	__attribute__((target("aes,sse2")))
+#endif
+#endif
+
+/* blocks in flight at once, as AESENC has a latency several times its issue rate; see AESNI_EACH_LANE */
+#define AES_XTS_LANES	8
+
+#define GETU32(p)	(((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+#define PUTU32(p, v)	((p)[0] = (uint8_t)((v) >> 24), (p)[1] = (uint8_t)((v) >> 16), (p)[2] = (uint8_t)((v) >> 8), (p)[3] = (uint8_t)(v))
+#define ROTR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL8(x, n)	((uint8_t)(((x) << (n)) | ((x) >> (8 - (n)))))
+
+struct aes_tables {
+	uint8_t		sbox[256];
+	uint8_t		inv_sbox[256];
+	uint32_t	te[4][256];	/* SubBytes and MixColumns for one byte of a column, in each of its rows */
+	uint32_t	td[4][256];	/* the same for InvSubBytes and InvMixColumns */
+};
+
+static uint8_t aes_xtime(uint8_t x)
+{
+	return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+static uint8_t aes_mul(uint8_t a, uint8_t b)
+{
+	uint8_t r = 0;
+
+	for (; b != 0; b >>= 1, a = aes_xtime(a)) {
+		if (b & 1)
+			r ^= a;
+	}
+	return r;
+}
+
+static struct aes_tables aes_build_tables(void)
+{
+	struct aes_tables	t;
+	uint8_t			p = 1, q = 1, s, si;
+	uint32_t		i, w, k;
+
+	/* p walks the powers of 3 and q those of its inverse, so q is always 1/p */
+	do {
+		p = (uint8_t)(p ^ aes_xtime(p));
+		q ^= (uint8_t)(q << 1);
+		q ^= (uint8_t)(q << 2);
+		q ^= (uint8_t)(q << 4);
+		if (q & 0x80)
+			q ^= 0x09;
+		t.sbox[p] = (uint8_t)(q ^ ROTL8(q, 1) ^ ROTL8(q, 2) ^ ROTL8(q, 3) ^ ROTL8(q, 4) ^ 0x63);
+	} while (p != 1);
+	t.sbox[0] = 0x63;
+
+	for (i = 0; i < 256; i++)
+		t.inv_sbox[t.sbox[i]] = (uint8_t)i;
+
+	for (i = 0; i < 256; i++) {
+		s = t.sbox[i];
+		si = t.inv_sbox[i];
+		w = ((uint32_t)aes_xtime(s) << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | (uint32_t)(aes_xtime(s) ^ s);
+		for (k = 0; k < 4; k++)
+			t.te[k][i] = k ? ROTR32(w, 8 * k) : w;
+		w = ((uint32_t)aes_mul(si, 14) << 24) | ((uint32_t)aes_mul(si, 9) << 16) |
+		    ((uint32_t)aes_mul(si, 13) << 8) | (uint32_t)aes_mul(si, 11);
+		for (k = 0; k < 4; k++)
+			t.td[k][i] = k ? ROTR32(w, 8 * k) : w;
+	}
+
+	return t;
+}
+
+static const struct aes_tables &aes_get_tables(void)
+{
+	/* built on first use, which C++11 makes thread-safe */
+	static const struct aes_tables tables = aes_build_tables();
+
+	return tables;
+}
+
+static void aes_encrypt_soft(const struct aes_tables &t, const uint8_t *rk, uint32_t rounds, const uint8_t *in, uint8_t *out)
+{
+	uint32_t s0, s1, s2, s3, t0, t1, t2, t3, r;
+
+	s0 = GETU32(in) ^ GETU32(rk);
+	s1 = GETU32(in + 4) ^ GETU32(rk + 4);
+	s2 = GETU32(in + 8) ^ GETU32(rk + 8);
+	s3 = GETU32(in + 12) ^ GETU32(rk + 12);
+
+	for (r = 1; r < rounds; r++) {
+		rk += AES_BLOCK_LENGTH;
+		t0 = t.te[0][s0 >> 24] ^ t.te[1][(s1 >> 16) & 0xff] ^ t.te[2][(s2 >> 8) & 0xff] ^ t.te[3][s3 & 0xff] ^ GETU32(rk);
+		t1 = t.te[0][s1 >> 24] ^ t.te[1][(s2 >> 16) & 0xff] ^ t.te[2][(s3 >> 8) & 0xff] ^ t.te[3][s0 & 0xff] ^ GETU32(rk + 4);
+		t2 = t.te[0][s2 >> 24] ^ t.te[1][(s3 >> 16) & 0xff] ^ t.te[2][(s0 >> 8) & 0xff] ^ t.te[3][s1 & 0xff] ^ GETU32(rk + 8);
+		t3 = t.te[0][s3 >> 24] ^ t.te[1][(s0 >> 16) & 0xff] ^ t.te[2][(s1 >> 8) & 0xff] ^ t.te[3][s2 & 0xff] ^ GETU32(rk + 12);
+		s0 = t0;
+		s1 = t1;
+		s2 = t2;
+		s3 = t3;
+	}
+
+	/* the last round has no MixColumns */
+	rk += AES_BLOCK_LENGTH;
+	t0 = ((uint32_t)t.sbox[s0 >> 24] << 24) ^ ((uint32_t)t.sbox[(s1 >> 16) & 0xff] << 16) ^
+	     ((uint32_t)t.sbox[(s2 >> 8) & 0xff] << 8) ^ (uint32_t)t.sbox[s3 & 0xff] ^ GETU32(rk);
+	t1 = ((uint32_t)t.sbox[s1 >> 24] << 24) ^ ((uint32_t)t.sbox[(s2 >> 16) & 0xff] << 16) ^
+	     ((uint32_t)t.sbox[(s3 >> 8) & 0xff] << 8) ^ (uint32_t)t.sbox[s0 & 0xff] ^ GETU32(rk + 4);
+	t2 = ((uint32_t)t.sbox[s2 >> 24] << 24) ^ ((uint32_t)t.sbox[(s3 >> 16) & 0xff] << 16) ^
+	     ((uint32_t)t.sbox[(s0 >> 8) & 0xff] << 8) ^ (uint32_t)t.sbox[s1 & 0xff] ^ GETU32(rk + 8);
+	t3 = ((uint32_t)t.sbox[s3 >> 24] << 24) ^ ((uint32_t)t.sbox[(s0 >> 16) & 0xff] << 16) ^
+	     ((uint32_t)t.sbox[(s1 >> 8) & 0xff] << 8) ^ (uint32_t)t.sbox[s2 & 0xff] ^ GETU32(rk + 12);
+	PUTU32(out, t0);
+	PUTU32(out + 4, t1);
+	PUTU32(out + 8, t2);
+	PUTU32(out + 12, t3);
+}
+
+static void aes_decrypt_soft(const struct aes_tables &t, const uint8_t *rk, uint32_t rounds, const uint8_t *in, uint8_t *out)
+{
+	uint32_t s0, s1, s2, s3, t0, t1, t2, t3, r;
+
+	s0 = GETU32(in) ^ GETU32(rk);
+	s1 = GETU32(in + 4) ^ GETU32(rk + 4);
+	s2 = GETU32(in + 8) ^ GETU32(rk + 8);
+	s3 = GETU32(in + 12) ^ GETU32(rk + 12);
+
+	for (r = 1; r < rounds; r++) {
+		rk += AES_BLOCK_LENGTH;
+		t0 = t.td[0][s0 >> 24] ^ t.td[1][(s3 >> 16) & 0xff] ^ t.td[2][(s2 >> 8) & 0xff] ^ t.td[3][s1 & 0xff] ^ GETU32(rk);
+		t1 = t.td[0][s1 >> 24] ^ t.td[1][(s0 >> 16) & 0xff] ^ t.td[2][(s3 >> 8) & 0xff] ^ t.td[3][s2 & 0xff] ^ GETU32(rk + 4);
+		t2 = t.td[0][s2 >> 24] ^ t.td[1][(s1 >> 16) & 0xff] ^ t.td[2][(s0 >> 8) & 0xff] ^ t.td[3][s3 & 0xff] ^ GETU32(rk + 8);
+		t3 = t.td[0][s3 >> 24] ^ t.td[1][(s2 >> 16) & 0xff] ^ t.td[2][(s1 >> 8) & 0xff] ^ t.td[3][s0 & 0xff] ^ GETU32(rk + 12);
+		s0 = t0;
+		s1 = t1;
+		s2 = t2;
+		s3 = t3;
+	}
+
+	rk += AES_BLOCK_LENGTH;
+	t0 = ((uint32_t)t.inv_sbox[s0 >> 24] << 24) ^ ((uint32_t)t.inv_sbox[(s3 >> 16) & 0xff] << 16) ^
+	     ((uint32_t)t.inv_sbox[(s2 >> 8) & 0xff] << 8) ^ (uint32_t)t.inv_sbox[s1 & 0xff] ^ GETU32(rk);
+	t1 = ((uint32_t)t.inv_sbox[s1 >> 24] << 24) ^ ((uint32_t)t.inv_sbox[(s0 >> 16) & 0xff] << 16) ^
+	     ((uint32_t)t.inv_sbox[(s3 >> 8) & 0xff] << 8) ^ (uint32_t)t.inv_sbox[s2 & 0xff] ^ GETU32(rk + 4);
+	t2 = ((uint32_t)t.inv_sbox[s2 >> 24] << 24) ^ ((uint32_t)t.inv_sbox[(s1 >> 16) & 0xff] << 16) ^
+	     ((uint32_t)t.inv_sbox[(s0 >> 8) & 0xff] << 8) ^ (uint32_t)t.inv_sbox[s3 & 0xff] ^ GETU32(rk + 8);
+	t3 = ((uint32_t)t.inv_sbox[s3 >> 24] << 24) ^ ((uint32_t)t.inv_sbox[(s2 >> 16) & 0xff] << 16) ^
+	     ((uint32_t)t.inv_sbox[(s1 >> 8) & 0xff] << 8) ^ (uint32_t)t.inv_sbox[s0 & 0xff] ^ GETU32(rk + 12);
+	PUTU32(out, t0);
+	PUTU32(out + 4, t1);
+	PUTU32(out + 8, t2);
+	PUTU32(out + 12, t3);
+}
+
+/* multiply the tweak by x in GF(2^128); the tweak is little-endian, byte 0 lowest */
+static void aes_xts_next_tweak_soft(uint8_t tweak[AES_BLOCK_LENGTH])
+{
+	uint8_t	carry = tweak[AES_BLOCK_LENGTH - 1] >> 7;
+	int	i;
+
+	for (i = AES_BLOCK_LENGTH - 1; i > 0; i--)
+		tweak[i] = (uint8_t)((tweak[i] << 1) | (tweak[i - 1] >> 7));
+	tweak[0] = (uint8_t)((tweak[0] << 1) ^ (carry ? 0x87 : 0));
+}
+
+static void aes_xts_soft(const struct aes_xts_key *key, uint64_t unit, uint32_t unit_length,
+			 const uint8_t *in, uint8_t *out, uint32_t count, bool decrypt)
+{
+	const struct aes_tables	&t = aes_get_tables();
+	uint8_t			tweak[AES_BLOCK_LENGTH], block[AES_BLOCK_LENGTH];
+	uint32_t		u, off;
+	int			i;
+
+	for (u = 0; u < count; u++, unit++) {
+		for (i = 0; i < AES_BLOCK_LENGTH; i++)
+			tweak[i] = i < 8 ? (uint8_t)(unit >> (8 * i)) : 0;
+		aes_encrypt_soft(t, key->tweak.ek, key->tweak.rounds, tweak, tweak);
+
+		for (off = 0; off < unit_length; off += AES_BLOCK_LENGTH) {
+			for (i = 0; i < AES_BLOCK_LENGTH; i++)
+				block[i] = in[off + i] ^ tweak[i];
+			if (decrypt)
+				aes_decrypt_soft(t, key->data.dk, key->data.rounds, block, block);
+			else
+				aes_encrypt_soft(t, key->data.ek, key->data.rounds, block, block);
+			for (i = 0; i < AES_BLOCK_LENGTH; i++)
+				out[off + i] = block[i] ^ tweak[i];
+			aes_xts_next_tweak_soft(tweak);
+		}
+
+		in += unit_length;
+		out += unit_length;
+	}
+}
+
+#if AES_NI
+
+static bool aes_cpu_has_ni(void)
+{
+#ifdef _MSC_VER
+	int regs[4];
+
+	__cpuid(regs, 1);
+	return (regs[2] & (1 << 25)) != 0;
+#else
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ecx & bit_AES) != 0;
+#endif
+}
+
+AES_NI_TARGET static void aesni_load_keys(__m128i *rk, const uint8_t *keys, uint32_t rounds)
+{
+	uint32_t r;
+
+	for (r = 0; r <= rounds; r++)
+		rk[r] = _mm_loadu_si128((const __m128i *)(keys + r * AES_BLOCK_LENGTH));
+}
+
+AES_NI_TARGET static inline __m128i aesni_encrypt1(const __m128i *rk, uint32_t rounds, __m128i b)
+{
+	uint32_t r;
+
+	b = _mm_xor_si128(b, rk[0]);
+	for (r = 1; r < rounds; r++)
+		b = _mm_aesenc_si128(b, rk[r]);
+	return _mm_aesenclast_si128(b, rk[rounds]);
+}
+
+AES_NI_TARGET static inline __m128i aesni_decrypt1(const __m128i *rk, uint32_t rounds, __m128i b)
+{
+	uint32_t r;
+
+	b = _mm_xor_si128(b, rk[0]);
+	for (r = 1; r < rounds; r++)
+		b = _mm_aesdec_si128(b, rk[r]);
+	return _mm_aesdeclast_si128(b, rk[rounds]);
+}
+
+/*
+ * The lanes are written out one statement each rather than looped over, which
+ * is what gets compilers to keep all of them in registers, and they advance a
+ * round at a time so each round key is loaded once for the lot.
+ */
+#define AESNI_EACH_LANE(op)	do { op(0); op(1); op(2); op(3); op(4); op(5); op(6); op(7); } while (0)
+
+#define AESNI_LANE_XOR(i)	b[i] = _mm_xor_si128(b[i], key)
+#define AESNI_LANE_ENC(i)	b[i] = _mm_aesenc_si128(b[i], key)
+#define AESNI_LANE_ENCLAST(i)	b[i] = _mm_aesenclast_si128(b[i], key)
+#define AESNI_LANE_DEC(i)	b[i] = _mm_aesdec_si128(b[i], key)
+#define AESNI_LANE_DECLAST(i)	b[i] = _mm_aesdeclast_si128(b[i], key)
+
+AES_NI_TARGET static inline void aesni_encrypt_lanes(const __m128i *rk, uint32_t rounds, __m128i *b)
+{
+	__m128i		key = rk[0];
+	uint32_t	r;
+
+	AESNI_EACH_LANE(AESNI_LANE_XOR);
+	for (r = 1; r < rounds; r++) {
+		key = rk[r];
+		AESNI_EACH_LANE(AESNI_LANE_ENC);
+	}
+	key = rk[rounds];
+	AESNI_EACH_LANE(AESNI_LANE_ENCLAST);
+}
+
+AES_NI_TARGET static inline void aesni_decrypt_lanes(const __m128i *rk, uint32_t rounds, __m128i *b)
+{
+	__m128i		key = rk[0];
+	uint32_t	r;
+
+	AESNI_EACH_LANE(AESNI_LANE_XOR);
+	for (r = 1; r < rounds; r++) {
+		key = rk[r];
+		AESNI_EACH_LANE(AESNI_LANE_DEC);
+	}
+	key = rk[rounds];
+	AESNI_EACH_LANE(AESNI_LANE_DECLAST);
+}
+
+/* the tweak times x: shift each dword left, carrying each one's top bit into the next and the top one back in as 0x87 */
+AES_NI_TARGET static inline __m128i aesni_next_tweak(__m128i tweak)
+{
+	const __m128i	poly = _mm_set_epi32(1, 1, 1, 0x87);
+	__m128i		carry = _mm_shuffle_epi32(_mm_srai_epi32(tweak, 31), 0x93);
+
+	return _mm_xor_si128(_mm_slli_epi32(tweak, 1), _mm_and_si128(carry, poly));
+}
+
+/* each lane takes the next tweak in turn, whitening its block before the cipher and after */
+#define AESNI_XTS_LOAD(i)	(t[i] = tweak, tweak = aesni_next_tweak(tweak), b[i] = _mm_xor_si128(_mm_loadu_si128(src + i), t[i]))
+#define AESNI_XTS_STORE(i)	_mm_storeu_si128(dst + i, _mm_xor_si128(b[i], t[i]))
+
+AES_NI_TARGET static void aes_xts_ni(const struct aes_xts_key *key, uint64_t unit, uint32_t unit_length,
+				      const uint8_t *in, uint8_t *out, uint32_t count, bool decrypt)
+{
+	__m128i		rk[AES_MAX_ROUNDS + 1], tk[AES_MAX_ROUNDS + 1];
+	__m128i		tweaks[AES_XTS_LANES], t[AES_XTS_LANES], b[AES_XTS_LANES], tweak;
+	const __m128i	*src;
+	__m128i		*dst;
+	uint32_t	rounds = key->data.rounds, blocks = unit_length / AES_BLOCK_LENGTH;
+	uint32_t	done, n, u, j;
+	uint64_t	number;
+	int		i;
+
+	aesni_load_keys(rk, decrypt ? key->data.dk : key->data.ek, rounds);
+	aesni_load_keys(tk, key->tweak.ek, key->tweak.rounds);
+
+	for (done = 0; done < count; done += n) {
+		/* the first tweaks of a batch of units, encrypted side by side */
+		n = count - done < AES_XTS_LANES ? count - done : AES_XTS_LANES;
+		for (i = 0; i < AES_XTS_LANES; i++) {
+			number = unit + done + i;
+			tweaks[i] = _mm_set_epi32(0, 0, (int)(number >> 32), (int)number);
+		}
+		aesni_encrypt_lanes(tk, key->tweak.rounds, tweaks);
+
+		for (u = 0; u < n; u++) {
+			tweak = tweaks[u];
+
+			for (j = 0; j + AES_XTS_LANES <= blocks; j += AES_XTS_LANES) {
+				src = (const __m128i *)(in + j * AES_BLOCK_LENGTH);
+				dst = (__m128i *)(out + j * AES_BLOCK_LENGTH);
+				AESNI_EACH_LANE(AESNI_XTS_LOAD);
+				if (decrypt)
+					aesni_decrypt_lanes(rk, rounds, b);
+				else
+					aesni_encrypt_lanes(rk, rounds, b);
+				AESNI_EACH_LANE(AESNI_XTS_STORE);
+			}
+
+			/* units that aren't a multiple of the lane count finish a block at a time */
+			for (; j < blocks; j++) {
+				b[0] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + j * AES_BLOCK_LENGTH)), tweak);
+				b[0] = decrypt ? aesni_decrypt1(rk, rounds, b[0]) : aesni_encrypt1(rk, rounds, b[0]);
+				_mm_storeu_si128((__m128i *)(out + j * AES_BLOCK_LENGTH), _mm_xor_si128(b[0], tweak));
+				tweak = aesni_next_tweak(tweak);
+			}
+
+			in += unit_length;
+			out += unit_length;
+		}
+	}
+}
+
+AES_NI_TARGET static void aes_crypt_block_ni(const struct aes_key *key, const uint8_t *in, uint8_t *out, bool decrypt)
+{
+	__m128i rk[AES_MAX_ROUNDS + 1], b;
+
+	aesni_load_keys(rk, decrypt ? key->dk : key->ek, key->rounds);
+	b = _mm_loadu_si128((const __m128i *)in);
+	b = decrypt ? aesni_decrypt1(rk, key->rounds, b) : aesni_encrypt1(rk, key->rounds, b);
+	_mm_storeu_si128((__m128i *)out, b);
+}
+
+#else
+
+static bool aes_cpu_has_ni(void)
+{
+	return false;
+}
+
+#endif
+
+static bool aes_use_ni = aes_cpu_has_ni();
+
+bool aes_accelerated(void)
+{
+	return aes_use_ni;
+}
+
+bool aes_set_accelerated(bool enable)
+{
+	aes_use_ni = enable && aes_cpu_has_ni();
+	return aes_use_ni;
+}
+
+/* InvMixColumns on one column of a round key, for the equivalent inverse cipher */
+static void aes_inv_mix_column(const uint8_t *a, uint8_t *r)
+{
+	r[0] = aes_mul(a[0], 14) ^ aes_mul(a[1], 11) ^ aes_mul(a[2], 13) ^ aes_mul(a[3], 9);
+	r[1] = aes_mul(a[0], 9) ^ aes_mul(a[1], 14) ^ aes_mul(a[2], 11) ^ aes_mul(a[3], 13);
+	r[2] = aes_mul(a[0], 13) ^ aes_mul(a[1], 9) ^ aes_mul(a[2], 14) ^ aes_mul(a[3], 11);
+	r[3] = aes_mul(a[0], 11) ^ aes_mul(a[1], 13) ^ aes_mul(a[2], 9) ^ aes_mul(a[3], 14);
+}
+
+int aes_set_key(struct aes_key *key, const void *bytes, size_t length)
+{
+	const struct aes_tables	&t = aes_get_tables();
+	uint8_t			*w = key->ek;
+	uint8_t			temp[4], first, rcon = 1;
+	uint32_t		nk, words, i, j;
+
+	if (length != 16 && length != 24 && length != 32)
+		return -1;
+
+	memset(key, 0, sizeof(*key));
+	nk = (uint32_t)length / 4;
+	key->rounds = nk + 6;
+	words = 4 * (key->rounds + 1);
+
+	/* FIPS 197 KeyExpansion, a 4-byte word at a time */
+	memcpy(w, bytes, length);
+	for (i = nk; i < words; i++) {
+		memcpy(temp, w + 4 * (i - 1), 4);
+		if (i % nk == 0) {
+			first = temp[0];
+			temp[0] = t.sbox[temp[1]] ^ rcon;
+			temp[1] = t.sbox[temp[2]];
+			temp[2] = t.sbox[temp[3]];
+			temp[3] = t.sbox[first];
+			rcon = aes_xtime(rcon);
+		} else if (nk > 6 && i % nk == 4) {
+			for (j = 0; j < 4; j++)
+				temp[j] = t.sbox[temp[j]];
+		}
+		for (j = 0; j < 4; j++)
+			w[4 * i + j] = w[4 * (i - nk) + j] ^ temp[j];
+	}
+
+	/* the decryption schedule is the same keys backwards, InvMixColumns applied to all but the outer two */
+	for (i = 0; i <= key->rounds; i++) {
+		const uint8_t	*src = key->ek + (key->rounds - i) * AES_BLOCK_LENGTH;
+		uint8_t		*dst = key->dk + i * AES_BLOCK_LENGTH;
+
+		if (i == 0 || i == key->rounds)
+			memcpy(dst, src, AES_BLOCK_LENGTH);
+		else
+			for (j = 0; j < 4; j++)
+				aes_inv_mix_column(src + 4 * j, dst + 4 * j);
+	}
+
+	return 0;
+}
+
+void aes_encrypt_block(const struct aes_key *key, const uint8_t in[AES_BLOCK_LENGTH], uint8_t out[AES_BLOCK_LENGTH])
+{
+#if AES_NI
+	if (aes_use_ni) {
+		aes_crypt_block_ni(key, in, out, false);
+		return;
+	}
+#endif
+	aes_encrypt_soft(aes_get_tables(), key->ek, key->rounds, in, out);
+}
+
+void aes_decrypt_block(const struct aes_key *key, const uint8_t in[AES_BLOCK_LENGTH], uint8_t out[AES_BLOCK_LENGTH])
+{
+#if AES_NI
+	if (aes_use_ni) {
+		aes_crypt_block_ni(key, in, out, true);
+		return;
+	}
+#endif
+	aes_decrypt_soft(aes_get_tables(), key->dk, key->rounds, in, out);
+}
+
+int aes_xts_set_key(struct aes_xts_key *key, const void *bytes, size_t length)
+{
+	const uint8_t *k = (const uint8_t *)bytes;
+
+	if (length != 32 && length != 64)
+		return -1;
+	if (aes_set_key(&key->data, k, length / 2) != 0 || aes_set_key(&key->tweak, k + length / 2, length / 2) != 0)
+		return -1;
+	return 0;
+}
+
+void aes_xts_encrypt(const struct aes_xts_key *key, uint64_t unit, uint32_t unit_length,
+		     const void *in, void *out, uint32_t count)
+{
+#if AES_NI
+	if (aes_use_ni) {
+		aes_xts_ni(key, unit, unit_length, (const uint8_t *)in, (uint8_t *)out, count, false);
+		return;
+	}
+#endif
+	aes_xts_soft(key, unit, unit_length, (const uint8_t *)in, (uint8_t *)out, count, false);
+}
+
+void aes_xts_decrypt(const struct aes_xts_key *key, uint64_t unit, uint32_t unit_length,
+		     const void *in, void *out, uint32_t count)
+{
+#if AES_NI
+	if (aes_use_ni) {
+		aes_xts_ni(key, unit, unit_length, (const uint8_t *)in, (uint8_t *)out, count, true);
+		return;
+	}
+#endif
+	aes_xts_soft(key, unit, unit_length, (const uint8_t *)in, (uint8_t *)out, count, true);
+}
@@ -0,0 +1,54 @@
+/*
+ * AES (FIPS 197) and the XTS mode of IEEE 1619, for storage encrypted at rest.
+ *
+ * Uses the AES-NI instructions where the CPU has them and a table driven
+ * implementation elsewhere; both give the same results from the same keys.
+ * The table version is not constant-time.
+ */
+
+#ifndef __LIB_AES_H
+#define __LIB_AES_H
+
+#include "types.h"
+
+__BEGIN_DECLS
+
+#define AES_BLOCK_LENGTH	16
+#define AES_MAX_ROUNDS		14
+
+struct aes_key {
+	uint8_t		ek[(AES_MAX_ROUNDS + 1) * AES_BLOCK_LENGTH];	/* round keys, in state byte order */
+	uint8_t		dk[(AES_MAX_ROUNDS + 1) * AES_BLOCK_LENGTH];	/* the same for the equivalent inverse cipher */
+	uint32_t	rounds;
+};
+
+/* length is 16, 24 or 32 bytes; returns 0, or -1 for any other length */
+int aes_set_key(struct aes_key *key, const void *bytes, size_t length);
+void aes_encrypt_block(const struct aes_key *key, const uint8_t in[AES_BLOCK_LENGTH], uint8_t out[AES_BLOCK_LENGTH]);
+void aes_decrypt_block(const struct aes_key *key, const uint8_t in[AES_BLOCK_LENGTH], uint8_t out[AES_BLOCK_LENGTH]);
+
+struct aes_xts_key {
+	struct aes_key	data;		/* key 1, encrypts the data */
+	struct aes_key	tweak;		/* key 2, encrypts the data unit number */
+};
+
+/* key 1 then key 2: 32 bytes for XTS-AES-128, 64 for XTS-AES-256; returns 0 or -1 */
+int aes_xts_set_key(struct aes_xts_key *key, const void *bytes, size_t length);
+
+/*
+ * Encrypt or decrypt count consecutive data units of unit_length bytes, a
+ * multiple of 16, the first of which is number unit. The unit number is the
+ * tweak, as a little-endian 128-bit value. in and out may be the same buffer.
+ */
+void aes_xts_encrypt(const struct aes_xts_key *key, uint64_t unit, uint32_t unit_length,
+		     const void *in, void *out, uint32_t count);
+void aes_xts_decrypt(const struct aes_xts_key *key, uint64_t unit, uint32_t unit_length,
+		     const void *in, void *out, uint32_t count);
+
+/* whether AES-NI is in use; the portable code can be forced, for comparison, by passing false */
+bool aes_accelerated(void);
+bool aes_set_accelerated(bool enable);
+
+__END_DECLS
+
+#endif
@@ -86,12 +86,30 @@ int register_blockdev(struct blockdev *dev)
 	return 0;
 }
 
+int unregister_blockdev(struct blockdev *dev)
+{
+	struct blockdev **link;
+
+	assert(dev != NULL);
+
+	for (link = &bdev_list; *link; link = &(*link)->next) {
+		if (*link == dev) {
+			*link = dev->next;
+			dev->next = NULL;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
 static void *get_bounce_buf(struct blockdev *dev)
 {
 	void *result;
 	uint32_t align = __max(dev->alignment, (uint32_t)get_cpu_cache_line_size());
 	uint32_t size = __max(dev->alignment, dev->block_size);
 
+	TRACE_INSTANT(TRACE_BOUNCE_ALLOC, size, align);
 	posix_memalign(&result, align, size);
 	return result;
 }
@@ -446,6 +464,27 @@ int blockdev_write_protected(struct blockdev *dev, const void *ptr, off_t offset
 }
 
 
+static void blockdev_notify_observers(struct blockdev *dev, const void *ptr, block_addr block, uint32_t count)
+{
+	struct blockdev_observer *obs;
+
+	if (count == 0)
+		return;
+
+	for (obs = dev->observers; obs; obs = obs->next)
+		obs->written(obs, dev, ptr, block, count);
+}
+
+int blockdev_write_block_unprotected(struct blockdev *dev, const void *ptr, block_addr block, uint32_t count)
+{
+	int	err;
+
+	err = dev->write_block_hook(dev, ptr, block, count);
+	if (err > 0)
+		blockdev_notify_observers(dev, ptr, block, err);
+	return err;
+}
+
 int blockdev_write_block_protected(struct blockdev *dev, const void *ptr, block_addr block, uint32_t count)
 {
 	size_t	overlap;
@@ -469,7 +508,7 @@ int blockdev_write_block_protected(struct blockdev *dev, const void *ptr, block_
 			overlap = 0;
 		}
 		//		printf("BDEV: writing first part: 0x%x/0x%x\n", block, count - overlap);
-		err = dev->write_block_hook(dev, ptr, block, count - overlap);
+		err = blockdev_write_block_unprotected(dev, ptr, block, count - overlap);
 		if (err < 0)			/* error */
 			return(-1);
 		if ((uint32_t)err < (count - overlap))	/* short write */
@@ -486,7 +525,7 @@ int blockdev_write_block_protected(struct blockdev *dev, const void *ptr, block_
 			overlap = 0;
 		}
 		//		printf("BDEV: writing second part: 0x%x/0x%x\n", block + overlap, count - overlap);
-		err = dev->write_block_hook(dev, (char *)ptr + (overlap << dev->block_shift), block + overlap, count - overlap);
+		err = blockdev_write_block_unprotected(dev, (char *)ptr + (overlap << dev->block_shift), block + overlap, count - overlap);
 		if (err < 0)			/* error */
 			return(-1);
 		if ((uint32_t)err < (count - overlap))	/* short write XXX does not handle both ends
@@ -496,6 +535,27 @@ int blockdev_write_block_protected(struct blockdev *dev, const void *ptr, block_
 	return(count);
 }
 
+void blockdev_add_observer(struct blockdev *dev, struct blockdev_observer *obs)
+{
+	assert(dev != NULL && obs != NULL);
+
+	obs->next = dev->observers;
+	dev->observers = obs;
+}
+
+void blockdev_remove_observer(struct blockdev *dev, struct blockdev_observer *obs)
+{
+	struct blockdev_observer **link;
+
+	for (link = &dev->observers; *link; link = &(*link)->next) {
+		if (*link == obs) {
+			*link = obs->next;
+			obs->next = NULL;
+			return;
+		}
+	}
+}
+
 /* set the protected region */
 int blockdev_set_protection(struct blockdev *dev, off_t offset, uint64_t length)
 {
@@ -558,5 +618,7 @@ int construct_blockdev(struct blockdev *dev, const char *name, uint64_t len, uin
 	dev->protect_start = 0;
 	dev->protect_end = 0;
 
+	dev->observers = NULL;
+
 	return 0;
 }
\ No newline at end of file
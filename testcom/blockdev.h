@@ -13,6 +13,7 @@
 
 #include <stdint.h>
 #include "types.h"
+#include "trace.h"
 
 __BEGIN_DECLS
 
@@ -22,6 +23,19 @@ typedef uint32_t block_addr;
 #define BLOCKDEV_FLAG_UPGRADE_PARTITION (1 << 1)
 
 typedef int64_t     		off_t;
+
+struct blockdev;
+
+/*
+ * A write observer is told about every run of blocks successfully written through
+ * blockdev_write_block_protected (and so through the default byte write hook),
+ * along with the data that was written.
+ */
+struct blockdev_observer {
+	struct blockdev_observer *next;
+	void(*written)(struct blockdev_observer *, struct blockdev *, const void *ptr, block_addr block, uint32_t count);
+};
+
 struct blockdev {
 	struct blockdev *next;
 	uint32_t flags;
@@ -49,10 +63,14 @@ struct blockdev {
 	/* write-protected region */
 	off_t protect_start;
 	off_t protect_end;
+
+	/* write observers */
+	struct blockdev_observer *observers;
 };
 
 struct blockdev *lookup_blockdev(const char *name);
 int register_blockdev(struct blockdev *);
+int unregister_blockdev(struct blockdev *);
 struct blockdev *first_blockdev(void);
 struct blockdev *next_blockdev(struct blockdev *dev);
 
@@ -60,17 +78,29 @@ struct blockdev *next_blockdev(struct blockdev *dev);
 int construct_blockdev(struct blockdev *, const char *name, uint64_t len, uint32_t block_size);
 
 /* user api */
+#if WITH_TRACE
+#define blockdev_read(bdev, ptr, off, len) blockdev_traced_read((bdev), ptr, off, len)
+#define blockdev_read_block(bdev, ptr, block, count) blockdev_traced_read_block((bdev), ptr, block, count)
+#define blockdev_write(bdev, ptr, off, len) blockdev_traced_write((bdev), ptr, off, len)
+#define blockdev_write_block(bdev, ptr, block, count) blockdev_traced_write_block((bdev), ptr, block, count)
+#define blockdev_erase(bdev, off, len) blockdev_traced_erase((bdev), off, len)
+#else
 #define blockdev_read(bdev, ptr, off, len) (bdev)->read_hook((bdev), ptr, off, len)	
 #define blockdev_read_block(bdev, ptr, block, count) (bdev)->read_block_hook((bdev), ptr, block, count)	
 #define blockdev_write(bdev, ptr, off, len) blockdev_write_protected((bdev), ptr, off, len)	
 #define blockdev_write_block(bdev, ptr, block, count) blockdev_write_block_protected((bdev), ptr, block, count)	
 #define blockdev_erase(bdev, off, len) (bdev)->erase_hook((bdev), off, len)
+#endif
 
 int blockdev_compare(struct blockdev *dev, const void *ptr, off_t bdev_offset, uint64_t len);
 int blockdev_set_protection(struct blockdev *dev, off_t offset, uint64_t length);
 void blockdev_set_buffer_alignment(struct blockdev *dev, uint32_t alignment);
 int blockdev_write_protected(struct blockdev *dev, const void *ptr, off_t offset, uint64_t len);
 int blockdev_write_block_protected(struct blockdev *dev, const void *ptr, block_addr block, uint32_t count);
+/* write blocks inside the protected region too, for the owner of that region; observers are still told */
+int blockdev_write_block_unprotected(struct blockdev *dev, const void *ptr, block_addr block, uint32_t count);
+void blockdev_add_observer(struct blockdev *dev, struct blockdev_observer *obs);
+void blockdev_remove_observer(struct blockdev *dev, struct blockdev_observer *obs);
 
 /* a default memory based block device */
 struct blockdev *create_mem_blockdev(const char *name, void *ptr, uint64_t len, uint32_t block_size);
@@ -78,6 +108,69 @@ struct blockdev *create_mem_blockdev(const char *name, void *ptr, uint64_t len,
 /* a subdevice device, which lets you access a range of a device as another device */
 struct blockdev *create_subdev_blockdev(const char *name, struct blockdev *parent, off_t off, uint64_t len, uint32_t block_size);
 
+/* a memory block device whose blocks live in a shared, content-indexed pool (see dedup_blockdev.h) */
+struct blockdev *create_dedup_blockdev(const char *name, uint64_t len, uint32_t block_size);
+
+/* a view of parent that stores each block AES-XTS encrypted, key being both XTS keys (see xts_blockdev.h) */
+struct blockdev *create_xts_blockdev(const char *name, struct blockdev *parent, const void *key, size_t key_length);
+
+/* a device at the far end of a serial line, served by serial_blockdev_serve (see serial_blockdev.h) */
+struct modem_line;
+struct blockdev *create_serial_blockdev(const char *name, struct modem_line *line);
+
+#if WITH_TRACE
+/* the user api with a trace slice around each hook dispatch */
+static inline int blockdev_traced_read(struct blockdev *dev, void *ptr, off_t off, uint64_t len)
+{
+	int result;
+
+	TRACE_BEGIN(TRACE_BLOCKDEV_READ, off, len);
+	result = dev->read_hook(dev, ptr, off, len);
+	TRACE_END(TRACE_BLOCKDEV_READ, result);
+	return result;
+}
+
+static inline int blockdev_traced_read_block(struct blockdev *dev, void *ptr, block_addr block, uint32_t count)
+{
+	int result;
+
+	TRACE_BEGIN(TRACE_BLOCKDEV_READ_BLOCK, block, count);
+	result = dev->read_block_hook(dev, ptr, block, count);
+	TRACE_END(TRACE_BLOCKDEV_READ_BLOCK, result);
+	return result;
+}
+
+static inline int blockdev_traced_write(struct blockdev *dev, const void *ptr, off_t off, uint64_t len)
+{
+	int result;
+
+	TRACE_BEGIN(TRACE_BLOCKDEV_WRITE, off, len);
+	result = blockdev_write_protected(dev, ptr, off, len);
+	TRACE_END(TRACE_BLOCKDEV_WRITE, result);
+	return result;
+}
+
+static inline int blockdev_traced_write_block(struct blockdev *dev, const void *ptr, block_addr block, uint32_t count)
+{
+	int result;
+
+	TRACE_BEGIN(TRACE_BLOCKDEV_WRITE_BLOCK, block, count);
+	result = blockdev_write_block_protected(dev, ptr, block, count);
+	TRACE_END(TRACE_BLOCKDEV_WRITE_BLOCK, result);
+	return result;
+}
+
+static inline int blockdev_traced_erase(struct blockdev *dev, off_t off, uint64_t len)
+{
+	int result;
+
+	TRACE_BEGIN(TRACE_BLOCKDEV_ERASE, off, len);
+	result = dev->erase_hook(dev, off, len);
+	TRACE_END(TRACE_BLOCKDEV_ERASE, result);
+	return result;
+}
+#endif
+
 __END_DECLS
 
 #endif
\ No newline at end of file
@@ -0,0 +1,343 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include "blockdev.h"
+#include "blockdev_merkle.h"
+#include "compat.h"
+#include "fourcc.h"
+
+#define MERKLE_BUILD_BLOCKS	64
+#define MERKLE_VERSION		1
+
+/* leaves and interior nodes are hashed with distinct prefixes so one can't pose as the other */
+#define MERKLE_LEAF_PREFIX	0x00
+#define MERKLE_NODE_PREFIX	0x01
+
+struct merkle_file_header {
+	uint32_t	magic;
+#define kMerkleFileMagic	fourcc("MRKL")
+	uint32_t	version;
+	uint32_t	block_size;
+	uint32_t	block_count;
+	uint32_t	leaf_capacity;
+	uint32_t	hash_size;
+};
+
+/*
+ * The tree is stored as an implicit binary heap: node 1 is the root, node n has
+ * children 2n and 2n+1, and leaf i lives at leaf_capacity + i. The leaf count is
+ * padded to a power of two; padding leaves hold all-zero hashes.
+ */
+struct blockdev_merkle {
+	struct blockdev_observer	obs;	/* must be first */
+	struct blockdev			*dev;
+	uint32_t			block_size;
+	uint32_t			block_count;
+	uint32_t			leaf_capacity;
+	uint8_t				(*nodes)[MERKLE_HASH_SIZE];
+};
+
+static void merkle_hash_leaf(struct blockdev_merkle *tree, uint32_t leaf, const void *data)
+{
+	struct sha256_ctx	ctx;
+	uint8_t			prefix = MERKLE_LEAF_PREFIX;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, &prefix, 1);
+	sha256_update(&ctx, data, tree->block_size);
+	sha256_final(&ctx, tree->nodes[tree->leaf_capacity + leaf]);
+}
+
+static void merkle_hash_node(struct blockdev_merkle *tree, uint32_t node)
+{
+	struct sha256_ctx	ctx;
+	uint8_t			prefix = MERKLE_NODE_PREFIX;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, &prefix, 1);
+	sha256_update(&ctx, tree->nodes[node * 2], MERKLE_HASH_SIZE * 2);
+	sha256_final(&ctx, tree->nodes[node]);
+}
+
+/* recompute the interior nodes above leaves [first, last] */
+static void merkle_update_parents(struct blockdev_merkle *tree, uint32_t first, uint32_t last)
+{
+	uint32_t lo, hi, node;
+
+	lo = (tree->leaf_capacity + first) >> 1;
+	hi = (tree->leaf_capacity + last) >> 1;
+
+	while (lo >= 1) {
+		for (node = lo; node <= hi; node++)
+			merkle_hash_node(tree, node);
+		lo >>= 1;
+		hi >>= 1;
+	}
+}
+
+static struct blockdev_merkle *merkle_alloc(uint32_t block_size, uint32_t block_count)
+{
+	struct blockdev_merkle	*tree;
+	uint32_t		capacity;
+
+	capacity = 1;
+	while (capacity < block_count) {
+		if (capacity > (UINT32_MAX >> 2))
+			return NULL;
+		capacity <<= 1;
+	}
+
+	tree = (struct blockdev_merkle *)calloc(1, sizeof(*tree));
+	if (tree == NULL)
+		return NULL;
+
+	tree->nodes = (uint8_t (*)[MERKLE_HASH_SIZE])calloc((size_t)capacity * 2, MERKLE_HASH_SIZE);
+	if (tree->nodes == NULL) {
+		free(tree);
+		return NULL;
+	}
+
+	tree->block_size = block_size;
+	tree->block_count = block_count;
+	tree->leaf_capacity = capacity;
+
+	return tree;
+}
+
+static void merkle_written(struct blockdev_observer *obs, struct blockdev *dev, const void *ptr, block_addr block, uint32_t count)
+{
+	struct blockdev_merkle	*tree = (struct blockdev_merkle *)obs;
+	const uint8_t		*data = (const uint8_t *)ptr;
+	uint32_t		i;
+
+	if (block >= tree->block_count)
+		return;
+	if (count > tree->block_count - block)
+		count = tree->block_count - block;
+
+	for (i = 0; i < count; i++)
+		merkle_hash_leaf(tree, block + i, data + ((size_t)i << dev->block_shift));
+
+	merkle_update_parents(tree, block, block + count - 1);
+}
+
+struct blockdev_merkle *blockdev_merkle_build(struct blockdev *dev)
+{
+	struct blockdev_merkle	*tree;
+	uint8_t			*buf;
+	block_addr		block;
+	uint32_t		count, i;
+	int			err;
+
+	tree = merkle_alloc(dev->block_size, dev->block_count);
+	if (tree == NULL) {
+		printf("merkle: can't allocate tree for \"%s\"\n", dev->name);
+		return NULL;
+	}
+
+	buf = (uint8_t *)malloc((size_t)MERKLE_BUILD_BLOCKS * dev->block_size);
+	if (buf == NULL) {
+		blockdev_merkle_free(tree);
+		return NULL;
+	}
+
+	for (block = 0; block < dev->block_count; block += count) {
+		count = __min(MERKLE_BUILD_BLOCKS, dev->block_count - block);
+
+		err = blockdev_read_block(dev, buf, block, count);
+		if (err <= 0) {
+			printf("merkle: read fail at block %u of \"%s\"\n", block, dev->name);
+			free(buf);
+			blockdev_merkle_free(tree);
+			return NULL;
+		}
+		count = err;
+
+		for (i = 0; i < count; i++)
+			merkle_hash_leaf(tree, block + i, buf + ((size_t)i << dev->block_shift));
+	}
+	free(buf);
+
+	for (i = tree->leaf_capacity - 1; i >= 1; i--)
+		merkle_hash_node(tree, i);
+
+	blockdev_merkle_attach(tree, dev);
+
+	return tree;
+}
+
+int blockdev_merkle_attach(struct blockdev_merkle *tree, struct blockdev *dev)
+{
+	if (tree->dev != NULL)
+		return -1;
+
+	if (dev->block_size != tree->block_size || dev->block_count != tree->block_count) {
+		printf("merkle: geometry mismatch attaching to \"%s\"\n", dev->name);
+		return -1;
+	}
+
+	tree->obs.written = &merkle_written;
+	tree->dev = dev;
+	blockdev_add_observer(dev, &tree->obs);
+
+	return 0;
+}
+
+void blockdev_merkle_detach(struct blockdev_merkle *tree)
+{
+	if (tree->dev == NULL)
+		return;
+
+	blockdev_remove_observer(tree->dev, &tree->obs);
+	tree->dev = NULL;
+}
+
+void blockdev_merkle_free(struct blockdev_merkle *tree)
+{
+	if (tree == NULL)
+		return;
+
+	blockdev_merkle_detach(tree);
+	free(tree->nodes);
+	free(tree);
+}
+
+int blockdev_merkle_save(struct blockdev_merkle *tree, const char *path)
+{
+	struct merkle_file_header	hdr;
+	FILE				*fp;
+	size_t				nodes;
+	int				result = 0;
+
+	fp = compat_fopen(path, "wb");
+	if (fp == NULL) {
+		printf("merkle: can't create \"%s\"\n", path);
+		return -1;
+	}
+
+	hdr.magic = kMerkleFileMagic;
+	hdr.version = MERKLE_VERSION;
+	hdr.block_size = tree->block_size;
+	hdr.block_count = tree->block_count;
+	hdr.leaf_capacity = tree->leaf_capacity;
+	hdr.hash_size = MERKLE_HASH_SIZE;
+
+	/* node 0 is unused and not stored */
+	nodes = (size_t)tree->leaf_capacity * 2 - 1;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(tree->nodes[1], MERKLE_HASH_SIZE, nodes, fp) != nodes) {
+		printf("merkle: write fail on \"%s\"\n", path);
+		result = -1;
+	}
+
+	if (fclose(fp) != 0)
+		result = -1;
+
+	return result;
+}
+
+struct blockdev_merkle *blockdev_merkle_load(const char *path)
+{
+	struct merkle_file_header	hdr;
+	struct blockdev_merkle		*tree;
+	FILE				*fp;
+	size_t				nodes;
+
+	fp = compat_fopen(path, "rb");
+	if (fp == NULL) {
+		printf("merkle: can't open \"%s\"\n", path);
+		return NULL;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr.magic != kMerkleFileMagic || hdr.version != MERKLE_VERSION ||
+	    hdr.hash_size != MERKLE_HASH_SIZE) {
+		printf("merkle: \"%s\" is not a merkle tree\n", path);
+		fclose(fp);
+		return NULL;
+	}
+
+	tree = merkle_alloc(hdr.block_size, hdr.block_count);
+	if (tree == NULL || tree->leaf_capacity != hdr.leaf_capacity) {
+		printf("merkle: bad geometry in \"%s\"\n", path);
+		blockdev_merkle_free(tree);
+		fclose(fp);
+		return NULL;
+	}
+
+	nodes = (size_t)tree->leaf_capacity * 2 - 1;
+	if (fread(tree->nodes[1], MERKLE_HASH_SIZE, nodes, fp) != nodes) {
+		printf("merkle: short read on \"%s\"\n", path);
+		blockdev_merkle_free(tree);
+		fclose(fp);
+		return NULL;
+	}
+
+	fclose(fp);
+	return tree;
+}
+
+const uint8_t *blockdev_merkle_root(struct blockdev_merkle *tree)
+{
+	return tree->nodes[1];
+}
+
+int blockdev_merkle_diff(struct blockdev_merkle *a, struct blockdev_merkle *b,
+			 struct blockdev_range *ranges, uint32_t max_ranges)
+{
+	uint32_t	stack[64];
+	uint32_t	depth, node, leaf;
+	uint32_t	found = 0;
+	block_addr	run_start = 0;
+	uint32_t	run_count = 0;
+
+	if (a->block_size != b->block_size || a->block_count != b->block_count)
+		return -1;
+
+	/* depth-first, left child first, so ranges come out in ascending order */
+	depth = 0;
+	stack[depth++] = 1;
+	while (depth > 0) {
+		node = stack[--depth];
+
+		if (memcmp(a->nodes[node], b->nodes[node], MERKLE_HASH_SIZE) == 0)
+			continue;
+
+		if (node < a->leaf_capacity) {
+			stack[depth++] = node * 2 + 1;
+			stack[depth++] = node * 2;
+			continue;
+		}
+
+		leaf = node - a->leaf_capacity;
+		if (leaf >= a->block_count)
+			continue;
+
+		if (run_count != 0 && run_start + run_count == leaf) {
+			run_count++;
+			continue;
+		}
+
+		if (run_count != 0) {
+			if (found < max_ranges) {
+				ranges[found].block = run_start;
+				ranges[found].count = run_count;
+			}
+			found++;
+		}
+		run_start = leaf;
+		run_count = 1;
+	}
+
+	if (run_count != 0) {
+		if (found < max_ranges) {
+			ranges[found].block = run_start;
+			ranges[found].count = run_count;
+		}
+		found++;
+	}
+
+	return (int)found;
+}
@@ -0,0 +1,55 @@
+/*
+ * Merkle trees of block hashes for block devices.
+ *
+ * A tree holds a SHA-256 hash per block plus the interior hashes above them.
+ * Once attached to a device it follows every write made through
+ * blockdev_write_block_protected, so it never has to re-read the device.
+ * Trees can be saved and loaded, and two trees of the same geometry can be
+ * diffed in O(changes * log n) without touching either device.
+ */
+
+#ifndef __LIB_BLOCKDEV_MERKLE_H
+#define __LIB_BLOCKDEV_MERKLE_H
+
+#include "blockdev.h"
+#include "sha256.h"
+
+__BEGIN_DECLS
+
+#define MERKLE_HASH_SIZE	SHA256_DIGEST_LENGTH
+
+struct blockdev_merkle;
+
+/* a run of blocks */
+struct blockdev_range {
+	block_addr	block;
+	uint32_t	count;
+};
+
+/* hash every block of dev and attach the tree so it tracks later writes */
+struct blockdev_merkle *blockdev_merkle_build(struct blockdev *dev);
+
+/* attach a loaded tree to a device of the same geometry, or detach it */
+int blockdev_merkle_attach(struct blockdev_merkle *tree, struct blockdev *dev);
+void blockdev_merkle_detach(struct blockdev_merkle *tree);
+
+/* detaches if needed */
+void blockdev_merkle_free(struct blockdev_merkle *tree);
+
+int blockdev_merkle_save(struct blockdev_merkle *tree, const char *path);
+struct blockdev_merkle *blockdev_merkle_load(const char *path);
+
+const uint8_t *blockdev_merkle_root(struct blockdev_merkle *tree);
+
+/*
+ * List the block ranges that differ between two trees, in ascending order.
+ *
+ * Fills at most max_ranges entries. Returns the total number of differing ranges
+ * (which may exceed max_ranges), or -1 if the trees have different geometry.
+ */
+int blockdev_merkle_diff(struct blockdev_merkle *a, struct blockdev_merkle *b,
+			 struct blockdev_range *ranges, uint32_t max_ranges);
+
+__END_DECLS
+
+#endif
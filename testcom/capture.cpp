@@ -0,0 +1,546 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include "modemmon.h"
+#include "capture.h"
+#include "compat.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define CAPTURE_VERSION		1
+#define CAPTURE_READ_SIZE	16384
+#define CAPTURE_MIN_RING	(64 * 1024)
+#define CAPTURE_STDIO_BUFFER	(4 * 1024 * 1024)
+#define CAPTURE_WINDOW_SIZE	(64ull * 1024 * 1024)	/* a multiple of the mapping granularity */
+#define CAPTURE_FLUSH_MS	50
+#define CAPTURE_NAME_SIZE	32
+
+/* records and their data stay 8-byte aligned in the ring and the file */
+#define CAPTURE_PAD(len)	(((uint64_t)(len) + 7) & ~7ull)
+
+/*
+ * One port's ring. head is only written by the reader thread and tail only
+ * by the writer thread; a cache line of padding after each keeps them off
+ * each other's lines (padding rather than alignas, which heap allocation
+ * doesn't honour before C++17). The ring holds capture_records exactly as
+ * they go into the file, so draining is a straight copy.
+ */
+#define CAPTURE_CACHE_LINE	64
+
+struct capture_ring {
+	std::atomic<uint64_t>			head;
+	uint64_t				lost;		/* dropped bytes not yet marked in the ring */
+	uint8_t					producerPad[CAPTURE_CACHE_LINE];
+
+	std::atomic<uint64_t>			tail;
+	uint8_t					consumerPad[CAPTURE_CACHE_LINE];
+
+	uint8_t					*data;
+	uint64_t				size;
+	struct modem_line			*line;
+	uint16_t				port;
+	std::thread				reader;
+
+	/* written by the reader, read by capture_get_stats */
+	std::atomic<uint64_t>			bytes;
+	std::atomic<uint64_t>			chunks;
+	std::atomic<uint64_t>			overrunBytes;
+	std::atomic<uint64_t>			overruns;
+	std::atomic<uint32_t>			highWater;
+	std::atomic<bool>			failed;
+};
+
+struct capture {
+	std::string				path;
+	uint32_t				ringSize;
+	uint32_t				flags;
+	std::vector<struct capture_ring *>	rings;
+	bool					started;
+	uint64_t				startTime;
+
+	/* the writer sleeps until a ring passes a quarter full or CAPTURE_FLUSH_MS passes */
+	std::thread				writer;
+	std::mutex				wakeLock;
+	std::condition_variable			wakeCond;
+	std::atomic<bool>			wake;
+	std::atomic<bool>			stopping;
+
+	/* output, owned by the writer thread once started */
+	FILE					*fp;
+	uint8_t					*window;
+	uint64_t				windowBase;
+#ifdef _WIN32
+	HANDLE					file;
+#else
+	int					fd;
+#endif
+	std::atomic<uint64_t>			written;
+	bool					error;
+};
+
+/*
+ * Output. The stdio path leans on a large buffer to batch the writes; the
+ * mapped path copies into a window of the file and slides it along,
+ * growing the file a window at a time and trimming it on close.
+ */
+
+static bool
+capture_sink_open(struct capture *capture)
+{
+	capture->window = NULL;
+	capture->windowBase = 0;
+	capture->written = 0;
+	capture->error = false;
+
+	if ((capture->flags & CAPTURE_MMAP) == 0) {
+		capture->fp = compat_fopen(capture->path.c_str(), "wb");
+		if (capture->fp == NULL) {
+			printf("capture: can't create %s\n", capture->path.c_str());
+			return false;
+		}
+		setvbuf(capture->fp, NULL, _IOFBF, CAPTURE_STDIO_BUFFER);
+		return true;
+	}
+
+	capture->fp = NULL;
+#ifdef _WIN32
+	capture->file = CreateFileA(capture->path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+				    CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (capture->file == INVALID_HANDLE_VALUE) {
+		printf("capture: CreateFile %s failed with error %d.\n", capture->path.c_str(), GetLastError());
+		return false;
+	}
+#else
+	capture->fd = open(capture->path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (capture->fd < 0) {
+		printf("capture: open %s failed with error %d.\n", capture->path.c_str(), errno);
+		return false;
+	}
+#endif
+	return true;
+}
+
+static void
+capture_unmap_window(struct capture *capture)
+{
+	if (capture->window == NULL)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(capture->window);
+#else
+	munmap(capture->window, CAPTURE_WINDOW_SIZE);
+#endif
+	capture->window = NULL;
+}
+
+/* map the window starting at base, extending the file to cover it */
+static bool
+capture_map_window(struct capture *capture, uint64_t base)
+{
+	uint64_t	end = base + CAPTURE_WINDOW_SIZE;
+
+	capture_unmap_window(capture);
+
+#ifdef _WIN32
+	HANDLE	mapping;
+
+	mapping = CreateFileMappingA(capture->file, NULL, PAGE_READWRITE, (DWORD)(end >> 32), (DWORD)end, NULL);
+	if (mapping == NULL) {
+		printf("capture: CreateFileMapping failed with error %d.\n", GetLastError());
+		return false;
+	}
+	capture->window = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_WRITE, (DWORD)(base >> 32), (DWORD)base,
+						   CAPTURE_WINDOW_SIZE);
+	CloseHandle(mapping);
+	if (capture->window == NULL) {
+		printf("capture: MapViewOfFile failed with error %d.\n", GetLastError());
+		return false;
+	}
+#else
+	void	*window;
+
+	if (ftruncate(capture->fd, (off_t)end) != 0) {
+		printf("capture: ftruncate failed with error %d.\n", errno);
+		return false;
+	}
+	window = mmap(NULL, CAPTURE_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, (off_t)base);
+	if (window == MAP_FAILED) {
+		printf("capture: mmap failed with error %d.\n", errno);
+		return false;
+	}
+	capture->window = (uint8_t *)window;
+#endif
+
+	capture->windowBase = base;
+	return true;
+}
+
+static void
+capture_sink_write(struct capture *capture, const void *data, uint64_t len)
+{
+	const uint8_t	*p = (const uint8_t *)data;
+	uint64_t	written = capture->written;
+	uint64_t	count;
+
+	if (capture->error || len == 0)
+		return;
+
+	if (capture->fp != NULL) {
+		if (fwrite(data, 1, (size_t)len, capture->fp) != len) {
+			printf("capture: write to %s failed\n", capture->path.c_str());
+			capture->error = true;
+			return;
+		}
+		capture->written = written + len;
+		return;
+	}
+
+	while (len != 0) {
+		if (capture->window == NULL || written == capture->windowBase + CAPTURE_WINDOW_SIZE) {
+			if (!capture_map_window(capture, written)) {
+				capture->error = true;
+				return;
+			}
+		}
+		count = capture->windowBase + CAPTURE_WINDOW_SIZE - written;
+		if (count > len)
+			count = len;
+		memcpy(capture->window + (written - capture->windowBase), p, (size_t)count);
+		p += count;
+		len -= count;
+		written += count;
+	}
+	capture->written = written;
+}
+
+static void
+capture_sink_close(struct capture *capture)
+{
+	if (capture->fp != NULL) {
+		if (fclose(capture->fp) != 0)
+			capture->error = true;
+		capture->fp = NULL;
+		return;
+	}
+
+	capture_unmap_window(capture);
+
+	/* trim the unused tail of the last window */
+#ifdef _WIN32
+	LARGE_INTEGER	end;
+
+	end.QuadPart = (LONGLONG)capture->written;
+	if (!SetFilePointerEx(capture->file, end, NULL, FILE_BEGIN) || !SetEndOfFile(capture->file))
+		capture->error = true;
+	CloseHandle(capture->file);
+#else
+	if (ftruncate(capture->fd, (off_t)capture->written) != 0)
+		capture->error = true;
+	close(capture->fd);
+#endif
+}
+
+/*
+ * Rings.
+ */
+
+static void
+capture_ring_copy(struct capture_ring *ring, uint64_t pos, const void *src, uint64_t len)
+{
+	uint64_t	offset = pos & (ring->size - 1);
+	uint64_t	first = ring->size - offset;
+
+	if (len == 0)
+		return;
+	if (first > len)
+		first = len;
+	memcpy(ring->data + offset, src, (size_t)first);
+	memcpy(ring->data, (const uint8_t *)src + first, (size_t)(len - first));
+}
+
+/* reader side; false if the record doesn't fit */
+static bool
+capture_ring_push(struct capture_ring *ring, const struct capture_record *record, const void *data, uint64_t *used)
+{
+	uint64_t	head = ring->head.load(std::memory_order_relaxed);
+	uint64_t	payload = (record->flags & CAPTURE_RECORD_OVERRUN) ? 0 : record->length;
+	uint64_t	need = sizeof(*record) + CAPTURE_PAD(payload);
+
+	*used = head - ring->tail.load(std::memory_order_acquire);
+	if (*used + need > ring->size)
+		return false;
+
+	static const uint8_t	zeros[8] = { 0 };
+
+	capture_ring_copy(ring, head, record, sizeof(*record));
+	capture_ring_copy(ring, head + sizeof(*record), data, payload);
+	capture_ring_copy(ring, head + sizeof(*record) + payload, zeros, CAPTURE_PAD(payload) - payload);
+	ring->head.store(head + need, std::memory_order_release);
+
+	*used += need;
+	if (*used > ring->highWater.load(std::memory_order_relaxed))
+		ring->highWater.store((uint32_t)*used, std::memory_order_relaxed);
+	return true;
+}
+
+/* writer side: everything published so far goes to the file as it is */
+static void
+capture_ring_drain(struct capture *capture, struct capture_ring *ring)
+{
+	uint64_t	tail = ring->tail.load(std::memory_order_relaxed);
+	uint64_t	head = ring->head.load(std::memory_order_acquire);
+	uint64_t	offset, first;
+
+	if (head == tail)
+		return;
+
+	offset = tail & (ring->size - 1);
+	first = ring->size - offset;
+	if (first > head - tail)
+		first = head - tail;
+	capture_sink_write(capture, ring->data + offset, first);
+	capture_sink_write(capture, ring->data, head - tail - first);
+
+	ring->tail.store(head, std::memory_order_release);
+}
+
+static void
+capture_reader(struct capture *capture, struct capture_ring *ring)
+{
+	struct modem_line	*line = ring->line;
+	struct capture_record	record;
+	uint8_t			buf[CAPTURE_READ_SIZE];
+	uint64_t		used = 0;
+	int			count;
+
+	record.port = ring->port;
+	for (;;) {
+		count = line->read_hook(line, buf, sizeof(buf));
+		record.timestamp = modem_time_us();
+		if (count <= 0) {
+			if (count < 0)
+				ring->failed = true;
+			return;
+		}
+
+		/* a gap is marked ahead of the data that follows it, or the data waits its turn to be lost */
+		if (ring->lost != 0) {
+			record.length = ring->lost > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)ring->lost;
+			record.flags = CAPTURE_RECORD_OVERRUN;
+			if (capture_ring_push(ring, &record, NULL, &used))
+				ring->lost -= record.length;
+		}
+
+		record.length = (uint32_t)count;
+		record.flags = 0;
+		if (ring->lost == 0 && capture_ring_push(ring, &record, buf, &used)) {
+			ring->bytes.fetch_add(count, std::memory_order_relaxed);
+			ring->chunks.fetch_add(1, std::memory_order_relaxed);
+		} else {
+			ring->lost += count;
+			ring->overrunBytes.fetch_add(count, std::memory_order_relaxed);
+			ring->overruns.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		if (used > ring->size / 4 && !capture->wake.exchange(true))
+			capture->wakeCond.notify_one();
+	}
+}
+
+static void
+capture_writer(struct capture *capture)
+{
+	struct capture_record	record;
+	bool			last;
+
+	for (;;) {
+		/* read first, so the pass after stopping is set sees everything the readers wrote */
+		last = capture->stopping;
+		if (!last) {
+			std::unique_lock<std::mutex> guard(capture->wakeLock);
+			capture->wakeCond.wait_for(guard, std::chrono::milliseconds(CAPTURE_FLUSH_MS),
+				[capture] { return capture->wake.load() || capture->stopping.load(); });
+			capture->wake = false;
+		}
+
+		for (size_t i = 0; i < capture->rings.size(); i++)
+			capture_ring_drain(capture, capture->rings[i]);
+
+		if (last)
+			break;
+	}
+
+	/* the readers are gone; mark any loss they had no room left to record */
+	for (size_t i = 0; i < capture->rings.size(); i++) {
+		struct capture_ring *ring = capture->rings[i];
+
+		while (ring->lost != 0) {
+			record.timestamp = modem_time_us();
+			record.length = ring->lost > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)ring->lost;
+			record.port = ring->port;
+			record.flags = CAPTURE_RECORD_OVERRUN;
+			capture_sink_write(capture, &record, sizeof(record));
+			ring->lost -= record.length;
+		}
+	}
+}
+
+struct capture *
+capture_create(const char *path, uint32_t ringSize, uint32_t flags)
+{
+	struct capture	*capture = new struct capture;
+	uint32_t	size = CAPTURE_MIN_RING;
+
+	while (size < ringSize && size < 0x80000000u)
+		size <<= 1;
+
+	capture->path = path;
+	capture->ringSize = size;
+	capture->flags = flags;
+	capture->started = false;
+	capture->startTime = 0;
+	capture->wake = false;
+	capture->stopping = false;
+	capture->fp = NULL;
+	capture->window = NULL;
+	capture->windowBase = 0;
+	capture->written = 0;
+	capture->error = false;
+
+	return capture;
+}
+
+int
+capture_add(struct capture *capture, struct modem_line *line)
+{
+	struct capture_ring	*ring;
+
+	if (capture->started || capture->rings.size() > 0xFFFF)
+		return -1;
+
+	ring = new struct capture_ring;
+	ring->data = (uint8_t *)malloc(capture->ringSize);
+	if (ring->data == NULL) {
+		delete ring;
+		return -1;
+	}
+	ring->head = 0;
+	ring->tail = 0;
+	ring->lost = 0;
+	ring->size = capture->ringSize;
+	ring->line = line;
+	ring->port = (uint16_t)capture->rings.size();
+	ring->bytes = 0;
+	ring->chunks = 0;
+	ring->overrunBytes = 0;
+	ring->overruns = 0;
+	ring->highWater = 0;
+	ring->failed = false;
+
+	capture->rings.push_back(ring);
+	return ring->port;
+}
+
+int
+capture_start(struct capture *capture)
+{
+	struct capture_file_header	header;
+	char				name[CAPTURE_NAME_SIZE];
+
+	if (capture->started || !capture_sink_open(capture))
+		return -1;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = kCaptureMagic;
+	header.version = CAPTURE_VERSION;
+	header.portCount = (uint32_t)capture->rings.size();
+	capture_sink_write(capture, &header, sizeof(header));
+	for (size_t i = 0; i < capture->rings.size(); i++) {
+		memset(name, 0, sizeof(name));
+		snprintf(name, sizeof(name), "%s", capture->rings[i]->line->name);
+		capture_sink_write(capture, name, sizeof(name));
+	}
+
+	capture->started = true;
+	capture->stopping = false;
+	capture->startTime = modem_time_us();
+	capture->writer = std::thread(capture_writer, capture);
+	for (size_t i = 0; i < capture->rings.size(); i++)
+		capture->rings[i]->reader = std::thread(capture_reader, capture, capture->rings[i]);
+
+	return 0;
+}
+
+int
+capture_stop(struct capture *capture)
+{
+	if (!capture->started)
+		return 0;
+
+	for (size_t i = 0; i < capture->rings.size(); i++)
+		capture->rings[i]->line->cancel_hook(capture->rings[i]->line);
+	for (size_t i = 0; i < capture->rings.size(); i++)
+		capture->rings[i]->reader.join();
+
+	capture->stopping = true;
+	capture->wakeCond.notify_one();
+	capture->writer.join();
+	capture_sink_close(capture);
+	capture->started = false;
+
+	return capture->error ? -1 : 0;
+}
+
+void
+capture_get_stats(struct capture *capture, struct capture_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->elapsed = capture->startTime ? modem_time_us() - capture->startTime : 0;
+	stats->written = capture->written;
+	stats->ports = (uint32_t)capture->rings.size();
+	stats->ringSize = capture->ringSize;
+
+	for (size_t i = 0; i < capture->rings.size(); i++) {
+		struct capture_ring *ring = capture->rings[i];
+
+		stats->bytes += ring->bytes;
+		stats->chunks += ring->chunks;
+		stats->overrunBytes += ring->overrunBytes;
+		stats->overruns += ring->overruns;
+		if (ring->highWater > stats->highWater)
+			stats->highWater = ring->highWater;
+		if (ring->failed)
+			stats->failedPorts++;
+	}
+}
+
+void
+capture_free(struct capture *capture)
+{
+	if (capture == NULL)
+		return;
+
+	capture_stop(capture);
+	for (size_t i = 0; i < capture->rings.size(); i++) {
+		free(capture->rings[i]->data);
+		delete capture->rings[i];
+	}
+	delete capture;
+}
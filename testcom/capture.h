@@ -0,0 +1,78 @@
+/*
+ * Serial data capture.
+ *
+ * Each port gets a reader thread that reads into a lock-free single-producer,
+ * single-consumer ring. One writer thread drains every ring into a capture
+ * file in large batches, either through stdio or a sliding mmap window.
+ * Reads that find the ring full are dropped and counted, and an overrun
+ * record marks the gap in the file.
+ */
+
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include "modemmon.h"
+#include "fourcc.h"
+
+__BEGIN_DECLS
+
+/*
+ * Capture file layout: a capture_file_header, portCount 32-byte port names,
+ * then capture_records, each followed by length bytes of data padded to a
+ * multiple of 8. Overrun records carry no data; their length is the number
+ * of bytes lost.
+ */
+struct capture_file_header {
+	uint32_t	magic;
+#define kCaptureMagic		fourcc("SCap")
+	uint32_t	version;
+	uint32_t	portCount;
+	uint32_t	reserved;
+};
+
+struct capture_record {
+	uint64_t	timestamp;	/* microseconds, from modem_time_us(), when the read completed */
+	uint32_t	length;
+	uint16_t	port;
+	uint16_t	flags;
+#define CAPTURE_RECORD_OVERRUN	(1 << 0)
+};
+
+/* capture_create flags */
+#define CAPTURE_MMAP		(1 << 0)	/* write through a mapped window rather than stdio */
+
+struct capture_stats {
+	uint64_t	elapsed;	/* microseconds since capture_start */
+	uint64_t	bytes;		/* received into the rings */
+	uint64_t	chunks;
+	uint64_t	written;	/* size of the capture file so far */
+	uint64_t	overrunBytes;	/* received but dropped for want of ring space */
+	uint64_t	overruns;
+	uint32_t	ports;
+	uint32_t	ringSize;
+	uint32_t	highWater;	/* worst occupancy of any ring, in bytes */
+	uint32_t	failedPorts;
+};
+
+struct capture;
+
+/* ringSize is rounded up to a power of two */
+struct capture *capture_create(const char *path, uint32_t ringSize, uint32_t flags);
+
+/* add lines before capture_start; the caller keeps ownership and must outlive the capture */
+int capture_add(struct capture *capture, struct modem_line *line);
+
+int capture_start(struct capture *capture);
+
+/*
+ * Cancel the lines (which also stops any monitor on them), drain the rings
+ * and finish the file. Returns 0, or -1 if the file could not be written.
+ */
+int capture_stop(struct capture *capture);
+
+void capture_get_stats(struct capture *capture, struct capture_stats *stats);
+void capture_free(struct capture *capture);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Small portability shims for the host tools (MSVC CRT vs. POSIX).
+ */
+
+#ifndef __COMPAT_H
+#define __COMPAT_H
+
+#include <stdio.h>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <share.h>
+#else
+#include <unistd.h>
+#endif
+
+/* fopen() is deprecated under the MSVC SDL checks */
+static inline FILE *compat_fopen(const char *path, const char *mode)
+{
+#ifdef _WIN32
+	FILE *fp;
+
+	if (fopen_s(&fp, path, mode) != 0)
+		return NULL;
+	return fp;
+#else
+	return fopen(path, mode);
+#endif
+}
+
+/* tmpfile() is deprecated under the MSVC SDL checks too */
+static inline FILE *compat_tmpfile(void)
+{
+#ifdef _WIN32
+	FILE *fp;
+
+	if (tmpfile_s(&fp) != 0)
+		return NULL;
+	return fp;
+#else
+	return tmpfile();
+#endif
+}
+
+/*
+ * Send a stream such as stdout to the null device, for timing code that prints.
+ * Returns a descriptor to hand to compat_restore_stream, or -1 if nothing changed.
+ */
+static inline int compat_quiet_stream(FILE *fp)
+{
+	int saved, null;
+
+	fflush(fp);
+#ifdef _WIN32
+	if ((saved = _dup(_fileno(fp))) < 0)
+		return -1;
+	if (_sopen_s(&null, "NUL", _O_WRONLY, _SH_DENYNO, 0) != 0) {
+		_close(saved);
+		return -1;
+	}
+	_dup2(null, _fileno(fp));
+	_close(null);
+#else
+	if ((saved = dup(fileno(fp))) < 0)
+		return -1;
+	if ((null = open("/dev/null", O_WRONLY)) < 0) {
+		close(saved);
+		return -1;
+	}
+	dup2(null, fileno(fp));
+	close(null);
+#endif
+	return saved;
+}
+
+static inline void compat_restore_stream(FILE *fp, int saved)
+{
+	if (saved < 0)
+		return;
+	fflush(fp);
+#ifdef _WIN32
+	_dup2(saved, _fileno(fp));
+	_close(saved);
+#else
+	dup2(saved, fileno(fp));
+	close(saved);
+#endif
+}
+
+#endif
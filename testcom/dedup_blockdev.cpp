@@ -0,0 +1,365 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <mutex>
+#include "blockdev.h"
+#include "dedup_blockdev.h"
+#include "hash.h"
+
+/* a pooled block; block_size bytes of data follow the header */
+struct dedup_block {
+	struct dedup_block	*hash_next;
+	uint64_t		hash;
+	uint64_t		refcount;	/* the shared zero block gets one per zero block of every device */
+};
+
+#define DEDUP_BLOCK_DATA(blk)	((uint8_t *)((blk) + 1))
+#define DEDUP_INITIAL_BUCKETS	1024
+#define DEDUP_IMPORT_BLOCKS	64
+
+/* one pool per block size, shared by every dedup device of that size */
+struct dedup_pool {
+	struct dedup_pool	*next;
+	uint32_t		block_size;
+	uint32_t		bucket_mask;
+	uint64_t		count;
+	struct dedup_block	**buckets;
+};
+
+struct dedup_blockdev {
+	struct blockdev		bdev;
+	struct dedup_pool	*pool;
+	struct dedup_block	**map;
+};
+
+/*
+ * The lock covers the pools and the refcounts. Reads don't take it: every block
+ * a device maps is pinned by that device's reference, and only the device's own
+ * writes can change its map.
+ */
+static std::mutex		dedup_lock;
+static struct dedup_pool	*dedup_pools = NULL;
+static uint64_t			dedup_referenced = 0;
+
+static struct dedup_pool *dedup_get_pool(uint32_t block_size)
+{
+	struct dedup_pool *pool;
+
+	for (pool = dedup_pools; pool; pool = pool->next) {
+		if (pool->block_size == block_size)
+			return pool;
+	}
+
+	pool = (struct dedup_pool *)calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+	pool->buckets = (struct dedup_block **)calloc(DEDUP_INITIAL_BUCKETS, sizeof(*pool->buckets));
+	if (pool->buckets == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pool->block_size = block_size;
+	pool->bucket_mask = DEDUP_INITIAL_BUCKETS - 1;
+
+	pool->next = dedup_pools;
+	dedup_pools = pool;
+
+	return pool;
+}
+
+static void dedup_pool_grow(struct dedup_pool *pool)
+{
+	struct dedup_block	**buckets;
+	struct dedup_block	*blk, *next;
+	uint32_t		new_mask, i;
+
+	new_mask = (pool->bucket_mask << 1) | 1;
+	buckets = (struct dedup_block **)calloc((size_t)new_mask + 1, sizeof(*buckets));
+	if (buckets == NULL)
+		return;		/* keep the longer chains */
+
+	for (i = 0; i <= pool->bucket_mask; i++) {
+		for (blk = pool->buckets[i]; blk; blk = next) {
+			next = blk->hash_next;
+			blk->hash_next = buckets[blk->hash & new_mask];
+			buckets[blk->hash & new_mask] = blk;
+		}
+	}
+
+	free(pool->buckets);
+	pool->buckets = buckets;
+	pool->bucket_mask = new_mask;
+}
+
+static struct dedup_block *dedup_pool_lookup(struct dedup_pool *pool, uint64_t hash, const void *data)
+{
+	struct dedup_block *blk;
+
+	for (blk = pool->buckets[hash & pool->bucket_mask]; blk; blk = blk->hash_next) {
+		if (blk->hash == hash && memcmp(DEDUP_BLOCK_DATA(blk), data, pool->block_size) == 0)
+			return blk;
+	}
+
+	return NULL;
+}
+
+static void dedup_pool_insert(struct dedup_pool *pool, struct dedup_block *blk)
+{
+	struct dedup_block **bucket;
+
+	bucket = &pool->buckets[blk->hash & pool->bucket_mask];
+	blk->hash_next = *bucket;
+	*bucket = blk;
+
+	if (++pool->count > (uint64_t)pool->bucket_mask + 1)
+		dedup_pool_grow(pool);
+}
+
+static void dedup_pool_remove(struct dedup_pool *pool, struct dedup_block *blk)
+{
+	struct dedup_block **link;
+
+	for (link = &pool->buckets[blk->hash & pool->bucket_mask]; *link; link = &(*link)->hash_next) {
+		if (*link == blk) {
+			*link = blk->hash_next;
+			pool->count--;
+			return;
+		}
+	}
+
+	assert(0);
+}
+
+/* find or create the pooled copy of data and take a reference on it */
+static struct dedup_block *dedup_get_block(struct dedup_pool *pool, uint64_t hash, const void *data)
+{
+	struct dedup_block *blk;
+
+	blk = dedup_pool_lookup(pool, hash, data);
+	if (blk != NULL) {
+		blk->refcount++;
+		return blk;
+	}
+
+	blk = (struct dedup_block *)malloc(sizeof(*blk) + pool->block_size);
+	if (blk == NULL)
+		return NULL;
+	memcpy(DEDUP_BLOCK_DATA(blk), data, pool->block_size);
+	blk->hash = hash;
+	blk->refcount = 1;
+	dedup_pool_insert(pool, blk);
+
+	return blk;
+}
+
+static void dedup_put_block(struct dedup_pool *pool, struct dedup_block *blk)
+{
+	assert(blk->refcount > 0);
+
+	if (--blk->refcount == 0) {
+		dedup_pool_remove(pool, blk);
+		free(blk);
+	}
+}
+
+static int dedup_read_block(struct blockdev *_dev, void *ptr, block_addr block, uint32_t count)
+{
+	struct dedup_blockdev	*dev = (struct dedup_blockdev *)_dev;
+	uint8_t			*dst = (uint8_t *)ptr;
+	uint32_t		i;
+
+	if (block >= _dev->block_count)
+		return 0;
+	if (count > _dev->block_count - block)
+		count = _dev->block_count - block;
+
+	for (i = 0; i < count; i++) {
+		memcpy(dst, DEDUP_BLOCK_DATA(dev->map[block + i]), _dev->block_size);
+		dst += _dev->block_size;
+	}
+
+	return count;
+}
+
+/* copy-on-write: a block is only ever modified in place when this device holds the sole reference */
+static int dedup_write_block(struct blockdev *_dev, const void *ptr, block_addr block, uint32_t count)
+{
+	struct dedup_blockdev	*dev = (struct dedup_blockdev *)_dev;
+	struct dedup_pool	*pool = dev->pool;
+	const uint8_t		*src = (const uint8_t *)ptr;
+	struct dedup_block	*old, *blk;
+	uint64_t		hash;
+	uint32_t		i;
+
+	if (block >= _dev->block_count)
+		return 0;
+	if (count > _dev->block_count - block)
+		count = _dev->block_count - block;
+
+	std::lock_guard<std::mutex> guard(dedup_lock);
+
+	for (i = 0; i < count; i++, src += _dev->block_size) {
+		old = dev->map[block + i];
+		hash = hash64(src, _dev->block_size, 0);
+
+		/* rewriting identical contents is common (partial block updates) */
+		if (old->hash == hash && memcmp(DEDUP_BLOCK_DATA(old), src, _dev->block_size) == 0)
+			continue;
+
+		blk = dedup_pool_lookup(pool, hash, src);
+		if (blk != NULL) {
+			blk->refcount++;
+		}
+		else if (old->refcount == 1) {
+			/* nobody else sees the old contents, recycle the block */
+			dedup_pool_remove(pool, old);
+			memcpy(DEDUP_BLOCK_DATA(old), src, _dev->block_size);
+			old->hash = hash;
+			dedup_pool_insert(pool, old);
+			continue;
+		}
+		else {
+			blk = dedup_get_block(pool, hash, src);
+			if (blk == NULL) {
+				printf("dedup: out of memory writing block %u\n", block + i);
+				return i > 0 ? (int)i : -1;
+			}
+		}
+
+		dev->map[block + i] = blk;
+		dedup_put_block(pool, old);
+	}
+
+	return count;
+}
+
+struct blockdev *create_dedup_blockdev(const char *name, uint64_t len, uint32_t block_size)
+{
+	struct dedup_blockdev	*dev;
+	struct dedup_block	*zero;
+	uint8_t			*zero_data;
+	uint32_t		i;
+
+	dev = (struct dedup_blockdev *)calloc(1, sizeof(*dev));
+	if (dev == NULL)
+		return NULL;
+
+	construct_blockdev(&dev->bdev, name, len, block_size);
+
+	/* each block holds one reference to the shared zero block; with no blocks there is none to hold */
+	if (dev->bdev.block_count == 0) {
+		printf("dedup: device \"%s\" is smaller than one %u byte block\n", name, block_size);
+		free(dev);
+		return NULL;
+	}
+
+	dev->map = (struct dedup_block **)malloc((size_t)dev->bdev.block_count * sizeof(*dev->map));
+	zero_data = (uint8_t *)calloc(1, block_size);
+	if (dev->map == NULL || zero_data == NULL)
+		goto fail;
+
+	{
+		std::lock_guard<std::mutex> guard(dedup_lock);
+
+		dev->pool = dedup_get_pool(block_size);
+		if (dev->pool == NULL)
+			goto fail;
+
+		/* a fresh device reads as zeroes, all of it backed by one shared block */
+		zero = dedup_get_block(dev->pool, hash64(zero_data, block_size, 0), zero_data);
+		if (zero == NULL)
+			goto fail;
+		zero->refcount += (uint64_t)dev->bdev.block_count - 1;
+		dedup_referenced += dev->bdev.block_count;
+	}
+	free(zero_data);
+
+	for (i = 0; i < dev->bdev.block_count; i++)
+		dev->map[i] = zero;
+
+	dev->bdev.read_block_hook = &dedup_read_block;
+	dev->bdev.write_block_hook = &dedup_write_block;
+
+	return &dev->bdev;
+
+fail:
+	printf("dedup: can't allocate device \"%s\"\n", name);
+	free(zero_data);
+	free(dev->map);
+	free(dev);
+	return NULL;
+}
+
+int dedup_blockdev_import(struct blockdev *dev, struct blockdev *src)
+{
+	uint8_t		*buf;
+	block_addr	block;
+	uint32_t	count;
+	int		err;
+
+	if (src->block_size != dev->block_size || src->block_count != dev->block_count) {
+		printf("dedup: import geometry mismatch \"%s\" -> \"%s\"\n", src->name, dev->name);
+		return -1;
+	}
+
+	buf = (uint8_t *)malloc((size_t)DEDUP_IMPORT_BLOCKS * dev->block_size);
+	if (buf == NULL)
+		return -1;
+
+	for (block = 0; block < dev->block_count; block += count) {
+		count = __min(DEDUP_IMPORT_BLOCKS, dev->block_count - block);
+
+		err = blockdev_read_block(src, buf, block, count);
+		if (err <= 0) {
+			printf("dedup: import read fail at block %u\n", block);
+			free(buf);
+			return -1;
+		}
+		count = err;
+
+		/* populate directly, an import is not subject to the write protection */
+		err = dev->write_block_hook(dev, buf, block, count);
+		if (err < (int)count) {
+			free(buf);
+			return -1;
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+
+void free_dedup_blockdev(struct blockdev *_dev)
+{
+	struct dedup_blockdev	*dev = (struct dedup_blockdev *)_dev;
+	uint32_t		i;
+
+	{
+		std::lock_guard<std::mutex> guard(dedup_lock);
+
+		for (i = 0; i < _dev->block_count; i++)
+			dedup_put_block(dev->pool, dev->map[i]);
+		dedup_referenced -= _dev->block_count;
+	}
+
+	free(dev->map);
+	free(dev);
+}
+
+void dedup_blockdev_pool_stats(struct dedup_pool_stats *stats)
+{
+	struct dedup_pool *pool;
+
+	std::lock_guard<std::mutex> guard(dedup_lock);
+
+	memset(stats, 0, sizeof(*stats));
+	for (pool = dedup_pools; pool; pool = pool->next) {
+		stats->unique_blocks += pool->count;
+		stats->resident_bytes += pool->count * (sizeof(struct dedup_block) + pool->block_size);
+		stats->resident_bytes += ((uint64_t)pool->bucket_mask + 1) * sizeof(*pool->buckets);
+	}
+	stats->referenced_blocks = dedup_referenced;
+	stats->resident_bytes += dedup_referenced * sizeof(struct dedup_block *);
+}
@@ -0,0 +1,35 @@
+/*
+ * Deduplicating memory block device.
+ *
+ * Block contents live in a process-wide pool indexed by content hash and
+ * shared, reference counted, between every dedup device of the same block
+ * size. Each device only owns a block map. Writes are copy-on-write, so
+ * near-identical images cost little more than the blocks in which they differ.
+ */
+
+#ifndef __LIB_DEDUP_BLOCKDEV_H
+#define __LIB_DEDUP_BLOCKDEV_H
+
+#include "blockdev.h"
+
+__BEGIN_DECLS
+
+struct dedup_pool_stats {
+	uint64_t	unique_blocks;		/* blocks resident in the pools */
+	uint64_t	referenced_blocks;	/* sum of all device block maps */
+	uint64_t	resident_bytes;		/* block data plus bookkeeping */
+};
+
+/* create_dedup_blockdev() is declared in blockdev.h next to the other backends */
+
+/* copy the contents of src into a dedup device of the same geometry */
+int dedup_blockdev_import(struct blockdev *dev, struct blockdev *src);
+
+/* drop a dedup device and its block references; unregister it first */
+void free_dedup_blockdev(struct blockdev *dev);
+
+void dedup_blockdev_pool_stats(struct dedup_pool_stats *stats);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,656 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <vector>
+#include "modemmon.h"
+#include "eventlog.h"
+#include "compat.h"
+#include "fourcc.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+ * File layout:
+ *
+ *	event_log_header, portCount names of EVENT_LOG_NAME_SIZE bytes
+ *	blocks: event_log_block, port bitmap, length bytes of events, padded to 8
+ *	index: blockCount event_log_index_entry, then event_log_trailer
+ *
+ * An event is a zigzag varint timestamp delta from the previous event in
+ * the block (the first from base), a varint port, and one byte holding the
+ * lines in the low nibble and the lines that changed in the high nibble.
+ * Deltas are signed because ports reported from different threads can land
+ * a few microseconds out of order.
+ */
+
+#define EVENT_LOG_VERSION	1
+#define EVENT_LOG_NAME_SIZE	32
+#define EVENT_LOG_BLOCK_EVENTS	4096
+#define EVENT_LOG_PAD(len)	(((uint64_t)(len) + 7) & ~7ull)
+
+struct event_log_header {
+	uint32_t	magic;
+#define kEventLogMagic		fourcc("SCev")
+	uint32_t	version;
+	uint32_t	portCount;
+	uint32_t	nameSize;
+	int64_t		epochOffset;	/* wall clock minus modem_time_us() when the log was created */
+	uint64_t	reserved;
+};
+
+struct event_log_block {
+	uint32_t	magic;
+#define kEventLogBlockMagic	fourcc("SCeb")
+	uint32_t	length;		/* bytes of encoded events */
+	uint32_t	count;
+	uint32_t	reserved;
+	uint64_t	base;		/* timestamp the first delta is from */
+	uint64_t	min;
+	uint64_t	max;
+	/* followed by the port bitmap and the events */
+};
+
+struct event_log_index_entry {
+	uint64_t	offset;
+	uint64_t	min;
+	uint64_t	max;
+	uint32_t	count;
+	uint32_t	reserved;
+};
+
+struct event_log_trailer {
+	uint32_t	magic;
+#define kEventLogIndexMagic	fourcc("SCei")
+	uint32_t	version;
+	uint64_t	blockCount;
+	uint64_t	indexOffset;
+	uint64_t	reserved;
+};
+
+static uint32_t
+event_log_port_words(uint32_t portCount)
+{
+	return (portCount + 63) / 64;
+}
+
+static int64_t
+event_log_wall_time_us(void)
+{
+#ifdef _WIN32
+	FILETIME	ft;
+	uint64_t	ticks;
+
+	GetSystemTimePreciseAsFileTime(&ft);
+	ticks = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return (int64_t)((ticks - 116444736000000000ull) / 10);	/* 100ns ticks since 1601 */
+#else
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/*
+ * Writer.
+ */
+
+struct event_log {
+	FILE					*fp;
+	uint32_t				portCount;
+	uint32_t				portWords;
+	uint64_t				offset;		/* where the next block goes */
+	bool					error;
+
+	/* the block being built */
+	std::vector<uint8_t>			events;
+	std::vector<uint64_t>			ports;
+	uint32_t				count;
+	uint64_t				base;
+	uint64_t				previous;
+	uint64_t				min;
+	uint64_t				max;
+
+	std::vector<struct event_log_index_entry> index;
+};
+
+static void
+event_log_write(struct event_log *log, const void *data, size_t len)
+{
+	if (!log->error && fwrite(data, 1, len, log->fp) != len) {
+		printf("event_log: write failed\n");
+		log->error = true;
+	}
+	log->offset += len;
+}
+
+struct event_log *
+event_log_create(const char *path, uint32_t portCount, const char *const *names)
+{
+	struct event_log	*log;
+	struct event_log_header	header;
+	char			name[EVENT_LOG_NAME_SIZE];
+	FILE			*fp;
+
+	fp = compat_fopen(path, "wb");
+	if (fp == NULL) {
+		printf("event_log: can't create %s\n", path);
+		return NULL;
+	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+	log = new struct event_log;
+	log->fp = fp;
+	log->portCount = portCount;
+	log->portWords = event_log_port_words(portCount);
+	log->offset = 0;
+	log->error = false;
+	log->events.reserve(EVENT_LOG_BLOCK_EVENTS * 4);
+	log->ports.assign(log->portWords, 0);
+	log->count = 0;
+	log->base = log->previous = log->min = log->max = 0;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = kEventLogMagic;
+	header.version = EVENT_LOG_VERSION;
+	header.portCount = portCount;
+	header.nameSize = EVENT_LOG_NAME_SIZE;
+	header.epochOffset = event_log_wall_time_us() - (int64_t)modem_time_us();
+	event_log_write(log, &header, sizeof(header));
+
+	for (uint32_t port = 0; port < portCount; port++) {
+		memset(name, 0, sizeof(name));
+		if (names != NULL && names[port] != NULL)
+			snprintf(name, sizeof(name), "%s", names[port]);
+		event_log_write(log, name, sizeof(name));
+	}
+
+	return log;
+}
+
+static void
+event_log_put_varint(std::vector<uint8_t> &out, uint64_t value)
+{
+	while (value >= 0x80) {
+		out.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((uint8_t)value);
+}
+
+int
+event_log_append(struct event_log *log, const struct modem_event *event)
+{
+	int64_t	delta;
+
+	if (event->port >= log->portCount)
+		return -1;
+
+	if (log->count == 0)
+		log->base = log->previous = log->min = log->max = event->timestamp;
+
+	delta = (int64_t)(event->timestamp - log->previous);
+	event_log_put_varint(log->events, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+	event_log_put_varint(log->events, event->port);
+	log->events.push_back((uint8_t)((event->lines & 0xF) | ((event->changed & 0xF) << 4)));
+
+	log->previous = event->timestamp;
+	if (event->timestamp < log->min)
+		log->min = event->timestamp;
+	if (event->timestamp > log->max)
+		log->max = event->timestamp;
+	log->ports[event->port / 64] |= 1ull << (event->port % 64);
+
+	if (++log->count == EVENT_LOG_BLOCK_EVENTS)
+		return event_log_flush(log) == 0 ? 0 : -1;
+	return log->error ? -1 : 0;
+}
+
+static void
+event_log_end_block(struct event_log *log)
+{
+	static const uint8_t		zeros[8] = { 0 };
+	struct event_log_block		block;
+	struct event_log_index_entry	entry;
+
+	if (log->count == 0)
+		return;
+
+	memset(&block, 0, sizeof(block));
+	block.magic = kEventLogBlockMagic;
+	block.length = (uint32_t)log->events.size();
+	block.count = log->count;
+	block.base = log->base;
+	block.min = log->min;
+	block.max = log->max;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.offset = log->offset;
+	entry.min = log->min;
+	entry.max = log->max;
+	entry.count = log->count;
+	log->index.push_back(entry);
+
+	event_log_write(log, &block, sizeof(block));
+	event_log_write(log, log->ports.data(), log->portWords * sizeof(uint64_t));
+	event_log_write(log, log->events.data(), log->events.size());
+	event_log_write(log, zeros, (size_t)(EVENT_LOG_PAD(log->events.size()) - log->events.size()));
+
+	log->events.clear();
+	log->ports.assign(log->portWords, 0);
+	log->count = 0;
+}
+
+int
+event_log_flush(struct event_log *log)
+{
+	event_log_end_block(log);
+	if (!log->error && fflush(log->fp) != 0)
+		log->error = true;
+	return log->error ? -1 : 0;
+}
+
+int
+event_log_close(struct event_log *log)
+{
+	struct event_log_trailer	trailer;
+	int				result;
+
+	if (log == NULL)
+		return 0;
+
+	event_log_end_block(log);
+
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.magic = kEventLogIndexMagic;
+	trailer.version = EVENT_LOG_VERSION;
+	trailer.blockCount = log->index.size();
+	trailer.indexOffset = log->offset;
+	if (!log->index.empty())
+		event_log_write(log, log->index.data(), log->index.size() * sizeof(log->index[0]));
+	event_log_write(log, &trailer, sizeof(trailer));
+
+	if (fclose(log->fp) != 0)
+		log->error = true;
+	result = log->error ? -1 : 0;
+	delete log;
+	return result;
+}
+
+/*
+ * Reader.
+ */
+
+/* a block as the reader sees it, with the running bounds that make the time search safe */
+struct event_log_block_ref {
+	uint64_t	offset;
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	maxBefore;	/* highest max of this and every earlier block */
+	uint64_t	minAfter;	/* lowest min of this and every later block */
+};
+
+struct event_log_reader {
+	uint8_t					*base;
+	size_t					length;
+	const struct event_log_header		*header;
+	uint64_t				dataStart;
+	uint64_t				dataEnd;
+	uint32_t				portWords;
+	std::vector<struct event_log_block_ref>	blocks;
+};
+
+static void *
+event_log_map(const char *path, size_t *length)
+{
+#ifdef _WIN32
+	HANDLE		file, mapping;
+	LARGE_INTEGER	size;
+	void		*base;
+
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+			   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || (uint64_t)size.QuadPart > SIZE_MAX) {
+		CloseHandle(file);
+		return NULL;
+	}
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL)
+		return NULL;
+	base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+
+	*length = (size_t)size.QuadPart;
+	return base;
+#else
+	struct stat	st;
+	void		*base;
+	int		fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	*length = (size_t)st.st_size;
+	return base;
+#endif
+}
+
+static void
+event_log_unmap(void *base, size_t length)
+{
+#ifdef _WIN32
+	(void)length;
+	UnmapViewOfFile(base);
+#else
+	munmap(base, length);
+#endif
+}
+
+/* the block at offset, if it lies wholly within the data */
+static const struct event_log_block *
+event_log_block_at(struct event_log_reader *reader, uint64_t offset, uint64_t *size)
+{
+	const struct event_log_block	*block;
+
+	if (offset < reader->dataStart || offset > reader->dataEnd ||
+	    reader->dataEnd - offset < sizeof(*block) + reader->portWords * sizeof(uint64_t))
+		return NULL;
+
+	block = (const struct event_log_block *)(reader->base + offset);
+	*size = sizeof(*block) + reader->portWords * sizeof(uint64_t) + EVENT_LOG_PAD(block->length);
+	if (block->magic != kEventLogBlockMagic || *size > reader->dataEnd - offset)
+		return NULL;
+	return block;
+}
+
+static bool
+event_log_load_index(struct event_log_reader *reader)
+{
+	const struct event_log_trailer		*trailer;
+	const struct event_log_index_entry	*entries;
+	struct event_log_block_ref		ref;
+
+	/* every part of a closed log is padded to 8; a log that isn't was cut short, and has no trailer to read */
+	if (reader->length < reader->dataStart + sizeof(*trailer) || (reader->length & 7) != 0)
+		return false;
+
+	trailer = (const struct event_log_trailer *)(reader->base + reader->length - sizeof(*trailer));
+	if (trailer->magic != kEventLogIndexMagic || trailer->version != EVENT_LOG_VERSION ||
+	    trailer->indexOffset < reader->dataStart || trailer->indexOffset > reader->length ||
+	    trailer->blockCount > (reader->length - sizeof(*trailer) - trailer->indexOffset) / sizeof(*entries) ||
+	    trailer->indexOffset + trailer->blockCount * sizeof(*entries) + sizeof(*trailer) != reader->length)
+		return false;
+
+	reader->dataEnd = trailer->indexOffset;
+	entries = (const struct event_log_index_entry *)(reader->base + trailer->indexOffset);
+	reader->blocks.reserve((size_t)trailer->blockCount);
+	for (uint64_t i = 0; i < trailer->blockCount; i++) {
+		ref.offset = entries[i].offset;
+		ref.min = entries[i].min;
+		ref.max = entries[i].max;
+		reader->blocks.push_back(ref);
+	}
+	return true;
+}
+
+/* no index, so the log wasn't closed: walk the blocks up to the first incomplete one */
+static void
+event_log_rebuild_index(struct event_log_reader *reader)
+{
+	const struct event_log_block	*block;
+	struct event_log_block_ref	ref;
+	uint64_t			offset, size;
+
+	reader->dataEnd = reader->length;
+	reader->blocks.clear();
+
+	for (offset = reader->dataStart; (block = event_log_block_at(reader, offset, &size)) != NULL; offset += size) {
+		ref.offset = offset;
+		ref.min = block->min;
+		ref.max = block->max;
+		reader->blocks.push_back(ref);
+	}
+	reader->dataEnd = offset;
+}
+
+struct event_log_reader *
+event_log_open(const char *path)
+{
+	struct event_log_reader	*reader;
+	uint8_t			*base;
+	size_t			length;
+	size_t			count;
+
+	base = (uint8_t *)event_log_map(path, &length);
+	if (base == NULL) {
+		printf("event_log: can't map %s\n", path);
+		return NULL;
+	}
+
+	reader = new struct event_log_reader;
+	reader->base = base;
+	reader->length = length;
+	reader->header = (const struct event_log_header *)base;
+
+	if (length < sizeof(*reader->header) || reader->header->magic != kEventLogMagic ||
+	    reader->header->version != EVENT_LOG_VERSION || reader->header->nameSize != EVENT_LOG_NAME_SIZE ||
+	    reader->header->portCount > (length - sizeof(*reader->header)) / EVENT_LOG_NAME_SIZE) {
+		printf("event_log: %s is not an event log\n", path);
+		event_log_close_reader(reader);
+		return NULL;
+	}
+
+	reader->portWords = event_log_port_words(reader->header->portCount);
+	reader->dataStart = sizeof(*reader->header) + (uint64_t)reader->header->portCount * EVENT_LOG_NAME_SIZE;
+
+	if (!event_log_load_index(reader))
+		event_log_rebuild_index(reader);
+
+	count = reader->blocks.size();
+	for (size_t i = 0; i < count; i++) {
+		reader->blocks[i].maxBefore = reader->blocks[i].max;
+		if (i > 0 && reader->blocks[i - 1].maxBefore > reader->blocks[i].maxBefore)
+			reader->blocks[i].maxBefore = reader->blocks[i - 1].maxBefore;
+	}
+	for (size_t i = count; i-- > 0; ) {
+		reader->blocks[i].minAfter = reader->blocks[i].min;
+		if (i + 1 < count && reader->blocks[i + 1].minAfter < reader->blocks[i].minAfter)
+			reader->blocks[i].minAfter = reader->blocks[i + 1].minAfter;
+	}
+
+	return reader;
+}
+
+void
+event_log_close_reader(struct event_log_reader *reader)
+{
+	if (reader == NULL)
+		return;
+	event_log_unmap(reader->base, reader->length);
+	delete reader;
+}
+
+uint32_t
+event_log_port_count(struct event_log_reader *reader)
+{
+	return reader->header->portCount;
+}
+
+const char *
+event_log_port_name(struct event_log_reader *reader, uint32_t port)
+{
+	const char	*name;
+
+	if (port >= reader->header->portCount)
+		return NULL;
+
+	/* the writer always leaves a NUL; anything else is damage */
+	name = (const char *)reader->base + sizeof(*reader->header) + (size_t)port * EVENT_LOG_NAME_SIZE;
+	return memchr(name, '\0', EVENT_LOG_NAME_SIZE) != NULL ? name : "";
+}
+
+int64_t
+event_log_epoch_offset(struct event_log_reader *reader)
+{
+	return reader->header->epochOffset;
+}
+
+void
+event_log_query_all(struct event_log_query *query)
+{
+	query->start = 0;
+	query->end = UINT64_MAX;
+	query->port = -1;
+	query->changed = 0;
+	query->levelMask = 0;
+	query->levelValue = 0;
+}
+
+static inline bool
+event_log_get_varint(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+	uint64_t	result = 0;
+	uint32_t	shift;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		if (*p == end)
+			return false;
+		result |= (uint64_t)(**p & 0x7F) << shift;
+		if ((*(*p)++ & 0x80) == 0) {
+			*value = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+int64_t
+event_log_replay(struct event_log_reader *reader, const struct event_log_query *query,
+		 event_log_fn fn, void *refcon)
+{
+	const struct event_log_block	*block;
+	const uint64_t			*ports;
+	const uint8_t			*p, *end;
+	struct modem_event		event;
+	uint64_t			size, value, timestamp;
+	int64_t				delivered = 0;
+	size_t				lo, hi, mid, i;
+	uint32_t			n, flags;
+
+	if (query->start >= query->end)
+		return 0;
+
+	/* first block that could reach start */
+	lo = 0;
+	hi = reader->blocks.size();
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (reader->blocks[mid].maxBefore < query->start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; i < reader->blocks.size() && reader->blocks[i].minAfter < query->end; i++) {
+		if (reader->blocks[i].max < query->start || reader->blocks[i].min >= query->end)
+			continue;
+
+		block = event_log_block_at(reader, reader->blocks[i].offset, &size);
+		if (block == NULL)
+			return -1;
+
+		ports = (const uint64_t *)(block + 1);
+		if (query->port >= 0 &&
+		    ((uint32_t)query->port >= reader->header->portCount ||
+		     (ports[query->port / 64] & (1ull << (query->port % 64))) == 0))
+			continue;
+
+		p = (const uint8_t *)(ports + reader->portWords);
+		end = p + block->length;
+		timestamp = block->base;
+		for (n = 0; n < block->count; n++) {
+			if (!event_log_get_varint(&p, end, &value))
+				return -1;
+			timestamp += (value >> 1) ^ (0 - (value & 1));
+			if (!event_log_get_varint(&p, end, &value) || p == end)
+				return -1;
+			flags = *p++;
+
+			if (query->port >= 0 && value != (uint64_t)query->port)
+				continue;
+			if (timestamp < query->start || timestamp >= query->end)
+				continue;
+			if (query->changed != 0 && ((flags >> 4) & query->changed) == 0)
+				continue;
+			if (((flags & 0xF) & query->levelMask) != (query->levelValue & query->levelMask))
+				continue;
+
+			event.timestamp = timestamp;
+			event.lines = flags & 0xF;
+			event.changed = flags >> 4;
+			event.port = (uint32_t)value;
+			delivered++;
+			if (!fn(refcon, &event))
+				return delivered;
+		}
+	}
+
+	return delivered;
+}
+
+static bool
+event_log_summarize_one(void *refcon, const struct modem_event *event)
+{
+	struct event_log_summary	*summary = (struct event_log_summary *)refcon;
+
+	if (summary->events == 0 || event->timestamp < summary->first)
+		summary->first = event->timestamp;
+	if (event->timestamp > summary->last)
+		summary->last = event->timestamp;
+	summary->events++;
+
+	for (int line = 0; line < 4; line++) {
+		if ((event->changed & (1 << line)) == 0)
+			continue;
+		if (event->lines & (1 << line))
+			summary->rises[line]++;
+		else
+			summary->falls[line]++;
+	}
+	return true;
+}
+
+int
+event_log_summarize(struct event_log_reader *reader, const struct event_log_query *query,
+		    struct event_log_summary *summary)
+{
+	memset(summary, 0, sizeof(*summary));
+	return event_log_replay(reader, query, event_log_summarize_one, summary) < 0 ? -1 : 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Binary modem event log.
+ *
+ * Only transitions are logged, packed into blocks of delta-encoded events.
+ * Each block header carries its time span and a bitmap of the ports it
+ * mentions, and an index of the blocks closes the file. A reader maps the
+ * file, binary-searches the index for a time range, skips blocks that don't
+ * mention the port asked for and decodes the rest.
+ *
+ * A log that was never closed has no index; the reader rebuilds it from the
+ * block headers, losing at most the block that was being written.
+ */
+
+#ifndef __EVENTLOG_H
+#define __EVENTLOG_H
+
+#include "modemmon.h"
+
+__BEGIN_DECLS
+
+struct event_log;
+struct event_log_reader;
+
+/* names may be NULL; ports are numbered 0 .. portCount - 1 */
+struct event_log *event_log_create(const char *path, uint32_t portCount, const char *const *names);
+int event_log_append(struct event_log *log, const struct modem_event *event);
+
+/* end the current block and push it to the file, e.g. periodically during a long capture */
+int event_log_flush(struct event_log *log);
+
+/* write the index and close; returns 0, or -1 if anything failed to write */
+int event_log_close(struct event_log *log);
+
+/* events match when each given criterion holds */
+struct event_log_query {
+	uint64_t	start;		/* timestamp range [start, end) */
+	uint64_t	end;
+	int32_t		port;		/* -1 for any */
+	uint32_t	changed;	/* at least one of these lines toggled; 0 for any */
+	uint32_t	levelMask;	/* lines in levelMask are as in levelValue after the event */
+	uint32_t	levelValue;
+};
+
+/* every event in the log */
+void event_log_query_all(struct event_log_query *query);
+
+struct event_log_summary {
+	uint64_t	events;
+	uint64_t	first;		/* timestamps of the first and last matching event */
+	uint64_t	last;
+	uint64_t	rises[4];	/* per line, indexed by bit number of MODEM_LINE_* */
+	uint64_t	falls[4];
+};
+
+/* return false to stop the replay */
+typedef bool(*event_log_fn)(void *refcon, const struct modem_event *event);
+
+struct event_log_reader *event_log_open(const char *path);
+void event_log_close_reader(struct event_log_reader *reader);
+
+uint32_t event_log_port_count(struct event_log_reader *reader);
+const char *event_log_port_name(struct event_log_reader *reader, uint32_t port);
+
+/* add to a timestamp to get microseconds since 1970 */
+int64_t event_log_epoch_offset(struct event_log_reader *reader);
+
+/* returns the number of matching events delivered, or -1 if the log is damaged */
+int64_t event_log_replay(struct event_log_reader *reader, const struct event_log_query *query,
+			 event_log_fn fn, void *refcon);
+int event_log_summarize(struct event_log_reader *reader, const struct event_log_query *query,
+			struct event_log_summary *summary);
+
+__END_DECLS
+
+#endif
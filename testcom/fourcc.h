@@ -0,0 +1,23 @@
+/*
+ * Four-character codes, for tags and file magics.
+ *
+ * A code is four characters packed first character highest, which is what
+ * both MSVC and GCC make of a literal such as 'SrNm' -- but the value of a
+ * multi-character literal is implementation-defined, so fourcc() spells the
+ * packing out. It is a constant expression and can stand anywhere the literal
+ * could.
+ */
+
+#ifndef __LIB_FOURCC_H
+#define __LIB_FOURCC_H
+
+#include "types.h"
+
+constexpr u_int32_t
+fourcc(const char (&s)[5])
+{
+	return ((u_int32_t)(uint8_t)s[0] << 24) | ((u_int32_t)(uint8_t)s[1] << 16) |
+	       ((u_int32_t)(uint8_t)s[2] << 8) | (u_int32_t)(uint8_t)s[3];
+}
+
+#endif
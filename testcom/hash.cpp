@@ -0,0 +1,81 @@
+#include "pch.h"
+#include <string.h>
+#include "hash.h"
+
+#define HASH_PRIME1	0x87c37b91114253d5ULL
+#define HASH_PRIME2	0x4cf5ad432745937fULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * murmur3-style mixing over two 64-bit lanes. Each step premixes its two
+ * words with multiplies that depend on nothing but the input, so those
+ * overlap; the lane states are chained through each other (h1 += h2,
+ * h2 += h1) and update in sequence.
+ */
+uint64_t hash64(const void *ptr, size_t len, uint64_t seed)
+{
+	const uint8_t	*p = (const uint8_t *)ptr;
+	uint64_t	h1 = seed;
+	uint64_t	h2 = seed ^ HASH_PRIME2;
+	uint64_t	k1, k2;
+	size_t		remaining = len;
+
+	while (remaining >= 16) {
+		k1 = read64(p);
+		k2 = read64(p + 8);
+
+		k1 *= HASH_PRIME1; k1 = rotl64(k1, 31); k1 *= HASH_PRIME2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= HASH_PRIME2; k2 = rotl64(k2, 33); k2 *= HASH_PRIME1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+
+		p += 16;
+		remaining -= 16;
+	}
+
+	/* tail */
+	k1 = 0;
+	k2 = 0;
+	if (remaining > 8) {
+		memcpy(&k2, p + 8, remaining - 8);
+		k2 *= HASH_PRIME2; k2 = rotl64(k2, 33); k2 *= HASH_PRIME1; h2 ^= k2;
+		remaining = 8;
+	}
+	if (remaining > 0) {
+		memcpy(&k1, p, remaining);
+		k1 *= HASH_PRIME1; k1 = rotl64(k1, 31); k1 *= HASH_PRIME2; h1 ^= k1;
+	}
+
+	h1 ^= (uint64_t)len;
+	h2 ^= (uint64_t)len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+
+	return h1;
+}
@@ -0,0 +1,17 @@
+/*
+ * Fast non-cryptographic hashing of block-sized buffers.
+ */
+
+#ifndef __LIB_HASH_H
+#define __LIB_HASH_H
+
+#include "types.h"
+
+__BEGIN_DECLS
+
+/* 64-bit hash of len bytes, suitable for content indexing (not for integrity) */
+uint64_t hash64(const void *ptr, size_t len, uint64_t seed);
+
+__END_DECLS
+
+#endif
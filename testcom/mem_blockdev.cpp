@@ -0,0 +1,69 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "blockdev.h"
+
+/* a block device over a caller's buffer, which must outlive it */
+struct mem_blockdev {
+	struct blockdev	bdev;
+	uint8_t		*ptr;
+};
+
+static int mem_read_block(struct blockdev *_dev, void *ptr, block_addr block, uint32_t count)
+{
+	struct mem_blockdev *dev = (struct mem_blockdev *)_dev;
+
+	if (block >= _dev->block_count)
+		return 0;
+	if (count > _dev->block_count - block)
+		count = _dev->block_count - block;
+
+	memcpy(ptr, dev->ptr + ((uint64_t)block << _dev->block_shift), (size_t)count << _dev->block_shift);
+	return count;
+}
+
+static int mem_write_block(struct blockdev *_dev, const void *ptr, block_addr block, uint32_t count)
+{
+	struct mem_blockdev *dev = (struct mem_blockdev *)_dev;
+
+	if (block >= _dev->block_count)
+		return 0;
+	if (count > _dev->block_count - block)
+		count = _dev->block_count - block;
+
+	memcpy(dev->ptr + ((uint64_t)block << _dev->block_shift), ptr, (size_t)count << _dev->block_shift);
+	return count;
+}
+
+/* the memory is byte addressable, so reads need not go through the bounce buffer */
+static int mem_read(struct blockdev *_dev, void *ptr, off_t offset, uint64_t len)
+{
+	struct mem_blockdev *dev = (struct mem_blockdev *)_dev;
+
+	if (offset < 0 || (uint64_t)offset >= _dev->total_len)
+		return 0;
+	if (len > _dev->total_len - offset)
+		len = _dev->total_len - offset;
+
+	memcpy(ptr, dev->ptr + offset, (size_t)len);
+	return (int)len;
+}
+
+struct blockdev *create_mem_blockdev(const char *name, void *ptr, uint64_t len, uint32_t block_size)
+{
+	struct mem_blockdev *dev;
+
+	dev = (struct mem_blockdev *)calloc(1, sizeof(*dev));
+	if (dev == NULL)
+		return NULL;
+
+	construct_blockdev(&dev->bdev, name, len, block_size);
+	dev->ptr = (uint8_t *)ptr;
+
+	dev->bdev.read_hook = &mem_read;
+	dev->bdev.read_block_hook = &mem_read_block;
+	dev->bdev.write_block_hook = &mem_write_block;
+
+	return &dev->bdev;
+}
@@ -0,0 +1,940 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include "modemmon.h"
+#include "modemmon_private.h"
+
+#ifndef _WIN32
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+#endif
+
+uint64_t
+modem_time_us(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER	frequency;
+	LARGE_INTEGER		count;
+
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&count);
+
+	/* split to keep count * 1000000 from overflowing */
+	return (uint64_t)(count.QuadPart / frequency.QuadPart) * 1000000 +
+	       (uint64_t)(count.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+const char *
+modem_lines_string(uint32_t lines, char *buf, size_t len)
+{
+	snprintf(buf, len, "%sCTS %sDSR %sRI %sDCD",
+		 (lines & MODEM_LINE_CTS) ? "" : "-",
+		 (lines & MODEM_LINE_DSR) ? "" : "-",
+		 (lines & MODEM_LINE_RI) ? "" : "-",
+		 (lines & MODEM_LINE_DCD) ? "" : "-");
+	return buf;
+}
+
+/*
+ * Simulated line.
+ *
+ * Toggles accumulate in pending until a wait collects them, so a test can
+ * pulse a line faster than the monitor runs and still see the transition.
+ * Data written with modem_line_sim_write() queues until read.
+ */
+
+struct modem_sim {
+	struct modem_line		line;
+	std::mutex			lock;
+	std::condition_variable		cond;
+	uint32_t			lines;
+	uint32_t			pending;
+	std::vector<uint8_t>		received;
+	struct modem_sim		*peer;		/* receives what this line writes */
+	bool				cancelled;
+};
+
+static int
+modem_sim_wait(struct modem_line *line, uint32_t mask, uint32_t *changed)
+{
+	struct modem_sim *sim = (struct modem_sim *)line;
+	std::unique_lock<std::mutex> guard(sim->lock);
+
+	while ((sim->pending & mask) == 0 && !sim->cancelled)
+		sim->cond.wait(guard);
+
+	if (sim->cancelled)
+		return MODEM_WAIT_CANCELLED;
+
+	*changed = sim->pending & mask;
+	sim->pending &= ~mask;
+	return MODEM_WAIT_CHANGED;
+}
+
+static int
+modem_sim_get(struct modem_line *line, uint32_t *lines)
+{
+	struct modem_sim *sim = (struct modem_sim *)line;
+	std::lock_guard<std::mutex> guard(sim->lock);
+
+	*lines = sim->lines;
+	return 0;
+}
+
+static int
+modem_sim_read(struct modem_line *line, void *buf, uint32_t len)
+{
+	struct modem_sim *sim = (struct modem_sim *)line;
+	std::unique_lock<std::mutex> guard(sim->lock);
+	uint32_t count;
+
+	while (sim->received.empty() && !sim->cancelled)
+		sim->cond.wait(guard);
+
+	if (sim->cancelled)
+		return 0;
+
+	count = (uint32_t)sim->received.size() < len ? (uint32_t)sim->received.size() : len;
+	memcpy(buf, sim->received.data(), count);
+	sim->received.erase(sim->received.begin(), sim->received.begin() + count);
+	return (int)count;
+}
+
+static int
+modem_sim_write(struct modem_line *line, const void *buf, uint32_t len)
+{
+	struct modem_sim *sim = (struct modem_sim *)line;
+
+	{
+		std::lock_guard<std::mutex> guard(sim->lock);
+		if (sim->cancelled)
+			return 0;
+	}
+
+	/* with no peer the data goes nowhere, as on an unplugged cable */
+	if (sim->peer != NULL)
+		modem_line_sim_write(&sim->peer->line, buf, len);
+	return (int)len;
+}
+
+/* a simulated line carries bytes, not bits; there is no framing or speed to set */
+static int
+modem_sim_raw(struct modem_line *line, uint32_t baud)
+{
+	(void)line;
+	(void)baud;
+	return 0;
+}
+
+static void
+modem_sim_cancel(struct modem_line *line)
+{
+	struct modem_sim *sim = (struct modem_sim *)line;
+	std::lock_guard<std::mutex> guard(sim->lock);
+
+	sim->cancelled = true;
+	sim->cond.notify_all();
+}
+
+static void
+modem_sim_close(struct modem_line *line)
+{
+	delete (struct modem_sim *)line;
+}
+
+struct modem_line *
+modem_line_create_sim(const char *name)
+{
+	struct modem_sim *sim = new struct modem_sim;
+
+	memset(&sim->line, 0, sizeof(sim->line));
+	snprintf(sim->line.name, sizeof(sim->line.name), "%s", name);
+	sim->line.wait_hook = modem_sim_wait;
+	sim->line.get_hook = modem_sim_get;
+	sim->line.read_hook = modem_sim_read;
+	sim->line.write_hook = modem_sim_write;
+	sim->line.raw_hook = modem_sim_raw;
+	sim->line.cancel_hook = modem_sim_cancel;
+	sim->line.close_hook = modem_sim_close;
+	sim->lines = 0;
+	sim->pending = 0;
+	sim->peer = NULL;
+	sim->cancelled = false;
+
+	return &sim->line;
+}
+
+void
+modem_line_sim_set(struct modem_line *line, uint32_t lines)
+{
+	struct modem_sim *sim = (struct modem_sim *)line;
+	std::lock_guard<std::mutex> guard(sim->lock);
+
+	lines &= MODEM_LINE_ALL;
+	sim->pending |= sim->lines ^ lines;
+	sim->lines = lines;
+	sim->cond.notify_all();
+}
+
+void
+modem_line_sim_write(struct modem_line *line, const void *data, uint32_t len)
+{
+	struct modem_sim *sim = (struct modem_sim *)line;
+	std::lock_guard<std::mutex> guard(sim->lock);
+
+	sim->received.insert(sim->received.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+	sim->cond.notify_all();
+}
+
+void
+modem_line_sim_connect(struct modem_line *a, struct modem_line *b)
+{
+	((struct modem_sim *)a)->peer = (struct modem_sim *)b;
+	((struct modem_sim *)b)->peer = (struct modem_sim *)a;
+}
+
+#ifdef _WIN32
+
+/*
+ * Windows serial port: an overlapped WaitCommEvent, raced against a cancel
+ * event so that another thread can stop the monitor.
+ */
+
+DWORD
+modem_comm_mask(uint32_t lines)
+{
+	return ((lines & MODEM_LINE_CTS) ? EV_CTS : 0) |
+	       ((lines & MODEM_LINE_DSR) ? EV_DSR : 0) |
+	       ((lines & MODEM_LINE_RI) ? EV_RING : 0) |
+	       ((lines & MODEM_LINE_DCD) ? EV_RLSD : 0);
+}
+
+uint32_t
+modem_comm_lines(DWORD events)
+{
+	return ((events & EV_CTS) ? MODEM_LINE_CTS : 0) |
+	       ((events & EV_DSR) ? MODEM_LINE_DSR : 0) |
+	       ((events & EV_RING) ? MODEM_LINE_RI : 0) |
+	       ((events & EV_RLSD) ? MODEM_LINE_DCD : 0);
+}
+
+static int
+modem_comm_wait(struct modem_line *line, uint32_t mask, uint32_t *changed)
+{
+	struct modem_comm	*comm = (struct modem_comm *)line;
+	OVERLAPPED		ov;
+	HANDLE			handles[2];
+	DWORD			commMask, events, transferred;
+
+	if (WaitForSingleObject(comm->cancel, 0) == WAIT_OBJECT_0)
+		return MODEM_WAIT_CANCELLED;
+
+	commMask = modem_comm_mask(mask);
+	if (commMask != comm->commMask) {
+		if (!SetCommMask(comm->handle, commMask)) {
+			printf("SetCommMask failed with error %d.\n", GetLastError());
+			return MODEM_WAIT_ERROR;
+		}
+		comm->commMask = commMask;
+	}
+
+	memset(&ov, 0, sizeof(ov));
+	ov.hEvent = comm->completion;
+	events = 0;
+
+	if (!WaitCommEvent(comm->handle, &events, &ov)) {
+		if (GetLastError() != ERROR_IO_PENDING) {
+			printf("WaitCommEvent failed with error %d.\n", GetLastError());
+			return MODEM_WAIT_ERROR;
+		}
+
+		handles[0] = comm->completion;
+		handles[1] = comm->cancel;
+		if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0) {
+			CancelIoEx(comm->handle, &ov);
+			GetOverlappedResult(comm->handle, &ov, &transferred, TRUE);
+			return MODEM_WAIT_CANCELLED;
+		}
+
+		if (!GetOverlappedResult(comm->handle, &ov, &transferred, FALSE)) {
+			printf("WaitCommEvent failed with error %d.\n", GetLastError());
+			return MODEM_WAIT_ERROR;
+		}
+	}
+
+	*changed = modem_comm_lines(events);
+	return MODEM_WAIT_CHANGED;
+}
+
+static int
+modem_comm_read(struct modem_line *line, void *buf, uint32_t len)
+{
+	struct modem_comm	*comm = (struct modem_comm *)line;
+	OVERLAPPED		ov;
+	HANDLE			handles[2];
+	DWORD			count;
+
+	/* with the timeouts from modem_comm_raw a read ends as soon as data arrives; zero is a timeout */
+	do {
+		if (WaitForSingleObject(comm->cancel, 0) == WAIT_OBJECT_0)
+			return 0;
+
+		/* the low bit keeps the completion off any completion port the handle is bound to */
+		memset(&ov, 0, sizeof(ov));
+		ov.hEvent = (HANDLE)((ULONG_PTR)comm->readCompletion | 1);
+		count = 0;
+
+		if (!ReadFile(comm->handle, buf, len, &count, &ov)) {
+			if (GetLastError() != ERROR_IO_PENDING) {
+				printf("%s: ReadFile failed with error %d.\n", line->name, GetLastError());
+				return -1;
+			}
+
+			handles[0] = comm->readCompletion;
+			handles[1] = comm->cancel;
+			if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0) {
+				CancelIoEx(comm->handle, &ov);
+				GetOverlappedResult(comm->handle, &ov, &count, TRUE);
+				return 0;
+			}
+
+			if (!GetOverlappedResult(comm->handle, &ov, &count, FALSE)) {
+				printf("%s: ReadFile failed with error %d.\n", line->name, GetLastError());
+				return -1;
+			}
+		}
+	} while (count == 0);
+
+	return (int)count;
+}
+
+static int
+modem_comm_write(struct modem_line *line, const void *buf, uint32_t len)
+{
+	struct modem_comm	*comm = (struct modem_comm *)line;
+	const uint8_t		*data = (const uint8_t *)buf;
+	OVERLAPPED		ov;
+	HANDLE			handles[2];
+	DWORD			count;
+	uint32_t		done;
+
+	/* a write timeout of zero in modem_comm_raw means WriteFile only completes short on error */
+	for (done = 0; done < len; done += count) {
+		if (WaitForSingleObject(comm->cancel, 0) == WAIT_OBJECT_0)
+			return 0;
+
+		memset(&ov, 0, sizeof(ov));
+		ov.hEvent = (HANDLE)((ULONG_PTR)comm->writeCompletion | 1);
+		count = 0;
+
+		if (!WriteFile(comm->handle, data + done, len - done, &count, &ov)) {
+			if (GetLastError() != ERROR_IO_PENDING) {
+				printf("%s: WriteFile failed with error %d.\n", line->name, GetLastError());
+				return -1;
+			}
+
+			handles[0] = comm->writeCompletion;
+			handles[1] = comm->cancel;
+			if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0) {
+				CancelIoEx(comm->handle, &ov);
+				GetOverlappedResult(comm->handle, &ov, &count, TRUE);
+				return 0;
+			}
+
+			if (!GetOverlappedResult(comm->handle, &ov, &count, FALSE)) {
+				printf("%s: WriteFile failed with error %d.\n", line->name, GetLastError());
+				return -1;
+			}
+		}
+		if (count == 0) {
+			printf("%s: WriteFile timed out.\n", line->name);
+			return -1;
+		}
+	}
+
+	return (int)len;
+}
+
+static int
+modem_comm_raw(struct modem_line *line, uint32_t baud)
+{
+	struct modem_comm	*comm = (struct modem_comm *)line;
+	COMMTIMEOUTS		timeouts;
+	DCB			dcb;
+
+	memset(&dcb, 0, sizeof(dcb));
+	dcb.DCBlength = sizeof(dcb);
+	if (!GetCommState(comm->handle, &dcb)) {
+		printf("%s: GetCommState failed with error %d.\n", line->name, GetLastError());
+		return -1;
+	}
+
+	if (baud != 0)
+		dcb.BaudRate = baud;
+	dcb.ByteSize = 8;
+	dcb.Parity = NOPARITY;
+	dcb.StopBits = ONESTOPBIT;
+	dcb.fBinary = TRUE;
+	dcb.fParity = FALSE;
+	dcb.fOutX = FALSE;
+	dcb.fInX = FALSE;
+	dcb.fErrorChar = FALSE;
+	dcb.fNull = FALSE;
+	dcb.fAbortOnError = FALSE;
+	if (!SetCommState(comm->handle, &dcb)) {
+		printf("%s: SetCommState failed with error %d.\n", line->name, GetLastError());
+		return -1;
+	}
+
+	/* return whatever has arrived as soon as anything has, waiting as long as it takes */
+	memset(&timeouts, 0, sizeof(timeouts));
+	timeouts.ReadIntervalTimeout = MAXDWORD;
+	timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+	timeouts.ReadTotalTimeoutConstant = MAXDWORD - 1;
+	if (!SetCommTimeouts(comm->handle, &timeouts)) {
+		printf("%s: SetCommTimeouts failed with error %d.\n", line->name, GetLastError());
+		return -1;
+	}
+
+	/* a deeper driver queue rides out scheduling hiccups at high rates */
+	SetupComm(comm->handle, 1 << 16, 1 << 12);
+	return 0;
+}
+
+static int
+modem_comm_get(struct modem_line *line, uint32_t *lines)
+{
+	struct modem_comm	*comm = (struct modem_comm *)line;
+	DWORD			status;
+
+	if (!GetCommModemStatus(comm->handle, &status)) {
+		printf("GetCommModemStatus failed with error %d.\n", GetLastError());
+		return -1;
+	}
+
+	*lines = ((status & MS_CTS_ON) ? MODEM_LINE_CTS : 0) |
+		 ((status & MS_DSR_ON) ? MODEM_LINE_DSR : 0) |
+		 ((status & MS_RING_ON) ? MODEM_LINE_RI : 0) |
+		 ((status & MS_RLSD_ON) ? MODEM_LINE_DCD : 0);
+	return 0;
+}
+
+static void
+modem_comm_cancel(struct modem_line *line)
+{
+	SetEvent(((struct modem_comm *)line)->cancel);
+}
+
+static void
+modem_comm_close(struct modem_line *line)
+{
+	struct modem_comm *comm = (struct modem_comm *)line;
+
+	CloseHandle(comm->handle);
+	CloseHandle(comm->completion);
+	CloseHandle(comm->readCompletion);
+	CloseHandle(comm->writeCompletion);
+	CloseHandle(comm->cancel);
+	free(comm);
+}
+
+struct modem_comm *
+modem_comm_from_line(struct modem_line *line)
+{
+	if (line->wait_hook != modem_comm_wait)
+		return NULL;
+	return (struct modem_comm *)line;
+}
+
+struct modem_line *
+modem_line_open(const char *port)
+{
+	struct modem_comm	*comm;
+	char			path[MAX_PATH];
+
+	/* COM10 and up only open through the device namespace */
+	if (strncmp(port, "\\\\.\\", 4) == 0)
+		snprintf(path, sizeof(path), "%s", port);
+	else
+		snprintf(path, sizeof(path), "\\\\.\\%s", port);
+
+	comm = (struct modem_comm *)calloc(1, sizeof(*comm));
+	if (comm == NULL)
+		return NULL;
+
+	comm->handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+				   OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (comm->handle == INVALID_HANDLE_VALUE) {
+		printf("CreateFile failed with error %d.\n", GetLastError());
+		free(comm);
+		return NULL;
+	}
+
+	comm->completion = CreateEvent(NULL, TRUE, FALSE, NULL);
+	comm->readCompletion = CreateEvent(NULL, TRUE, FALSE, NULL);
+	comm->writeCompletion = CreateEvent(NULL, TRUE, FALSE, NULL);
+	comm->cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (comm->completion == NULL || comm->readCompletion == NULL || comm->writeCompletion == NULL ||
+	    comm->cancel == NULL) {
+		printf("CreateEvent failed with error %d.\n", GetLastError());
+		if (comm->completion != NULL)
+			CloseHandle(comm->completion);
+		if (comm->readCompletion != NULL)
+			CloseHandle(comm->readCompletion);
+		if (comm->writeCompletion != NULL)
+			CloseHandle(comm->writeCompletion);
+		if (comm->cancel != NULL)
+			CloseHandle(comm->cancel);
+		CloseHandle(comm->handle);
+		free(comm);
+		return NULL;
+	}
+
+	snprintf(comm->line.name, sizeof(comm->line.name), "%s", port);
+	comm->line.wait_hook = modem_comm_wait;
+	comm->line.get_hook = modem_comm_get;
+	comm->line.read_hook = modem_comm_read;
+	comm->line.write_hook = modem_comm_write;
+	comm->line.raw_hook = modem_comm_raw;
+	comm->line.cancel_hook = modem_comm_cancel;
+	comm->line.close_hook = modem_comm_close;
+
+	return &comm->line;
+}
+
+#elif defined(__linux__)
+
+/*
+ * Linux tty: TIOCMIWAIT sleeps in the driver until a line changes, and the
+ * TIOCGICOUNT interrupt counters show which lines toggled, pulses included.
+ *
+ * TIOCMIWAIT can only be interrupted by a signal, so cancelling sends
+ * MODEM_CANCEL_SIGNAL to each blocked thread until it lets go; reads sleep
+ * in poll(), which the same signal breaks.
+ */
+
+#define MODEM_CANCEL_SIGNAL	SIGUSR2
+
+/* threads that may be blocked in the driver */
+#define MODEM_TTY_WAITER	0
+#define MODEM_TTY_READER	1
+#define MODEM_TTY_WRITER	2
+#define MODEM_TTY_THREADS	3
+
+struct modem_tty {
+	struct modem_line		line;
+	int				fd;
+	bool				haveCounts;
+	struct serial_icounter_struct	counts;
+	std::atomic<bool>		cancelled;
+	std::atomic<bool>		blocked[MODEM_TTY_THREADS];
+	pthread_t			threads[MODEM_TTY_THREADS];
+};
+
+static void
+modem_tty_signal(int)
+{
+}
+
+/* lines whose interrupt counters moved since the last call */
+static uint32_t
+modem_tty_toggled(struct modem_tty *tty)
+{
+	struct serial_icounter_struct	counts;
+	uint32_t			toggled;
+
+	if (!tty->haveCounts || ioctl(tty->fd, TIOCGICOUNT, &counts) != 0)
+		return 0;
+
+	toggled = ((counts.cts != tty->counts.cts) ? MODEM_LINE_CTS : 0) |
+		  ((counts.dsr != tty->counts.dsr) ? MODEM_LINE_DSR : 0) |
+		  ((counts.rng != tty->counts.rng) ? MODEM_LINE_RI : 0) |
+		  ((counts.dcd != tty->counts.dcd) ? MODEM_LINE_DCD : 0);
+	tty->counts = counts;
+	return toggled;
+}
+
+static int
+modem_tty_wait(struct modem_line *line, uint32_t mask, uint32_t *changed)
+{
+	struct modem_tty	*tty = (struct modem_tty *)line;
+	int			bits, result;
+
+	/* anything that toggled since the last wait has already happened */
+	*changed = modem_tty_toggled(tty) & mask;
+	if (*changed != 0)
+		return MODEM_WAIT_CHANGED;
+
+	bits = ((mask & MODEM_LINE_CTS) ? TIOCM_CTS : 0) |
+	       ((mask & MODEM_LINE_DSR) ? TIOCM_DSR : 0) |
+	       ((mask & MODEM_LINE_RI) ? TIOCM_RNG : 0) |
+	       ((mask & MODEM_LINE_DCD) ? TIOCM_CAR : 0);
+
+	tty->threads[MODEM_TTY_WAITER] = pthread_self();
+	tty->blocked[MODEM_TTY_WAITER] = true;
+	for (;;) {
+		if (tty->cancelled) {
+			result = MODEM_WAIT_CANCELLED;
+			break;
+		}
+		if (ioctl(tty->fd, TIOCMIWAIT, bits) == 0) {
+			*changed = modem_tty_toggled(tty) & mask;
+			result = MODEM_WAIT_CHANGED;
+			break;
+		}
+		if (errno != EINTR) {
+			printf("TIOCMIWAIT failed with error %d.\n", errno);
+			result = MODEM_WAIT_ERROR;
+			break;
+		}
+	}
+	tty->blocked[MODEM_TTY_WAITER] = false;
+
+	return result;
+}
+
+static int
+modem_tty_read(struct modem_line *line, void *buf, uint32_t len)
+{
+	struct modem_tty	*tty = (struct modem_tty *)line;
+	struct pollfd		pfd;
+	ssize_t			count;
+	int			result;
+
+	pfd.fd = tty->fd;
+	pfd.events = POLLIN;
+
+	tty->threads[MODEM_TTY_READER] = pthread_self();
+	tty->blocked[MODEM_TTY_READER] = true;
+	for (;;) {
+		if (tty->cancelled) {
+			result = 0;
+			break;
+		}
+		count = read(tty->fd, buf, len);
+		if (count > 0) {
+			result = (int)count;
+			break;
+		}
+		if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+			/* zero is a hangup */
+			printf("%s: read failed with error %d.\n", line->name, count == 0 ? EIO : errno);
+			result = -1;
+			break;
+		}
+		if (errno == EAGAIN && poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			printf("%s: poll failed with error %d.\n", line->name, errno);
+			result = -1;
+			break;
+		}
+	}
+	tty->blocked[MODEM_TTY_READER] = false;
+
+	return result;
+}
+
+static int
+modem_tty_write(struct modem_line *line, const void *buf, uint32_t len)
+{
+	struct modem_tty	*tty = (struct modem_tty *)line;
+	const uint8_t		*data = (const uint8_t *)buf;
+	struct pollfd		pfd;
+	ssize_t			count;
+	uint32_t		done;
+	int			result;
+
+	pfd.fd = tty->fd;
+	pfd.events = POLLOUT;
+
+	tty->threads[MODEM_TTY_WRITER] = pthread_self();
+	tty->blocked[MODEM_TTY_WRITER] = true;
+	for (done = 0, result = (int)len; done < len;) {
+		if (tty->cancelled) {
+			result = 0;
+			break;
+		}
+		count = write(tty->fd, data + done, len - done);
+		if (count > 0) {
+			done += (uint32_t)count;
+			continue;
+		}
+		if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+			printf("%s: write failed with error %d.\n", line->name, count == 0 ? EIO : errno);
+			result = -1;
+			break;
+		}
+		if (errno == EAGAIN && poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			printf("%s: poll failed with error %d.\n", line->name, errno);
+			result = -1;
+			break;
+		}
+	}
+	tty->blocked[MODEM_TTY_WRITER] = false;
+
+	return result;
+}
+
+static speed_t
+modem_tty_speed(uint32_t baud)
+{
+	static const struct {
+		uint32_t	baud;
+		speed_t		speed;
+	} speeds[] = {
+		{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+		{ 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 }, { 500000, B500000 },
+		{ 921600, B921600 }, { 1000000, B1000000 }, { 1500000, B1500000 }, { 2000000, B2000000 },
+		{ 3000000, B3000000 }, { 4000000, B4000000 },
+	};
+
+	for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+		if (speeds[i].baud == baud)
+			return speeds[i].speed;
+	}
+	return B0;
+}
+
+static int
+modem_tty_raw(struct modem_line *line, uint32_t baud)
+{
+	struct modem_tty	*tty = (struct modem_tty *)line;
+	struct termios		tio;
+	speed_t			speed;
+
+	if (tcgetattr(tty->fd, &tio) != 0) {
+		printf("%s: tcgetattr failed with error %d.\n", line->name, errno);
+		return -1;
+	}
+
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	if (baud != 0) {
+		speed = modem_tty_speed(baud);
+		if (speed == B0) {
+			printf("%s: unsupported baud rate %u\n", line->name, baud);
+			return -1;
+		}
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+	}
+
+	if (tcsetattr(tty->fd, TCSANOW, &tio) != 0) {
+		printf("%s: tcsetattr failed with error %d.\n", line->name, errno);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+modem_tty_get(struct modem_line *line, uint32_t *lines)
+{
+	struct modem_tty	*tty = (struct modem_tty *)line;
+	int			status;
+
+	if (ioctl(tty->fd, TIOCMGET, &status) != 0) {
+		printf("TIOCMGET failed with error %d.\n", errno);
+		return -1;
+	}
+
+	*lines = ((status & TIOCM_CTS) ? MODEM_LINE_CTS : 0) |
+		 ((status & TIOCM_DSR) ? MODEM_LINE_DSR : 0) |
+		 ((status & TIOCM_RNG) ? MODEM_LINE_RI : 0) |
+		 ((status & TIOCM_CAR) ? MODEM_LINE_DCD : 0);
+	return 0;
+}
+
+static void
+modem_tty_cancel(struct modem_line *line)
+{
+	struct modem_tty		*tty = (struct modem_tty *)line;
+	const struct timespec		retry = { 0, 1000000 };
+
+	tty->cancelled = true;
+
+	/* a signal landing just before the thread blocks is lost, so keep knocking */
+	for (;;) {
+		bool knocked = false;
+
+		for (int i = 0; i < MODEM_TTY_THREADS; i++) {
+			if (tty->blocked[i]) {
+				pthread_kill(tty->threads[i], MODEM_CANCEL_SIGNAL);
+				knocked = true;
+			}
+		}
+		if (!knocked)
+			break;
+		nanosleep(&retry, NULL);
+	}
+}
+
+static void
+modem_tty_close(struct modem_line *line)
+{
+	struct modem_tty *tty = (struct modem_tty *)line;
+
+	close(tty->fd);
+	delete tty;
+}
+
+static struct modem_line *
+modem_tty_create(int fd, const char *name)
+{
+	struct modem_tty	*tty;
+	struct sigaction	sa;
+
+	/* no SA_RESTART, so the cancel signal breaks TIOCMIWAIT and poll with EINTR */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = modem_tty_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(MODEM_CANCEL_SIGNAL, &sa, NULL);
+
+	tty = new struct modem_tty;
+	memset(&tty->line, 0, sizeof(tty->line));
+	snprintf(tty->line.name, sizeof(tty->line.name), "%s", name);
+	tty->line.wait_hook = modem_tty_wait;
+	tty->line.get_hook = modem_tty_get;
+	tty->line.read_hook = modem_tty_read;
+	tty->line.write_hook = modem_tty_write;
+	tty->line.raw_hook = modem_tty_raw;
+	tty->line.cancel_hook = modem_tty_cancel;
+	tty->line.close_hook = modem_tty_close;
+	tty->fd = fd;
+	tty->haveCounts = ioctl(fd, TIOCGICOUNT, &tty->counts) == 0;
+	tty->cancelled = false;
+	for (int i = 0; i < MODEM_TTY_THREADS; i++)
+		tty->blocked[i] = false;
+
+	return &tty->line;
+}
+
+struct modem_line *
+modem_line_open(const char *port)
+{
+	int	fd;
+
+	fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) {
+		printf("open %s failed with error %d.\n", port, errno);
+		return NULL;
+	}
+
+	return modem_tty_create(fd, port);
+}
+
+struct modem_line *
+modem_line_open_pty(char *peer, size_t len)
+{
+	int	fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) {
+		printf("posix_openpt failed with error %d.\n", errno);
+		return NULL;
+	}
+	if (grantpt(fd) != 0 || unlockpt(fd) != 0 || ptsname_r(fd, peer, len) != 0) {
+		printf("pty setup failed with error %d.\n", errno);
+		close(fd);
+		return NULL;
+	}
+
+	return modem_tty_create(fd, "ptmx");
+}
+
+#else
+
+struct modem_line *
+modem_line_open(const char *port)
+{
+	printf("modem_line_open: %s: no serial driver on this platform\n", port);
+	return NULL;
+}
+
+#endif
+
+#ifndef __linux__
+
+struct modem_line *
+modem_line_open_pty(char *peer, size_t len)
+{
+	printf("modem_line_open_pty: no pseudo-terminals on this platform\n");
+	return NULL;
+}
+
+#endif
+
+void
+modem_line_close(struct modem_line *line)
+{
+	if (line != NULL)
+		line->close_hook(line);
+}
+
+int
+modem_monitor(struct modem_line *line, uint32_t mask, modem_event_fn fn, void *refcon)
+{
+	struct modem_event	event;
+	uint32_t		previous, changed;
+	int			result;
+
+	if (line->get_hook(line, &event.lines) != 0)
+		return -1;
+	event.timestamp = modem_time_us();
+	event.changed = 0;
+	event.port = 0;
+	if (!fn(refcon, line, &event))
+		return 0;
+
+	for (;;) {
+		changed = 0;
+		result = line->wait_hook(line, mask, &changed);
+
+		/* stamp the wakeup before anything else can delay it */
+		event.timestamp = modem_time_us();
+
+		if (result == MODEM_WAIT_CANCELLED)
+			return 0;
+		if (result != MODEM_WAIT_CHANGED)
+			return -1;
+
+		previous = event.lines;
+		if (line->get_hook(line, &event.lines) != 0)
+			return -1;
+
+		event.changed = (changed | (previous ^ event.lines)) & mask;
+		if (event.changed == 0)
+			continue;
+
+		if (!fn(refcon, line, &event))
+			return 0;
+	}
+}
+
+void
+modem_monitor_stop(struct modem_line *line)
+{
+	line->cancel_hook(line);
+}
@@ -0,0 +1,108 @@
+/*
+ * Modem status line monitor.
+ *
+ * A modem_line is a small driver over something with CTS/DSR/RI/DCD lines
+ * and a receive stream: a serial port (WaitCommEvent on Windows, TIOCMIWAIT
+ * on Linux) or a simulated line that a test sets and feeds by hand. modem_monitor() blocks in the
+ * driver until a line changes and reports each transition with a
+ * microsecond timestamp, so short pulses are not lost between polls.
+ */
+
+#ifndef __MODEMMON_H
+#define __MODEMMON_H
+
+#include <stdint.h>
+#include "types.h"
+
+__BEGIN_DECLS
+
+#define MODEM_LINE_CTS		(1 << 0)
+#define MODEM_LINE_DSR		(1 << 1)
+#define MODEM_LINE_RI		(1 << 2)
+#define MODEM_LINE_DCD		(1 << 3)
+#define MODEM_LINE_ALL		(MODEM_LINE_CTS | MODEM_LINE_DSR | MODEM_LINE_RI | MODEM_LINE_DCD)
+
+/* wait_hook results */
+#define MODEM_WAIT_CHANGED	0
+#define MODEM_WAIT_CANCELLED	1
+#define MODEM_WAIT_ERROR	(-1)
+
+struct modem_line {
+	char name[32];
+
+	/*
+	 * Block until a line in mask may have changed, or until cancelled.
+	 * *changed gets the lines the driver saw toggle, which can include
+	 * pulses already over by the time the state is read; 0 if unknown.
+	 */
+	int(*wait_hook)(struct modem_line *, uint32_t mask, uint32_t *changed);
+	int(*get_hook)(struct modem_line *, uint32_t *lines);
+
+	/*
+	 * Block until received data arrives and read up to len bytes of it.
+	 * Returns the count, 0 once cancelled, or -1 on error.
+	 */
+	int(*read_hook)(struct modem_line *, void *buf, uint32_t len);
+
+	/*
+	 * Block until all len bytes are queued for transmission.
+	 * Returns len, 0 once cancelled, or -1 on error.
+	 */
+	int(*write_hook)(struct modem_line *, const void *buf, uint32_t len);
+
+	/* switch to raw 8N1 for data capture, at baud unless it is 0 */
+	int(*raw_hook)(struct modem_line *, uint32_t baud);
+
+	/* wake any wait_hook or read_hook, now or in future; callable from any thread */
+	void(*cancel_hook)(struct modem_line *);
+	void(*close_hook)(struct modem_line *);
+};
+
+struct modem_event {
+	uint64_t	timestamp;	/* microseconds, from modem_time_us() */
+	uint32_t	lines;		/* state after the transition */
+	uint32_t	changed;	/* lines that toggled; 0 for the initial state */
+	uint32_t	port;		/* index within a modem_set; 0 for modem_monitor() */
+};
+
+/* return false to stop monitoring */
+typedef bool(*modem_event_fn)(void *refcon, struct modem_line *line, const struct modem_event *event);
+
+/* monotonic clock shared by every timestamp in the monitor */
+uint64_t modem_time_us(void);
+
+/* open a serial port by name ("COM4" or "/dev/ttyUSB0"); NULL on failure */
+struct modem_line *modem_line_open(const char *port);
+
+/*
+ * The master side of a new pseudo-terminal, with the path of the slave in
+ * peer for modem_line_open(); a stand-in for a device at the far end of a
+ * cable. The master has no modem lines. Linux only; NULL elsewhere.
+ */
+struct modem_line *modem_line_open_pty(char *peer, size_t len);
+
+/* a line driven by modem_line_sim_set() rather than hardware */
+struct modem_line *modem_line_create_sim(const char *name);
+void modem_line_sim_set(struct modem_line *line, uint32_t lines);
+void modem_line_sim_write(struct modem_line *line, const void *data, uint32_t len);
+
+/* cross two simulated lines, so each receives what the other writes; close both together */
+void modem_line_sim_connect(struct modem_line *a, struct modem_line *b);
+
+void modem_line_close(struct modem_line *line);
+
+/*
+ * Report the initial state of the lines in mask, then every transition,
+ * until fn returns false or modem_monitor_stop() is called.
+ *
+ * Returns 0 when stopped, or -1 if the driver fails.
+ */
+int modem_monitor(struct modem_line *line, uint32_t mask, modem_event_fn fn, void *refcon);
+void modem_monitor_stop(struct modem_line *line);
+
+/* "CTS DSR -RI DCD" style summary of lines, for printing */
+const char *modem_lines_string(uint32_t lines, char *buf, size_t len);
+
+__END_DECLS
+
+#endif
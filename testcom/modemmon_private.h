@@ -0,0 +1,33 @@
+/*
+ * Modem monitor driver internals, shared by the monitor modules.
+ */
+
+#ifndef __MODEMMON_PRIVATE_H
+#define __MODEMMON_PRIVATE_H
+
+#include "modemmon.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+/* a serial port opened by modem_line_open */
+struct modem_comm {
+	struct modem_line	line;
+	HANDLE			handle;		/* opened FILE_FLAG_OVERLAPPED */
+	HANDLE			completion;	/* for WaitCommEvent */
+	HANDLE			readCompletion;	/* for ReadFile */
+	HANDLE			writeCompletion; /* for WriteFile */
+	HANDLE			cancel;
+	DWORD			commMask;
+};
+
+/* the serial port behind line, or NULL if it has another driver */
+struct modem_comm	*modem_comm_from_line(struct modem_line *line);
+
+DWORD			modem_comm_mask(uint32_t lines);
+uint32_t		modem_comm_lines(DWORD events);
+#endif
+
+#endif
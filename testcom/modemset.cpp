@@ -0,0 +1,693 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "modemmon.h"
+#include "modemmon_private.h"
+#include "modemset.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <glob.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+/* a transition seen by a waiter thread, queued for the dispatch loop */
+struct modem_set_item {
+	uint64_t	timestamp;
+	uint32_t	port;
+	uint32_t	changed;
+	uint32_t	lines;
+	int		result;
+};
+
+#ifdef _WIN32
+/* an outstanding WaitCommEvent on a serial port */
+struct modem_set_io {
+	OVERLAPPED	ov;
+	DWORD		events;
+	bool		armed;
+};
+
+/* completion keys: ports use their index + 1 */
+#define MODEM_SET_KEY_WAKE	0
+#endif
+
+struct modem_set {
+	uint32_t			mask;
+	struct modem_line		**lines;
+	struct modem_port_state		*ports;
+	uint32_t			count;
+	uint32_t			capacity;
+
+	/* events from waiter threads */
+	std::mutex			queueLock;
+	std::vector<struct modem_set_item> queue;
+	std::vector<struct modem_set_item> draining;
+	std::vector<std::thread>	waiters;
+	std::atomic<bool>		stopping;
+
+	modem_event_fn			fn;
+	void				*refcon;
+
+	/* statistics */
+	uint64_t			startTime;
+	uint64_t			events;
+	uint64_t			wakeups;
+	uint64_t			reportTime;
+	uint64_t			reportEvents;
+
+#ifdef _WIN32
+	HANDLE				iocp;
+	struct modem_set_io		*io;
+#elif defined(__linux__)
+	int				epollFd;
+	int				wakeFd;
+	int				timerFd;
+#endif
+};
+
+struct modem_set *
+modem_set_create(uint32_t mask)
+{
+	struct modem_set *set = new struct modem_set;
+
+	set->mask = mask & MODEM_LINE_ALL;
+	set->lines = NULL;
+	set->ports = NULL;
+	set->count = 0;
+	set->capacity = 0;
+	set->stopping = false;
+	set->fn = NULL;
+	set->refcon = NULL;
+	set->startTime = 0;
+	set->events = 0;
+	set->wakeups = 0;
+	set->reportTime = 0;
+	set->reportEvents = 0;
+
+#ifdef _WIN32
+	set->io = NULL;
+	set->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (set->iocp == NULL) {
+		printf("CreateIoCompletionPort failed with error %d.\n", GetLastError());
+		delete set;
+		return NULL;
+	}
+#elif defined(__linux__)
+	set->epollFd = -1;
+	set->wakeFd = -1;
+	set->timerFd = -1;
+#endif
+
+	return set;
+}
+
+int
+modem_set_add(struct modem_set *set, struct modem_line *line)
+{
+	uint32_t	capacity;
+	void		*grown;
+#ifdef _WIN32
+	struct modem_comm *comm = modem_comm_from_line(line);
+#endif
+
+	if (set->count == set->capacity) {
+		capacity = set->capacity ? set->capacity * 2 : 16;
+		grown = realloc(set->lines, capacity * sizeof(*set->lines));
+		if (grown == NULL)
+			goto fail;
+		set->lines = (struct modem_line **)grown;
+		grown = realloc(set->ports, capacity * sizeof(*set->ports));
+		if (grown == NULL)
+			goto fail;
+		set->ports = (struct modem_port_state *)grown;
+#ifdef _WIN32
+		grown = realloc(set->io, capacity * sizeof(*set->io));
+		if (grown == NULL)
+			goto fail;
+		set->io = (struct modem_set_io *)grown;
+#endif
+		set->capacity = capacity;
+	}
+
+#ifdef _WIN32
+	/* serial ports complete their waits on the set's completion port */
+	if (comm != NULL && CreateIoCompletionPort(comm->handle, set->iocp, set->count + 1, 0) == NULL) {
+		printf("%s: CreateIoCompletionPort failed with error %d.\n", line->name, GetLastError());
+		goto fail;
+	}
+	memset(&set->io[set->count], 0, sizeof(set->io[set->count]));
+#endif
+
+	set->lines[set->count] = line;
+	memset(&set->ports[set->count], 0, sizeof(set->ports[set->count]));
+	return (int)set->count++;
+
+fail:
+	modem_line_close(line);
+	return -1;
+}
+
+#ifdef _WIN32
+/* '*' and '?' wildcards, ignoring case as device names do */
+static bool
+modem_set_match(const char *pattern, const char *name)
+{
+	for (; *pattern != '\0'; pattern++, name++) {
+		if (*pattern == '*') {
+			while (*pattern == '*')
+				pattern++;
+			if (*pattern == '\0')
+				return true;
+			for (; *name != '\0'; name++) {
+				if (modem_set_match(pattern, name))
+					return true;
+			}
+			return false;
+		}
+		if (*name == '\0')
+			return false;
+		if (*pattern != '?' && toupper((uint8_t)*pattern) != toupper((uint8_t)*name))
+			return false;
+	}
+	return *name == '\0';
+}
+
+/* COM2 before COM10 */
+static bool
+modem_set_name_before(const std::string &a, const std::string &b)
+{
+	if (a.size() != b.size())
+		return a.size() < b.size();
+	return a < b;
+}
+#endif
+
+int
+modem_set_open(struct modem_set *set, const char *pattern)
+{
+	struct modem_line	*line;
+	int			opened = 0;
+
+	if (strpbrk(pattern, "*?") == NULL) {
+		line = modem_line_open(pattern);
+		if (line == NULL)
+			return 0;
+		return modem_set_add(set, line) < 0 ? 0 : 1;
+	}
+
+#ifdef _WIN32
+	std::vector<char>		devices(65536);
+	std::vector<std::string>	names;
+	const char			*name;
+
+	/* serial ports aren't files, so match against the DOS device names */
+	while (QueryDosDeviceA(NULL, devices.data(), (DWORD)devices.size()) == 0) {
+		if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+			printf("QueryDosDevice failed with error %d.\n", GetLastError());
+			return 0;
+		}
+		devices.resize(devices.size() * 2);
+	}
+
+	for (name = devices.data(); *name != '\0'; name += strlen(name) + 1) {
+		if (modem_set_match(pattern, name))
+			names.push_back(name);
+	}
+	std::sort(names.begin(), names.end(), modem_set_name_before);
+
+	for (size_t i = 0; i < names.size(); i++) {
+		line = modem_line_open(names[i].c_str());
+		if (line != NULL && modem_set_add(set, line) >= 0)
+			opened++;
+	}
+#else
+	glob_t	matches;
+
+	if (glob(pattern, 0, NULL, &matches) != 0)
+		return 0;
+
+	for (size_t i = 0; i < matches.gl_pathc; i++) {
+		line = modem_line_open(matches.gl_pathv[i]);
+		if (line != NULL && modem_set_add(set, line) >= 0)
+			opened++;
+	}
+	globfree(&matches);
+#endif
+
+	return opened;
+}
+
+uint32_t
+modem_set_count(struct modem_set *set)
+{
+	return set->count;
+}
+
+struct modem_line *
+modem_set_line(struct modem_set *set, uint32_t port)
+{
+	return port < set->count ? set->lines[port] : NULL;
+}
+
+const struct modem_port_state *
+modem_set_port(struct modem_set *set, uint32_t port)
+{
+	return port < set->count ? &set->ports[port] : NULL;
+}
+
+void
+modem_set_get_stats(struct modem_set *set, struct modem_set_stats *stats)
+{
+	uint64_t	now = modem_time_us();
+	uint32_t	port;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->elapsed = now - set->startTime;
+	stats->events = set->events;
+	stats->wakeups = set->wakeups;
+	stats->intervalElapsed = now - set->reportTime;
+	stats->intervalEvents = set->events - set->reportEvents;
+	stats->ports = set->count;
+
+	for (port = 0; port < set->count; port++) {
+		if (set->ports[port].transitions != 0)
+			stats->activePorts++;
+		if (set->ports[port].failed)
+			stats->failedPorts++;
+	}
+}
+
+static void
+modem_set_report(struct modem_set *set, modem_stats_fn statsFn)
+{
+	struct modem_set_stats	stats;
+
+	modem_set_get_stats(set, &stats);
+	statsFn(set->refcon, &stats);
+	set->reportTime = set->startTime + stats.elapsed;
+	set->reportEvents = stats.events;
+}
+
+/* fold a wakeup into the port's state and pass on any transition */
+static void
+modem_set_deliver(struct modem_set *set, uint32_t port, uint64_t timestamp, uint32_t changed, uint32_t lines, bool initial)
+{
+	struct modem_port_state	*state = &set->ports[port];
+	struct modem_event	event;
+
+	event.timestamp = timestamp;
+	event.lines = lines;
+	event.port = port;
+	if (initial) {
+		event.changed = 0;
+	} else {
+		event.changed = (changed | (state->lines ^ lines)) & set->mask;
+		if (event.changed == 0) {
+			state->lines = (uint8_t)lines;
+			return;
+		}
+		state->transitions++;
+		state->lastChange = timestamp;
+		set->events++;
+	}
+	state->lines = (uint8_t)lines;
+
+	if (!set->fn(set->refcon, set->lines[port], &event))
+		set->stopping = true;
+}
+
+static void
+modem_set_fail(struct modem_set *set, uint32_t port)
+{
+	set->ports[port].failed = 1;
+	printf("%s: no longer monitored\n", set->lines[port]->name);
+}
+
+static void
+modem_set_wake(struct modem_set *set)
+{
+#ifdef _WIN32
+	PostQueuedCompletionStatus(set->iocp, 0, MODEM_SET_KEY_WAKE, NULL);
+#elif defined(__linux__)
+	uint64_t	one = 1;
+
+	if (set->wakeFd >= 0 && write(set->wakeFd, &one, sizeof(one)) < 0)
+		printf("modem_set: wake failed with error %d.\n", errno);
+#endif
+}
+
+/* only the first item into an empty queue needs to wake the loop */
+static void
+modem_set_post(struct modem_set *set, const struct modem_set_item *item)
+{
+	bool	wake;
+
+	{
+		std::lock_guard<std::mutex> guard(set->queueLock);
+		wake = set->queue.empty();
+		set->queue.push_back(*item);
+	}
+
+	if (wake)
+		modem_set_wake(set);
+}
+
+static void
+modem_set_drain(struct modem_set *set)
+{
+	{
+		std::lock_guard<std::mutex> guard(set->queueLock);
+		set->draining.swap(set->queue);
+	}
+
+	for (size_t i = 0; i < set->draining.size() && !set->stopping; i++) {
+		const struct modem_set_item *item = &set->draining[i];
+
+		if (item->result != MODEM_WAIT_CHANGED)
+			modem_set_fail(set, item->port);
+		else
+			modem_set_deliver(set, item->port, item->timestamp, item->changed, item->lines, false);
+	}
+	set->draining.clear();
+}
+
+/* sleeps in the driver, so a quiet port costs nothing */
+static void
+modem_set_waiter(struct modem_set *set, uint32_t port)
+{
+	struct modem_line	*line = set->lines[port];
+	struct modem_set_item	item;
+
+	item.port = port;
+	for (;;) {
+		item.changed = 0;
+		item.lines = 0;
+		item.result = line->wait_hook(line, set->mask, &item.changed);
+		item.timestamp = modem_time_us();
+
+		if (item.result == MODEM_WAIT_CANCELLED)
+			return;
+		if (item.result == MODEM_WAIT_CHANGED && line->get_hook(line, &item.lines) != 0)
+			item.result = MODEM_WAIT_ERROR;
+
+		modem_set_post(set, &item);
+		if (item.result != MODEM_WAIT_CHANGED)
+			return;
+	}
+}
+
+#ifdef _WIN32
+static bool
+modem_set_arm(struct modem_set *set, uint32_t port)
+{
+	struct modem_comm	*comm = modem_comm_from_line(set->lines[port]);
+	struct modem_set_io	*io = &set->io[port];
+
+	memset(&io->ov, 0, sizeof(io->ov));
+	io->events = 0;
+
+	/* completes through the port even when it succeeds at once */
+	if (!WaitCommEvent(comm->handle, &io->events, &io->ov) && GetLastError() != ERROR_IO_PENDING) {
+		printf("%s: WaitCommEvent failed with error %d.\n", comm->line.name, GetLastError());
+		return false;
+	}
+	io->armed = true;
+	return true;
+}
+
+static void
+modem_set_complete(struct modem_set *set, uint32_t port)
+{
+	struct modem_comm	*comm = modem_comm_from_line(set->lines[port]);
+	struct modem_set_io	*io = &set->io[port];
+	uint64_t		timestamp = modem_time_us();
+	uint32_t		lines;
+	DWORD			transferred;
+
+	io->armed = false;
+	if (set->stopping)
+		return;
+
+	if (!GetOverlappedResult(comm->handle, &io->ov, &transferred, FALSE) ||
+	    comm->line.get_hook(&comm->line, &lines) != 0) {
+		modem_set_fail(set, port);
+		return;
+	}
+
+	modem_set_deliver(set, port, timestamp, modem_comm_lines(io->events), lines, false);
+	if (!set->stopping && !modem_set_arm(set, port))
+		modem_set_fail(set, port);
+}
+#endif
+
+/* start watching every port; serial ports on Windows go through the completion port */
+static void
+modem_set_start(struct modem_set *set)
+{
+	uint32_t	port;
+
+	for (port = 0; port < set->count; port++) {
+#ifdef _WIN32
+		struct modem_comm *comm = modem_comm_from_line(set->lines[port]);
+
+		if (comm != NULL) {
+			if (!SetCommMask(comm->handle, modem_comm_mask(set->mask)) || !modem_set_arm(set, port))
+				modem_set_fail(set, port);
+			else
+				comm->commMask = modem_comm_mask(set->mask);
+			continue;
+		}
+#endif
+		set->waiters.push_back(std::thread(modem_set_waiter, set, port));
+	}
+}
+
+static void
+modem_set_finish(struct modem_set *set)
+{
+	uint32_t	port;
+
+	set->stopping = true;
+
+#ifdef _WIN32
+	OVERLAPPED_ENTRY	entries[64];
+	ULONG			count, i;
+	uint32_t		armed = 0;
+
+	for (port = 0; port < set->count; port++) {
+		if (set->io[port].armed) {
+			CancelIoEx(modem_comm_from_line(set->lines[port])->handle, &set->io[port].ov);
+			armed++;
+		}
+	}
+
+	/* the OVERLAPPEDs belong to the set until their cancellations complete */
+	while (armed != 0 && GetQueuedCompletionStatusEx(set->iocp, entries, 64, &count, INFINITE, FALSE)) {
+		for (i = 0; i < count; i++) {
+			if (entries[i].lpCompletionKey == MODEM_SET_KEY_WAKE)
+				continue;
+			set->io[entries[i].lpCompletionKey - 1].armed = false;
+			armed--;
+		}
+	}
+#endif
+
+	for (port = 0; port < set->count; port++) {
+#ifdef _WIN32
+		if (modem_comm_from_line(set->lines[port]) != NULL)
+			continue;
+#endif
+		set->lines[port]->cancel_hook(set->lines[port]);
+	}
+
+	for (size_t i = 0; i < set->waiters.size(); i++)
+		set->waiters[i].join();
+	set->waiters.clear();
+	set->queue.clear();
+}
+
+int
+modem_set_run(struct modem_set *set, modem_event_fn fn, modem_stats_fn statsFn, uint32_t interval, void *refcon)
+{
+	uint32_t	port, lines;
+	int		result = 0;
+
+	if (statsFn == NULL)
+		interval = 0;
+
+	set->fn = fn;
+	set->refcon = refcon;
+	set->stopping = false;
+	set->startTime = modem_time_us();
+	set->reportTime = set->startTime;
+	set->events = 0;
+	set->wakeups = 0;
+	set->reportEvents = 0;
+
+#ifdef __linux__
+	struct epoll_event	event;
+	struct itimerspec	period;
+
+	set->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	set->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (set->epollFd < 0 || set->wakeFd < 0) {
+		printf("modem_set: epoll setup failed with error %d.\n", errno);
+		result = -1;
+		goto out;
+	}
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = set->wakeFd;
+	epoll_ctl(set->epollFd, EPOLL_CTL_ADD, set->wakeFd, &event);
+
+	if (interval != 0) {
+		set->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (set->timerFd < 0) {
+			printf("modem_set: timerfd_create failed with error %d.\n", errno);
+			result = -1;
+			goto out;
+		}
+		period.it_interval.tv_sec = interval / 1000;
+		period.it_interval.tv_nsec = (long)(interval % 1000) * 1000000;
+		period.it_value = period.it_interval;
+		timerfd_settime(set->timerFd, 0, &period, NULL);
+		event.data.fd = set->timerFd;
+		epoll_ctl(set->epollFd, EPOLL_CTL_ADD, set->timerFd, &event);
+	}
+#elif !defined(_WIN32)
+	printf("modem_set: no dispatcher on this platform\n");
+	return -1;
+#endif
+
+	/* waits go in first, so nothing between the initial read and the first wait is lost */
+	modem_set_start(set);
+
+	for (port = 0; port < set->count && !set->stopping; port++) {
+		if (set->ports[port].failed)
+			continue;
+		if (set->lines[port]->get_hook(set->lines[port], &lines) != 0)
+			modem_set_fail(set, port);
+		else
+			modem_set_deliver(set, port, modem_time_us(), 0, lines, true);
+	}
+
+	while (!set->stopping) {
+#ifdef _WIN32
+		OVERLAPPED_ENTRY	entries[64];
+		ULONG			count, i;
+		DWORD			timeout = INFINITE;
+		uint64_t		now, due;
+
+		if (interval != 0) {
+			now = modem_time_us();
+			due = set->reportTime + (uint64_t)interval * 1000;
+			timeout = (due > now) ? (DWORD)((due - now + 999) / 1000) : 0;
+		}
+
+		if (!GetQueuedCompletionStatusEx(set->iocp, entries, 64, &count, timeout, FALSE)) {
+			if (GetLastError() != WAIT_TIMEOUT) {
+				printf("GetQueuedCompletionStatusEx failed with error %d.\n", GetLastError());
+				result = -1;
+				break;
+			}
+			count = 0;
+		}
+		set->wakeups++;
+
+		for (i = 0; i < count && !set->stopping; i++) {
+			if (entries[i].lpCompletionKey != MODEM_SET_KEY_WAKE)
+				modem_set_complete(set, (uint32_t)(entries[i].lpCompletionKey - 1));
+		}
+		modem_set_drain(set);
+
+		if (interval != 0 && !set->stopping &&
+		    modem_time_us() >= set->reportTime + (uint64_t)interval * 1000)
+			modem_set_report(set, statsFn);
+#else
+		struct epoll_event	ready[4];
+		uint64_t		value;
+		bool			report = false;
+		int			count, i;
+
+		count = epoll_wait(set->epollFd, ready, 4, -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("epoll_wait failed with error %d.\n", errno);
+			result = -1;
+			break;
+		}
+		set->wakeups++;
+
+		for (i = 0; i < count; i++) {
+			if (read(ready[i].data.fd, &value, sizeof(value)) < 0)
+				continue;
+			if (ready[i].data.fd == set->timerFd)
+				report = true;
+		}
+		modem_set_drain(set);
+
+		if (report && !set->stopping)
+			modem_set_report(set, statsFn);
+#endif
+	}
+
+	modem_set_finish(set);
+
+#ifdef __linux__
+out:
+	if (set->timerFd >= 0)
+		close(set->timerFd);
+	if (set->wakeFd >= 0)
+		close(set->wakeFd);
+	if (set->epollFd >= 0)
+		close(set->epollFd);
+	set->timerFd = -1;
+	set->wakeFd = -1;
+	set->epollFd = -1;
+#endif
+
+	return result;
+}
+
+void
+modem_set_stop(struct modem_set *set)
+{
+	set->stopping = true;
+	modem_set_wake(set);
+}
+
+void
+modem_set_free(struct modem_set *set)
+{
+	uint32_t	port;
+
+	if (set == NULL)
+		return;
+
+	for (port = 0; port < set->count; port++)
+		modem_line_close(set->lines[port]);
+	free(set->lines);
+	free(set->ports);
+
+#ifdef _WIN32
+	free(set->io);
+	CloseHandle(set->iocp);
+#endif
+
+	delete set;
+}
@@ -0,0 +1,76 @@
+/*
+ * Monitor for many modem lines at once.
+ *
+ * A modem_set owns a table of lines and reports every transition on any of
+ * them from a single dispatch loop. Serial ports on Windows complete their
+ * WaitCommEvent on an I/O completion port; lines whose waits can only block
+ * (TIOCMIWAIT, simulated lines) get a waiter thread that sleeps in the driver
+ * and hands events to the loop, which on Linux waits in epoll. Either way
+ * the work done tracks the event rate, not the number of ports.
+ */
+
+#ifndef __MODEMSET_H
+#define __MODEMSET_H
+
+#include "modemmon.h"
+
+__BEGIN_DECLS
+
+/* per-port state, kept compact so hundreds of ports stay in a few cache lines */
+struct modem_port_state {
+	uint64_t	lastChange;	/* timestamp of the last transition, 0 if none */
+	uint32_t	transitions;
+	uint8_t		lines;
+	uint8_t		failed;		/* the driver returned an error; no longer watched */
+	uint16_t	reserved;
+};
+
+struct modem_set_stats {
+	uint64_t	elapsed;	/* microseconds since modem_set_run started */
+	uint64_t	events;		/* transitions reported */
+	uint64_t	wakeups;	/* times the dispatch loop woke */
+	uint64_t	intervalElapsed;	/* since the previous stats report */
+	uint64_t	intervalEvents;
+	uint32_t	ports;
+	uint32_t	activePorts;	/* ports with at least one transition */
+	uint32_t	failedPorts;
+};
+
+typedef void(*modem_stats_fn)(void *refcon, const struct modem_set_stats *stats);
+
+struct modem_set;
+
+/* watch the lines in mask on every port added to the set */
+struct modem_set *modem_set_create(uint32_t mask);
+
+/* add lines before modem_set_run; the set owns line (closing it on failure) and returns its port index or -1 */
+int modem_set_add(struct modem_set *set, struct modem_line *line);
+
+/*
+ * Open every serial port matching pattern, which may use '*' and '?'
+ * ("/dev/ttyUSB*", "COM1?"). Returns the number opened.
+ */
+int modem_set_open(struct modem_set *set, const char *pattern);
+
+uint32_t modem_set_count(struct modem_set *set);
+struct modem_line *modem_set_line(struct modem_set *set, uint32_t port);
+const struct modem_port_state *modem_set_port(struct modem_set *set, uint32_t port);
+
+/*
+ * Report the initial state of every port, then every transition, until fn
+ * returns false or modem_set_stop() is called. With an interval, statsFn is
+ * called every interval milliseconds from the same loop.
+ *
+ * Returns 0 when stopped, or -1 if the set can't be monitored.
+ */
+int modem_set_run(struct modem_set *set, modem_event_fn fn, modem_stats_fn statsFn, uint32_t interval, void *refcon);
+void modem_set_stop(struct modem_set *set);
+
+void modem_set_get_stats(struct modem_set *set, struct modem_set_stats *stats);
+
+/* closes every line in the set */
+void modem_set_free(struct modem_set *set);
+
+__END_DECLS
+
+#endif
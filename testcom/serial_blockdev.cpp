@@ -0,0 +1,612 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "blockdev.h"
+#include "serial_blockdev.h"
+#include "dedup_blockdev.h"
+#include "compat.h"
+
+#define SERIAL_BDEV_TIMEOUT_MS	1000
+#define SERIAL_BDEV_RETRIES	5
+#define SERIAL_BDEV_CHUNK	4096		/* payload per request, unless a block is bigger */
+#define SERIAL_BDEV_READ_SIZE	4096		/* bytes taken from the line at a time */
+
+/* CRC-32 (IEEE 802.3, reflected) */
+static uint32_t serial_bdev_crc32(const void *ptr, size_t len)
+{
+	static uint32_t		table[256];
+	static std::once_flag	once;
+	const uint8_t		*p = (const uint8_t *)ptr;
+	uint32_t		crc = 0xFFFFFFFF;
+
+	std::call_once(once, [] {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	});
+
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+/*
+ * Frame receiver. Bytes accumulate until a whole frame is present; anything
+ * that fails a check costs one byte and the search for the magic resumes
+ * from the next, so a damaged frame never hides the one behind it.
+ */
+struct serial_bdev_rx {
+	std::vector<uint8_t>	buf;
+	size_t			start;		/* first byte not yet consumed */
+	uint64_t		badFrames;
+};
+
+static void serial_bdev_rx_add(struct serial_bdev_rx *rx, const void *data, size_t len)
+{
+	if (rx->start > 0 && rx->start >= rx->buf.size() / 2) {
+		rx->buf.erase(rx->buf.begin(), rx->buf.begin() + rx->start);
+		rx->start = 0;
+	}
+	rx->buf.insert(rx->buf.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+}
+
+/* the next intact frame, its payload valid until the next serial_bdev_rx_add; false if more bytes are needed */
+static bool serial_bdev_rx_next(struct serial_bdev_rx *rx, struct serial_bdev_frame *frame, const uint8_t **payload)
+{
+	const uint8_t	*p;
+	size_t		avail, need, i;
+	uint32_t	crc;
+
+	for (;;) {
+		p = rx->buf.data() + rx->start;
+		avail = rx->buf.size() - rx->start;
+
+		for (i = 0; i + 1 < avail; i++) {
+			if (p[i] == (kSerialBdevMagic & 0xFF) && p[i + 1] == (kSerialBdevMagic >> 8))
+				break;
+		}
+		/* keep a trailing byte that may be the start of the magic */
+		rx->start += i;
+		p += i;
+		avail -= i;
+
+		if (avail < sizeof(*frame))
+			return false;
+
+		memcpy(frame, p, sizeof(*frame));
+		if (frame->crc != serial_bdev_crc32(p, offsetof(struct serial_bdev_frame, crc)) ||
+		    frame->length > SERIAL_BDEV_MAX_PAYLOAD) {
+			rx->badFrames++;
+			rx->start++;
+			continue;
+		}
+
+		need = sizeof(*frame) + frame->length + (frame->length != 0 ? sizeof(crc) : 0);
+		if (avail < need)
+			return false;
+
+		if (frame->length != 0) {
+			memcpy(&crc, p + sizeof(*frame) + frame->length, sizeof(crc));
+			if (crc != serial_bdev_crc32(p + sizeof(*frame), frame->length)) {
+				rx->badFrames++;
+				rx->start++;
+				continue;
+			}
+		}
+
+		*payload = p + sizeof(*frame);
+		rx->start += need;
+		return true;
+	}
+}
+
+/* returns the write_hook result: > 0 when sent, 0 if the line was cancelled, -1 on error */
+static int serial_bdev_send(struct modem_line *line, std::vector<uint8_t> &scratch, uint8_t type, uint8_t status,
+			    uint16_t tag, uint32_t block, uint32_t count, const void *payload, uint32_t length)
+{
+	struct serial_bdev_frame	frame;
+	uint32_t			crc;
+	size_t				size;
+
+	frame.magic = kSerialBdevMagic;
+	frame.type = type;
+	frame.status = status;
+	frame.tag = tag;
+	frame.length = (uint16_t)length;
+	frame.block = block;
+	frame.count = count;
+	frame.crc = serial_bdev_crc32(&frame, offsetof(struct serial_bdev_frame, crc));
+
+	/* one write per frame, so the driver sees the whole thing at once */
+	size = sizeof(frame) + length + (length != 0 ? sizeof(crc) : 0);
+	scratch.resize(size);
+	memcpy(scratch.data(), &frame, sizeof(frame));
+	if (length != 0) {
+		crc = serial_bdev_crc32(payload, length);
+		memcpy(scratch.data() + sizeof(frame), payload, length);
+		memcpy(scratch.data() + sizeof(frame) + length, &crc, sizeof(crc));
+	}
+
+	return line->write_hook(line, scratch.data(), (uint32_t)size);
+}
+
+/*
+ * Client.
+ *
+ * The caller's thread sends requests and a receiver thread matches replies
+ * to the window by tag, copying read data straight into the caller's buffer.
+ * A retransmitted request keeps its tag, so whichever reply arrives first
+ * completes it and any duplicate is ignored. The responder handles requests
+ * in order, so a duplicate has always been handled before the transfer that
+ * sent it returns.
+ */
+
+struct serial_bdev_request {
+	bool		active;
+	bool		done;
+	uint8_t		type;
+	uint8_t		status;
+	uint16_t	tag;
+	uint32_t	retries;
+	block_addr	block;		/* for SERIAL_BDEV_INFO, the geometry on completion */
+	uint32_t	count;
+	uint8_t		*data;		/* read destination or write source */
+};
+
+struct serial_blockdev {
+	struct blockdev			bdev;
+	struct modem_line		*line;
+	std::thread			receiver;
+
+	std::mutex			io;		/* one transfer at a time; guards scratch */
+	std::vector<uint8_t>		scratch;
+
+	std::mutex			lock;		/* shared with the receiver */
+	std::condition_variable		cond;
+	struct serial_bdev_request	window[SERIAL_BDEV_WINDOW];
+	uint16_t			nextTag;
+	uint64_t			lastReceived;	/* modem_time_us() of the last byte in */
+	bool				failed;		/* the receiver has stopped */
+	uint32_t			timeout_ms;
+	struct serial_blockdev_stats	stats;
+};
+
+/* called with the lock held */
+static void serial_bdev_complete(struct serial_blockdev *dev, const struct serial_bdev_frame *frame, const uint8_t *payload)
+{
+	struct serial_bdev_request	*req;
+	uint32_t			i;
+
+	if ((frame->type & SERIAL_BDEV_REPLY) == 0)
+		return;
+
+	for (i = 0; i < SERIAL_BDEV_WINDOW; i++) {
+		req = &dev->window[i];
+		if (req->active && !req->done && req->tag == frame->tag &&
+		    req->type == (frame->type & ~SERIAL_BDEV_REPLY))
+			break;
+	}
+	if (i == SERIAL_BDEV_WINDOW)
+		return;		/* a duplicate, or a reply to an abandoned request */
+
+	req->status = frame->status;
+	if (frame->status == SERIAL_BDEV_OK) {
+		switch (req->type) {
+		case SERIAL_BDEV_INFO:
+			req->block = frame->block;
+			req->count = frame->count;
+			break;
+		case SERIAL_BDEV_READ:
+			if (frame->block != req->block || frame->count != req->count ||
+			    frame->length != (uint64_t)req->count * dev->bdev.block_size) {
+				req->status = SERIAL_BDEV_EINVAL;
+				break;
+			}
+			memcpy(req->data, payload, frame->length);
+			dev->stats.bytes += frame->length;
+			break;
+		case SERIAL_BDEV_WRITE:
+			dev->stats.bytes += (uint64_t)req->count * dev->bdev.block_size;
+			break;
+		}
+	}
+	req->done = true;
+}
+
+static void serial_bdev_receive(struct serial_blockdev *dev)
+{
+	struct serial_bdev_rx		rx;
+	struct serial_bdev_frame	frame;
+	const uint8_t			*payload;
+	uint8_t				buf[SERIAL_BDEV_READ_SIZE];
+	int				count;
+
+	rx.start = 0;
+	rx.badFrames = 0;
+
+	for (;;) {
+		count = dev->line->read_hook(dev->line, buf, sizeof(buf));
+		if (count <= 0)
+			break;
+		serial_bdev_rx_add(&rx, buf, count);
+
+		std::lock_guard<std::mutex> guard(dev->lock);
+		dev->lastReceived = modem_time_us();
+		while (serial_bdev_rx_next(&rx, &frame, &payload))
+			serial_bdev_complete(dev, &frame, payload);
+		dev->stats.badFrames = rx.badFrames;
+		dev->cond.notify_all();
+	}
+
+	std::lock_guard<std::mutex> guard(dev->lock);
+	dev->failed = true;
+	dev->cond.notify_all();
+}
+
+/*
+ * Move count blocks in requests of up to SERIAL_BDEV_CHUNK bytes, keeping up to
+ * SERIAL_BDEV_WINDOW of them in flight. A SERIAL_BDEV_INFO transfer is a single
+ * request, whose answer lands in geometry[0] (block size) and geometry[1].
+ */
+static int serial_bdev_transfer(struct serial_blockdev *dev, uint8_t type, uint8_t *data, block_addr block,
+				uint32_t count, uint32_t *geometry)
+{
+	struct serial_bdev_request	*req;
+	uint32_t			chunk, requests, issued, inflight, i;
+	uint64_t			now, quiet;
+	int				result = 0;
+
+	if (type == SERIAL_BDEV_INFO) {
+		chunk = 0;
+		requests = 1;
+	}
+	else {
+		chunk = __max(1, SERIAL_BDEV_CHUNK / dev->bdev.block_size);
+		requests = (count + chunk - 1) / chunk;
+	}
+
+	std::lock_guard<std::mutex> io(dev->io);
+	std::unique_lock<std::mutex> guard(dev->lock);
+
+	dev->lastReceived = modem_time_us();
+	for (issued = 0, inflight = 0; result == 0 && (issued < requests || inflight > 0);) {
+		if (dev->failed) {
+			result = -1;
+			break;
+		}
+
+		/* fill the window */
+		while (issued < requests && inflight < SERIAL_BDEV_WINDOW) {
+			for (req = dev->window; req->active; req++)
+				;
+			req->active = true;
+			req->done = false;
+			req->type = type;
+			req->status = SERIAL_BDEV_OK;
+			req->tag = dev->nextTag++;
+			req->retries = 0;
+			req->block = block + issued * chunk;
+			req->count = type == SERIAL_BDEV_INFO ? 0 : __min(chunk, count - issued * chunk);
+			req->data = type == SERIAL_BDEV_INFO ? NULL : data + (size_t)issued * chunk * dev->bdev.block_size;
+			issued++;
+			inflight++;
+			dev->stats.requests++;
+
+			/* the receiver only ever marks an active request done, so the fields can be read unlocked */
+			guard.unlock();
+			if (serial_bdev_send(dev->line, dev->scratch, req->type, 0, req->tag, req->block, req->count,
+					     req->type == SERIAL_BDEV_WRITE ? req->data : NULL,
+					     req->type == SERIAL_BDEV_WRITE ? req->count * dev->bdev.block_size : 0) <= 0)
+				result = -1;
+			guard.lock();
+			if (result != 0)
+				break;
+		}
+		if (result != 0)
+			break;
+
+		/* retire what has completed */
+		for (i = 0; i < SERIAL_BDEV_WINDOW; i++) {
+			req = &dev->window[i];
+			if (!req->active || !req->done)
+				continue;
+			if (req->status != SERIAL_BDEV_OK) {
+				printf("serial: %s: request for block %u failed with status %u\n", dev->line->name,
+				       req->block, req->status);
+				result = -1;
+			}
+			else if (type == SERIAL_BDEV_INFO) {
+				geometry[0] = req->block;
+				geometry[1] = req->count;
+			}
+			req->active = false;
+			inflight--;
+		}
+		if (result != 0 || inflight == 0 || (inflight < SERIAL_BDEV_WINDOW && issued < requests))
+			continue;
+
+		/* wait for a reply, or for the line to go quiet */
+		now = modem_time_us();
+		quiet = now - dev->lastReceived;
+		if (quiet < (uint64_t)dev->timeout_ms * 1000) {
+			dev->cond.wait_for(guard, std::chrono::microseconds((uint64_t)dev->timeout_ms * 1000 - quiet));
+			continue;
+		}
+
+		/* nothing heard for a whole timeout: whatever is outstanding was lost */
+		for (i = 0; i < SERIAL_BDEV_WINDOW && result == 0; i++) {
+			req = &dev->window[i];
+			if (!req->active || req->done)
+				continue;
+			if (++req->retries > SERIAL_BDEV_RETRIES) {
+				printf("serial: %s: no reply for block %u\n", dev->line->name, req->block);
+				result = -1;
+				break;
+			}
+			dev->stats.retransmits++;
+
+			guard.unlock();
+			if (serial_bdev_send(dev->line, dev->scratch, req->type, 0, req->tag, req->block, req->count,
+					     req->type == SERIAL_BDEV_WRITE ? req->data : NULL,
+					     req->type == SERIAL_BDEV_WRITE ? req->count * dev->bdev.block_size : 0) <= 0)
+				result = -1;
+			guard.lock();
+		}
+		dev->lastReceived = modem_time_us();
+	}
+
+	/* abandon anything still in flight; the receiver drops late replies */
+	for (i = 0; i < SERIAL_BDEV_WINDOW; i++)
+		dev->window[i].active = false;
+
+	return result;
+}
+
+static int serial_bdev_read_block(struct blockdev *_dev, void *ptr, block_addr block, uint32_t count)
+{
+	struct serial_blockdev *dev = (struct serial_blockdev *)_dev;
+
+	if (block >= _dev->block_count)
+		return 0;
+	if (count > _dev->block_count - block)
+		count = _dev->block_count - block;
+
+	if (serial_bdev_transfer(dev, SERIAL_BDEV_READ, (uint8_t *)ptr, block, count, NULL) != 0)
+		return -1;
+
+	return count;
+}
+
+static int serial_bdev_write_block(struct blockdev *_dev, const void *ptr, block_addr block, uint32_t count)
+{
+	struct serial_blockdev *dev = (struct serial_blockdev *)_dev;
+
+	if (block >= _dev->block_count)
+		return 0;
+	if (count > _dev->block_count - block)
+		count = _dev->block_count - block;
+
+	if (serial_bdev_transfer(dev, SERIAL_BDEV_WRITE, (uint8_t *)ptr, block, count, NULL) != 0)
+		return -1;
+
+	return count;
+}
+
+struct blockdev *create_serial_blockdev(const char *name, struct modem_line *line)
+{
+	struct serial_blockdev	*dev;
+	uint32_t		geometry[2];
+
+	dev = new (std::nothrow) struct serial_blockdev;
+	if (dev == NULL)
+		return NULL;
+
+	memset(&dev->bdev, 0, sizeof(dev->bdev));
+	memset(dev->window, 0, sizeof(dev->window));
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	dev->line = line;
+	dev->nextTag = 0;
+	dev->lastReceived = 0;
+	dev->failed = false;
+	dev->timeout_ms = SERIAL_BDEV_TIMEOUT_MS;
+
+	try {
+		dev->receiver = std::thread(serial_bdev_receive, dev);
+	}
+	catch (const std::system_error &) {
+		printf("serial: %s: can't start the receiver\n", line->name);
+		delete dev;
+		return NULL;
+	}
+
+	if (serial_bdev_transfer(dev, SERIAL_BDEV_INFO, NULL, 0, 0, geometry) != 0) {
+		printf("serial: %s: no responder\n", line->name);
+		goto fail;
+	}
+	if (geometry[0] == 0 || (geometry[0] & (geometry[0] - 1)) != 0 || geometry[0] > SERIAL_BDEV_MAX_PAYLOAD ||
+	    geometry[1] == 0) {
+		printf("serial: %s: unusable geometry, %u blocks of %u bytes\n", line->name, geometry[1], geometry[0]);
+		goto fail;
+	}
+
+	construct_blockdev(&dev->bdev, name, (uint64_t)geometry[0] * geometry[1], geometry[0]);
+	dev->bdev.read_block_hook = &serial_bdev_read_block;
+	dev->bdev.write_block_hook = &serial_bdev_write_block;
+
+	return &dev->bdev;
+
+fail:
+	/* the line stays the caller's; the cancel only stops the receiver, which is all that still uses it */
+	line->cancel_hook(line);
+	dev->receiver.join();
+	delete dev;
+	return NULL;
+}
+
+void serial_blockdev_set_timeout(struct blockdev *_dev, uint32_t timeout_ms)
+{
+	struct serial_blockdev *dev = (struct serial_blockdev *)_dev;
+	std::lock_guard<std::mutex> guard(dev->lock);
+
+	dev->timeout_ms = timeout_ms;
+}
+
+void serial_blockdev_get_stats(struct blockdev *_dev, struct serial_blockdev_stats *stats)
+{
+	struct serial_blockdev *dev = (struct serial_blockdev *)_dev;
+	std::lock_guard<std::mutex> guard(dev->lock);
+
+	*stats = dev->stats;
+}
+
+void free_serial_blockdev(struct blockdev *_dev)
+{
+	struct serial_blockdev *dev = (struct serial_blockdev *)_dev;
+
+	dev->line->cancel_hook(dev->line);
+	dev->receiver.join();
+	modem_line_close(dev->line);
+	delete dev;
+}
+
+/*
+ * Responder.
+ */
+
+int serial_blockdev_serve(struct modem_line *line, struct blockdev *dev)
+{
+	struct serial_bdev_rx		rx;
+	struct serial_bdev_frame	frame;
+	const uint8_t			*payload;
+	std::vector<uint8_t>		scratch, data;
+	uint8_t				buf[SERIAL_BDEV_READ_SIZE];
+	uint64_t			bytes;
+	uint32_t			block, count, length;
+	uint8_t				status;
+	int				result;
+
+	rx.start = 0;
+	rx.badFrames = 0;
+
+	for (;;) {
+		result = line->read_hook(line, buf, sizeof(buf));
+		if (result <= 0)
+			return result;
+		serial_bdev_rx_add(&rx, buf, result);
+
+		while (serial_bdev_rx_next(&rx, &frame, &payload)) {
+			if ((frame.type & SERIAL_BDEV_REPLY) != 0)
+				continue;
+
+			status = SERIAL_BDEV_OK;
+			block = frame.block;
+			count = frame.count;
+			bytes = (uint64_t)count * dev->block_size;
+			length = 0;
+
+			switch (frame.type) {
+			case SERIAL_BDEV_INFO:
+				block = dev->block_size;
+				count = dev->block_count;
+				break;
+
+			case SERIAL_BDEV_READ:
+			case SERIAL_BDEV_WRITE:
+				if (count == 0 || bytes > SERIAL_BDEV_MAX_PAYLOAD ||
+				    (frame.type == SERIAL_BDEV_WRITE && frame.length != bytes)) {
+					status = SERIAL_BDEV_EINVAL;
+					break;
+				}
+				if (block >= dev->block_count || count > dev->block_count - block) {
+					status = SERIAL_BDEV_ERANGE;
+					break;
+				}
+				if (frame.type == SERIAL_BDEV_WRITE) {
+					if (blockdev_write_block(dev, payload, block, count) != (int)count)
+						status = SERIAL_BDEV_EIO;
+					break;
+				}
+				data.resize((size_t)bytes);
+				if (blockdev_read_block(dev, data.data(), block, count) != (int)count)
+					status = SERIAL_BDEV_EIO;
+				else
+					length = (uint32_t)bytes;
+				break;
+
+			default:
+				status = SERIAL_BDEV_EINVAL;
+				break;
+			}
+
+			result = serial_bdev_send(line, scratch, frame.type | SERIAL_BDEV_REPLY, status, frame.tag,
+						  block, count, length != 0 ? data.data() : NULL, length);
+			if (result <= 0)
+				return result;
+		}
+	}
+}
+
+int serial_blockdev_serve_file(struct modem_line *line, const char *path, uint32_t block_size)
+{
+	struct blockdev	*dev;
+	FILE		*fp;
+	uint8_t		*buf;
+	long		size;
+	uint64_t	len;
+	int		result;
+
+	if (block_size == 0 || (block_size & (block_size - 1)) != 0 || block_size > SERIAL_BDEV_MAX_PAYLOAD) {
+		printf("serial: unusable block size %u\n", block_size);
+		return -1;
+	}
+
+	fp = compat_fopen(path, "rb");
+	if (fp == NULL) {
+		printf("serial: can't open %s\n", path);
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (size < 0) {
+		fclose(fp);
+		return -1;
+	}
+
+	/* at least one block, the tail zero-filled */
+	len = __max((uint64_t)size + block_size - 1, block_size) & ~(uint64_t)(block_size - 1);
+	buf = (uint8_t *)calloc(1, (size_t)len);
+	if (buf == NULL || fread(buf, 1, size, fp) != (size_t)size) {
+		printf("serial: can't read %s\n", path);
+		free(buf);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	/* the dedup device keeps the copy; mostly-empty images cost little */
+	dev = create_dedup_blockdev("serve", len, block_size);
+	if (dev == NULL || dev->write_block_hook(dev, buf, 0, dev->block_count) != (int)dev->block_count) {
+		if (dev != NULL)
+			free_dedup_blockdev(dev);
+		free(buf);
+		return -1;
+	}
+	free(buf);
+
+	result = serial_blockdev_serve(line, dev);
+	free_dedup_blockdev(dev);
+	return result;
+}
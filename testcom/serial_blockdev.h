@@ -0,0 +1,83 @@
+/*
+ * Remote block device over a serial line.
+ *
+ * Block reads and writes become requests in a small framed protocol: each
+ * frame is a header with its own CRC, then an optional payload and the
+ * payload's CRC, so a receiver can resynchronise on the next magic after
+ * line noise. Several requests are kept in flight at once, so throughput
+ * is set by the line rate rather than the round trip. A request whose reply
+ * is lost is sent again once the line has been quiet for the stall timeout.
+ *
+ * serial_blockdev_serve() is the other end, answering requests from a
+ * local blockdev; over a pseudo-terminal it stands in for a remote unit.
+ */
+
+#ifndef __LIB_SERIAL_BLOCKDEV_H
+#define __LIB_SERIAL_BLOCKDEV_H
+
+#include "blockdev.h"
+#include "modemmon.h"
+
+__BEGIN_DECLS
+
+/*
+ * Frame layout. All fields are little-endian; the header CRC covers the
+ * header up to itself, and length payload bytes follow with a CRC of their own.
+ */
+struct serial_bdev_frame {
+	uint16_t	magic;
+#define kSerialBdevMagic	0x4253		/* "SB" */
+	uint8_t		type;
+#define SERIAL_BDEV_INFO	1		/* reply: block = block size, count = block count */
+#define SERIAL_BDEV_READ	2		/* reply carries count blocks */
+#define SERIAL_BDEV_WRITE	3		/* request carries count blocks */
+#define SERIAL_BDEV_REPLY	0x80		/* or'd into the request type */
+	uint8_t		status;
+#define SERIAL_BDEV_OK		0
+#define SERIAL_BDEV_ERANGE	1
+#define SERIAL_BDEV_EIO		2
+#define SERIAL_BDEV_EINVAL	3
+	uint16_t	tag;		/* echoed in the reply */
+	uint16_t	length;		/* payload bytes */
+	uint32_t	block;
+	uint32_t	count;
+	uint32_t	crc;
+};
+
+#define SERIAL_BDEV_MAX_PAYLOAD	(32 * 1024)
+#define SERIAL_BDEV_WINDOW	8		/* requests in flight */
+
+struct serial_blockdev_stats {
+	uint64_t	requests;
+	uint64_t	retransmits;
+	uint64_t	badFrames;	/* dropped for a bad CRC or a bad header */
+	uint64_t	bytes;		/* payload moved in either direction */
+};
+
+/*
+ * create_serial_blockdev() is declared in blockdev.h next to the other backends.
+ * The device takes the line, already set up with raw_hook, and asks the far
+ * end for its geometry. If that fails NULL is returned, and the line, which
+ * may have been cancelled, is still the caller's to close.
+ */
+
+/* milliseconds without a byte received before outstanding requests are sent again */
+void serial_blockdev_set_timeout(struct blockdev *dev, uint32_t timeout_ms);
+
+void serial_blockdev_get_stats(struct blockdev *dev, struct serial_blockdev_stats *stats);
+
+/* cancel and close the line and free the device; unregister it first */
+void free_serial_blockdev(struct blockdev *dev);
+
+/*
+ * Answer requests arriving on line from dev until the line is cancelled.
+ * Returns 0 when cancelled, or -1 if the line fails.
+ */
+int serial_blockdev_serve(struct modem_line *line, struct blockdev *dev);
+
+/* serve a copy of the file at path, padded to whole blocks; writes change only the copy */
+int serial_blockdev_serve_file(struct modem_line *line, const char *path, uint32_t block_size);
+
+__END_DECLS
+
+#endif
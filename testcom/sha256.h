@@ -0,0 +1,31 @@
+/*
+ * SHA-256 (FIPS 180-4), used where hashes must hold up as integrity checks.
+ */
+
+#ifndef __LIB_SHA256_H
+#define __LIB_SHA256_H
+
+#include "types.h"
+
+__BEGIN_DECLS
+
+#define SHA256_DIGEST_LENGTH	32
+#define SHA256_BLOCK_LENGTH	64
+
+struct sha256_ctx {
+	uint32_t	state[8];
+	uint64_t	length;
+	uint32_t	buffered;
+	uint8_t		buffer[SHA256_BLOCK_LENGTH];
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *ptr, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+/* one-shot convenience */
+void sha256(const void *ptr, size_t len, uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+__END_DECLS
+
+#endif
@@ -2,101 +2,1048 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <algorithm>
 #include "blockdev.h"
 #include "syscfg.h"
+#include "syscfg_private.h"
+#include "syscfg_output.h"
+#include "syscfg_query.h"
+#include "compat.h"
+#include "trace.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SYSCFG_SSE2	1
+#endif
+
+/* the context behind the original single-image API */
+static struct syscfg_ctx	syscfgDefault;
+
+static inline u_int32_t
+syscfgTagHash(u_int32_t tag, u_int32_t bits)
+{
+	/* Fibonacci hashing; the top bits mix all four tag characters */
+	return (u_int32_t)(tag * 2654435761u) >> (32 - bits);
+}
+
+static bool
+syscfgReadTag(struct syscfg_ctx *ctx, u_int32_t index, u_int32_t *tag)
+{
+	struct syscfgEntryCNTB	entry;
+	size_t			offset;
+
+	offset = sizeof(struct syscfgHeader) + index * sizeof(struct syscfgEntry);
+	if (offset >= ctx->dataLength || offset + sizeof(struct syscfgEntry) > ctx->dataLength)
+		return false;
+
+	memcpy(&entry, ctx->data + offset, sizeof(entry));
+	*tag = (entry.seTag == kSyscfgTagCNTB) ? entry.seRealTag : entry.seTag;
+	return true;
+}
+
+static void
+syscfgFreeTagIndex(struct syscfg_ctx *ctx)
+{
+	/* the slots stay in the arena until the image is released */
+	ctx->tagIndex = NULL;
+	ctx->tagIndexBits = 0;
+	ctx->wellKnownValid = false;
+}
+
+/* on allocation failure there is simply no index, and lookups fall back to scanning */
+static void
+syscfgBuildTagIndex(struct syscfg_ctx *ctx)
+{
+	struct syscfgTagSlot	*tagIndex;
+	u_int32_t		index, tag, slot, mask, bits, keys;
+	bool			duplicates = false;
+
+	/* a damaged key count must not size the index past the entries actually there */
+	keys = 0;
+	if (ctx->data != NULL && ctx->dataLength > sizeof(struct syscfgHeader))
+		keys = (u_int32_t)__min((size_t)ctx->keyCount,
+			(ctx->dataLength - sizeof(struct syscfgHeader)) / sizeof(struct syscfgEntry));
+	if (keys == 0) {
+		syscfgFreeTagIndex(ctx);
+		return;
+	}
+
+	/* keep the load factor at or below one half */
+	for (bits = 4; (1u << bits) < keys * 2 && bits < 31; bits++)
+		;
+
+	/* the writer reindexes after every change; reuse the slots while the size holds */
+	tagIndex = (ctx->tagIndexBits == bits) ? ctx->tagIndex : NULL;
+	syscfgFreeTagIndex(ctx);
+	if (tagIndex != NULL)
+		memset(tagIndex, 0, ((size_t)1 << bits) * sizeof(*tagIndex));
+	else if ((tagIndex = (struct syscfgTagSlot *)syscfgArenaCalloc(&ctx->arena, (size_t)1 << bits, sizeof(*tagIndex))) == NULL)
+		return;
+	mask = (1u << bits) - 1;
+
+	for (index = 0; index < keys; index++) {
+		if (!syscfgReadTag(ctx, index, &tag))
+			break;
+
+		/* duplicate tags resolve to the first entry, as the linear scan did */
+		for (slot = syscfgTagHash(tag, bits); tagIndex[slot].index != 0; slot = (slot + 1) & mask) {
+			if (tagIndex[slot].tag == tag)
+				break;
+		}
+		if (tagIndex[slot].index == 0) {
+			tagIndex[slot].tag = tag;
+			tagIndex[slot].index = index + 1;
+		}
+		else
+			duplicates = true;
+	}
+
+	ctx->tagIndex = tagIndex;
+	ctx->tagIndexBits = bits;
+	ctx->duplicateTags = duplicates;
+}
+
+static bool
+syscfgLookupTagIndexed(struct syscfg_ctx *ctx, u_int32_t tag, u_int32_t *index)
+{
+	u_int32_t	slot, mask, i, entryTag;
+
+	if (ctx->tagIndex != NULL) {
+		mask = (1u << ctx->tagIndexBits) - 1;
+		for (slot = syscfgTagHash(tag, ctx->tagIndexBits); ctx->tagIndex[slot].index != 0; slot = (slot + 1) & mask) {
+			if (ctx->tagIndex[slot].tag == tag) {
+				*index = ctx->tagIndex[slot].index - 1;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	for (i = 0; i < ctx->keyCount; i++) {
+		if (!syscfgReadTag(ctx, i, &entryTag))
+			break;
+		if (entryTag == tag) {
+			*index = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* resolve the well-known tags through the general index, once per load */
+static void
+syscfgFillWellKnown(struct syscfg_ctx *ctx)
+{
+	u_int32_t	slot, index;
+
+	for (slot = 0; slot < SYSCFG_WELL_KNOWN_SLOTS; slot++) {
+		ctx->wellKnown[slot] = 0;
+		if (kSyscfgWellKnownTable.tags[slot] != 0 &&
+		    syscfgLookupTagIndexed(ctx, kSyscfgWellKnownTable.tags[slot], &index))
+			ctx->wellKnown[slot] = index + 1;
+	}
+	ctx->wellKnownValid = true;
+}
+
+/* find the entry table slot holding tag */
+bool
+syscfgLookupTag(struct syscfg_ctx *ctx, u_int32_t tag, u_int32_t *index)
+{
+	int	slot;
+
+	slot = syscfgWellKnownSlot(tag);
+	if (slot >= 0 && ctx->wellKnownValid) {
+		if (ctx->wellKnown[slot] == 0)
+			return false;
+		*index = ctx->wellKnown[slot] - 1;
+		return true;
+	}
+	return syscfgLookupTagIndexed(ctx, tag, index);
+}
+
+static bool
+syscfgExtentBefore(const struct syscfgExtent &a, const struct syscfgExtent &b)
+{
+	if (a.offset != b.offset)
+		return a.offset < b.offset;
+	return a.size < b.size;
+}
+
+/*
+ * Check the whole image once so that lookups and entry views can be handed out
+ * unchecked: the entry table must fit, every CNTB payload must lie past the
+ * table and inside both the region and shMaxSize, and payloads may be shared
+ * between entries but must not partially overlap.
+ */
+static bool
+syscfgValidate(struct syscfg_ctx *ctx)
+{
+	struct syscfgHeader	hdr;
+	struct syscfgEntryCNTB	entry;
+	struct syscfgExtent	*extents;
+	struct syscfg_arena_mark mark;
+	const uint8_t		*p;
+	size_t			tableEnd, limit;
+	u_int32_t		index, count;
+	u_int64_t		end;
+	bool			ok = true;
+
+	if (ctx->data == NULL || ctx->dataLength < sizeof(hdr))
+		return false;
+
+	memcpy(&hdr, ctx->data, sizeof(hdr));
+	if (hdr.shMagic != kSysCfgHeaderMagic)
+		return false;
+
+	tableEnd = sizeof(struct syscfgHeader) + (size_t)ctx->keyCount * sizeof(struct syscfgEntry);
+	if (tableEnd > ctx->dataLength)
+		return false;
+
+	limit = __min(ctx->regionLength, (size_t)hdr.shMaxSize);
+
+	syscfgArenaMark(&ctx->arena, &mark);
+	extents = (struct syscfgExtent *)syscfgArenaAlloc(&ctx->arena, (size_t)ctx->keyCount * sizeof(*extents));
+	if (extents == NULL)
+		return false;
+
+	count = 0;
+	p = ctx->data + sizeof(struct syscfgHeader);
+	for (index = 0; index < ctx->keyCount; index++, p += sizeof(struct syscfgEntry)) {
+		memcpy(&entry, p, sizeof(entry));
+		if (entry.seTag != kSyscfgTagCNTB)
+			continue;
+
+		end = (u_int64_t)entry.seDataOffset + entry.seDataSize;
+		if (entry.seRealTag == kSyscfgTagCNTB || entry.seDataOffset < tableEnd || end > limit) {
+			ok = false;
+			break;
+		}
+		extents[count].offset = entry.seDataOffset;
+		extents[count].size = entry.seDataSize;
+		count++;
+	}
+
+	if (ok && count > 1) {
+		std::sort(extents, extents + count, syscfgExtentBefore);
+		for (index = 1; index < count; index++) {
+			if (extents[index].offset == extents[index - 1].offset &&
+			    extents[index].size == extents[index - 1].size)
+				continue;
+			if ((u_int64_t)extents[index - 1].offset + extents[index - 1].size > extents[index].offset) {
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	syscfgArenaRelease(&ctx->arena, &mark);
+	return ok;
+}
+
+/* rebuild everything derived from the entry table */
+void
+syscfgCtxReindex(struct syscfg_ctx *ctx)
+{
+	syscfgBuildTagIndex(ctx);
+	syscfgFillWellKnown(ctx);
+	ctx->validated = syscfgValidate(ctx);
+}
+
+static inline u_int32_t
+syscfgEntryTag(const struct syscfgEntryCNTB *entry)
+{
+	return (entry->seTag == kSyscfgTagCNTB) ? entry->seRealTag : entry->seTag;
+}
+
+/* point tag at index, unless an earlier entry already holds it */
+static void
+syscfgIndexInsert(struct syscfg_ctx *ctx, u_int32_t tag, u_int32_t index)
+{
+	struct syscfgTagSlot	*tagIndex = ctx->tagIndex;
+	u_int32_t		slot, mask;
+
+	mask = (1u << ctx->tagIndexBits) - 1;
+	for (slot = syscfgTagHash(tag, ctx->tagIndexBits); tagIndex[slot].index != 0; slot = (slot + 1) & mask) {
+		if (tagIndex[slot].tag == tag) {
+			ctx->duplicateTags = true;
+			if (index + 1 < tagIndex[slot].index)
+				tagIndex[slot].index = index + 1;
+			return;
+		}
+	}
+	tagIndex[slot].tag = tag;
+	tagIndex[slot].index = index + 1;
+}
+
+/* drop tag from the index, shifting back the run after it so that every probe still finds its tag */
+static void
+syscfgIndexRemove(struct syscfg_ctx *ctx, u_int32_t tag)
+{
+	struct syscfgTagSlot	*tagIndex = ctx->tagIndex;
+	u_int32_t		slot, next, home, mask;
+
+	mask = (1u << ctx->tagIndexBits) - 1;
+	for (slot = syscfgTagHash(tag, ctx->tagIndexBits); tagIndex[slot].index != 0; slot = (slot + 1) & mask) {
+		if (tagIndex[slot].tag == tag)
+			break;
+	}
+	if (tagIndex[slot].index == 0)
+		return;
+
+	for (next = (slot + 1) & mask; tagIndex[next].index != 0; next = (next + 1) & mask) {
+		/* an entry may fill the hole only if the hole is between its home slot and where it sits */
+		home = syscfgTagHash(tagIndex[next].tag, ctx->tagIndexBits);
+		if (((next - home) & mask) >= ((next - slot) & mask)) {
+			tagIndex[slot] = tagIndex[next];
+			slot = next;
+		}
+	}
+	tagIndex[slot].tag = 0;
+	tagIndex[slot].index = 0;
+}
+
+/* the entry index a well-known tag resolves to may have changed */
+static void
+syscfgRefreshWellKnown(struct syscfg_ctx *ctx, u_int32_t tag)
+{
+	u_int32_t	index;
+	int		slot;
+
+	slot = syscfgWellKnownSlot(tag);
+	if (slot < 0)
+		return;
+	ctx->wellKnown[slot] = syscfgLookupTagIndexed(ctx, tag, &index) ? index + 1 : 0;
+}
+
+/*
+ * Bring a context up to date with an image that differs from its own only
+ * within ranges (sorted and disjoint), copying those bytes from source, which
+ * is laid out like the image. Only the work the change touches is redone: the
+ * entry table slots the ranges overlap are taken out of the tag index and put
+ * back, and the image is revalidated only if a CNTB extent moved.
+ *
+ * Returns false if the change reaches the header, or the context keeps state
+ * that can't be patched (a byte-swapped or lazy image); the
+ * caller must then load the image again in full.
+ */
+bool
+syscfgCtxPatch(struct syscfg_ctx *ctx, const uint8_t *source, const struct syscfgExtent *ranges, u_int32_t count)
+{
+	struct syscfgEntryCNTB		*before, after;
+	struct syscfg_arena_mark	mark;
+	u_int32_t			*slots, slotCount, i, index, first, last, oldTag, newTag;
+	size_t				tableEnd, end, headerEnd;
+	bool				revalidate = !ctx->validated;
+
+	if (ctx->data == NULL || ctx->lazy || ctx->swapped || ctx->tagIndex == NULL || !ctx->wellKnownValid)
+		return false;
+
+	tableEnd = sizeof(struct syscfgHeader) + (size_t)ctx->keyCount * sizeof(struct syscfgEntry);
+	if (tableEnd > ctx->dataLength)
+		return false;
+
+	slotCount = 0;
+	for (i = 0; i < count; i++) {
+		end = (size_t)ranges[i].offset + ranges[i].size;
+		if (end > ctx->dataLength)
+			return false;
+		if (ranges[i].offset < sizeof(struct syscfgHeader)) {
+			headerEnd = __min(end, sizeof(struct syscfgHeader));
+			if (memcmp(ctx->data + ranges[i].offset, source + ranges[i].offset, headerEnd - ranges[i].offset) != 0)
+				return false;
+		}
+		if (ranges[i].size != 0 && end > sizeof(struct syscfgHeader) && ranges[i].offset < tableEnd) {
+			first = (u_int32_t)((__max((size_t)ranges[i].offset, sizeof(struct syscfgHeader)) - sizeof(struct syscfgHeader)) / sizeof(struct syscfgEntry));
+			last = (u_int32_t)((__min(end, tableEnd) - 1 - sizeof(struct syscfgHeader)) / sizeof(struct syscfgEntry));
+			slotCount += last - first + 1;
+		}
+	}
+
+	/* note what the touched slots held, then take the new bytes */
+	syscfgArenaMark(&ctx->arena, &mark);
+	slots = (u_int32_t *)syscfgArenaAlloc(&ctx->arena, (size_t)slotCount * sizeof(*slots));
+	before = (struct syscfgEntryCNTB *)syscfgArenaAlloc(&ctx->arena, (size_t)slotCount * sizeof(*before));
+	if (slotCount != 0 && (slots == NULL || before == NULL)) {
+		syscfgArenaRelease(&ctx->arena, &mark);
+		return false;
+	}
+
+	slotCount = 0;
+	for (i = 0; i < count; i++) {
+		end = (size_t)ranges[i].offset + ranges[i].size;
+		if (ranges[i].size == 0 || end <= sizeof(struct syscfgHeader) || ranges[i].offset >= tableEnd)
+			continue;
+		first = (u_int32_t)((__max((size_t)ranges[i].offset, sizeof(struct syscfgHeader)) - sizeof(struct syscfgHeader)) / sizeof(struct syscfgEntry));
+		last = (u_int32_t)((__min(end, tableEnd) - 1 - sizeof(struct syscfgHeader)) / sizeof(struct syscfgEntry));
+		for (index = first; index <= last; index++) {
+			/* an entry straddling two ranges is counted once */
+			if (slotCount != 0 && slots[slotCount - 1] == index)
+				continue;
+			slots[slotCount] = index;
+			memcpy(&before[slotCount], ctx->data + sizeof(struct syscfgHeader) + (size_t)index * sizeof(struct syscfgEntry),
+			       sizeof(before[slotCount]));
+			slotCount++;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		memcpy(ctx->data + ranges[i].offset, source + ranges[i].offset, ranges[i].size);
+
+	/* first take out every tag that left its slot, then put in the new ones */
+	for (i = 0; i < slotCount; i++) {
+		memcpy(&after, ctx->data + sizeof(struct syscfgHeader) + (size_t)slots[i] * sizeof(struct syscfgEntry), sizeof(after));
+		oldTag = syscfgEntryTag(&before[i]);
+		if (oldTag == syscfgEntryTag(&after) || !syscfgLookupTagIndexed(ctx, oldTag, &index) || index != slots[i])
+			continue;
+
+		syscfgIndexRemove(ctx, oldTag);
+		if (ctx->duplicateTags) {
+			/* a later entry with the same tag takes over */
+			for (index = slots[i] + 1; index < ctx->keyCount; index++) {
+				if (syscfgReadTag(ctx, index, &newTag) && newTag == oldTag) {
+					syscfgIndexInsert(ctx, oldTag, index);
+					break;
+				}
+			}
+		}
+	}
 
-static u_int32_t	syscfgKeyCount;
-static uint8_t		*syscfgData = NULL;
-static size_t		syscfgDataLength=0;
+	for (i = 0; i < slotCount; i++) {
+		memcpy(&after, ctx->data + sizeof(struct syscfgHeader) + (size_t)slots[i] * sizeof(struct syscfgEntry), sizeof(after));
+		oldTag = syscfgEntryTag(&before[i]);
+		newTag = syscfgEntryTag(&after);
+		if (oldTag != newTag) {
+			syscfgIndexInsert(ctx, newTag, slots[i]);
+			syscfgRefreshWellKnown(ctx, oldTag);
+			syscfgRefreshWellKnown(ctx, newTag);
+		}
 
+		/* payload bytes can change freely; a payload moving or resizing needs the extents checked again */
+		if ((before[i].seTag == kSyscfgTagCNTB || after.seTag == kSyscfgTagCNTB) &&
+		    (before[i].seTag != after.seTag || before[i].seRealTag != after.seRealTag ||
+		     before[i].seDataOffset != after.seDataOffset || before[i].seDataSize != after.seDataSize))
+			revalidate = true;
+	}
+
+	syscfgArenaRelease(&ctx->arena, &mark);
+
+	if (revalidate)
+		ctx->validated = syscfgValidate(ctx);
+	return true;
+}
 
-#define SCFG_MAGIC 0x53436667
-#define CNTB_MAGIC 0x434e5442
-#define SCFG_LOCATION 0x4000
+/* byte-swap count 32-bit words in place */
+void
+syscfgSwapWords(uint8_t *p, size_t count)
+{
+	u_int32_t	word;
+	size_t		i = 0;
+
+#ifdef SYSCFG_SSE2
+	/* swap bytes within each 16-bit half, then swap the halves */
+	for (; i + 4 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i * 4));
+
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		_mm_storeu_si128((__m128i *)(p + i * 4), v);
+	}
+#endif
 
-struct syscfgHeader {
-	u_int32_t	shMagic;
-#define kSysCfgHeaderMagic	'SCfg'
-	u_int32_t	shSize;
-	u_int32_t	shMaxSize;
-	u_int32_t	shVersion;
-	u_int32_t	shBigEndian;
-	u_int32_t	shKeyCount;
-};
+	for (; i < count; i++) {
+		memcpy(&word, p + i * 4, sizeof(word));
+		word = (word >> 24) | ((word >> 8) & 0xff00) | ((word << 8) & 0xff0000) | (word << 24);
+		memcpy(p + i * 4, &word, sizeof(word));
+	}
+}
 
+static inline u_int32_t
+syscfgSwap32(u_int32_t word)
+{
+	syscfgSwapWords((uint8_t *)&word, 1);
+	return word;
+}
 
+/*
+ * Accept a header in either byte order, converting it to host order.
+ * Returns false if the magic matches neither.
+ */
+static bool
+syscfgHeaderNormalize(struct syscfgHeader *hdr, bool *swapped)
+{
+	if (hdr->shMagic == kSysCfgHeaderMagic) {
+		*swapped = false;
+		return true;
+	}
+	if (hdr->shMagic == kSysCfgHeaderMagicSwapped) {
+		syscfgSwapWords((uint8_t *)hdr, sizeof(*hdr) / sizeof(u_int32_t));
+		*swapped = true;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Bring a byte-swapped image to host order: the header and entry table are
+ * swapped a word at a time, then the inline data of ordinary entries, which is
+ * raw bytes rather than words, is swapped back. Extended data is never swapped.
+ * A borrowed image is copied first.
+ */
+static bool
+syscfgCtxNormalize(struct syscfg_ctx *ctx)
+{
+	struct syscfgHeader	hdr;
+	uint8_t			*data, *p;
+	size_t			tableEnd;
+	u_int32_t		index, keyCount, tag;
+
+	ctx->swapped = false;
+	if (ctx->data == NULL || ctx->dataLength < sizeof(hdr))
+		return true;
+
+	memcpy(&hdr, ctx->data, sizeof(hdr));
+	if (hdr.shMagic != kSysCfgHeaderMagicSwapped)
+		return true;
+
+	if (!ctx->ownsData) {
+		data = (uint8_t *)syscfgArenaAlloc(&ctx->arena, ctx->dataLength);
+		if (data == NULL) {
+			printf("syscfg: can't allocate 0x%zx bytes\n", ctx->dataLength);
+			return false;
+		}
+		memcpy(data, ctx->data, ctx->dataLength);
+		ctx->data = data;
+		ctx->ownsData = true;
+	}
+
+	keyCount = syscfgSwap32(hdr.shKeyCount);
+	tableEnd = sizeof(struct syscfgHeader) + (size_t)keyCount * sizeof(struct syscfgEntry);
+	if (tableEnd > ctx->dataLength) {
+		keyCount = (u_int32_t)((ctx->dataLength - sizeof(struct syscfgHeader)) / sizeof(struct syscfgEntry));
+		tableEnd = sizeof(struct syscfgHeader) + (size_t)keyCount * sizeof(struct syscfgEntry);
+	}
+
+	syscfgSwapWords(ctx->data, tableEnd / sizeof(u_int32_t));
+
+	p = ctx->data + sizeof(struct syscfgHeader);
+	for (index = 0; index < keyCount; index++, p += sizeof(struct syscfgEntry)) {
+		memcpy(&tag, p, sizeof(tag));
+		if (tag != kSyscfgTagCNTB)
+			syscfgSwapWords(p + offsetof(struct syscfgEntry, seData), SYSCFG_INLINE_WORDS);
+	}
+
+	ctx->swapped = true;
+	return true;
+}
+
+static bool
+syscfgCtxAttach(struct syscfg_ctx *ctx, uint8_t *data, size_t len, u_int32_t keyCount, bool ownsData)
+{
+	ctx->data = data;
+	ctx->dataLength = len;
+	ctx->regionLength = len;
+	ctx->keyCount = keyCount;
+	ctx->ownsData = ownsData;
+	if (!syscfgCtxNormalize(ctx)) {
+		ctx->data = NULL;
+		ctx->dataLength = 0;
+		ctx->keyCount = 0;
+		ctx->ownsData = false;
+		return false;
+	}
+	syscfgCtxReindex(ctx);
+	return true;
+}
+
+static bool
+syscfgPayloadBefore(const struct syscfgLazyPayload &a, const struct syscfgExtent &b)
+{
+	if (a.offset != b.offset)
+		return a.offset < b.offset;
+	return a.size < b.size;
+}
 
+/*
+ * Attach the header and entry table of an image whose extended data stays on
+ * bdev until it is asked for. Payloads shared by several entries are fetched once.
+ */
+static bool
+syscfgCtxAttachLazy(struct syscfg_ctx *ctx, uint8_t *table, size_t tableLength, size_t regionLength,
+		    u_int32_t keyCount, struct blockdev *bdev, u_int64_t bdevOffset)
+{
+	struct syscfgEntryCNTB		entry;
+	struct syscfgExtent		*extents;
+	struct syscfg_arena_mark	mark;
+	size_t				offset;
+	u_int32_t			index, count;
+
+	/* at most one payload per entry the table really holds */
+	count = 0;
+	if (tableLength > sizeof(struct syscfgHeader))
+		count = (u_int32_t)__min((size_t)keyCount, (tableLength - sizeof(struct syscfgHeader)) / sizeof(struct syscfgEntry));
+	ctx->payloads = (struct syscfgLazyPayload *)syscfgArenaCalloc(&ctx->arena, count, sizeof(*ctx->payloads));
+	syscfgArenaMark(&ctx->arena, &mark);
+	extents = (struct syscfgExtent *)syscfgArenaCalloc(&ctx->arena, count, sizeof(*extents));
+	ctx->lazyLock = new (std::nothrow) std::mutex;
+	if (ctx->payloads == NULL || extents == NULL || ctx->lazyLock == NULL) {
+		delete ctx->lazyLock;
+		ctx->payloads = NULL;
+		ctx->lazyLock = NULL;
+		return false;
+	}
+
+	ctx->lazy = true;
+	ctx->bdev = bdev;
+	ctx->bdevOffset = bdevOffset;
+
+	ctx->data = table;
+	ctx->dataLength = tableLength;
+	ctx->regionLength = regionLength;
+	ctx->keyCount = keyCount;
+	ctx->ownsData = true;
+	syscfgCtxNormalize(ctx);
+
+	count = 0;
+	for (index = 0; index < keyCount; index++) {
+		offset = sizeof(struct syscfgHeader) + (size_t)index * sizeof(struct syscfgEntry);
+		if (offset + sizeof(struct syscfgEntry) > tableLength)
+			break;
+		memcpy(&entry, table + offset, sizeof(entry));
+		if (entry.seTag != kSyscfgTagCNTB)
+			continue;
+		extents[count].offset = entry.seDataOffset;
+		extents[count].size = entry.seDataSize;
+		count++;
+	}
+
+	/* the payloads can't be moved once they hold atomics, so sort the extents and copy them over */
+	std::sort(extents, extents + count, syscfgExtentBefore);
+	count = (u_int32_t)(std::unique(extents, extents + count,
+		[](const struct syscfgExtent &a, const struct syscfgExtent &b) {
+			return a.offset == b.offset && a.size == b.size;
+		}) - extents);
+	for (index = 0; index < count; index++) {
+		ctx->payloads[index].offset = extents[index].offset;
+		ctx->payloads[index].size = extents[index].size;
+		ctx->payloads[index].data.store(NULL, std::memory_order_relaxed);
+	}
+	ctx->payloadCount = count;
+	syscfgArenaRelease(&ctx->arena, &mark);
+
+	syscfgCtxReindex(ctx);
+
+	return true;
+}
+
+/* return the cached copy of some extended data, reading it in on first use */
+static uint8_t *
+syscfgLazyFetch(struct syscfg_ctx *ctx, u_int32_t offset, u_int32_t size)
+{
+	struct syscfgLazyPayload	*payload;
+	struct syscfgExtent		key;
+	struct syscfg_arena_mark	mark;
+	uint8_t				*data;
+	int				result;
+
+	key.offset = offset;
+	key.size = size;
+	payload = std::lower_bound(ctx->payloads, ctx->payloads + ctx->payloadCount, key, syscfgPayloadBefore);
+	if (payload == ctx->payloads + ctx->payloadCount || payload->offset != offset || payload->size != size)
+		return NULL;
+
+	/* once filled a payload never changes, so a hit needs no lock */
+	data = payload->data.load(std::memory_order_acquire);
+	if (data != NULL)
+		return data;
+
+	/* the lock covers the arena too; nothing else allocates from a lazy context once it is loaded */
+	std::lock_guard<std::mutex> guard(*ctx->lazyLock);
+
+	/* someone else may have filled it while we waited */
+	data = payload->data.load(std::memory_order_relaxed);
+	if (data != NULL)
+		return data;
+
+	syscfgArenaMark(&ctx->arena, &mark);
+	data = (uint8_t *)syscfgArenaAlloc(&ctx->arena, size);
+	if (data == NULL)
+		return NULL;
+
+	result = blockdev_read(ctx->bdev, data, ctx->bdevOffset + offset, size);
+	if (result < 0 || (u_int32_t)result < size) {
+		printf("syscfg: bdev read fail (%d) fetching 0x%x bytes at 0x%x\n", result, size, offset);
+		syscfgArenaRelease(&ctx->arena, &mark);
+		return NULL;
+	}
+
+	/* publish the bytes along with the pointer */
+	payload->data.store(data, std::memory_order_release);
+	return data;
+}
+
+/* drop the image; the arena keeps its memory for the next one */
+void
+syscfgCtxRelease(struct syscfg_ctx *ctx)
+{
+	ctx->dataLength = 0;
+	ctx->data = NULL;
+	ctx->keyCount = 0;
+	ctx->ownsData = false;
+	ctx->validated = false;
+	ctx->swapped = false;
+	syscfgFreeTagIndex(ctx);
+	syscfgWriterRelease(ctx);
+	ctx->bdev = NULL;
+
+	if (ctx->lazy) {
+		delete ctx->lazyLock;
+		ctx->payloads = NULL;
+		ctx->payloadCount = 0;
+		ctx->lazyLock = NULL;
+		ctx->lazy = false;
+	}
+
+	syscfgArenaReset(&ctx->arena);
+}
+
+/* check the header of an image handed to us whole; returns the key count */
+static bool
+syscfgCheckImage(const uint8_t *data, size_t len, u_int32_t *keyCount)
+{
+	struct syscfgHeader	hdr;
+	bool			swapped;
+
+	if (data == NULL || len < sizeof(hdr)) {
+		printf("syscfg: image too small\n");
+		return false;
+	}
+
+	memcpy(&hdr, data, sizeof(hdr));
+	if (!syscfgHeaderNormalize(&hdr, &swapped)) {
+		printf("syscfg: bad magic\n");
+		return false;
+	}
+
+	*keyCount = hdr.shKeyCount;
+	return true;
+}
+
+/* the key count comes from the header here, once, so dumps and lookups never have to fix it up */
 void syscfg_init(uint8_t *sys, size_t len)
 {
-	syscfgData = sys;
-	syscfgDataLength = len;
-	syscfgKeyCount = 62;
+	u_int32_t keyCount;
+
+	syscfgCtxRelease(&syscfgDefault);
+	if (syscfgCheckImage(sys, len, &keyCount))
+		syscfgCtxAttach(&syscfgDefault, sys, len, keyCount, false);
 }
 
 void syscfg_reinit(void)
 {
-	free(syscfgData);
-	syscfgDataLength = 0;
-	syscfgData = NULL;
-	syscfgKeyCount = 0;
+	syscfgCtxRelease(&syscfgDefault);
+}
+
+static struct syscfg_ctx *
+syscfgCtxOpenBuffer(const uint8_t *data, size_t len)
+{
+	struct syscfg_ctx	*ctx;
+	u_int32_t		keyCount;
+
+	if (!syscfgCheckImage(data, len, &keyCount))
+		return NULL;
+
+	ctx = (struct syscfg_ctx *)calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+
+	/* the buffer is borrowed and only ever read; a byte-swapped one is copied */
+	if (!syscfgCtxAttach(ctx, (uint8_t *)data, len, keyCount, false)) {
+		syscfgArenaDestroy(&ctx->arena);
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+struct syscfg_ctx *
+syscfg_ctx_open_buffer(const uint8_t *data, size_t len)
+{
+	struct syscfg_ctx *ctx;
+
+	TRACE_BEGIN(TRACE_SYSCFG_OPEN_BUFFER, len, 0);
+	ctx = syscfgCtxOpenBuffer(data, len);
+	TRACE_END(TRACE_SYSCFG_OPEN_BUFFER, ctx != NULL);
+	return ctx;
+}
+
+/* load a copy of an image into an empty context */
+bool
+syscfgCtxLoadImage(struct syscfg_ctx *ctx, const uint8_t *image, size_t len)
+{
+	uint8_t		*data;
+	u_int32_t	keyCount;
+
+	if (!syscfgCheckImage(image, len, &keyCount))
+		return false;
+
+	data = (uint8_t *)syscfgArenaAlloc(&ctx->arena, len);
+	if (data == NULL) {
+		printf("syscfg: can't allocate 0x%zx bytes\n", len);
+		return false;
+	}
+	memcpy(data, image, len);
+
+	if (!syscfgCtxAttach(ctx, data, len, keyCount, true)) {
+		syscfgArenaReset(&ctx->arena);
+		return false;
+	}
+	return true;
+}
+
+struct syscfg_ctx *
+syscfg_ctx_open_file(const char *path)
+{
+	struct syscfg_ctx	*ctx;
+	FILE			*fp;
+	uint8_t			*data;
+	long			len;
+	u_int32_t		keyCount;
+
+	fp = compat_fopen(path, "rb");
+	if (fp == NULL) {
+		printf("syscfg: can't open \"%s\"\n", path);
+		return NULL;
+	}
+
+	if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+		printf("syscfg: can't size \"%s\"\n", path);
+		fclose(fp);
+		return NULL;
+	}
+
+	ctx = (struct syscfg_ctx *)calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+
+	data = (uint8_t *)syscfgArenaAlloc(&ctx->arena, len);
+	if (data == NULL || fread(data, 1, len, fp) != (size_t)len) {
+		printf("syscfg: read fail on \"%s\"\n", path);
+		fclose(fp);
+		goto fail;
+	}
+	fclose(fp);
+
+	if (!syscfgCheckImage(data, len, &keyCount) ||
+	    !syscfgCtxAttach(ctx, data, len, keyCount, true))
+		goto fail;
+	return ctx;
+
+fail:
+	syscfgArenaDestroy(&ctx->arena);
+	free(ctx);
+	return NULL;
+}
+
+void
+syscfg_ctx_close(struct syscfg_ctx *ctx)
+{
+	if (ctx == NULL)
+		return;
+
+	syscfgCtxRelease(ctx);
+	syscfgArenaDestroy(&ctx->arena);
+	free(ctx);
+}
+
+u_int32_t
+syscfg_ctx_key_count(struct syscfg_ctx *ctx)
+{
+	return ctx->keyCount;
 }
 
+static void
+syscfgDumpError(struct syscfgOutput *out, const char *msg)
+{
+	/* the text dump always reported inline; machine formats keep their stream clean */
+	if (out->format == kSyscfgOutputText)
+		syscfgOutputString(out, msg);
+	else
+		fprintf(stderr, "syscfg: %s\n", msg);
+}
+
+static void
+syscfgDumpTagChars(struct syscfgOutput *out, u_int32_t tag)
+{
+	char	chars[4];
+
+	syscfgTagChars(tag, chars);
+
+	if (out->format == kSyscfgOutputJSON)
+		syscfgOutputJSONString(out, chars, sizeof(chars));
+	else
+		syscfgOutputBytes(out, chars, sizeof(chars));
+}
+
+static void
+syscfgDumpEntryText(struct syscfgOutput *out, const struct syscfgMemEntry *entry,
+		    const uint8_t *data, size_t size, bool isExt, const char *sfx)
+{
+	u_int32_t	word;
+	size_t		i, j;
+
+	syscfgOutputHex32(out, entry->seTag);
+	syscfgOutputString(out, " '");
+	syscfgDumpTagChars(out, entry->seTag);
+	syscfgOutputString(out, "'  ");
+	syscfgOutputDecimal(out, entry->seDataSize, 4);
+	syscfgOutputString(out, "B ");
+	syscfgOutputChar(out, isExt ? '*' : ' ');
+	syscfgOutputString(out, "  ");
+	syscfgOutputBytes(out, entry->seData, strnlen((const char *)entry->seData, sizeof(entry->seData)));
+	syscfgOutputString(out, "  ");
+
+	/* Format the data in nice columns */
+	for (i = 0; i < size; i += 16) {
+		if (i >= 16)
+			syscfgOutputSpaces(out, 28);
+
+		/* Starting at the offset, display the data values up to 4 per line, zero padded. */
+		for (j = i; j < (i + 16); j += 4) {
+			word = 0;
+			if (j < size)
+				memcpy(&word, data + j, __min((size_t)4, size - j));
+			syscfgOutputHex32(out, word);
+			syscfgOutputChar(out, ' ');
+		}
+
+		syscfgOutputString(out, sfx);
+		syscfgOutputChar(out, '\n');
+	}
+}
+
+static void
+syscfgDumpEntryJSON(struct syscfgOutput *out, const struct syscfgMemEntry *entry,
+		    const uint8_t *data, size_t size, bool isExt, bool first)
+{
+	syscfgOutputString(out, first ? "\n    {\"tag\":" : ",\n    {\"tag\":");
+	syscfgDumpTagChars(out, entry->seTag);
+	syscfgOutputString(out, ",\"value\":");
+	syscfgOutputDecimal(out, entry->seTag, 0);
+	syscfgOutputString(out, ",\"size\":");
+	syscfgOutputDecimal(out, size, 0);
+	if (isExt) {
+		syscfgOutputString(out, ",\"offset\":");
+		syscfgOutputDecimal(out, entry->seDataOffset, 0);
+	}
+	syscfgOutputString(out, ",\"data\":\"");
+	syscfgOutputHexBytes(out, data, size);
+	syscfgOutputString(out, "\"}");
+}
+
+static void
+syscfgDumpEntryBinary(struct syscfgOutput *out, const struct syscfgMemEntry *entry,
+		      const uint8_t *data, size_t size, bool isExt)
+{
+	struct syscfgBinaryRecord	rec;
+
+	rec.rTag = entry->seTag;
+	rec.rSize = (u_int32_t)size;
+	rec.rFlags = isExt ? kSyscfgBinaryExt : 0;
+	syscfgOutputBytes(out, &rec, sizeof(rec));
+	syscfgOutputBytes(out, data, size);
+}
+
+/*
+ * Dump the image in the given format.
+ *
+ * The text format is the traditional layout; with arguments it shows only the
+ * named tags (or, given "ext", everything) with extended data in full. Tag
+ * arguments may use '?' and '*' wildcards, see syscfg_query.h. The JSON
+ * and binary formats always carry every byte of every selected entry.
+ */
 int
-do_syscfg(int argc, struct cmd_arg *args)
+syscfg_ctx_dump_format(struct syscfg_ctx *ctx, int argc, struct cmd_arg *args, int format, FILE *fp)
 {
-	struct syscfgHeader	hdr;
-	struct syscfgMemEntry	entry;
-	int			index, curArg;
-	size_t			size, i, j;
-	char			*sfx;
-	bool			isExt;
-	size_t			lowExt;
-	size_t			highExt;
-	size_t			extSize = 0;
-	uint8_t			*buffer;
-	bool			showExt = false;
-
-	if (NULL == syscfgData) {
-		printf("syscfg is not initialized!\n");
+	struct syscfgOutput		out;
+	struct syscfgHeader		hdr;
+	struct syscfgMemEntry		entry;
+	struct syscfgBinaryHeader	bhdr;
+	struct syscfgBinaryRecord	rec;
+	struct syscfg_query		query;
+	int				index;
+	int				result = 0;
+	size_t				size;
+	const char			*sfx;
+	bool				isExt;
+	size_t				lowExt;
+	size_t				highExt;
+	size_t				extSize = 0;
+	const uint8_t			*data;
+	bool				showExt = false;
+	bool				first = true;
+
+	syscfgOutputInit(&out, fp, format);
+
+	if (NULL == ctx || NULL == ctx->data) {
+		syscfgDumpError(&out, "syscfg is not initialized!\n");
+		syscfgOutputFinish(&out);
 		return(0);
 	}
 
-	if (syscfgDataLength < sizeof(struct syscfgHeader))
+	if (ctx->dataLength < sizeof(struct syscfgHeader))
 		return (0);
 
-	memcpy(&hdr, syscfgData, sizeof(struct syscfgHeader));
-	printf("version 0x%08x with %d entries\n\n", hdr.shVersion, hdr.shKeyCount);
+	/* compile the requested tags once rather than comparing every argument against every entry */
+	if (!syscfg_query_compile(&query, argc, args)) {
+		syscfgDumpError(&out, "out of memory");
+		syscfgOutputFinish(&out);
+		return(0);
+	}
 
-	syscfgKeyCount = hdr.shKeyCount;
+	/* When parameters are present, always show in extended mode */
+	showExt = argc > 1;
+
+	memcpy(&hdr, ctx->data, sizeof(struct syscfgHeader));
+
+	switch (format) {
+	case kSyscfgOutputText:
+		syscfgOutputString(&out, "version ");
+		syscfgOutputHex32(&out, hdr.shVersion);
+		syscfgOutputString(&out, " with ");
+		syscfgOutputDecimal(&out, hdr.shKeyCount, 0);
+		syscfgOutputString(&out, " entries\n\n");
+		break;
+	case kSyscfgOutputJSON:
+		syscfgOutputString(&out, "{\n  \"version\":");
+		syscfgOutputDecimal(&out, hdr.shVersion, 0);
+		syscfgOutputString(&out, ",\n  \"keyCount\":");
+		syscfgOutputDecimal(&out, hdr.shKeyCount, 0);
+		syscfgOutputString(&out, ",\n  \"entries\":[");
+		break;
+	case kSyscfgOutputBinary:
+		bhdr.bhMagic = kSyscfgBinaryMagic;
+		bhdr.bhVersion = 1;
+		bhdr.bhSysCfgVersion = hdr.shVersion;
+		bhdr.bhKeyCount = hdr.shKeyCount;
+		syscfgOutputBytes(&out, &bhdr, sizeof(bhdr));
+		break;
+	}
 
 	lowExt = hdr.shMaxSize;
 	highExt = hdr.shSize;
 
 	for (index = 0; ; index++) {
-		if (!syscfgFindByIndex(index, &entry))
+		if (!syscfg_ctx_find_by_index(ctx, index, &entry))
 			break;
 
-		if (argc > 1) {
-
-			/* When parameters are present, always show in extended mode */
-			showExt = true;
-
-			/* If the first parameter is ext, assume match in all cases by skipping the match block */
-			if (strcmp("ext", args[1].str) != 0) {
-
-				/* Scan the list of arguments looking for a match */
-				for (curArg = 1; curArg < argc; curArg++) {
-					if (((entry.seTag >> 24) & 0xFF) == args[curArg].str[0] &&
-						((entry.seTag >> 16) & 0xFF) == args[curArg].str[1] &&
-						((entry.seTag >> 8) & 0xFF) == args[curArg].str[2] &&
-						((entry.seTag >> 0) & 0xFF) == args[curArg].str[3])
-						break;
-				}
-				if (curArg == argc) continue;
-			}
-		}
+		if (!syscfg_query_match(&query, entry.seTag))
+			continue;
 
-		sfx = (char *)"";
+		sfx = "";
 
 		/* Is this a standard entry or an Offset entry? */
 		if (entry.seDataOffset != 0) {
@@ -105,20 +1052,21 @@ do_syscfg(int argc, struct cmd_arg *args)
 
 				/* The Size of the entry is too big for the structure
 				 * Should it be truncated? */
-				if (!showExt) {
+				if (!showExt && format == kSyscfgOutputText) {
 					size = sizeof(entry.seData);
-					sfx = (char *)"...";
+					sfx = "...";
 				}
 			}
-			if (entry.seDataOffset + entry.seDataSize > hdr.shMaxSize) {
-				printf("entry->seDataOffset not within syscfgData");
-				return(0);
+			if (!ctx->validated && entry.seDataOffset + entry.seDataSize > hdr.shMaxSize) {
+				syscfgDumpError(&out, "entry->seDataOffset not within syscfgData");
+				goto abort;
 			}
 
-			/* Allocate the requested space aligned on 16 bytes to zero
-			 * pad the display. */
-			buffer = (uint8_t *)calloc(1, (size + 15) & ~15);
-			memcpy(buffer, syscfgData + entry.seDataOffset, size);
+			data = (const uint8_t *)syscfg_ctx_get_data(ctx, &entry);
+			if (data == NULL) {
+				syscfgDumpError(&out, "entry->seDataOffset not readable");
+				goto abort;
+			}
 
 			// Calculate the extents of the offset section
 			if (entry.seDataOffset < lowExt) {
@@ -130,60 +1078,111 @@ do_syscfg(int argc, struct cmd_arg *args)
 			isExt = true;
 		}
 		else {
-			/* allocate enough space to mirror the entrys buffer */
 			size = sizeof(entry.seData);
-
-			buffer = (uint8_t *)malloc(sizeof(entry.seData));
-			memcpy(buffer, entry.seData, size);
-
+			data = entry.seData;
 			isExt = false;
 		}
-		printf("0x%08x '%c%c%c%c'  %4dB %c  %s  ",
-			entry.seTag,
-			(entry.seTag >> 24) & 0xff,
-			(entry.seTag >> 16) & 0xff,
-			(entry.seTag >> 8) & 0xff,
-			entry.seTag & 0xff,
-			entry.seDataSize,
-			isExt ? '*' : ' ',
-			entry.seData);
-
-		/* Format the data in nice columns */
-		for (i = 0; i < size; i += 16) {
-			printf("%*s", (i >= 16) ? 28 : 0, "");
-
-			/* Starting at the offset, display the data values up to 4 per line. */
-			for (j = i; j < (i + 16); j += 4) {
-				printf("0x%08x ", *((u_int32_t *)&buffer[j]));
-			}
 
-			printf("%s\n", sfx);
+		switch (format) {
+		case kSyscfgOutputText:
+			syscfgDumpEntryText(&out, &entry, data, size, isExt, sfx);
+			break;
+		case kSyscfgOutputJSON:
+			syscfgDumpEntryJSON(&out, &entry, data, size, isExt, first);
+			break;
+		case kSyscfgOutputBinary:
+			syscfgDumpEntryBinary(&out, &entry, data, size, isExt);
+			break;
 		}
-
-		free(buffer);
+		first = false;
 	}
 
-	printf("\n");
-	printf("header @ 0-%zu", sizeof(struct syscfgHeader) - 1);
-	printf("; entries @ %zu-%d", sizeof(struct syscfgHeader), hdr.shSize - 1);
-	if (lowExt < highExt) {
+	if (lowExt < highExt)
 		extSize = highExt - lowExt;
-		printf("; extra data @ %zu-%zu", lowExt, highExt - 1);
+
+	switch (format) {
+	case kSyscfgOutputText:
+		syscfgOutputString(&out, "\nheader @ 0-");
+		syscfgOutputDecimal(&out, sizeof(struct syscfgHeader) - 1, 0);
+		syscfgOutputString(&out, "; entries @ ");
+		syscfgOutputDecimal(&out, sizeof(struct syscfgHeader), 0);
+		syscfgOutputChar(&out, '-');
+		/* shSize - 1 was printed with %d */
+		if (hdr.shSize == 0)
+			syscfgOutputString(&out, "-1");
+		else
+			syscfgOutputDecimal(&out, hdr.shSize - 1, 0);
+		if (lowExt < highExt) {
+			syscfgOutputString(&out, "; extra data @ ");
+			syscfgOutputDecimal(&out, lowExt, 0);
+			syscfgOutputChar(&out, '-');
+			syscfgOutputDecimal(&out, highExt - 1, 0);
+		}
+		syscfgOutputString(&out, "; using ");
+		syscfgOutputDecimal(&out, hdr.shSize + extSize, 0);
+		syscfgOutputString(&out, " of ");
+		syscfgOutputDecimal(&out, hdr.shMaxSize, 0);
+		syscfgOutputString(&out, " bytes\n");
+		break;
+	case kSyscfgOutputJSON:
+		syscfgOutputString(&out, first ? "],\n  \"size\":" : "\n  ],\n  \"size\":");
+		syscfgOutputDecimal(&out, hdr.shSize, 0);
+		syscfgOutputString(&out, ",\n  \"maxSize\":");
+		syscfgOutputDecimal(&out, hdr.shMaxSize, 0);
+		if (lowExt < highExt) {
+			syscfgOutputString(&out, ",\n  \"extraData\":[");
+			syscfgOutputDecimal(&out, lowExt, 0);
+			syscfgOutputChar(&out, ',');
+			syscfgOutputDecimal(&out, highExt, 0);
+			syscfgOutputChar(&out, ']');
+		}
+		syscfgOutputString(&out, ",\n  \"used\":");
+		syscfgOutputDecimal(&out, hdr.shSize + extSize, 0);
+		syscfgOutputString(&out, "\n}\n");
+		break;
+	case kSyscfgOutputBinary:
+		rec.rTag = 0;
+		rec.rSize = 0;
+		rec.rFlags = kSyscfgBinaryEnd;
+		syscfgOutputBytes(&out, &rec, sizeof(rec));
+		break;
 	}
-	printf("; using %zu of %d bytes\n", hdr.shSize + extSize, hdr.shMaxSize);
 
+	if (syscfgOutputFinish(&out) != 0)
+		result = -1;
+	syscfg_query_free(&query);
+	return(result);
+
+abort:
+	syscfgOutputFinish(&out);
+	syscfg_query_free(&query);
 	return(0);
 }
 
+int
+syscfg_ctx_dump(struct syscfg_ctx *ctx, int argc, struct cmd_arg *args)
+{
+	return syscfg_ctx_dump_format(ctx, argc, args, kSyscfgOutputText, stdout);
+}
+
+int
+do_syscfg(int argc, struct cmd_arg *args)
+{
+	return syscfg_ctx_dump(&syscfgDefault, argc, args);
+}
+
 bool
-syscfgInitWithBdev(const char *bdevName)
+syscfgCtxLoadBdev(struct syscfg_ctx *ctx, const char *bdevName, bool lazy)
 {
 	int result;
 	struct blockdev	*candidate;
 	struct syscfgHeader hdr;
-
-	if (syscfgData != NULL)
-		return(false);
+	struct syscfgLocation location;
+	bool swapped = false;
+	off_t offset;
+	size_t dataLength;
+	size_t regionLength = 0;
+	uint8_t *data;
 
 	/* look for the suggested bdev */
 	if ((candidate = lookup_blockdev(bdevName)) == NULL) {
@@ -191,65 +1190,162 @@ syscfgInitWithBdev(const char *bdevName)
 		return(false);
 	}
 
-	/* Make sure it's big enough */
+	/* look for the header where we expect it */
+	offset = kSysCfgBdevOffset;
 	if (candidate->total_len <= kSysCfgBdevOffset + sizeof(hdr)) {
 		printf("syscfg: bdev size 0x%llx too small\n", candidate->total_len);
-		return (false);
+		hdr.shMagic = 0;
 	}
-
-	/* look for the header */
-	if (blockdev_read(candidate, &hdr, kSysCfgBdevOffset, sizeof(hdr)) < (int)sizeof(hdr)) {
+	else if (blockdev_read(candidate, &hdr, kSysCfgBdevOffset, sizeof(hdr)) < (int)sizeof(hdr)) {
 		printf("syscfg: bdev read fail\n");
 		return(false);
 	}
 
-	if (hdr.shMagic != kSysCfgHeaderMagic) {
-		printf("syscfg: bad magic\n");
-		return(false);
+	/* the region may have moved, go looking for it */
+	if (!syscfgHeaderNormalize(&hdr, &swapped)) {
+		if (syscfgScanBdev(candidate, &location, 1) < 1) {
+			printf("syscfg: bad magic\n");
+			return(false);
+		}
+		offset = (off_t)location.slOffset;
+		printf("syscfg: found header at 0x%llx\n", offset);
+
+		if (blockdev_read(candidate, &hdr, offset, sizeof(hdr)) < (int)sizeof(hdr)) {
+			printf("syscfg: bdev read fail\n");
+			return(false);
+		}
+	}
+	else if (swapped) {
+		printf("syscfg: big-endian image\n");
 	}
 
 	printf("syscfg: version 0x%08x with %d entries using %d of %d bytes\n",
 		hdr.shVersion, hdr.shKeyCount, hdr.shSize, hdr.shMaxSize);
 
 	/* If there is a syscfg there will also be diag info... protect them. */
-	blockdev_set_protection(candidate, 0x2000, 0x6000);
+	if (offset == kSysCfgBdevOffset)
+		blockdev_set_protection(candidate, 0x2000, 0x6000);
 
-	syscfgDataLength = candidate->total_len - kSysCfgBdevOffset;
-	if (hdr.shSize < syscfgDataLength)
-		syscfgDataLength = hdr.shMaxSize;
+	dataLength = candidate->total_len - offset;
+	if (hdr.shSize < dataLength)
+		dataLength = hdr.shMaxSize;
 
-	syscfgData = (uint8_t		*)malloc(syscfgDataLength);
+	/* only the header and entry table now, the extended data as it is used */
+	if (lazy) {
+		regionLength = dataLength;
+		dataLength = __min((size_t)hdr.shSize, regionLength);
+	}
 
-	result = blockdev_read(candidate, syscfgData, kSysCfgBdevOffset, syscfgDataLength);
+	data = (uint8_t		*)syscfgArenaAlloc(&ctx->arena, dataLength);
+	if (data == NULL) {
+		printf("syscfg: can't allocate 0x%zx bytes\n", dataLength);
+		return false;
+	}
 
-	if (result < 0 || (size_t)result < syscfgDataLength) {
+	result = blockdev_read(candidate, data, offset, dataLength);
+
+	if (result < 0 || (size_t)result < dataLength) {
 		printf("syscfg: bdev read fail (%d)\n", result);
-		syscfg_reinit();
+		syscfgArenaReset(&ctx->arena);
 		return false;
 	}
 
-	syscfgKeyCount = hdr.shKeyCount;
+	if (lazy) {
+		if (!syscfgCtxAttachLazy(ctx, data, dataLength, regionLength, hdr.shKeyCount, candidate, offset)) {
+			syscfgArenaReset(&ctx->arena);
+			return false;
+		}
+		return(true);
+	}
+
+	if (!syscfgCtxAttach(ctx, data, dataLength, hdr.shKeyCount, true)) {
+		syscfgArenaReset(&ctx->arena);
+		return false;
+	}
+	ctx->bdev = candidate;
+	ctx->bdevOffset = offset;
 
 	return(true);
 }
 
+bool
+syscfgInitWithBdev(const char *bdevName)
+{
+	bool result;
+
+	if (syscfgDefault.data != NULL)
+		return(false);
+
+	TRACE_BEGIN(TRACE_SYSCFG_LOAD_BDEV, false, 0);
+	result = syscfgCtxLoadBdev(&syscfgDefault, bdevName, false);
+	TRACE_END(TRACE_SYSCFG_LOAD_BDEV, result);
+	return result;
+}
+
+static struct syscfg_ctx *
+syscfgCtxOpenBdev(const char *bdevName, bool lazy)
+{
+	struct syscfg_ctx *ctx;
+
+	ctx = (struct syscfg_ctx *)calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+
+	TRACE_BEGIN(TRACE_SYSCFG_LOAD_BDEV, lazy, 0);
+	if (!syscfgCtxLoadBdev(ctx, bdevName, lazy)) {
+		TRACE_END(TRACE_SYSCFG_LOAD_BDEV, false);
+		syscfgArenaDestroy(&ctx->arena);
+		free(ctx);
+		return NULL;
+	}
+	TRACE_END(TRACE_SYSCFG_LOAD_BDEV, true);
+
+	return ctx;
+}
+
+struct syscfg_ctx *
+syscfg_ctx_open_bdev(const char *bdevName)
+{
+	return syscfgCtxOpenBdev(bdevName, false);
+}
+
+struct syscfg_ctx *
+syscfg_ctx_open_bdev_lazy(const char *bdevName)
+{
+	return syscfgCtxOpenBdev(bdevName, true);
+}
+
 void *
-syscfgGetData(struct syscfgMemEntry *entry)
+syscfg_ctx_get_data(struct syscfg_ctx *ctx, struct syscfgMemEntry *entry)
 {
 	/* Handle data stored externally from the entry */
 	if (entry->seDataOffset != 0) {
-		if (entry->seDataOffset > syscfgDataLength)
-			return NULL;
-		if (entry->seDataOffset + entry->seDataSize > syscfgDataLength)
-			return NULL;
+		if (!ctx->validated) {
+			if (entry->seDataOffset > ctx->regionLength)
+				return NULL;
+			if ((u_int64_t)entry->seDataOffset + entry->seDataSize > ctx->regionLength)
+				return NULL;
+		}
 
-		return syscfgData + entry->seDataOffset;
+		if (ctx->lazy)
+			return syscfgLazyFetch(ctx, entry->seDataOffset, entry->seDataSize);
+
+		return ctx->data + entry->seDataOffset;
 	}
 	else {
+		/* a CNTB entry pointing at offset zero claims more than the inline bytes */
+		if (entry->seDataSize > sizeof(entry->seData))
+			return NULL;
 		return entry->seData;
 	}
 }
 
+void *
+syscfgGetData(struct syscfgMemEntry *entry)
+{
+	return syscfg_ctx_get_data(&syscfgDefault, entry);
+}
+
 uint32_t
 syscfgGetSize(struct syscfgMemEntry *entry)
 {
@@ -257,19 +1353,19 @@ syscfgGetSize(struct syscfgMemEntry *entry)
 }
 
 int
-syscfgCopyDataForTag(u_int32_t tag, u_int8_t *buffer, size_t size)
+syscfg_ctx_copy_data_for_tag(struct syscfg_ctx *ctx, u_int32_t tag, u_int8_t *buffer, size_t size)
 {
 	bool			result;
 	struct syscfgMemEntry	entry;
 	void			*data;
 
-	result = syscfgFindByTag(tag, &entry);
+	result = syscfg_ctx_find_by_tag(ctx, tag, &entry);
 	if (!result)
 		return(-1);
 	if (size > entry.seDataSize)
 		size = entry.seDataSize;
 
-	data = syscfgGetData(&entry);
+	data = syscfg_ctx_get_data(ctx, &entry);
 	if (data == NULL)
 		return(-1);
 
@@ -279,39 +1375,49 @@ syscfgCopyDataForTag(u_int32_t tag, u_int8_t *buffer, size_t size)
 	return size;
 }
 
+int
+syscfgCopyDataForTag(u_int32_t tag, u_int8_t *buffer, size_t size)
+{
+	return syscfg_ctx_copy_data_for_tag(&syscfgDefault, tag, buffer, size);
+}
+
+static bool syscfgCtxFindByIndex(struct syscfg_ctx *ctx, u_int32_t index, struct syscfgMemEntry *result);
+
 bool
-syscfgFindByTag(u_int32_t tag, struct syscfgMemEntry *entry)
+syscfg_ctx_find_by_tag(struct syscfg_ctx *ctx, u_int32_t tag, struct syscfgMemEntry *entry)
 {
-	static struct syscfgMemEntry	temp;
-	bool				result;
-	u_int32_t			index;
+	u_int32_t index;
+	bool found;
 
-	for (index = 0; index < syscfgKeyCount; index++) {
-		result = syscfgFindByIndex(index, &temp);
-		if (result && (temp.seTag == tag)) {
-			memcpy(entry, &temp, sizeof(*entry));
-			return true;
-		}
-	}
-	return false;
+	TRACE_BEGIN(TRACE_SYSCFG_FIND_BY_TAG, tag, 0);
+	found = syscfgLookupTag(ctx, tag, &index) && syscfgCtxFindByIndex(ctx, index, entry);
+	TRACE_END(TRACE_SYSCFG_FIND_BY_TAG, found);
+	return found;
 }
 
 bool
-syscfgFindByIndex(u_int32_t index, struct syscfgMemEntry *result)
+syscfgFindByTag(u_int32_t tag, struct syscfgMemEntry *entry)
+{
+	return syscfg_ctx_find_by_tag(&syscfgDefault, tag, entry);
+}
+
+static bool
+syscfgCtxFindByIndex(struct syscfg_ctx *ctx, u_int32_t index, struct syscfgMemEntry *result)
 {
 	struct syscfgEntry	entry;
 	struct syscfgEntryCNTB	*entryCNTB;
 
-	if (index >= syscfgKeyCount)
+	if (index >= ctx->keyCount)
 		return false;
 
+	/* a validated table is known to hold keyCount entries */
 	size_t offset = sizeof(struct syscfgHeader) + index * sizeof(struct syscfgEntry);
-	if (offset >= syscfgDataLength || offset + sizeof(struct syscfgEntry) >= syscfgDataLength)
+	if (!ctx->validated && (offset >= ctx->dataLength || offset + sizeof(struct syscfgEntry) > ctx->dataLength))
 		return false;
 
-	memcpy(&entry, syscfgData + offset, sizeof(entry));
+	memcpy(&entry, ctx->data + offset, sizeof(entry));
 
-	if (entry.seTag == 'CNTB') {
+	if (entry.seTag == kSyscfgTagCNTB) {
 		entryCNTB = (struct syscfgEntryCNTB *)&entry;
 		result->seTag = entryCNTB->seRealTag;
 		memset(result->seData, 0, sizeof(result->seData));
@@ -327,22 +1433,145 @@ syscfgFindByIndex(u_int32_t index, struct syscfgMemEntry *result)
 	return true;
 }
 
+bool
+syscfg_ctx_find_by_index(struct syscfg_ctx *ctx, u_int32_t index, struct syscfgMemEntry *result)
+{
+	bool found;
+
+	TRACE_BEGIN(TRACE_SYSCFG_FIND_BY_INDEX, index, 0);
+	found = syscfgCtxFindByIndex(ctx, index, result);
+	TRACE_END(TRACE_SYSCFG_FIND_BY_INDEX, found);
+	return found;
+}
+
+bool
+syscfgFindByIndex(u_int32_t index, struct syscfgMemEntry *result)
+{
+	return syscfg_ctx_find_by_index(&syscfgDefault, index, result);
+}
+
+bool
+syscfg_ctx_find_tag(struct syscfg_ctx *ctx, uint32_t tag, void **data_out, uint32_t *size_out)
+{
+	struct syscfgMemEntry	result;
+	u_int32_t		index;
+
+	if (!syscfgLookupTag(ctx, tag, &index) || !syscfg_ctx_find_by_index(ctx, index, &result))
+		return false;
+
+	if (data_out) {
+		/* point inline data at the entry table itself, not at our temporary */
+		if (result.seDataOffset == 0 && result.seDataSize <= sizeof(result.seData))
+			*data_out = ctx->data + sizeof(struct syscfgHeader) +
+				index * sizeof(struct syscfgEntry) + offsetof(struct syscfgEntry, seData);
+		else
+			*data_out = syscfg_ctx_get_data(ctx, &result);
+	}
+	if (size_out) {
+		*size_out = syscfgGetSize(&result);
+	}
+
+	return true;
+}
+
 bool
 syscfg_find_tag(uint32_t tag, void **data_out, uint32_t *size_out)
 {
-	static struct syscfgMemEntry result;
+	return syscfg_ctx_find_tag(&syscfgDefault, tag, data_out, size_out);
+}
 
-	if (syscfgFindByTag(tag, &result)) {
-		if (data_out) {
-			*data_out = syscfgGetData(&result);
-		}
-		if (size_out) {
-			*size_out = syscfgGetSize(&result);
-		}
+int
+syscfg_ctx_iterate(struct syscfg_ctx *ctx, syscfg_iterate_fn fn, void *refcon)
+{
+	struct syscfgMemEntry	entry;
+	u_int32_t		index;
+	void			*data;
 
-		return true;
+	for (index = 0; syscfg_ctx_find_by_index(ctx, index, &entry); index++) {
+		data = syscfg_ctx_get_data(ctx, &entry);
+		if (data == NULL)
+			continue;
+		if (!fn(refcon, &entry, data))
+			return index + 1;
 	}
-	else {
+
+	return index;
+}
+
+bool
+syscfg_ctx_iter_begin(struct syscfg_ctx *ctx, struct syscfgIterator *it)
+{
+	if (!ctx->validated)
+		return false;
+
+	it->next = ctx->data + sizeof(struct syscfgHeader);
+	it->end = it->next + (size_t)ctx->keyCount * sizeof(struct syscfgEntry);
+	it->base = ctx->data;
+	it->ctx = ctx;
+	return true;
+}
+
+static bool
+syscfgIterNext(struct syscfgIterator *it, struct syscfgEntryView *view)
+{
+	struct syscfgEntryCNTB	entry;
+
+	if (it->next >= it->end)
 		return false;
+
+	/* the table was bounds checked when the image was loaded */
+	memcpy(&entry, it->next, sizeof(entry));
+	if (entry.seTag == kSyscfgTagCNTB) {
+		view->tag = entry.seRealTag;
+		view->size = entry.seDataSize;
+		if (it->ctx->lazy)
+			view->data = syscfgLazyFetch(it->ctx, entry.seDataOffset, entry.seDataSize);
+		else
+			view->data = it->base + entry.seDataOffset;
+		view->isExt = true;
+	}
+	else {
+		view->tag = entry.seTag;
+		view->size = sizeof(((struct syscfgEntry *)0)->seData);
+		view->data = it->next + offsetof(struct syscfgEntry, seData);
+		view->isExt = false;
 	}
-}
\ No newline at end of file
+
+	it->next += sizeof(struct syscfgEntry);
+	return true;
+}
+
+bool
+syscfg_ctx_iter_next(struct syscfgIterator *it, struct syscfgEntryView *view)
+{
+	bool found;
+
+	TRACE_BEGIN(TRACE_SYSCFG_ITER_NEXT, (it->next - it->base - sizeof(struct syscfgHeader)) / sizeof(struct syscfgEntry), 0);
+	found = syscfgIterNext(it, view);
+	TRACE_END(TRACE_SYSCFG_ITER_NEXT, found);
+	return found;
+}
+
+int
+syscfgSetDataForTag(u_int32_t tag, const void *data, size_t size)
+{
+	return syscfg_ctx_set_data_for_tag(&syscfgDefault, tag, data, size);
+}
+
+int
+syscfgAddTag(u_int32_t tag, const void *data, size_t size)
+{
+	return syscfg_ctx_add_tag(&syscfgDefault, tag, data, size);
+}
+
+int
+syscfgRemoveTag(u_int32_t tag)
+{
+	return syscfg_ctx_remove_tag(&syscfgDefault, tag);
+}
+
+int
+syscfgCommit(void)
+{
+	return syscfg_ctx_commit(&syscfgDefault);
+}
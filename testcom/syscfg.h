@@ -58,6 +58,18 @@ struct syscfgMemEntry {
 	u_int32_t	seDataOffset;
 };
 
+/* a plausible SysCfg location, as found by syscfgScanBdev */
+struct syscfgLocation {
+	u_int64_t	slOffset;	/* of the header within the bdev */
+	u_int32_t	slVersion;
+	u_int32_t	slSize;
+	u_int32_t	slMaxSize;
+	u_int32_t	slKeyCount;
+	u_int32_t	slCNTBCount;	/* 'CNTB' entries seen in the entry table */
+};
+
+struct blockdev;
+
 typedef struct OIBSyscfgEntry
 {
 	int type;
@@ -68,6 +80,9 @@ typedef struct OIBSyscfgEntry
 
 void syscfg_init(uint8_t *sys, size_t len);
 
+/* forget the image loaded by syscfg_init or syscfgInitWithBdev */
+void syscfg_reinit(void);
+
 int
 do_syscfg(int argc, struct cmd_arg *args);
 /*
@@ -77,6 +92,17 @@ do_syscfg(int argc, struct cmd_arg *args);
  */
 bool	syscfgInitWithBdev(const char *bdevName);
 
+/*
+ * Scan a whole bdev for SysCfg headers.
+ *
+ * Every 'SCfg' magic is checked against the header sanity rules, and every
+ * 'CNTB' entry found in a candidate's entry table must point inside its region.
+ * Fills at most maxLocations entries in device order.
+ *
+ * Returns the number of plausible locations found, or -1 on a read error.
+ */
+int	syscfgScanBdev(struct blockdev *bdev, struct syscfgLocation *locations, int maxLocations);
+
 /*
  * Copy the data for an entry by tag
  *
@@ -124,6 +150,96 @@ uint32_t	syscfgGetSize(struct syscfgMemEntry *entry);
 /* Returns true if the tag is found and populates the given pointers if they are non-NULL */
 bool		syscfg_find_tag(uint32_t tag, void **data_out, uint32_t *size_out);
 
+/*
+ * Reentrant interface.
+ *
+ * Each context holds one loaded image. Contexts are independent of each other
+ * and of the default context used by the functions above, and lookups never
+ * modify a context, so any number of threads may share one.
+ */
+struct syscfg_ctx;
+
+/* The buffer is borrowed, not copied, and must outlive the context. */
+struct syscfg_ctx	*syscfg_ctx_open_buffer(const uint8_t *data, size_t len);
+struct syscfg_ctx	*syscfg_ctx_open_bdev(const char *bdevName);
+/*
+ * Read only the header and entry table up front. Each CNTB payload is read
+ * from the bdev on first access and cached; the bdev must outlive the context.
+ */
+struct syscfg_ctx	*syscfg_ctx_open_bdev_lazy(const char *bdevName);
+struct syscfg_ctx	*syscfg_ctx_open_file(const char *path);
+void			syscfg_ctx_close(struct syscfg_ctx *ctx);
+
+u_int32_t	syscfg_ctx_key_count(struct syscfg_ctx *ctx);
+bool		syscfg_ctx_find_by_tag(struct syscfg_ctx *ctx, u_int32_t tag, struct syscfgMemEntry *entry);
+bool		syscfg_ctx_find_by_index(struct syscfg_ctx *ctx, u_int32_t index, struct syscfgMemEntry *result);
+void *		syscfg_ctx_get_data(struct syscfg_ctx *ctx, struct syscfgMemEntry *entry);
+int		syscfg_ctx_copy_data_for_tag(struct syscfg_ctx *ctx, u_int32_t tag, u_int8_t *buffer, size_t size);
+
+/* Unlike syscfg_find_tag, inline data is returned from the image itself and stays valid until close. */
+bool		syscfg_ctx_find_tag(struct syscfg_ctx *ctx, uint32_t tag, void **data_out, uint32_t *size_out);
+
+/*
+ * Call fn for every entry in table order until it returns false.
+ * Returns the number of entries visited.
+ */
+typedef bool (*syscfg_iterate_fn)(void *refcon, const struct syscfgMemEntry *entry, const void *data);
+int		syscfg_ctx_iterate(struct syscfg_ctx *ctx, syscfg_iterate_fn fn, void *refcon);
+
+int		syscfg_ctx_dump(struct syscfg_ctx *ctx, int argc, struct cmd_arg *args);
+
+/*
+ * Writing.
+ *
+ * Edits change the in-memory image and record exactly which bytes changed;
+ * commit then writes only the blocks holding those bytes, in an order that
+ * leaves a loadable image if it is cut short. The writes land inside the
+ * range protected at init, which stays in force for every other writer.
+ * Only a context loaded whole (not lazily) from a bdev can be written, and
+ * nothing else may use it during an edit.
+ *
+ * Data of up to 16 bytes is stored inline unless the tag already has extended
+ * data; anything larger goes to free space in the extended area.
+ * Removing a tag moves the last entry into its slot.
+ * Each returns 0 on success or -1; commit returns the number of blocks written.
+ */
+int		syscfg_ctx_set_data_for_tag(struct syscfg_ctx *ctx, u_int32_t tag, const void *data, size_t size);
+int		syscfg_ctx_add_tag(struct syscfg_ctx *ctx, u_int32_t tag, const void *data, size_t size);
+int		syscfg_ctx_remove_tag(struct syscfg_ctx *ctx, u_int32_t tag);
+int		syscfg_ctx_commit(struct syscfg_ctx *ctx);
+
+int		syscfgSetDataForTag(u_int32_t tag, const void *data, size_t size);
+int		syscfgAddTag(u_int32_t tag, const void *data, size_t size);
+int		syscfgRemoveTag(u_int32_t tag);
+int		syscfgCommit(void);
+
+/*
+ * Zero-copy iteration.
+ *
+ * Views point straight into the image (the entry table for inline data, the
+ * extended area for CNTB entries) and stay valid until the context is closed.
+ * All bounds are checked when the image is loaded, so iter_begin fails on an
+ * image with any out-of-range entry and iter_next does no checking at all.
+ * On a lazy context extended data is fetched as the walk reaches it, and a
+ * view's data is NULL if that read fails.
+ */
+struct syscfgEntryView {
+	u_int32_t	tag;
+	u_int32_t	size;
+	const uint8_t	*data;
+	bool		isExt;
+};
+
+struct syscfgIterator {
+	const uint8_t		*next;
+	const uint8_t		*end;
+	const uint8_t		*base;
+	struct syscfg_ctx	*ctx;
+};
+
+bool		syscfg_ctx_iter_begin(struct syscfg_ctx *ctx, struct syscfgIterator *it);
+bool		syscfg_ctx_iter_next(struct syscfgIterator *it, struct syscfgEntryView *view);
+
 __END_DECLS
 
 #endif
\ No newline at end of file
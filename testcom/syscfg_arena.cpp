@@ -0,0 +1,184 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "syscfg.h"
+#include "syscfg_private.h"
+
+/*
+ * Arena allocator for a syscfg context.
+ *
+ * Everything a loaded image needs (the image itself, the tag index, the
+ * lazy payload cache, validation scratch) is carved out of a few large
+ * chunks by bumping a pointer, and released all at once. A reset keeps the
+ * memory: several chunks are merged into one big enough for what was in
+ * use, so loading the next image of a similar size costs no allocator
+ * calls at all and leaves nothing behind to fragment the heap.
+ */
+
+#define ARENA_CHUNK_SIZE	(64 * 1024)
+#define ARENA_ALIGN		16
+#define ARENA_RETAIN_MAX	(16 * 1024 * 1024)	/* give anything bigger back on reset */
+
+struct syscfgArenaChunk {
+	struct syscfgArenaChunk	*next;		/* older chunks */
+	size_t			size;		/* usable bytes after the header */
+	size_t			used;
+};
+
+/* data starts past the header, rounded up so it is as aligned as malloc made the chunk */
+#define ARENA_HEADER_SIZE	((sizeof(struct syscfgArenaChunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_CHUNK_DATA(chunk)	((uint8_t *)(chunk) + ARENA_HEADER_SIZE)
+
+/* link a new chunk in after prev, or at the head if prev is NULL */
+static struct syscfgArenaChunk *
+syscfgArenaNewChunk(struct syscfg_arena *arena, struct syscfgArenaChunk *prev, size_t size)
+{
+	struct syscfgArenaChunk *chunk;
+
+	chunk = (struct syscfgArenaChunk *)malloc(ARENA_HEADER_SIZE + size);
+	if (chunk == NULL)
+		return NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	if (prev != NULL) {
+		chunk->next = prev->next;
+		prev->next = chunk;
+	} else {
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	arena->reserved += size;
+	arena->chunkAllocs++;
+	return chunk;
+}
+
+void *
+syscfgArenaAlloc(struct syscfg_arena *arena, size_t size)
+{
+	struct syscfgArenaChunk	*chunk = arena->chunks;
+	size_t			offset;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size == 0)
+		size = ARENA_ALIGN;
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		/*
+		 * A big request gets a chunk to itself, sized to fit. It goes in
+		 * behind the head, which still has room for the small ones.
+		 */
+		if (size > ARENA_CHUNK_SIZE / 2)
+			chunk = syscfgArenaNewChunk(arena, chunk, size);
+		else
+			chunk = syscfgArenaNewChunk(arena, NULL, ARENA_CHUNK_SIZE);
+		if (chunk == NULL)
+			return NULL;
+	}
+
+	offset = chunk->used;
+	chunk->used += size;
+	arena->used += size;
+	if (arena->used > arena->peak)
+		arena->peak = arena->used;
+	return ARENA_CHUNK_DATA(chunk) + offset;
+}
+
+void *
+syscfgArenaCalloc(struct syscfg_arena *arena, size_t count, size_t size)
+{
+	void *p;
+
+	if (size != 0 && count > (size_t)-1 / size)
+		return NULL;
+	p = syscfgArenaAlloc(arena, count * size);
+	if (p != NULL)
+		memset(p, 0, count * size);
+	return p;
+}
+
+void
+syscfgArenaMark(struct syscfg_arena *arena, struct syscfg_arena_mark *mark)
+{
+	mark->chunk = arena->chunks;
+	mark->behind = arena->chunks != NULL ? arena->chunks->next : NULL;
+	mark->used = arena->chunks != NULL ? arena->chunks->used : 0;
+	mark->arenaUsed = arena->used;
+}
+
+/*
+ * Give back everything allocated since the mark; chunks added since then are
+ * freed. They are all ahead of the marked chunk, or between it and the chunk
+ * that followed it.
+ */
+void
+syscfgArenaRelease(struct syscfg_arena *arena, const struct syscfg_arena_mark *mark)
+{
+	struct syscfgArenaChunk *chunk;
+
+	while (arena->chunks != mark->chunk) {
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		arena->reserved -= chunk->size;
+		free(chunk);
+	}
+	if (arena->chunks != NULL) {
+		while (arena->chunks->next != mark->behind) {
+			chunk = arena->chunks->next;
+			arena->chunks->next = chunk->next;
+			arena->reserved -= chunk->size;
+			free(chunk);
+		}
+		arena->chunks->used = mark->used;
+	}
+	arena->used = mark->arenaUsed;
+}
+
+void
+syscfgArenaReset(struct syscfg_arena *arena)
+{
+	struct syscfgArenaChunk	*chunk, *next;
+	size_t			size;
+
+	if (arena->chunks == NULL)
+		return;
+
+	/* one chunk already: just rewind it */
+	if (arena->chunks->next == NULL && arena->chunks->size <= ARENA_RETAIN_MAX) {
+		arena->chunks->used = 0;
+		arena->used = 0;
+		arena->peak = 0;
+		return;
+	}
+
+	/* merge into one chunk sized for the high water mark, so next time fits without growing */
+	size = arena->peak;
+	for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->chunks = NULL;
+	arena->reserved = 0;
+	arena->used = 0;
+	arena->peak = 0;
+
+	if (size > ARENA_RETAIN_MAX)
+		return;
+	size = (size + ARENA_CHUNK_SIZE - 1) & ~(size_t)(ARENA_CHUNK_SIZE - 1);
+	syscfgArenaNewChunk(arena, NULL, size != 0 ? size : ARENA_CHUNK_SIZE);
+}
+
+void
+syscfgArenaDestroy(struct syscfg_arena *arena)
+{
+	struct syscfgArenaChunk *chunk, *next;
+
+	for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->chunks = NULL;
+	arena->reserved = 0;
+	arena->used = 0;
+	arena->peak = 0;
+}
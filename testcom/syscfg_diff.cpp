@@ -0,0 +1,394 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include "syscfg.h"
+#include "syscfg_diff.h"
+#include "syscfg_output.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define DIFF_SSE2	1
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+struct diff_entry {
+	u_int32_t	tag;
+	u_int32_t	size;
+	u_int32_t	index;		/* keeps repeated tags in table order */
+	const uint8_t	*data;
+};
+
+struct diff_state {
+	struct syscfgDiffRange	*ranges;
+	u_int32_t		rangeCount;
+	u_int32_t		rangeCapacity;
+};
+
+static bool
+diff_entry_before(const struct diff_entry &a, const struct diff_entry &b)
+{
+	if (a.tag != b.tag)
+		return a.tag < b.tag;
+	return a.index < b.index;
+}
+
+/* gather an image's entries, sorted by tag */
+static struct diff_entry *
+diff_collect(struct syscfg_ctx *ctx, u_int32_t *count)
+{
+	struct syscfgIterator	it;
+	struct syscfgEntryView	view;
+	struct diff_entry	*entries;
+	u_int32_t		n = 0;
+
+	if (!syscfg_ctx_iter_begin(ctx, &it))
+		return NULL;
+
+	entries = (struct diff_entry *)malloc(((size_t)syscfg_ctx_key_count(ctx) + 1) * sizeof(*entries));
+	if (entries == NULL)
+		return NULL;
+
+	while (syscfg_ctx_iter_next(&it, &view)) {
+		if (view.data == NULL) {
+			free(entries);
+			return NULL;
+		}
+		entries[n].tag = view.tag;
+		entries[n].size = view.size;
+		entries[n].index = n;
+		entries[n].data = view.data;
+		n++;
+	}
+
+	std::sort(entries, entries + n, diff_entry_before);
+	*count = n;
+	return entries;
+}
+
+static inline u_int32_t
+diff_ctz(u_int32_t mask)
+{
+#ifdef _MSC_VER
+	unsigned long bit;
+
+	_BitScanForward(&bit, mask);
+	return bit;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+/* first position at or after pos where a and b differ (want == false) or agree (want == true) */
+static size_t
+diff_scan(const uint8_t *a, const uint8_t *b, size_t pos, size_t len, bool want)
+{
+#ifdef DIFF_SSE2
+	for (; pos + 16 <= len; pos += 16) {
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + pos)),
+							     _mm_loadu_si128((const __m128i *)(b + pos))));
+		if (!want)
+			mask ^= 0xffff;
+		if (mask != 0)
+			return pos + diff_ctz((u_int32_t)mask);
+	}
+#endif
+	for (; pos < len; pos++) {
+		if ((a[pos] == b[pos]) == want)
+			return pos;
+	}
+	return len;
+}
+
+static bool
+diff_add_range(struct diff_state *state, size_t offset, size_t length)
+{
+	struct syscfgDiffRange	*grown;
+	u_int32_t		capacity;
+
+	if (state->rangeCount == state->rangeCapacity) {
+		capacity = state->rangeCapacity ? state->rangeCapacity * 2 : 16;
+		grown = (struct syscfgDiffRange *)realloc(state->ranges, capacity * sizeof(*grown));
+		if (grown == NULL)
+			return false;
+		state->ranges = grown;
+		state->rangeCapacity = capacity;
+	}
+
+	state->ranges[state->rangeCount].offset = (u_int32_t)offset;
+	state->ranges[state->rangeCount].length = (u_int32_t)length;
+	state->rangeCount++;
+	return true;
+}
+
+/* fill state with the ranges where two payloads differ; returns false on allocation failure */
+static bool
+diff_ranges(struct diff_state *state, const struct diff_entry *a, const struct diff_entry *b)
+{
+	size_t	common, start, end;
+
+	state->rangeCount = 0;
+	common = __min(a->size, b->size);
+
+	for (start = diff_scan(a->data, b->data, 0, common, false); start < common;
+	     start = diff_scan(a->data, b->data, end, common, false)) {
+		end = diff_scan(a->data, b->data, start, common, true);
+		if (!diff_add_range(state, start, end - start))
+			return false;
+	}
+
+	if (a->size != b->size) {
+		/* the tail joins a difference that runs right up to it */
+		if (state->rangeCount > 0 &&
+		    state->ranges[state->rangeCount - 1].offset + state->ranges[state->rangeCount - 1].length == common) {
+			state->ranges[state->rangeCount - 1].length += __max(a->size, b->size) - (u_int32_t)common;
+			return true;
+		}
+		return diff_add_range(state, common, __max(a->size, b->size) - common);
+	}
+
+	return true;
+}
+
+int
+syscfg_ctx_diff(struct syscfg_ctx *oldCtx, struct syscfg_ctx *newCtx, syscfg_diff_fn fn, void *refcon)
+{
+	struct diff_entry	*oldEntries, *newEntries;
+	struct diff_state	state;
+	struct syscfgDiffItem	item;
+	u_int32_t		oldCount, newCount, i, j;
+	int			differences = 0;
+	bool			report;
+
+	oldEntries = diff_collect(oldCtx, &oldCount);
+	if (oldEntries == NULL)
+		return -1;
+	newEntries = diff_collect(newCtx, &newCount);
+	if (newEntries == NULL) {
+		free(oldEntries);
+		return -1;
+	}
+
+	memset(&state, 0, sizeof(state));
+
+	/* both sides are sorted by tag, so one merge pass pairs them up */
+	i = j = 0;
+	while (i < oldCount || j < newCount) {
+		memset(&item, 0, sizeof(item));
+		report = true;
+
+		if (j == newCount || (i < oldCount && oldEntries[i].tag < newEntries[j].tag)) {
+			item.tag = oldEntries[i].tag;
+			item.kind = kSyscfgDiffRemoved;
+			item.oldData = oldEntries[i].data;
+			item.oldSize = oldEntries[i].size;
+			i++;
+		}
+		else if (i == oldCount || newEntries[j].tag < oldEntries[i].tag) {
+			item.tag = newEntries[j].tag;
+			item.kind = kSyscfgDiffAdded;
+			item.newData = newEntries[j].data;
+			item.newSize = newEntries[j].size;
+			j++;
+		}
+		else {
+			if (oldEntries[i].size == newEntries[j].size &&
+			    diff_scan(oldEntries[i].data, newEntries[j].data, 0, oldEntries[i].size, false) == oldEntries[i].size) {
+				report = false;
+			}
+			else {
+				if (!diff_ranges(&state, &oldEntries[i], &newEntries[j])) {
+					differences = -1;
+					break;
+				}
+				item.tag = oldEntries[i].tag;
+				item.kind = kSyscfgDiffChanged;
+				item.oldData = oldEntries[i].data;
+				item.oldSize = oldEntries[i].size;
+				item.newData = newEntries[j].data;
+				item.newSize = newEntries[j].size;
+				item.ranges = state.ranges;
+				item.rangeCount = state.rangeCount;
+			}
+			i++;
+			j++;
+		}
+
+		if (report) {
+			differences++;
+			if (fn != NULL && !fn(refcon, &item))
+				break;
+		}
+	}
+
+	free(state.ranges);
+	free(oldEntries);
+	free(newEntries);
+	return differences;
+}
+
+struct diff_print_state {
+	struct syscfgOutput	out;
+	u_int32_t		counts[3];
+};
+
+static void
+diff_print_tag(struct syscfgOutput *out, u_int32_t tag)
+{
+	char	chars[4];
+
+	syscfgTagChars(tag, chars);
+
+	if (out->format == kSyscfgOutputJSON) {
+		syscfgOutputJSONString(out, chars, sizeof(chars));
+	}
+	else {
+		syscfgOutputChar(out, '\'');
+		syscfgOutputBytes(out, chars, sizeof(chars));
+		syscfgOutputChar(out, '\'');
+	}
+}
+
+static bool
+diff_print_text(void *refcon, const struct syscfgDiffItem *item)
+{
+	struct diff_print_state	*state = (struct diff_print_state *)refcon;
+	struct syscfgOutput	*out = &state->out;
+	u_int32_t		i;
+
+	state->counts[item->kind]++;
+
+	switch (item->kind) {
+	case kSyscfgDiffAdded:
+		syscfgOutputString(out, "+ ");
+		diff_print_tag(out, item->tag);
+		syscfgOutputChar(out, ' ');
+		syscfgOutputDecimal(out, item->newSize, 4);
+		syscfgOutputString(out, "B  ");
+		syscfgOutputHexBytes(out, item->newData, __min(item->newSize, 16u));
+		syscfgOutputString(out, item->newSize > 16 ? "...\n" : "\n");
+		break;
+	case kSyscfgDiffRemoved:
+		syscfgOutputString(out, "- ");
+		diff_print_tag(out, item->tag);
+		syscfgOutputChar(out, ' ');
+		syscfgOutputDecimal(out, item->oldSize, 4);
+		syscfgOutputString(out, "B\n");
+		break;
+	case kSyscfgDiffChanged:
+		syscfgOutputString(out, "~ ");
+		diff_print_tag(out, item->tag);
+		syscfgOutputChar(out, ' ');
+		syscfgOutputDecimal(out, item->oldSize, 4);
+		if (item->oldSize != item->newSize) {
+			syscfgOutputString(out, "B -> ");
+			syscfgOutputDecimal(out, item->newSize, 0);
+		}
+		syscfgOutputString(out, "B  bytes ");
+		for (i = 0; i < item->rangeCount; i++) {
+			if (i > 0)
+				syscfgOutputString(out, ", ");
+			syscfgOutputDecimal(out, item->ranges[i].offset, 0);
+			if (item->ranges[i].length > 1) {
+				syscfgOutputChar(out, '-');
+				syscfgOutputDecimal(out, (u_int64_t)item->ranges[i].offset + item->ranges[i].length - 1, 0);
+			}
+		}
+		syscfgOutputChar(out, '\n');
+		break;
+	}
+	return true;
+}
+
+static bool
+diff_print_json(void *refcon, const struct syscfgDiffItem *item)
+{
+	static const char	*kinds[] = { "added", "removed", "changed" };
+	struct diff_print_state	*state = (struct diff_print_state *)refcon;
+	struct syscfgOutput	*out = &state->out;
+	bool			first = (state->counts[0] + state->counts[1] + state->counts[2]) == 0;
+	u_int32_t		i;
+
+	state->counts[item->kind]++;
+
+	syscfgOutputString(out, first ? "\n    {\"tag\":" : ",\n    {\"tag\":");
+	diff_print_tag(out, item->tag);
+	syscfgOutputString(out, ",\"change\":\"");
+	syscfgOutputString(out, kinds[item->kind]);
+	syscfgOutputChar(out, '"');
+
+	if (item->oldData != NULL) {
+		syscfgOutputString(out, ",\"oldSize\":");
+		syscfgOutputDecimal(out, item->oldSize, 0);
+		syscfgOutputString(out, ",\"old\":\"");
+		syscfgOutputHexBytes(out, item->oldData, item->oldSize);
+		syscfgOutputChar(out, '"');
+	}
+	if (item->newData != NULL) {
+		syscfgOutputString(out, ",\"newSize\":");
+		syscfgOutputDecimal(out, item->newSize, 0);
+		syscfgOutputString(out, ",\"new\":\"");
+		syscfgOutputHexBytes(out, item->newData, item->newSize);
+		syscfgOutputChar(out, '"');
+	}
+	if (item->kind == kSyscfgDiffChanged) {
+		syscfgOutputString(out, ",\"ranges\":[");
+		for (i = 0; i < item->rangeCount; i++) {
+			syscfgOutputString(out, i > 0 ? ",[" : "[");
+			syscfgOutputDecimal(out, item->ranges[i].offset, 0);
+			syscfgOutputChar(out, ',');
+			syscfgOutputDecimal(out, item->ranges[i].length, 0);
+			syscfgOutputChar(out, ']');
+		}
+		syscfgOutputChar(out, ']');
+	}
+	syscfgOutputChar(out, '}');
+	return true;
+}
+
+int
+syscfg_ctx_diff_print(struct syscfg_ctx *oldCtx, struct syscfg_ctx *newCtx, int format, FILE *fp)
+{
+	struct diff_print_state	state;
+	int			result;
+
+	memset(&state, 0, sizeof(state));
+	syscfgOutputInit(&state.out, fp, format);
+
+	if (format == kSyscfgOutputJSON) {
+		syscfgOutputString(&state.out, "{\n  \"changes\":[");
+		result = syscfg_ctx_diff(oldCtx, newCtx, diff_print_json, &state);
+		syscfgOutputString(&state.out, result > 0 ? "\n  ],\n" : "],\n");
+		if (result < 0)
+			syscfgOutputString(&state.out, "  \"error\":\"image failed validation\",\n");
+		syscfgOutputString(&state.out, "  \"added\":");
+		syscfgOutputDecimal(&state.out, state.counts[kSyscfgDiffAdded], 0);
+		syscfgOutputString(&state.out, ",\n  \"removed\":");
+		syscfgOutputDecimal(&state.out, state.counts[kSyscfgDiffRemoved], 0);
+		syscfgOutputString(&state.out, ",\n  \"changed\":");
+		syscfgOutputDecimal(&state.out, state.counts[kSyscfgDiffChanged], 0);
+		syscfgOutputString(&state.out, "\n}\n");
+	}
+	else {
+		result = syscfg_ctx_diff(oldCtx, newCtx, diff_print_text, &state);
+		if (result < 0) {
+			syscfgOutputString(&state.out, "syscfg: can't diff, image failed validation\n");
+		}
+		else {
+			syscfgOutputDecimal(&state.out, state.counts[kSyscfgDiffAdded], 0);
+			syscfgOutputString(&state.out, " added, ");
+			syscfgOutputDecimal(&state.out, state.counts[kSyscfgDiffRemoved], 0);
+			syscfgOutputString(&state.out, " removed, ");
+			syscfgOutputDecimal(&state.out, state.counts[kSyscfgDiffChanged], 0);
+			syscfgOutputString(&state.out, " changed\n");
+		}
+	}
+
+	if (syscfgOutputFinish(&state.out) != 0)
+		return -1;
+	return result;
+}
@@ -0,0 +1,56 @@
+/*
+ * Structural diff of two SysCfg images.
+ *
+ * Entries are matched by tag (repeated tags pair up in table order), so the
+ * diff is independent of where each image keeps its entries and data.
+ */
+
+#ifndef __SYSCFG_DIFF_H
+#define __SYSCFG_DIFF_H
+
+#include <stdio.h>
+#include "types.h"
+#include "syscfg.h"
+
+__BEGIN_DECLS
+
+enum syscfgDiffKind {
+	kSyscfgDiffAdded,	/* only in the new image */
+	kSyscfgDiffRemoved,	/* only in the old image */
+	kSyscfgDiffChanged,
+};
+
+/* bytes [offset, offset + length) differ; a size change shows as a range over the tail */
+struct syscfgDiffRange {
+	u_int32_t	offset;
+	u_int32_t	length;
+};
+
+struct syscfgDiffItem {
+	u_int32_t			tag;
+	int				kind;
+	const uint8_t			*oldData;	/* NULL when added */
+	u_int32_t			oldSize;
+	const uint8_t			*newData;	/* NULL when removed */
+	u_int32_t			newSize;
+	const struct syscfgDiffRange	*ranges;	/* changed entries only */
+	u_int32_t			rangeCount;
+};
+
+/* return false to stop the diff */
+typedef bool (*syscfg_diff_fn)(void *refcon, const struct syscfgDiffItem *item);
+
+/*
+ * Call fn for every tag that differs between oldCtx and newCtx, in tag order.
+ * Both images must have passed validation at load.
+ *
+ * Returns the number of differing tags, or -1 if either image can't be walked.
+ */
+int	syscfg_ctx_diff(struct syscfg_ctx *oldCtx, struct syscfg_ctx *newCtx, syscfg_diff_fn fn, void *refcon);
+
+/* print the diff as text or JSON (see syscfg_output.h); returns as syscfg_ctx_diff */
+int	syscfg_ctx_diff_print(struct syscfg_ctx *oldCtx, struct syscfg_ctx *newCtx, int format, FILE *fp);
+
+__END_DECLS
+
+#endif
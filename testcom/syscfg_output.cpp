@@ -0,0 +1,215 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "syscfg_output.h"
+
+/* write out whenever this much has been formatted */
+#define OUTPUT_FLUSH_SIZE	(64 * 1024)
+#define OUTPUT_INITIAL_SIZE	(OUTPUT_FLUSH_SIZE + 4096)
+
+static const char hexDigits[] = "0123456789abcdef";
+
+void
+syscfgOutputInit(struct syscfgOutput *out, FILE *fp, int format)
+{
+	out->buf = NULL;
+	out->len = 0;
+	out->cap = 0;
+	out->fp = fp;
+	out->format = format;
+	out->error = false;
+}
+
+void
+syscfgOutputFlush(struct syscfgOutput *out)
+{
+	if (out->len == 0)
+		return;
+
+	if (fwrite(out->buf, 1, out->len, out->fp) != out->len)
+		out->error = true;
+	out->len = 0;
+}
+
+int
+syscfgOutputFinish(struct syscfgOutput *out)
+{
+	syscfgOutputFlush(out);
+	if (fflush(out->fp) != 0)
+		out->error = true;
+
+	free(out->buf);
+	out->buf = NULL;
+	out->cap = 0;
+
+	return out->error ? -1 : 0;
+}
+
+/* make room for len more bytes, flushing or growing as needed */
+static char *
+syscfgOutputReserve(struct syscfgOutput *out, size_t len)
+{
+	size_t	cap;
+	char	*buf;
+
+	if (out->len + len > out->cap && out->len >= OUTPUT_FLUSH_SIZE)
+		syscfgOutputFlush(out);
+
+	if (out->len + len > out->cap) {
+		cap = out->cap ? out->cap : OUTPUT_INITIAL_SIZE;
+		while (cap < out->len + len)
+			cap *= 2;
+		buf = (char *)realloc(out->buf, cap);
+		if (buf == NULL) {
+			/* fall back to writing around the buffer */
+			syscfgOutputFlush(out);
+			if (len > out->cap)
+				return NULL;
+		}
+		else {
+			out->buf = buf;
+			out->cap = cap;
+		}
+	}
+
+	return out->buf + out->len;
+}
+
+static inline void
+syscfgOutputCommit(struct syscfgOutput *out, size_t len)
+{
+	out->len += len;
+	if (out->len >= OUTPUT_FLUSH_SIZE)
+		syscfgOutputFlush(out);
+}
+
+void
+syscfgOutputBytes(struct syscfgOutput *out, const void *ptr, size_t len)
+{
+	char *dst = syscfgOutputReserve(out, len);
+
+	if (dst == NULL) {
+		if (fwrite(ptr, 1, len, out->fp) != len)
+			out->error = true;
+		return;
+	}
+
+	memcpy(dst, ptr, len);
+	syscfgOutputCommit(out, len);
+}
+
+void
+syscfgOutputString(struct syscfgOutput *out, const char *str)
+{
+	syscfgOutputBytes(out, str, strlen(str));
+}
+
+void
+syscfgOutputChar(struct syscfgOutput *out, char c)
+{
+	syscfgOutputBytes(out, &c, 1);
+}
+
+void
+syscfgOutputSpaces(struct syscfgOutput *out, size_t count)
+{
+	char *dst = syscfgOutputReserve(out, count);
+
+	if (dst == NULL) {
+		while (count--)
+			syscfgOutputBytes(out, " ", 1);
+		return;
+	}
+
+	memset(dst, ' ', count);
+	syscfgOutputCommit(out, count);
+}
+
+void
+syscfgOutputHex32(struct syscfgOutput *out, u_int32_t value)
+{
+	char	tmp[10];
+	int	i;
+
+	tmp[0] = '0';
+	tmp[1] = 'x';
+	for (i = 9; i >= 2; i--) {
+		tmp[i] = hexDigits[value & 0xf];
+		value >>= 4;
+	}
+
+	syscfgOutputBytes(out, tmp, sizeof(tmp));
+}
+
+void
+syscfgOutputHexBytes(struct syscfgOutput *out, const uint8_t *data, size_t len)
+{
+	char	*dst;
+	size_t	i, chunk;
+
+	/* in pieces, so a huge payload can't force a huge buffer */
+	while (len > 0) {
+		chunk = __min(len, (size_t)OUTPUT_FLUSH_SIZE / 2);
+		dst = syscfgOutputReserve(out, chunk * 2);
+		if (dst == NULL) {
+			out->error = true;
+			return;
+		}
+		for (i = 0; i < chunk; i++) {
+			dst[i * 2] = hexDigits[data[i] >> 4];
+			dst[i * 2 + 1] = hexDigits[data[i] & 0xf];
+		}
+		syscfgOutputCommit(out, chunk * 2);
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+void
+syscfgOutputDecimal(struct syscfgOutput *out, u_int64_t value, int width)
+{
+	char	tmp[20];
+	int	n = 0;
+
+	do {
+		tmp[sizeof(tmp) - 1 - n++] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+
+	if (width > n)
+		syscfgOutputSpaces(out, width - n);
+	syscfgOutputBytes(out, tmp + sizeof(tmp) - n, n);
+}
+
+void
+syscfgOutputJSONString(struct syscfgOutput *out, const char *str, size_t len)
+{
+	size_t	i;
+	char	esc[6];
+
+	syscfgOutputChar(out, '"');
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)str[i];
+
+		if (c == '"' || c == '\\') {
+			esc[0] = '\\';
+			esc[1] = (char)c;
+			syscfgOutputBytes(out, esc, 2);
+		}
+		else if (c < 0x20 || c >= 0x7f) {
+			/* tags and paths only; anything odd is escaped byte-wise */
+			esc[0] = '\\';
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hexDigits[c >> 4];
+			esc[5] = hexDigits[c & 0xf];
+			syscfgOutputBytes(out, esc, 6);
+		}
+		else {
+			syscfgOutputChar(out, (char)c);
+		}
+	}
+	syscfgOutputChar(out, '"');
+}
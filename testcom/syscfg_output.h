@@ -0,0 +1,86 @@
+/*
+ * Buffered output for the syscfg dump.
+ *
+ * Everything is formatted by hand into one growable buffer that is written out
+ * in large chunks, instead of a stdio call per field.
+ */
+
+#ifndef __SYSCFG_OUTPUT_H
+#define __SYSCFG_OUTPUT_H
+
+#include <stdio.h>
+#include "types.h"
+#include "syscfg.h"
+#include "syscfg_tags.h"
+
+__BEGIN_DECLS
+
+enum syscfgOutputFormat {
+	kSyscfgOutputText,	/* the traditional human-readable layout */
+	kSyscfgOutputJSON,
+	kSyscfgOutputBinary,	/* see syscfgBinaryHeader below */
+};
+
+/*
+ * Binary dump layout, all fields little-endian:
+ *   syscfgBinaryHeader, then for every entry
+ *   syscfgBinaryRecord followed by rSize bytes of data,
+ *   then a terminating record with rTag == 0 and rFlags == kSyscfgBinaryEnd.
+ */
+struct syscfgBinaryHeader {
+	u_int32_t	bhMagic;
+#define kSyscfgBinaryMagic	fourcc("SCdp")
+	u_int32_t	bhVersion;
+	u_int32_t	bhSysCfgVersion;
+	u_int32_t	bhKeyCount;
+};
+
+struct syscfgBinaryRecord {
+	u_int32_t	rTag;
+	u_int32_t	rSize;
+	u_int32_t	rFlags;
+#define kSyscfgBinaryExt	(1 << 0)
+#define kSyscfgBinaryEnd	(1 << 31)
+};
+
+struct syscfgOutput {
+	char		*buf;
+	size_t		len;
+	size_t		cap;
+	FILE		*fp;
+	int		format;
+	bool		error;
+};
+
+void	syscfgOutputInit(struct syscfgOutput *out, FILE *fp, int format);
+void	syscfgOutputFlush(struct syscfgOutput *out);
+
+/* flush and release the buffer; returns -1 if anything failed to write */
+int	syscfgOutputFinish(struct syscfgOutput *out);
+
+void	syscfgOutputBytes(struct syscfgOutput *out, const void *ptr, size_t len);
+void	syscfgOutputString(struct syscfgOutput *out, const char *str);
+void	syscfgOutputChar(struct syscfgOutput *out, char c);
+void	syscfgOutputSpaces(struct syscfgOutput *out, size_t count);
+
+/* "0x%08x" */
+void	syscfgOutputHex32(struct syscfgOutput *out, u_int32_t value);
+
+/* lowercase hex of a byte string, no prefix */
+void	syscfgOutputHexBytes(struct syscfgOutput *out, const uint8_t *data, size_t len);
+
+/* "%*llu" */
+void	syscfgOutputDecimal(struct syscfgOutput *out, u_int64_t value, int width);
+
+/* a JSON string literal, escaping as needed */
+void	syscfgOutputJSONString(struct syscfgOutput *out, const char *str, size_t len);
+
+/*
+ * Dump a context like do_syscfg, in any of the formats above, to fp.
+ * Returns -1 if the output could not be written.
+ */
+int	syscfg_ctx_dump_format(struct syscfg_ctx *ctx, int argc, struct cmd_arg *args, int format, FILE *fp);
+
+__END_DECLS
+
+#endif
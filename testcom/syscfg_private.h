@@ -0,0 +1,126 @@
+/*
+ * SysCfg on-disk layout, shared by the syscfg modules.
+ */
+
+#ifndef __SYSCFG_PRIVATE_H
+#define __SYSCFG_PRIVATE_H
+
+#include <atomic>
+#include <mutex>
+#include "types.h"
+#include "syscfg_tags.h"
+
+#define SCFG_MAGIC 0x53436667
+#define CNTB_MAGIC 0x434e5442
+#define SCFG_LOCATION 0x4000
+
+struct syscfgHeader {
+	u_int32_t	shMagic;
+#define kSysCfgHeaderMagic	fourcc("SCfg")
+#define kSysCfgHeaderMagicSwapped	fourcc("gfCS")	/* written by a big-endian host */
+	u_int32_t	shSize;
+	u_int32_t	shMaxSize;
+	u_int32_t	shVersion;
+	u_int32_t	shBigEndian;
+	u_int32_t	shKeyCount;
+};
+
+#define SYSCFG_INLINE_WORDS	(sizeof(((struct syscfgEntry *)0)->seData) / sizeof(u_int32_t))
+
+/*
+ * Open-addressing index from tag to entry table slot, built once at load.
+ * Slots hold index + 1 so that zero marks an empty slot.
+ */
+struct syscfgTagSlot {
+	u_int32_t	tag;
+	u_int32_t	index;
+};
+
+/* a run of bytes within the image */
+struct syscfgExtent {
+	u_int32_t	offset;
+	u_int32_t	size;
+};
+
+/* extended data of a lazily loaded image, fetched on first use; data is set once, under lazyLock */
+struct syscfgLazyPayload {
+	u_int32_t		offset;
+	u_int32_t		size;
+	std::atomic<uint8_t *>	data;
+};
+
+/*
+ * Bump allocator behind everything a context derives from its image, see
+ * syscfg_arena.cpp. A zeroed arena is empty and ready to use.
+ */
+struct syscfg_arena {
+	struct syscfgArenaChunk	*chunks;	/* allocation is from the head; big requests sit just behind it */
+	size_t			used;
+	size_t			peak;		/* most used since the last reset */
+	size_t			reserved;
+	u_int64_t		chunkAllocs;	/* chunks ever allocated */
+};
+
+struct syscfg_arena_mark {
+	struct syscfgArenaChunk	*chunk;
+	struct syscfgArenaChunk	*behind;	/* what followed chunk then */
+	size_t			used;
+	size_t			arenaUsed;
+};
+
+void	*syscfgArenaAlloc(struct syscfg_arena *arena, size_t size);
+void	*syscfgArenaCalloc(struct syscfg_arena *arena, size_t count, size_t size);
+void	syscfgArenaMark(struct syscfg_arena *arena, struct syscfg_arena_mark *mark);
+void	syscfgArenaRelease(struct syscfg_arena *arena, const struct syscfg_arena_mark *mark);
+void	syscfgArenaReset(struct syscfg_arena *arena);	/* free everything, keep the memory */
+void	syscfgArenaDestroy(struct syscfg_arena *arena);
+
+/* a loaded SysCfg image */
+struct syscfg_ctx {
+	uint8_t			*data;
+	size_t			dataLength;
+	size_t			regionLength;	/* extent that CNTB offsets may address */
+	u_int32_t		keyCount;
+	bool			ownsData;	/* data is in the arena, not borrowed */
+	bool			validated;	/* passed syscfgValidate; lookups skip their checks */
+	bool			swapped;	/* image was big-endian and is held in host order */
+
+	struct syscfgTagSlot	*tagIndex;
+	u_int32_t		tagIndexBits;
+	u_int32_t		wellKnown[SYSCFG_WELL_KNOWN_SLOTS];	/* index + 1 of each well-known tag, see syscfg_tags.h */
+	bool			wellKnownValid;
+	bool			duplicateTags;	/* some tag is in the table more than once */
+
+	/* where the image came from, for contexts loaded from a bdev */
+	struct blockdev		*bdev;
+	u_int64_t		bdevOffset;
+
+	/* lazy contexts hold only the header and entry table in data */
+	bool			lazy;
+	struct syscfgLazyPayload *payloads;	/* sorted by offset */
+	u_int32_t		payloadCount;
+	std::mutex		*lazyLock;
+
+	/* writer state, see syscfg_write.cpp */
+	struct syscfgExtent	*dirty;		/* bytes changed since the last commit */
+	u_int32_t		dirtyCount;
+	u_int32_t		dirtyCapacity;
+	struct syscfgExtent	*retired;	/* payloads dropped since the last commit, still live on disk */
+	u_int32_t		retiredCount;
+	u_int32_t		retiredCapacity;
+
+	/* image, tag index and lazy payloads; emptied when the image is released */
+	struct syscfg_arena	arena;
+};
+
+/* shared between the syscfg modules */
+bool	syscfgLookupTag(struct syscfg_ctx *ctx, u_int32_t tag, u_int32_t *index);
+void	syscfgCtxReindex(struct syscfg_ctx *ctx);
+void	syscfgCtxRelease(struct syscfg_ctx *ctx);
+bool	syscfgCtxLoadBdev(struct syscfg_ctx *ctx, const char *bdevName, bool lazy);
+bool	syscfgCtxLoadImage(struct syscfg_ctx *ctx, const uint8_t *image, size_t len);
+bool	syscfgCtxPatch(struct syscfg_ctx *ctx, const uint8_t *source, const struct syscfgExtent *ranges, u_int32_t count);
+void	syscfgSwapWords(uint8_t *p, size_t count);
+void	syscfgWriterRelease(struct syscfg_ctx *ctx);
+
+#endif
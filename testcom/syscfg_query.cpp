@@ -0,0 +1,111 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "syscfg.h"
+#include "syscfg_query.h"
+
+/*
+ * Pack an argument into a tag and the mask of bytes it pins down. Characters
+ * past the fourth are ignored, and a short argument without a '*' pads with
+ * NULs, as the old byte-by-byte comparison did.
+ */
+static void
+syscfgQueryPack(const char *str, u_int32_t *value, u_int32_t *mask)
+{
+	u_int32_t	shift;
+	int		i;
+
+	*value = 0;
+	*mask = 0;
+	for (i = 0; i < 4; i++) {
+		shift = 24 - 8 * i;
+		if (str[i] == '*')
+			return;
+		if (str[i] != '?') {
+			*value |= (u_int32_t)(uint8_t)str[i] << shift;
+			*mask |= 0xFFu << shift;
+		}
+		if (str[i] == '\0') {
+			/* pad the rest with NULs */
+			*mask |= (shift == 0) ? 0 : (0xFFFFFFFFu >> (32 - shift));
+			return;
+		}
+	}
+}
+
+bool
+syscfg_query_compile(struct syscfg_query *query, int argc, struct cmd_arg *args)
+{
+	u_int32_t	value, mask;
+	int		curArg;
+
+	memset(query, 0, sizeof(*query));
+
+	if (argc <= 1 || strcmp("ext", args[1].str) == 0) {
+		query->matchAll = true;
+		return true;
+	}
+
+	query->tags = (u_int32_t *)malloc((argc - 1) * sizeof(u_int32_t));
+	query->masks = (struct syscfgQueryMask *)malloc((argc - 1) * sizeof(struct syscfgQueryMask));
+	if (query->tags == NULL || query->masks == NULL) {
+		syscfg_query_free(query);
+		return false;
+	}
+
+	for (curArg = 1; curArg < argc; curArg++) {
+		syscfgQueryPack(args[curArg].str, &value, &mask);
+		if (mask == 0) {
+			/* "*" or "????" */
+			query->matchAll = true;
+		} else if (mask == 0xFFFFFFFFu) {
+			query->tags[query->tagCount++] = value;
+		} else {
+			query->masks[query->maskCount].value = value;
+			query->masks[query->maskCount].mask = mask;
+			query->maskCount++;
+		}
+	}
+
+	std::sort(query->tags, query->tags + query->tagCount);
+	query->tagCount = (u_int32_t)(std::unique(query->tags, query->tags + query->tagCount) - query->tags);
+
+	return true;
+}
+
+bool
+syscfg_query_match(const struct syscfg_query *query, u_int32_t tag)
+{
+	u_int32_t	lo, hi, mid, i;
+
+	if (query->matchAll)
+		return true;
+
+	lo = 0;
+	hi = query->tagCount;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (query->tags[mid] < tag)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < query->tagCount && query->tags[lo] == tag)
+		return true;
+
+	for (i = 0; i < query->maskCount; i++) {
+		if ((tag & query->masks[i].mask) == query->masks[i].value)
+			return true;
+	}
+
+	return false;
+}
+
+void
+syscfg_query_free(struct syscfg_query *query)
+{
+	free(query->tags);
+	free(query->masks);
+	memset(query, 0, sizeof(*query));
+}
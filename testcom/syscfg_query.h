@@ -0,0 +1,43 @@
+/*
+ * Tag queries over a SysCfg image.
+ *
+ * A query is compiled once from the dump arguments and then tested against
+ * each entry's tag. Each argument names a tag by its four characters; a '?'
+ * matches any single character and a '*' matches the rest of the tag, so
+ * "Mod?" and "CLH*" select families of tags. An argument of "ext" in first
+ * position selects every entry.
+ */
+
+#ifndef __SYSCFG_QUERY_H
+#define __SYSCFG_QUERY_H
+
+#include "types.h"
+#include "syscfg.h"
+
+__BEGIN_DECLS
+
+/* a tag matches when (tag & mask) == value */
+struct syscfgQueryMask {
+	u_int32_t	value;
+	u_int32_t	mask;
+};
+
+struct syscfg_query {
+	bool			matchAll;
+	u_int32_t		*tags;		/* exact tags, sorted and unique */
+	u_int32_t		tagCount;
+	struct syscfgQueryMask	*masks;		/* wildcard and prefix patterns */
+	u_int32_t		maskCount;
+};
+
+/*
+ * Compile args[1 .. argc - 1] into a query; with no arguments everything
+ * matches. Returns false if out of memory.
+ */
+bool	syscfg_query_compile(struct syscfg_query *query, int argc, struct cmd_arg *args);
+bool	syscfg_query_match(const struct syscfg_query *query, u_int32_t tag);
+void	syscfg_query_free(struct syscfg_query *query);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,245 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "blockdev.h"
+#include "syscfg.h"
+#include "syscfg_private.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_SSE2	1
+#endif
+
+/*
+ * The device is streamed in large chunks. The tail of each chunk is carried in
+ * front of the next one, so a header straddling a chunk boundary is still seen
+ * whole; positions too close to the end of a chunk to hold a header are left
+ * for the next pass.
+ */
+#define SCAN_CHUNK_SIZE		(1024 * 1024)
+#define SCAN_CARRY		64
+#define SCAN_DEFER		(sizeof(struct syscfgHeader) - 1)
+
+/* no real SysCfg reserves anywhere near this much */
+#define SCAN_MAX_REGION		0x100000
+
+/* first and last bytes of the magics as they appear in memory */
+#define SCFG_BYTE0		((uint8_t)(kSysCfgHeaderMagic & 0xff))
+#define SCFG_BYTE3		((uint8_t)((kSysCfgHeaderMagic >> 24) & 0xff))
+#define CNTB_BYTE0		((uint8_t)(kSyscfgTagCNTB & 0xff))
+#define CNTB_BYTE3		((uint8_t)((kSyscfgTagCNTB >> 24) & 0xff))
+
+struct scan_candidate {
+	struct syscfgLocation	loc;
+	u_int64_t		tableStart;
+	u_int64_t		tableEnd;
+	bool			bad;
+};
+
+struct scan_state {
+	struct blockdev		*bdev;
+	struct scan_candidate	*cands;
+	uint32_t		count;
+	uint32_t		capacity;
+	uint32_t		active;		/* candidates before this have been scanned past */
+	bool			nomem;
+};
+
+static bool scan_header_plausible(struct blockdev *bdev, u_int64_t offset, const struct syscfgHeader *hdr)
+{
+	u_int64_t tableSize;
+
+	if (hdr->shKeyCount == 0 || hdr->shMaxSize > SCAN_MAX_REGION)
+		return false;
+	if (hdr->shSize > hdr->shMaxSize)
+		return false;
+	if (offset + hdr->shMaxSize > bdev->total_len)
+		return false;
+
+	tableSize = sizeof(struct syscfgHeader) + (u_int64_t)hdr->shKeyCount * sizeof(struct syscfgEntry);
+	if (tableSize > hdr->shSize)
+		return false;
+
+	return true;
+}
+
+static void scan_add_candidate(struct scan_state *state, u_int64_t offset, const struct syscfgHeader *hdr)
+{
+	struct scan_candidate *cand;
+
+	if (state->count == state->capacity) {
+		uint32_t capacity = state->capacity ? state->capacity * 2 : 16;
+		cand = (struct scan_candidate *)realloc(state->cands, capacity * sizeof(*cand));
+		if (cand == NULL) {
+			state->nomem = true;
+			return;
+		}
+		state->cands = cand;
+		state->capacity = capacity;
+	}
+
+	cand = &state->cands[state->count++];
+	memset(cand, 0, sizeof(*cand));
+	cand->loc.slOffset = offset;
+	cand->loc.slVersion = hdr->shVersion;
+	cand->loc.slSize = hdr->shSize;
+	cand->loc.slMaxSize = hdr->shMaxSize;
+	cand->loc.slKeyCount = hdr->shKeyCount;
+	cand->tableStart = offset + sizeof(struct syscfgHeader);
+	cand->tableEnd = cand->tableStart + (u_int64_t)hdr->shKeyCount * sizeof(struct syscfgEntry);
+}
+
+/* a 'CNTB' entry sitting in a candidate's table must describe data inside its region */
+static void scan_check_cntb(struct scan_state *state, u_int64_t offset, const struct syscfgEntryCNTB *entry)
+{
+	struct scan_candidate	*cand;
+	u_int64_t		end;
+	uint32_t		i;
+
+	while (state->active < state->count && state->cands[state->active].tableEnd <= offset)
+		state->active++;
+
+	for (i = state->active; i < state->count; i++) {
+		cand = &state->cands[i];
+		if (offset < cand->tableStart || offset >= cand->tableEnd)
+			continue;
+		if ((offset - cand->tableStart) % sizeof(struct syscfgEntry) != 0)
+			continue;
+
+		end = (u_int64_t)entry->seDataOffset + entry->seDataSize;
+		if (entry->seDataOffset < cand->loc.slSize || end > cand->loc.slMaxSize)
+			cand->bad = true;
+		else
+			cand->loc.slCNTBCount++;
+	}
+}
+
+static void scan_hit(struct scan_state *state, u_int64_t offset, const uint8_t *p, size_t avail)
+{
+	struct syscfgHeader	hdr;
+	struct syscfgEntryCNTB	entry;
+	u_int32_t		magic;
+
+	memcpy(&magic, p, sizeof(magic));
+
+	if (magic == kSysCfgHeaderMagic && avail >= sizeof(hdr)) {
+		memcpy(&hdr, p, sizeof(hdr));
+		if (scan_header_plausible(state->bdev, offset, &hdr))
+			scan_add_candidate(state, offset, &hdr);
+	}
+	else if (magic == kSyscfgTagCNTB && avail >= sizeof(entry) && state->active < state->count) {
+		memcpy(&entry, p, sizeof(entry));
+		scan_check_cntb(state, offset, &entry);
+	}
+}
+
+/* look for either magic at every position in [start, limit); data holds at least limit + 3 bytes */
+static void scan_buffer(struct scan_state *state, const uint8_t *data, size_t filled, u_int64_t base, size_t start, size_t limit)
+{
+	size_t i = start;
+
+#ifdef SCAN_SSE2
+	const __m128i s0 = _mm_set1_epi8((char)SCFG_BYTE0);
+	const __m128i s3 = _mm_set1_epi8((char)SCFG_BYTE3);
+	const __m128i c0 = _mm_set1_epi8((char)CNTB_BYTE0);
+	const __m128i c3 = _mm_set1_epi8((char)CNTB_BYTE3);
+
+	/* compare the first and last magic byte of 16 positions at once, verify the rare hits */
+	for (; i + 16 <= limit; i += 16) {
+		__m128i	v0 = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i	v3 = _mm_loadu_si128((const __m128i *)(data + i + 3));
+		__m128i	hit;
+		int	mask;
+
+		hit = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(v0, s0), _mm_cmpeq_epi8(v3, s3)),
+				   _mm_and_si128(_mm_cmpeq_epi8(v0, c0), _mm_cmpeq_epi8(v3, c3)));
+		mask = _mm_movemask_epi8(hit);
+
+		while (mask != 0) {
+			size_t pos = i;
+			int bit = mask & -mask;
+
+			while (!(bit & 1)) {
+				bit >>= 1;
+				pos++;
+			}
+			scan_hit(state, base + pos, data + pos, filled - pos);
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; i < limit; i++) {
+		if ((data[i] == SCFG_BYTE0 && data[i + 3] == SCFG_BYTE3) ||
+		    (data[i] == CNTB_BYTE0 && data[i + 3] == CNTB_BYTE3))
+			scan_hit(state, base + i, data + i, filled - i);
+	}
+}
+
+int syscfgScanBdev(struct blockdev *bdev, struct syscfgLocation *locations, int maxLocations)
+{
+	struct scan_state	state;
+	uint8_t			*alloc, *buf, *data;
+	u_int64_t		readOffset, base, nextPos;
+	size_t			carried, filled, toread, limit;
+	uint32_t		i;
+	int			err, found;
+
+	memset(&state, 0, sizeof(state));
+	state.bdev = bdev;
+
+	/* keep the read destination cache-line aligned so blockdev_read can skip its bounce buffer */
+	alloc = (uint8_t *)malloc(SCAN_CARRY + SCAN_CHUNK_SIZE + 64);
+	if (alloc == NULL)
+		return -1;
+	buf = (uint8_t *)(((uintptr_t)alloc + 63) & ~(uintptr_t)63);
+
+	carried = 0;
+	nextPos = 0;
+	for (readOffset = 0; readOffset < bdev->total_len; readOffset += toread) {
+		toread = (size_t)__min((u_int64_t)SCAN_CHUNK_SIZE, bdev->total_len - readOffset);
+
+		err = blockdev_read(bdev, buf + SCAN_CARRY, readOffset, toread);
+		if (err < 0 || (size_t)err < toread) {
+			printf("syscfg: scan read fail at 0x%llx\n", readOffset);
+			free(alloc);
+			free(state.cands);
+			return -1;
+		}
+
+		data = buf + SCAN_CARRY - carried;
+		filled = carried + toread;
+		base = readOffset - carried;
+
+		if (readOffset + toread < bdev->total_len)
+			limit = filled - SCAN_DEFER;
+		else
+			limit = filled >= 3 ? filled - 3 : 0;
+
+		if (limit > nextPos - base)
+			scan_buffer(&state, data, filled, base, (size_t)(nextPos - base), limit);
+		nextPos = base + limit;
+
+		/* carry the tail forward */
+		carried = __min(filled, (size_t)SCAN_CARRY);
+		memmove(buf + SCAN_CARRY - carried, data + filled - carried, carried);
+	}
+
+	free(alloc);
+
+	if (state.nomem)
+		printf("syscfg: scan out of memory, results incomplete\n");
+
+	found = 0;
+	for (i = 0; i < state.count; i++) {
+		if (state.cands[i].bad)
+			continue;
+		if (found < maxLocations)
+			locations[found] = state.cands[i].loc;
+		found++;
+	}
+
+	free(state.cands);
+	return found;
+}
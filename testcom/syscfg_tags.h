@@ -0,0 +1,125 @@
+/*
+ * SysCfg tags as values.
+ *
+ * A tag is a four-character code, written with fourcc() (see fourcc.h)
+ * rather than as a multi-character literal.
+ *
+ * The tags our tools ask for by name also get a perfect hash, found by the
+ * compiler: a multiplier under which each of them lands in a slot of its own.
+ * A context fills a slot array with their entry indices when it builds its tag
+ * index, and from then on looking one up is a multiply, a shift and a compare.
+ */
+
+#ifndef __SYSCFG_TAGS_H
+#define __SYSCFG_TAGS_H
+
+#include "types.h"
+#include "fourcc.h"
+
+/* the characters of a tag, in the order they are written */
+static inline void
+syscfgTagChars(u_int32_t tag, char chars[4])
+{
+	for (int i = 0; i < 4; i++)
+		chars[i] = (char)(tag >> (24 - 8 * i));
+}
+
+/* an entry whose payload lives outside the entry table; the real tag follows */
+constexpr u_int32_t kSyscfgTagCNTB = fourcc("CNTB");
+
+/* keys that tools and callers look up by name */
+constexpr u_int32_t kSyscfgWellKnownTags[] = {
+	fourcc("SrNm"),	/* serial number */
+	fourcc("Mod#"),	/* model number */
+	fourcc("Regn"),	/* region */
+	fourcc("MLB#"),	/* main logic board serial */
+	fourcc("HwVr"),	/* hardware version */
+	fourcc("BMac"),	/* Bluetooth MAC */
+	fourcc("WMac"),	/* Wi-Fi MAC */
+	fourcc("EMac"),	/* Ethernet MAC */
+	fourcc("DClr"),	/* device colour */
+	fourcc("ClrC"),	/* cover glass colour */
+	fourcc("CLHS"),	/* housing colour */
+	fourcc("LCM#"),	/* display serial */
+	fourcc("Batt"),	/* battery serial */
+	fourcc("BCMS"),	/* back camera serial */
+	fourcc("FCMS"),	/* front camera serial */
+	fourcc("MtSN"),	/* multitouch serial */
+	fourcc("NvSn"),	/* NAND serial */
+	fourcc("NSrN"),	/* NAND serial, older images */
+	fourcc("CFG#"),	/* configuration code */
+	fourcc("SwBh"),	/* software behaviour bits */
+	fourcc("RMd#"),	/* regulatory model number */
+};
+
+#define SYSCFG_WELL_KNOWN_COUNT	(sizeof(kSyscfgWellKnownTags) / sizeof(kSyscfgWellKnownTags[0]))
+#define SYSCFG_WELL_KNOWN_BITS	6
+#define SYSCFG_WELL_KNOWN_SLOTS	(1u << SYSCFG_WELL_KNOWN_BITS)
+
+static_assert(SYSCFG_WELL_KNOWN_COUNT <= SYSCFG_WELL_KNOWN_SLOTS / 2, "too many well-known tags for the slot array");
+
+constexpr u_int32_t
+syscfgWellKnownHash(u_int32_t tag, u_int32_t multiplier)
+{
+	return (u_int32_t)(tag * multiplier) >> (32 - SYSCFG_WELL_KNOWN_BITS);
+}
+
+/* does multiplier send every well-known tag to a different slot? */
+constexpr bool
+syscfgWellKnownPerfect(u_int32_t multiplier)
+{
+	u_int64_t	used = 0, bit = 0;
+
+	for (size_t i = 0; i < SYSCFG_WELL_KNOWN_COUNT; i++) {
+		bit = (u_int64_t)1 << syscfgWellKnownHash(kSyscfgWellKnownTags[i], multiplier);
+		if ((used & bit) != 0)
+			return false;
+		used |= bit;
+	}
+	return true;
+}
+
+/* try odd multipliers spread by the golden ratio until one is perfect; zero if none is */
+constexpr u_int32_t
+syscfgWellKnownSearch()
+{
+	for (u_int32_t k = 1; k < 4096; k++) {
+		u_int32_t multiplier = (k * 2654435769u) | 1;
+		if (syscfgWellKnownPerfect(multiplier))
+			return multiplier;
+	}
+	return 0;
+}
+
+constexpr u_int32_t kSyscfgWellKnownMultiplier = syscfgWellKnownSearch();
+static_assert(kSyscfgWellKnownMultiplier != 0, "no perfect hash for the well-known tags");
+
+/* which tag owns each slot, zero where none does */
+struct syscfgWellKnownTable {
+	u_int32_t	tags[SYSCFG_WELL_KNOWN_SLOTS];
+};
+
+constexpr syscfgWellKnownTable
+syscfgWellKnownBuild()
+{
+	syscfgWellKnownTable table = {};
+
+	for (size_t i = 0; i < SYSCFG_WELL_KNOWN_COUNT; i++)
+		table.tags[syscfgWellKnownHash(kSyscfgWellKnownTags[i], kSyscfgWellKnownMultiplier)] = kSyscfgWellKnownTags[i];
+	return table;
+}
+
+constexpr syscfgWellKnownTable kSyscfgWellKnownTable = syscfgWellKnownBuild();
+
+/* the slot of a well-known tag, or -1 for any other tag */
+constexpr int
+syscfgWellKnownSlot(u_int32_t tag)
+{
+	return (tag != 0 && kSyscfgWellKnownTable.tags[syscfgWellKnownHash(tag, kSyscfgWellKnownMultiplier)] == tag) ?
+		(int)syscfgWellKnownHash(tag, kSyscfgWellKnownMultiplier) : -1;
+}
+
+static_assert(syscfgWellKnownSlot(fourcc("SrNm")) >= 0, "well-known tags must resolve to a slot");
+static_assert(syscfgWellKnownSlot(kSyscfgTagCNTB) < 0, "other tags must not");
+
+#endif
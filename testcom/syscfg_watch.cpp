@@ -0,0 +1,688 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "blockdev.h"
+#include "syscfg.h"
+#include "syscfg_private.h"
+#include "syscfg_watch.h"
+#include "compat.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#endif
+
+/*
+ * Watched images.
+ *
+ * Views are reference counted: the watch holds one reference on the current
+ * view and one on the spare (the view current replaced), and each reader holds
+ * one while it uses a view. A reader loads the current pointer and takes its
+ * reference inside a short window, counted in one of two counters picked by
+ * the watch's phase. After swapping in a new view the reloader flips the phase
+ * and waits for the counter readers were using to drain, then does it again
+ * for the other one, which catches a reader that picked its counter just
+ * before the first flip. New readers always count on the side not being
+ * waited for, so each wait ends however busy the readers are, and after both
+ * no reader can still be about to take a reference to the old view. Readers
+ * never wait, and the last release of a view frees it.
+ *
+ * A reload starts from the spare if no reader holds it, bringing it up to the
+ * current image by the ranges that separate the two and then applying the new
+ * change, so only changed bytes are copied and only touched entries are
+ * re-parsed. A busy spare, or a change syscfgCtxPatch won't take, means a full
+ * load into a fresh view.
+ */
+
+#define WATCH_FILE_BLOCK	512		/* granularity at which a changed file is compared */
+#define WATCH_POLL_MS		100		/* how often a file is checked where there are no notifications */
+
+struct syscfgWatchView {
+	struct syscfg_ctx	ctx;		/* first, so a context handed out leads back to its view */
+	std::atomic<u_int32_t>	refs;
+};
+
+struct syscfgWatchObserver {
+	struct blockdev_observer obs;		/* first, so the callback can find the watch */
+	struct syscfg_watch	*watch;
+};
+
+/* a run of bytes written to the bdev, in bdev offsets */
+struct syscfgWatchWrite {
+	u_int64_t		offset;
+	u_int64_t		size;
+};
+
+/* what identifies one version of a file, as far as the filesystem says */
+struct syscfgWatchFileState {
+	u_int64_t		size;
+	u_int64_t		mtime;
+	u_int64_t		inode;
+};
+
+struct syscfg_watch {
+	/* the current view and the one it replaced */
+	std::atomic<struct syscfgWatchView *>	current;
+	std::atomic<u_int32_t>			acquiring[2];	/* readers between loading current and taking a reference */
+	std::atomic<u_int32_t>			phase;		/* which of acquiring new readers count on */
+	struct syscfgWatchView			*spare;
+	std::vector<struct syscfgExtent>	spareDiff;	/* where spare and current may differ */
+	std::vector<uint8_t>			staging;	/* the changed bytes, laid out like the image */
+
+	/* a file */
+	std::string				path;
+	std::string				fileName;	/* within its directory, for matching notifications */
+	struct syscfgWatchFileState		fileState;
+#ifdef _WIN32
+	HANDLE					notify;
+#else
+	int					notify;
+#endif
+
+	/* or a bdev, with the writes its observer has seen since the last reload */
+	struct blockdev				*bdev;
+	struct syscfgWatchObserver		observer;
+	std::mutex				writesLock;
+	std::condition_variable			writesCond;
+	std::vector<struct syscfgWatchWrite>	writes;
+
+	struct syscfg_watch_stats		stats;
+};
+
+static struct syscfgWatchView *
+syscfgWatchNewView(void)
+{
+	struct syscfgWatchView *view;
+
+	/* value-initialised, which leaves the context zeroed as syscfg_ctx expects */
+	view = new (std::nothrow) struct syscfgWatchView();
+	if (view != NULL)
+		view->refs = 1;
+	return view;
+}
+
+static void
+syscfgWatchDropView(struct syscfgWatchView *view)
+{
+	if (view == NULL || view->refs.fetch_sub(1) != 1)
+		return;
+
+	syscfgCtxRelease(&view->ctx);
+	syscfgArenaDestroy(&view->ctx.arena);
+	delete view;
+}
+
+struct syscfg_ctx *
+syscfg_watch_acquire(struct syscfg_watch *watch)
+{
+	struct syscfgWatchView	*view;
+	u_int32_t		phase;
+
+	phase = watch->phase.load();
+	watch->acquiring[phase].fetch_add(1);
+	view = watch->current.load();
+	view->refs.fetch_add(1);
+	watch->acquiring[phase].fetch_sub(1);
+	return &view->ctx;
+}
+
+void
+syscfg_watch_release(struct syscfg_ctx *ctx)
+{
+	if (ctx != NULL)
+		syscfgWatchDropView((struct syscfgWatchView *)ctx);
+}
+
+/* swap in view; the one it replaces becomes the spare, differing from view by diff */
+static void
+syscfgWatchPublish(struct syscfg_watch *watch, struct syscfgWatchView *view, const std::vector<struct syscfgExtent> &diff)
+{
+	struct syscfgWatchView	*old;
+	u_int32_t		phase, i;
+
+	old = watch->current.exchange(view);
+
+	/* once both sides have drained, every reader that saw old has its reference */
+	for (i = 0; i < 2; i++) {
+		phase = watch->phase.load();
+		watch->phase.store(phase ^ 1);
+		while (watch->acquiring[phase].load() != 0)
+			std::this_thread::yield();
+	}
+
+	syscfgWatchDropView(watch->spare);
+	watch->spare = old;
+	watch->spareDiff = diff;
+	watch->stats.generation++;
+}
+
+/* sort and merge ranges in place */
+static void
+syscfgWatchMergeRanges(std::vector<struct syscfgExtent> &ranges)
+{
+	size_t	i, count;
+
+	std::sort(ranges.begin(), ranges.end(), [](const struct syscfgExtent &a, const struct syscfgExtent &b) {
+		return a.offset < b.offset;
+	});
+	for (i = 0, count = 0; i < ranges.size(); i++) {
+		if (count != 0 && ranges[i].offset <= (u_int64_t)ranges[count - 1].offset + ranges[count - 1].size) {
+			ranges[count - 1].size = (u_int32_t)__max((u_int64_t)ranges[count - 1].offset + ranges[count - 1].size,
+				(u_int64_t)ranges[i].offset + ranges[i].size) - ranges[count - 1].offset;
+			continue;
+		}
+		ranges[count++] = ranges[i];
+	}
+	ranges.resize(count);
+}
+
+/*
+ * Make a view of the image after changed, whose new bytes are in staging,
+ * falling back on full to load the whole image into an empty context.
+ */
+static struct syscfgWatchView *
+syscfgWatchBuild(struct syscfg_watch *watch, const std::vector<struct syscfgExtent> &changed,
+		 bool (*full)(struct syscfg_watch *, struct syscfg_ctx *))
+{
+	struct syscfgWatchView	*current = watch->current.load(), *view;
+	u_int64_t		bytes = 0;
+	size_t			i;
+
+	/* a spare only the watch holds can be brought forward in place */
+	view = NULL;
+	if (watch->spare != NULL && watch->spare->refs.load() == 1) {
+		view = watch->spare;
+		watch->spare = NULL;
+
+		if (syscfgCtxPatch(&view->ctx, current->ctx.data, watch->spareDiff.data(), (u_int32_t)watch->spareDiff.size()) &&
+		    syscfgCtxPatch(&view->ctx, watch->staging.data(), changed.data(), (u_int32_t)changed.size())) {
+			for (i = 0; i < watch->spareDiff.size(); i++)
+				bytes += watch->spareDiff[i].size;
+			for (i = 0; i < changed.size(); i++)
+				bytes += changed[i].size;
+			watch->stats.patched++;
+			watch->stats.bytesPatched += bytes;
+			return view;
+		}
+
+		/* keep the memory, lose the contents */
+		syscfgCtxRelease(&view->ctx);
+	}
+
+	if (view == NULL && (view = syscfgWatchNewView()) == NULL)
+		return NULL;
+	if (!full(watch, &view->ctx)) {
+		syscfgWatchDropView(view);
+		return NULL;
+	}
+	watch->stats.fullReloads++;
+	return view;
+}
+
+/*
+ * Files.
+ *
+ * A notification only says that the file changed, not where, so the new
+ * contents are read whole and compared with the current view a block at a
+ * time; patching then covers just the blocks that differ. Changes are picked
+ * up when the writer closes the file or renames a new one into place.
+ */
+
+static bool
+syscfgWatchFileStat(struct syscfg_watch *watch, struct syscfgWatchFileState *state)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA attrs;
+
+	if (!GetFileAttributesExA(watch->path.c_str(), GetFileExInfoStandard, &attrs))
+		return false;
+	state->size = ((u_int64_t)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow;
+	state->mtime = ((u_int64_t)attrs.ftLastWriteTime.dwHighDateTime << 32) | attrs.ftLastWriteTime.dwLowDateTime;
+	state->inode = 0;
+#else
+	struct stat st;
+
+	if (stat(watch->path.c_str(), &st) != 0)
+		return false;
+	state->size = (u_int64_t)st.st_size;
+#ifdef __linux__
+	state->mtime = (u_int64_t)st.st_mtim.tv_sec * 1000000000ull + (u_int64_t)st.st_mtim.tv_nsec;
+#else
+	state->mtime = (u_int64_t)st.st_mtime;
+#endif
+	state->inode = (u_int64_t)st.st_ino;
+#endif
+	return true;
+}
+
+static bool
+syscfgWatchFileRead(struct syscfg_watch *watch)
+{
+	FILE	*fp;
+	long	len;
+	bool	ok;
+
+	fp = compat_fopen(watch->path.c_str(), "rb");
+	if (fp == NULL) {
+		printf("syscfg: can't open \"%s\"\n", watch->path.c_str());
+		return false;
+	}
+	if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+		printf("syscfg: can't size \"%s\"\n", watch->path.c_str());
+		fclose(fp);
+		return false;
+	}
+
+	watch->staging.resize((size_t)len);
+	ok = len == 0 || fread(watch->staging.data(), 1, (size_t)len, fp) == (size_t)len;
+	fclose(fp);
+	if (!ok) {
+		printf("syscfg: read fail on \"%s\"\n", watch->path.c_str());
+		return false;
+	}
+	watch->stats.bytesRead += (u_int64_t)len;
+	return true;
+}
+
+static bool
+syscfgWatchFileLoad(struct syscfg_watch *watch, struct syscfg_ctx *ctx)
+{
+	return syscfgCtxLoadImage(ctx, watch->staging.data(), watch->staging.size());
+}
+
+static int
+syscfgWatchPollFile(struct syscfg_watch *watch, bool notified)
+{
+	struct syscfgWatchView			*current = watch->current.load(), *view;
+	struct syscfgWatchFileState		state;
+	std::vector<struct syscfgExtent>	changed;
+	struct syscfgExtent			range;
+	size_t					offset, len;
+
+	/* without a notification naming the file, only a new size, time or inode sends us to read it */
+	if (!syscfgWatchFileStat(watch, &state))
+		return -1;
+	if (!notified && state.size == watch->fileState.size && state.mtime == watch->fileState.mtime &&
+	    state.inode == watch->fileState.inode)
+		return 0;
+
+	/* a file caught mid-replace is tried again on the next look */
+	if (!syscfgWatchFileRead(watch))
+		return -1;
+	watch->fileState = state;
+
+	len = watch->staging.size();
+	if (len != current->ctx.dataLength || current->ctx.swapped) {
+		/* nothing of the old image carries over */
+		range.offset = 0;
+		range.size = (u_int32_t)len;
+		changed.push_back(range);
+	}
+	else {
+		for (offset = 0; offset < len; offset += WATCH_FILE_BLOCK) {
+			range.offset = (u_int32_t)offset;
+			range.size = (u_int32_t)__min((size_t)WATCH_FILE_BLOCK, len - offset);
+			if (memcmp(watch->staging.data() + offset, current->ctx.data + offset, range.size) != 0)
+				changed.push_back(range);
+		}
+		if (changed.empty())
+			return 0;
+		syscfgWatchMergeRanges(changed);
+	}
+
+	view = syscfgWatchBuild(watch, changed, syscfgWatchFileLoad);
+	if (view == NULL)
+		return -1;
+	syscfgWatchPublish(watch, view, changed);
+	return 1;
+}
+
+static bool
+syscfgWatchFileNotifyOpen(struct syscfg_watch *watch)
+{
+	std::string	dir;
+	size_t		slash;
+
+	slash = watch->path.find_last_of("/\\");
+	dir = (slash == std::string::npos) ? std::string(".") : watch->path.substr(0, slash + 1);
+	watch->fileName = (slash == std::string::npos) ? watch->path : watch->path.substr(slash + 1);
+
+#ifdef _WIN32
+	/* for the whole directory; the file's size and time tell whether it was ours */
+	watch->notify = FindFirstChangeNotificationA(dir.c_str(), FALSE,
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+	return watch->notify != INVALID_HANDLE_VALUE;
+#elif defined(__linux__)
+	watch->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->notify < 0)
+		return false;
+	/* the directory, so that a new file renamed over the old one is seen too */
+	if (inotify_add_watch(watch->notify, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+		close(watch->notify);
+		watch->notify = -1;
+		return false;
+	}
+	return true;
+#else
+	(void)dir;
+	watch->notify = -1;
+	return true;
+#endif
+}
+
+static void
+syscfgWatchFileNotifyClose(struct syscfg_watch *watch)
+{
+#ifdef _WIN32
+	if (watch->notify != INVALID_HANDLE_VALUE)
+		FindCloseChangeNotification(watch->notify);
+#else
+	if (watch->notify >= 0)
+		close(watch->notify);
+#endif
+}
+
+#ifdef __linux__
+/* read what inotify has queued; true if any of it was about the watched file */
+static bool
+syscfgWatchFileDrain(struct syscfg_watch *watch)
+{
+	struct inotify_event	*event;
+	char			buffer[4096];
+	ssize_t			len, offset;
+	bool			ours = false;
+
+	while ((len = read(watch->notify, buffer, sizeof(buffer))) > 0) {
+		for (offset = 0; offset < len; offset += sizeof(*event) + event->len) {
+			event = (struct inotify_event *)(buffer + offset);
+			if (event->len != 0 && watch->fileName == event->name)
+				ours = true;
+		}
+	}
+	return ours;
+}
+#endif
+
+static int
+syscfgWatchWaitFile(struct syscfg_watch *watch, int timeoutMs)
+{
+#ifdef _WIN32
+	if (WaitForSingleObject(watch->notify, (DWORD)timeoutMs) != WAIT_OBJECT_0)
+		return 0;
+	FindNextChangeNotification(watch->notify);
+	return syscfgWatchPollFile(watch, false);
+#elif defined(__linux__)
+	struct pollfd	pfd;
+
+	pfd.fd = watch->notify;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, timeoutMs) <= 0)
+		return 0;
+	return syscfgWatchPollFile(watch, syscfgWatchFileDrain(watch));
+#else
+	struct syscfgWatchFileState	state;
+	int				waited;
+
+	for (waited = 0; waited < timeoutMs; waited += WATCH_POLL_MS) {
+		if (syscfgWatchFileStat(watch, &state) && (state.size != watch->fileState.size ||
+		    state.mtime != watch->fileState.mtime || state.inode != watch->fileState.inode))
+			return syscfgWatchPollFile(watch, false);
+		std::this_thread::sleep_for(std::chrono::milliseconds(__min(WATCH_POLL_MS, timeoutMs - waited)));
+	}
+	return 0;
+#endif
+}
+
+static struct syscfg_watch *
+syscfgWatchNew(void)
+{
+	struct syscfg_watch *watch;
+
+	watch = new (std::nothrow) struct syscfg_watch;
+	if (watch == NULL)
+		return NULL;
+
+	watch->current = NULL;
+	watch->acquiring[0] = 0;
+	watch->acquiring[1] = 0;
+	watch->phase = 0;
+	watch->spare = NULL;
+#ifdef _WIN32
+	watch->notify = INVALID_HANDLE_VALUE;
+#else
+	watch->notify = -1;
+#endif
+	memset(&watch->fileState, 0, sizeof(watch->fileState));
+	watch->bdev = NULL;
+	memset(&watch->observer, 0, sizeof(watch->observer));
+	memset(&watch->stats, 0, sizeof(watch->stats));
+	return watch;
+}
+
+struct syscfg_watch *
+syscfg_watch_file(const char *path)
+{
+	struct syscfg_watch	*watch;
+	struct syscfgWatchView	*view;
+
+	watch = syscfgWatchNew();
+	if (watch == NULL)
+		return NULL;
+	watch->path = path;
+
+	/* watch first, so a change made while loading is not missed */
+	if (!syscfgWatchFileNotifyOpen(watch)) {
+		printf("syscfg: can't watch \"%s\"\n", path);
+		delete watch;
+		return NULL;
+	}
+
+	view = syscfgWatchNewView();
+	if (view == NULL || !syscfgWatchFileStat(watch, &watch->fileState) || !syscfgWatchFileRead(watch) ||
+	    !syscfgWatchFileLoad(watch, &view->ctx)) {
+		syscfgWatchDropView(view);
+		syscfgWatchFileNotifyClose(watch);
+		delete watch;
+		return NULL;
+	}
+	watch->current = view;
+	watch->stats.generation = 1;
+	return watch;
+}
+
+/*
+ * Bdevs.
+ *
+ * The observer records each run of blocks written, so a reload reads back
+ * exactly those blocks of the image. Only writes that go through the
+ * blockdev write path are seen.
+ */
+
+static void
+syscfgWatchWritten(struct blockdev_observer *obs, struct blockdev *bdev, const void *ptr, block_addr block, uint32_t count)
+{
+	struct syscfg_watch	*watch = ((struct syscfgWatchObserver *)obs)->watch;
+	struct syscfgWatchWrite	write;
+
+	(void)ptr;
+	write.offset = (u_int64_t)block << bdev->block_shift;
+	write.size = (u_int64_t)count << bdev->block_shift;
+
+	std::lock_guard<std::mutex> lock(watch->writesLock);
+	watch->writes.push_back(write);
+	watch->writesCond.notify_all();
+}
+
+static bool
+syscfgWatchBdevLoad(struct syscfg_watch *watch, struct syscfg_ctx *ctx)
+{
+	if (!syscfgCtxLoadBdev(ctx, watch->bdev->name, false))
+		return false;
+	watch->stats.bytesRead += ctx->dataLength;
+	return true;
+}
+
+static int
+syscfgWatchPollBdev(struct syscfg_watch *watch)
+{
+	struct syscfgWatchView			*current = watch->current.load(), *view;
+	std::vector<struct syscfgWatchWrite>	writes;
+	std::vector<struct syscfgExtent>	changed;
+	struct syscfgExtent			range;
+	u_int64_t				start, end, imageStart, imageEnd;
+	size_t					i;
+	int					result;
+
+	{
+		std::lock_guard<std::mutex> lock(watch->writesLock);
+		writes.swap(watch->writes);
+	}
+	if (writes.empty())
+		return 0;
+
+	/* the writes that landed in the image, as image offsets */
+	imageStart = current->ctx.bdevOffset;
+	imageEnd = imageStart + current->ctx.dataLength;
+	for (i = 0; i < writes.size(); i++) {
+		start = __max(writes[i].offset, imageStart);
+		end = __min(writes[i].offset + writes[i].size, imageEnd);
+		if (start >= end)
+			continue;
+		range.offset = (u_int32_t)(start - imageStart);
+		range.size = (u_int32_t)(end - start);
+		changed.push_back(range);
+	}
+	if (changed.empty())
+		return 0;
+	syscfgWatchMergeRanges(changed);
+
+	/* read back only what was written */
+	watch->staging.resize(current->ctx.dataLength);
+	for (i = 0; i < changed.size(); i++) {
+		result = blockdev_read(watch->bdev, watch->staging.data() + changed[i].offset,
+				       imageStart + changed[i].offset, changed[i].size);
+		if (result < 0 || (u_int32_t)result < changed[i].size) {
+			printf("syscfg: bdev read fail (%d)\n", result);
+			goto fail;
+		}
+		watch->stats.bytesRead += changed[i].size;
+	}
+
+	view = syscfgWatchBuild(watch, changed, syscfgWatchBdevLoad);
+	if (view == NULL)
+		goto fail;
+	syscfgWatchPublish(watch, view, changed);
+	return 1;
+
+fail:
+	/* the current view is still behind the bdev by these writes; try them again next time */
+	{
+		std::lock_guard<std::mutex> lock(watch->writesLock);
+		watch->writes.insert(watch->writes.end(), writes.begin(), writes.end());
+	}
+	return -1;
+}
+
+struct syscfg_watch *
+syscfg_watch_bdev(const char *bdevName)
+{
+	struct syscfg_watch	*watch;
+	struct syscfgWatchView	*view;
+
+	watch = syscfgWatchNew();
+	if (watch == NULL)
+		return NULL;
+
+	watch->bdev = lookup_blockdev(bdevName);
+	if (watch->bdev == NULL) {
+		printf("syscfg: can't find bdev \"%s\"\n", bdevName);
+		delete watch;
+		return NULL;
+	}
+
+	/* observe first, so a write made while loading is not missed */
+	watch->observer.obs.written = &syscfgWatchWritten;
+	watch->observer.watch = watch;
+	blockdev_add_observer(watch->bdev, &watch->observer.obs);
+
+	view = syscfgWatchNewView();
+	if (view == NULL || !syscfgWatchBdevLoad(watch, &view->ctx)) {
+		syscfgWatchDropView(view);
+		blockdev_remove_observer(watch->bdev, &watch->observer.obs);
+		delete watch;
+		return NULL;
+	}
+	watch->current = view;
+	watch->stats.generation = 1;
+	return watch;
+}
+
+int
+syscfg_watch_poll(struct syscfg_watch *watch)
+{
+	if (watch->bdev != NULL)
+		return syscfgWatchPollBdev(watch);
+#ifdef __linux__
+	return syscfgWatchPollFile(watch, syscfgWatchFileDrain(watch));
+#else
+	return syscfgWatchPollFile(watch, false);
+#endif
+}
+
+int
+syscfg_watch_wait(struct syscfg_watch *watch, int timeoutMs)
+{
+	if (watch->bdev != NULL) {
+		{
+			std::unique_lock<std::mutex> lock(watch->writesLock);
+			watch->writesCond.wait_for(lock, std::chrono::milliseconds(timeoutMs), [watch]() {
+				return !watch->writes.empty();
+			});
+		}
+		return syscfgWatchPollBdev(watch);
+	}
+	return syscfgWatchWaitFile(watch, timeoutMs);
+}
+
+void
+syscfg_watch_get_stats(struct syscfg_watch *watch, struct syscfg_watch_stats *stats)
+{
+	*stats = watch->stats;
+}
+
+void
+syscfg_watch_close(struct syscfg_watch *watch)
+{
+	if (watch == NULL)
+		return;
+
+	if (watch->bdev != NULL)
+		blockdev_remove_observer(watch->bdev, &watch->observer.obs);
+	else
+		syscfgWatchFileNotifyClose(watch);
+
+	syscfgWatchDropView(watch->spare);
+	syscfgWatchDropView(watch->current.load());
+	delete watch;
+}
@@ -0,0 +1,61 @@
+/*
+ * Following a SysCfg image as it changes.
+ *
+ * A watch holds a current view of an image, a read-only syscfg_ctx, and
+ * replaces it when the image changes: a file on disk (inotify on Linux,
+ * a change notification on the directory on Windows) or a registered
+ * bdev (a write observer, so the changed blocks are known exactly).
+ *
+ * A reload reads only what changed where it can tell, and re-parses only
+ * the entry table slots the change touches. The new view is built to one
+ * side and published with a single pointer swap, so readers never wait
+ * for a reload and a view they hold never changes under them. The view
+ * before the current one is patched up and reused once no reader holds it,
+ * which keeps the cost of a reload in proportion to the change.
+ */
+
+#ifndef __SYSCFG_WATCH_H
+#define __SYSCFG_WATCH_H
+
+#include "types.h"
+#include "syscfg.h"
+
+__BEGIN_DECLS
+
+struct syscfg_watch;
+
+struct syscfg_watch_stats {
+	u_int64_t	generation;	/* views published, including the first */
+	u_int64_t	patched;	/* reloads that patched the previous view */
+	u_int64_t	fullReloads;	/* reloads that parsed the whole image again */
+	u_int64_t	bytesRead;	/* read from the bdev or file by reloads */
+	u_int64_t	bytesPatched;	/* copied into views by patching */
+};
+
+/* load the image and start watching it; NULL if it can't be loaded */
+struct syscfg_watch	*syscfg_watch_file(const char *path);
+struct syscfg_watch	*syscfg_watch_bdev(const char *bdevName);
+/* views still held by readers stay valid until they are released */
+void			syscfg_watch_close(struct syscfg_watch *watch);
+
+/*
+ * Take a reference to the current view, and give it back. Any thread may
+ * do this at any time; the view does not change while it is held.
+ */
+struct syscfg_ctx	*syscfg_watch_acquire(struct syscfg_watch *watch);
+void			syscfg_watch_release(struct syscfg_ctx *view);
+
+/*
+ * Reload if the image changed: poll checks now, wait blocks for up to
+ * timeoutMs for a change first. Both return 1 if a new view was published,
+ * 0 if there was nothing to do, or -1 if the image couldn't be read or
+ * parsed, in which case the current view stays. Call these from one thread.
+ */
+int			syscfg_watch_poll(struct syscfg_watch *watch);
+int			syscfg_watch_wait(struct syscfg_watch *watch, int timeoutMs);
+
+void			syscfg_watch_get_stats(struct syscfg_watch *watch, struct syscfg_watch_stats *stats);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,675 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include "blockdev.h"
+#include "syscfg.h"
+#include "syscfg_private.h"
+
+/*
+ * In-place SysCfg writer.
+ *
+ * Edits go to the in-memory image of a context loaded whole from a bdev, and
+ * only the bytes that actually change are recorded. A commit writes just the
+ * blocks those fall in, ordered so that a crash part way through leaves an
+ * image that still loads (see syscfg_ctx_commit).
+ *
+ * Payloads dropped by an edit stay reserved until the commit, since the table
+ * still on disk refers to them, and so do slots past the end of a shrunk table.
+ */
+
+/* extended data is placed on this alignment */
+#define SYSCFG_PAYLOAD_ALIGN	16
+
+#define ENTRY_OFFSET(index)	(sizeof(struct syscfgHeader) + (size_t)(index) * sizeof(struct syscfgEntry))
+
+static bool
+syscfgExtentAppend(struct syscfgExtent **list, u_int32_t *count, u_int32_t *capacity, u_int32_t offset, u_int32_t size)
+{
+	struct syscfgExtent	*grown;
+	u_int32_t		newCapacity;
+
+	if (*count == *capacity) {
+		newCapacity = *capacity ? *capacity * 2 : 16;
+		grown = (struct syscfgExtent *)realloc(*list, newCapacity * sizeof(*grown));
+		if (grown == NULL)
+			return false;
+		*list = grown;
+		*capacity = newCapacity;
+	}
+
+	(*list)[*count].offset = offset;
+	(*list)[*count].size = size;
+	(*count)++;
+	return true;
+}
+
+static bool
+syscfgExtentBefore(const struct syscfgExtent &a, const struct syscfgExtent &b)
+{
+	if (a.offset != b.offset)
+		return a.offset < b.offset;
+	return a.size < b.size;
+}
+
+void
+syscfgWriterRelease(struct syscfg_ctx *ctx)
+{
+	free(ctx->dirty);
+	free(ctx->retired);
+	ctx->dirty = NULL;
+	ctx->dirtyCount = 0;
+	ctx->dirtyCapacity = 0;
+	ctx->retired = NULL;
+	ctx->retiredCount = 0;
+	ctx->retiredCapacity = 0;
+}
+
+static bool
+syscfgWritable(struct syscfg_ctx *ctx)
+{
+	if (ctx == NULL || ctx->data == NULL) {
+		printf("syscfg is not initialized!\n");
+		return false;
+	}
+	if (ctx->bdev == NULL || ctx->lazy) {
+		printf("syscfg: only images loaded whole from a bdev can be written\n");
+		return false;
+	}
+	if (!ctx->validated) {
+		printf("syscfg: image failed validation, not writing\n");
+		return false;
+	}
+	return true;
+}
+
+static void
+syscfgReadHeader(struct syscfg_ctx *ctx, struct syscfgHeader *hdr)
+{
+	memcpy(hdr, ctx->data, sizeof(*hdr));
+}
+
+static void
+syscfgReadEntry(struct syscfg_ctx *ctx, u_int32_t index, struct syscfgEntryCNTB *entry)
+{
+	memcpy(entry, ctx->data + ENTRY_OFFSET(index), sizeof(*entry));
+}
+
+/* the limit CNTB payloads must stay under */
+static size_t
+syscfgPayloadLimit(struct syscfg_ctx *ctx)
+{
+	struct syscfgHeader hdr;
+
+	syscfgReadHeader(ctx, &hdr);
+	return __min(ctx->dataLength, __min(ctx->regionLength, (size_t)hdr.shMaxSize));
+}
+
+/*
+ * Copy len bytes into the image at offset, recording the span from the first
+ * to the last byte that actually differs.
+ */
+static bool
+syscfgStore(struct syscfg_ctx *ctx, size_t offset, const void *src, size_t len)
+{
+	const uint8_t	*bytes = (const uint8_t *)src;
+	uint8_t		*dst = ctx->data + offset;
+	size_t		first, last;
+
+	for (first = 0; first < len && dst[first] == bytes[first]; first++)
+		;
+	if (first == len)
+		return true;
+	for (last = len; dst[last - 1] == bytes[last - 1]; last--)
+		;
+
+	if (!syscfgExtentAppend(&ctx->dirty, &ctx->dirtyCount, &ctx->dirtyCapacity,
+				(u_int32_t)(offset + first), (u_int32_t)(last - first))) {
+		printf("syscfg: out of memory tracking changes\n");
+		return false;
+	}
+
+	memcpy(dst + first, bytes + first, last - first);
+	return true;
+}
+
+/* keep a payload the on-disk table may still refer to from being reused before the commit */
+static bool
+syscfgRetire(struct syscfg_ctx *ctx, const struct syscfgEntryCNTB *entry)
+{
+	if (entry->seTag != kSyscfgTagCNTB)
+		return true;
+	return syscfgExtentAppend(&ctx->retired, &ctx->retiredCount, &ctx->retiredCapacity,
+				  entry->seDataOffset, entry->seDataSize);
+}
+
+/*
+ * Find room for size bytes of extended data at or past floor, avoiding every
+ * payload in the table and every retired one. Returns 0 if there is none.
+ */
+static u_int32_t
+syscfgFindSpace(struct syscfg_ctx *ctx, size_t floor, u_int32_t size)
+{
+	struct syscfgEntryCNTB	entry;
+	struct syscfgExtent	*used;
+	u_int32_t		index, count;
+	size_t			candidate, limit, end;
+
+	used = (struct syscfgExtent *)malloc((ctx->keyCount + ctx->retiredCount + 1) * sizeof(*used));
+	if (used == NULL)
+		return 0;
+
+	count = 0;
+	for (index = 0; index < ctx->keyCount; index++) {
+		syscfgReadEntry(ctx, index, &entry);
+		if (entry.seTag != kSyscfgTagCNTB)
+			continue;
+		used[count].offset = entry.seDataOffset;
+		used[count].size = entry.seDataSize;
+		count++;
+	}
+	if (ctx->retiredCount > 0)
+		memcpy(used + count, ctx->retired, ctx->retiredCount * sizeof(*used));
+	count += ctx->retiredCount;
+	std::sort(used, used + count, syscfgExtentBefore);
+
+	limit = syscfgPayloadLimit(ctx);
+	candidate = (floor + SYSCFG_PAYLOAD_ALIGN - 1) & ~(size_t)(SYSCFG_PAYLOAD_ALIGN - 1);
+	for (index = 0; index < count; index++) {
+		end = (size_t)used[index].offset + used[index].size;
+		if (end <= candidate)
+			continue;
+		if (candidate + size <= used[index].offset)
+			break;
+		candidate = (end + SYSCFG_PAYLOAD_ALIGN - 1) & ~(size_t)(SYSCFG_PAYLOAD_ALIGN - 1);
+	}
+	free(used);
+
+	if (candidate + size > limit || candidate == 0)
+		return 0;
+	return (u_int32_t)candidate;
+}
+
+/* fill in entry for tag holding data, placing it in fresh extended space if it doesn't fit inline */
+static bool
+syscfgMakeEntry(struct syscfg_ctx *ctx, u_int32_t index, u_int32_t tag, const void *data, size_t size,
+		bool keepCNTB, size_t floor)
+{
+	struct syscfgEntry	inlineEntry;
+	struct syscfgEntryCNTB	entry;
+	u_int32_t		offset;
+
+	if (size <= sizeof(inlineEntry.seData) && !keepCNTB) {
+		memset(&inlineEntry, 0, sizeof(inlineEntry));
+		inlineEntry.seTag = tag;
+		memcpy(inlineEntry.seData, data, size);
+		return syscfgStore(ctx, ENTRY_OFFSET(index), &inlineEntry, sizeof(inlineEntry));
+	}
+
+	if (size > UINT32_MAX || (offset = syscfgFindSpace(ctx, floor, (u_int32_t)size)) == 0) {
+		printf("syscfg: no room for 0x%zx bytes of data\n", size);
+		return false;
+	}
+
+	if (!syscfgStore(ctx, offset, data, size))
+		return false;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.seTag = kSyscfgTagCNTB;
+	entry.seRealTag = tag;
+	entry.seDataSize = (u_int32_t)size;
+	entry.seDataOffset = offset;
+	return syscfgStore(ctx, ENTRY_OFFSET(index), &entry, sizeof(entry));
+}
+
+int
+syscfg_ctx_set_data_for_tag(struct syscfg_ctx *ctx, u_int32_t tag, const void *data, size_t size)
+{
+	struct syscfgEntryCNTB	old;
+	u_int32_t		index;
+	bool			ok;
+
+	if (!syscfgWritable(ctx))
+		return -1;
+
+	if (!syscfgLookupTag(ctx, tag, &index))
+		return -1;
+
+	syscfgReadEntry(ctx, index, &old);
+
+	/* an extended entry stays extended, so its exact size is kept */
+	ok = syscfgRetire(ctx, &old) &&
+	     syscfgMakeEntry(ctx, index, tag, data, size, old.seTag == kSyscfgTagCNTB, ENTRY_OFFSET(ctx->keyCount));
+
+	syscfgCtxReindex(ctx);
+	return ok ? 0 : -1;
+}
+
+/* move every payload that starts below floor out of the way */
+static bool
+syscfgRelocateBelow(struct syscfg_ctx *ctx, size_t floor)
+{
+	struct syscfgEntryCNTB	entry, other;
+	u_int32_t		index, j, offset;
+
+	for (index = 0; index < ctx->keyCount; index++) {
+		syscfgReadEntry(ctx, index, &entry);
+		if (entry.seTag != kSyscfgTagCNTB || entry.seDataOffset >= floor)
+			continue;
+
+		offset = syscfgFindSpace(ctx, floor, entry.seDataSize);
+		if (offset == 0) {
+			printf("syscfg: no room to grow the entry table\n");
+			return false;
+		}
+		if (!syscfgRetire(ctx, &entry) ||
+		    !syscfgStore(ctx, offset, ctx->data + entry.seDataOffset, entry.seDataSize))
+			return false;
+
+		/* every entry sharing the payload follows it */
+		for (j = index; j < ctx->keyCount; j++) {
+			syscfgReadEntry(ctx, j, &other);
+			if (other.seTag != kSyscfgTagCNTB || other.seDataOffset != entry.seDataOffset ||
+			    other.seDataSize != entry.seDataSize)
+				continue;
+			other.seDataOffset = offset;
+			if (!syscfgStore(ctx, ENTRY_OFFSET(j), &other, sizeof(other)))
+				return false;
+		}
+	}
+	return true;
+}
+
+int
+syscfg_ctx_add_tag(struct syscfg_ctx *ctx, u_int32_t tag, const void *data, size_t size)
+{
+	struct syscfgHeader	hdr;
+	u_int32_t		index;
+	size_t			newTableEnd;
+	char			chars[4];
+	bool			ok;
+
+	if (!syscfgWritable(ctx))
+		return -1;
+
+	if (syscfgLookupTag(ctx, tag, &index)) {
+		syscfgTagChars(tag, chars);
+		printf("syscfg: tag '%.4s' already present\n", chars);
+		return -1;
+	}
+
+	syscfgReadHeader(ctx, &hdr);
+	newTableEnd = ENTRY_OFFSET(ctx->keyCount + 1);
+	if (newTableEnd > syscfgPayloadLimit(ctx)) {
+		printf("syscfg: no room to grow the entry table\n");
+		return -1;
+	}
+
+	/* the payloads go first, so the new slot is free by the time the table is written */
+	ok = syscfgRelocateBelow(ctx, newTableEnd) &&
+	     syscfgMakeEntry(ctx, ctx->keyCount, tag, data, size, false, newTableEnd);
+
+	if (ok) {
+		hdr.shKeyCount = ctx->keyCount + 1;
+		if (hdr.shSize < newTableEnd)
+			hdr.shSize = (u_int32_t)newTableEnd;
+		ok = syscfgStore(ctx, 0, &hdr, sizeof(hdr));
+	}
+	if (ok)
+		ctx->keyCount++;
+
+	syscfgCtxReindex(ctx);
+	return ok ? 0 : -1;
+}
+
+int
+syscfg_ctx_remove_tag(struct syscfg_ctx *ctx, u_int32_t tag)
+{
+	struct syscfgHeader	hdr;
+	struct syscfgEntryCNTB	old;
+	u_int32_t		index, last;
+	bool			ok;
+
+	if (!syscfgWritable(ctx))
+		return -1;
+
+	if (!syscfgLookupTag(ctx, tag, &index))
+		return -1;
+
+	syscfgReadHeader(ctx, &hdr);
+	syscfgReadEntry(ctx, index, &old);
+	last = ctx->keyCount - 1;
+
+	/*
+	 * The last entry fills the gap. Its old slot is left as it is until the
+	 * commit clears it, after the header stops counting it, and is kept from
+	 * being reused for data until then.
+	 */
+	ok = syscfgRetire(ctx, &old) &&
+	     syscfgExtentAppend(&ctx->retired, &ctx->retiredCount, &ctx->retiredCapacity,
+				(u_int32_t)ENTRY_OFFSET(last), sizeof(struct syscfgEntry));
+	if (ok && index != last)
+		ok = syscfgStore(ctx, ENTRY_OFFSET(index), ctx->data + ENTRY_OFFSET(last), sizeof(struct syscfgEntry));
+
+	if (ok) {
+		hdr.shKeyCount = last;
+		if (hdr.shSize == ENTRY_OFFSET(ctx->keyCount))
+			hdr.shSize = (u_int32_t)ENTRY_OFFSET(last);
+		ok = syscfgStore(ctx, 0, &hdr, sizeof(hdr));
+	}
+	if (ok)
+		ctx->keyCount--;
+
+	syscfgCtxReindex(ctx);
+	return ok ? 0 : -1;
+}
+
+/*
+ * Put the part of a byte-swapped image at image offset start back into the
+ * bdev's byte order: header and table words are swapped, except the inline
+ * data of ordinary entries, which is raw bytes. start and len are word aligned.
+ */
+static void
+syscfgToDiskOrder(struct syscfg_ctx *ctx, uint8_t *buf, size_t start, size_t len)
+{
+	size_t		offset, tableEnd, field;
+	u_int32_t	tag;
+
+	tableEnd = ENTRY_OFFSET(ctx->keyCount);
+	for (offset = start; offset < start + len && offset < tableEnd; offset += sizeof(u_int32_t)) {
+		if (offset >= sizeof(struct syscfgHeader)) {
+			field = (offset - sizeof(struct syscfgHeader)) % sizeof(struct syscfgEntry);
+			memcpy(&tag, ctx->data + offset - field, sizeof(tag));
+			if (field != 0 && tag != kSyscfgTagCNTB)
+				continue;
+		}
+		syscfgSwapWords(buf + (offset - start), 1);
+	}
+}
+
+/* a commit in progress: what the bdev holds, as far as it has been read, and what it should end up holding */
+struct syscfgCommit {
+	struct syscfg_ctx	*ctx;
+	struct blockdev		*bdev;
+	block_addr		firstBlock;	/* holding the start of the region */
+	u_int32_t		blockCount;	/* covering the region */
+	size_t			skew;		/* of the region start within the first block */
+	uint8_t			*disk;		/* blockCount blocks from firstBlock */
+	void			*diskAlloc;
+	uint8_t			*image;		/* the region as it should be, in the bdev's byte order */
+	bool			*loaded;	/* per block of disk */
+	bool			*pending;	/* changed in disk but not yet written */
+	int			blocks;		/* written so far */
+};
+
+#define COMMIT_BLOCK(c, offset)	((u_int32_t)(((c)->skew + (offset)) >> (c)->bdev->block_shift))
+
+static void
+syscfgCommitFree(struct syscfgCommit *c)
+{
+	free(c->diskAlloc);
+	free(c->image);
+	free(c->loaded);
+	free(c->pending);
+}
+
+static bool
+syscfgCommitBegin(struct syscfgCommit *c, struct syscfg_ctx *ctx)
+{
+	struct blockdev	*bdev = ctx->bdev;
+	u_int64_t	lastBlock;
+	u_int32_t	align;
+
+	memset(c, 0, sizeof(*c));
+	c->ctx = ctx;
+	c->bdev = bdev;
+	c->firstBlock = (block_addr)(ctx->bdevOffset >> bdev->block_shift);
+	c->skew = (size_t)(ctx->bdevOffset & (bdev->block_size - 1));
+	lastBlock = (ctx->bdevOffset + ctx->dataLength - 1) >> bdev->block_shift;
+	c->blockCount = (u_int32_t)(lastBlock - c->firstBlock + 1);
+
+	/* the hooks are called directly, so the buffer has to meet the bdev's alignment */
+	align = __max(bdev->alignment, 1u);
+	c->diskAlloc = malloc(((size_t)c->blockCount << bdev->block_shift) + align);
+	c->image = (uint8_t *)malloc(ctx->dataLength);
+	c->loaded = (bool *)calloc(c->blockCount, sizeof(bool));
+	c->pending = (bool *)calloc(c->blockCount, sizeof(bool));
+	if (c->diskAlloc == NULL || c->image == NULL || c->loaded == NULL || c->pending == NULL) {
+		printf("syscfg: out of memory for the commit\n");
+		syscfgCommitFree(c);
+		return false;
+	}
+	c->disk = (uint8_t *)(((uintptr_t)c->diskAlloc + align - 1) & ~(uintptr_t)(align - 1));
+
+	memcpy(c->image, ctx->data, ctx->dataLength);
+	if (ctx->swapped)
+		syscfgToDiskOrder(ctx, c->image, 0, ctx->dataLength);
+	return true;
+}
+
+/* read the blocks under image bytes [start, end) that aren't in yet */
+static bool
+syscfgCommitLoad(struct syscfgCommit *c, size_t start, size_t end)
+{
+	u_int32_t	block;
+
+	for (block = COMMIT_BLOCK(c, start); block <= COMMIT_BLOCK(c, end - 1); block++) {
+		if (c->loaded[block])
+			continue;
+		if (blockdev_read_block(c->bdev, c->disk + ((size_t)block << c->bdev->block_shift),
+					c->firstBlock + block, 1) != 1) {
+			printf("syscfg: bdev read fail at block 0x%x\n", c->firstBlock + block);
+			return false;
+		}
+		c->loaded[block] = true;
+	}
+	return true;
+}
+
+/* take image bytes [start, end) into the loaded blocks; the next flush writes them */
+static void
+syscfgCommitApply(struct syscfgCommit *c, size_t start, size_t end)
+{
+	u_int32_t	block;
+
+	memcpy(c->disk + c->skew + start, c->image + start, end - start);
+	for (block = COMMIT_BLOCK(c, start); block <= COMMIT_BLOCK(c, end - 1); block++)
+		c->pending[block] = true;
+}
+
+/*
+ * Take changed image bytes [start, end), all past the table, except those in
+ * retired extents: the table on disk may still use them, and nothing in the
+ * image does, so the image gets back what the bdev holds there instead.
+ */
+static void
+syscfgCommitData(struct syscfgCommit *c, size_t start, size_t end)
+{
+	struct syscfg_ctx	*ctx = c->ctx;
+	size_t			stop, skip, retiredStart, retiredEnd;
+	u_int32_t		i;
+
+	while (start < end) {
+		stop = end;
+		skip = start;
+		for (i = 0; i < ctx->retiredCount; i++) {
+			retiredStart = ctx->retired[i].offset;
+			retiredEnd = retiredStart + ctx->retired[i].size;
+			if (retiredStart <= start && retiredEnd > start)
+				skip = __max(skip, retiredEnd);
+			else if (retiredStart > start && retiredStart < stop)
+				stop = retiredStart;
+		}
+
+		if (skip > start) {
+			skip = __min(skip, end);
+			memcpy(ctx->data + start, c->disk + c->skew + start, skip - start);
+			start = skip;
+		}
+		else {
+			syscfgCommitApply(c, start, stop);
+			start = stop;
+		}
+	}
+}
+
+/*
+ * The region is normally inside the range protected at init, which is there
+ * to keep other writers off it, so the commit writes past the protection
+ * without lifting it for anyone else.
+ */
+static bool
+syscfgCommitWriteBlocks(struct syscfgCommit *c, u_int32_t block, u_int32_t count)
+{
+	const uint8_t	*ptr = c->disk + ((size_t)block << c->bdev->block_shift);
+	int		err;
+
+	err = blockdev_write_block_unprotected(c->bdev, ptr, c->firstBlock + block, count);
+	if (err > 0)
+		c->blocks += err;
+	if (err < 0 || (u_int32_t)err < count) {
+		printf("syscfg: bdev write fail (%d) at block 0x%x\n", err, c->firstBlock + block);
+		return false;
+	}
+	return true;
+}
+
+/* write every pending block, lowest first */
+static bool
+syscfgCommitFlush(struct syscfgCommit *c)
+{
+	u_int32_t	block, count;
+
+	for (block = 0; block < c->blockCount; block += count) {
+		for (count = 0; block + count < c->blockCount && c->pending[block + count]; count++)
+			c->pending[block + count] = false;
+		if (count == 0)
+			count = 1;
+		else if (!syscfgCommitWriteBlocks(c, block, count))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Write the changes back to the bdev, working from what it actually holds:
+ *
+ *   1. extended data, none of it under the table or in a payload that the
+ *      table on disk refers to;
+ *   2. changed entries, in index order, so a slot filled from a later one is
+ *      written before that one can go; a slot whose changes span two blocks
+ *      has its tag cleared, then its tail written, then its head and tag, so
+ *      it is briefly absent but never seen half written;
+ *   3. the header, which makes a grown or shrunk table count;
+ *   4. the slots a shrunk table no longer counts, cleared.
+ *
+ * A crash between any two block writes leaves an image that loads, with each
+ * entry as it was, as it is now or, for a split slot, missing. A failed commit
+ * can be retried.
+ * Returns the number of blocks written, or -1 on failure, in which case the
+ * changes stay pending.
+ */
+int
+syscfg_ctx_commit(struct syscfg_ctx *ctx)
+{
+	struct syscfgCommit	c;
+	struct syscfgHeader	diskHdr;
+	u_int32_t		i, index, diskCount;
+	size_t			tableEnd, diskTableEnd, tableMax, start, end, slot, edge;
+	int			result = -1;
+
+	if (!syscfgWritable(ctx))
+		return -1;
+	if (ctx->dirtyCount == 0)
+		return 0;
+
+	if (!syscfgCommitBegin(&c, ctx))
+		return -1;
+
+	/* how big the table on disk is decides what may be written before the header */
+	if (!syscfgCommitLoad(&c, 0, sizeof(diskHdr)))
+		goto out;
+	memcpy(&diskHdr, c.disk + c.skew, sizeof(diskHdr));
+	if (ctx->swapped)
+		syscfgSwapWords((uint8_t *)&diskHdr, sizeof(diskHdr) / sizeof(u_int32_t));
+	diskCount = diskHdr.shKeyCount;
+
+	tableEnd = ENTRY_OFFSET(ctx->keyCount);
+	diskTableEnd = ENTRY_OFFSET(diskCount);
+	if (diskTableEnd > ctx->dataLength) {
+		diskCount = ctx->keyCount;
+		diskTableEnd = tableEnd;
+	}
+	tableMax = __max(tableEnd, diskTableEnd);
+	if (!syscfgCommitLoad(&c, 0, tableMax))
+		goto out;
+
+	/* 1. */
+	for (i = 0; i < ctx->dirtyCount; i++) {
+		start = __max((size_t)ctx->dirty[i].offset, tableMax);
+		end = __min((size_t)ctx->dirty[i].offset + ctx->dirty[i].size, ctx->dataLength);
+		if (start >= end)
+			continue;
+		if (!syscfgCommitLoad(&c, start, end))
+			goto out;
+		syscfgCommitData(&c, start, end);
+	}
+	if (!syscfgCommitFlush(&c))
+		goto out;
+
+	/* 2. */
+	for (index = 0; index < ctx->keyCount; index++) {
+		slot = ENTRY_OFFSET(index);
+		for (start = slot; start < slot + sizeof(struct syscfgEntry) && c.disk[c.skew + start] == c.image[start]; start++)
+			;
+		if (start == slot + sizeof(struct syscfgEntry))
+			continue;
+		for (end = slot + sizeof(struct syscfgEntry); c.disk[c.skew + end - 1] == c.image[end - 1]; end--)
+			;
+
+		if (COMMIT_BLOCK(&c, start) == COMMIT_BLOCK(&c, end - 1)) {
+			syscfgCommitApply(&c, start, end);
+			continue;
+		}
+
+		edge = ((c.skew + start) | (ctx->bdev->block_size - 1)) + 1 - c.skew;
+		if (!syscfgCommitFlush(&c))
+			goto out;
+		if (index < diskCount) {
+			memset(c.disk + c.skew + slot, 0, sizeof(u_int32_t));
+			c.pending[COMMIT_BLOCK(&c, slot)] = true;
+			if (!syscfgCommitFlush(&c))
+				goto out;
+		}
+		syscfgCommitApply(&c, edge, end);
+		if (!syscfgCommitFlush(&c))
+			goto out;
+		syscfgCommitApply(&c, slot, edge);
+	}
+	if (!syscfgCommitFlush(&c))
+		goto out;
+
+	/* 3. */
+	if (memcmp(c.disk + c.skew, c.image, sizeof(struct syscfgHeader)) != 0) {
+		syscfgCommitApply(&c, 0, sizeof(struct syscfgHeader));
+		if (!syscfgCommitFlush(&c))
+			goto out;
+	}
+
+	/* 4. */
+	if (diskTableEnd > tableEnd) {
+		memset(ctx->data + tableEnd, 0, diskTableEnd - tableEnd);
+		memset(c.image + tableEnd, 0, diskTableEnd - tableEnd);
+		syscfgCommitApply(&c, tableEnd, diskTableEnd);
+		if (!syscfgCommitFlush(&c))
+			goto out;
+	}
+
+	ctx->dirtyCount = 0;
+	ctx->retiredCount = 0;
+	result = c.blocks;
+out:
+	syscfgCommitFree(&c);
+	return result;
+}
@@ -9,6 +9,229 @@
 #include <vector>
 
 #include "syscfg.h"
+#include "modemmon.h"
+#include "modemset.h"
+#include "capture.h"
+#include "eventlog.h"
+#include "blockdev.h"
+#include "serial_blockdev.h"
+#include "trace.h"
+
+static struct modem_set *monitoredSet;
+static struct modem_line *servedLine;
+
+// what the monitor callbacks feed besides the console
+struct MonitorOutputs {
+	struct capture		*capture;
+	struct event_log	*log;
+};
+
+static BOOL WINAPI StopMonitor(DWORD ctrlType)
+{
+	if (ctrlType != CTRL_C_EVENT && ctrlType != CTRL_BREAK_EVENT)
+		return FALSE;
+	if (servedLine != NULL)
+		servedLine->cancel_hook(servedLine);
+	else
+		modem_set_stop(monitoredSet);
+	return TRUE;
+}
+
+static bool PrintModemEvent(void *refcon, struct modem_line *line, const struct modem_event *event)
+{
+	char lines[32], changed[32];
+	struct MonitorOutputs *outputs = (struct MonitorOutputs *)refcon;
+
+	// with a log the transitions go there; printing them would only slow a busy set down
+	if (outputs->log != NULL)
+		return event_log_append(outputs->log, event) == 0;
+
+	if (event->changed == 0)
+		printf("%llu.%06llu %s STATUS %s\n", event->timestamp / 1000000, event->timestamp % 1000000,
+			line->name, modem_lines_string(event->lines, lines, sizeof(lines)));
+	else
+		printf("%llu.%06llu %s STATUS %s (changed %s)\n", event->timestamp / 1000000, event->timestamp % 1000000,
+			line->name, modem_lines_string(event->lines, lines, sizeof(lines)),
+			modem_lines_string(event->changed, changed, sizeof(changed)));
+	return true;
+}
+
+static void PrintCaptureStats(struct capture *capture)
+{
+	struct capture_stats stats;
+
+	capture_get_stats(capture, &stats);
+	printf("capture: %llu bytes in %llu reads, %.0f bytes/s; ring high water %u of %u; %llu bytes lost in %llu overruns; %llu bytes written\n",
+		stats.bytes, stats.chunks, stats.elapsed ? stats.bytes * 1e6 / stats.elapsed : 0.0,
+		stats.highWater, stats.ringSize, stats.overrunBytes, stats.overruns, stats.written);
+}
+
+static void PrintModemStats(void *refcon, const struct modem_set_stats *stats)
+{
+	printf("%u ports (%u active, %u failed): %llu events, %.1f/s over the last %.1fs, %llu wakeups\n",
+		stats->ports, stats->activePorts, stats->failedPorts, stats->events,
+		stats->intervalElapsed ? stats->intervalEvents * 1e6 / stats->intervalElapsed : 0.0,
+		stats->intervalElapsed / 1e6, stats->wakeups);
+
+	struct MonitorOutputs *outputs = (struct MonitorOutputs *)refcon;
+	if (outputs->capture != NULL)
+		PrintCaptureStats(outputs->capture);
+	// keep what has been logged safe on disk should the monitor be killed
+	if (outputs->log != NULL)
+		event_log_flush(outputs->log);
+}
+
+static bool PrintLoggedEvent(void *refcon, const struct modem_event *event)
+{
+	struct event_log_reader *reader = (struct event_log_reader *)refcon;
+	char lines[32], changed[32];
+	const char *name = event_log_port_name(reader, event->port);
+	int64_t when = (int64_t)event->timestamp + event_log_epoch_offset(reader);
+	time_t seconds = (time_t)(when / 1000000);
+	struct tm tm;
+	char date[32];
+
+	localtime_s(&tm, &seconds);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%06lld %s STATUS %s (changed %s)\n", date, when % 1000000,
+		name != NULL ? name : "?",
+		modem_lines_string(event->lines, lines, sizeof(lines)),
+		modem_lines_string(event->changed, changed, sizeof(changed)));
+	return true;
+}
+
+// "DCD" matches any DCD transition, "DCD-" only drops and "DCD+" only raises
+static bool ParseLineFilter(const char *filter, struct event_log_query *query)
+{
+	static const char *names[] = { "CTS", "DSR", "RI", "DCD" };
+
+	for (uint32_t bit = 0; bit < 4; bit++) {
+		size_t len = strlen(names[bit]);
+		if (_strnicmp(filter, names[bit], len) != 0)
+			continue;
+		if (filter[len] != 0 && filter[len] != '+' && filter[len] != '-')
+			continue;
+		query->changed |= 1u << bit;
+		if (filter[len] != 0) {
+			query->levelMask |= 1u << bit;
+			if (filter[len] == '+')
+				query->levelValue |= 1u << bit;
+		}
+		return true;
+	}
+	return false;
+}
+
+// testcom -r file [-p port] [-w line[+|-]]
+static int ReplayEventLog(const char *path, const char *port, const char *filter)
+{
+	struct event_log_reader *reader = event_log_open(path);
+	struct event_log_query query;
+	struct event_log_summary summary;
+	uint64_t start = modem_time_us();
+	int64_t count;
+
+	if (reader == NULL)
+		return (1);
+
+	event_log_query_all(&query);
+	if (port != NULL) {
+		for (uint32_t i = 0; i < event_log_port_count(reader); i++) {
+			const char *name = event_log_port_name(reader, i);
+			if (name != NULL && _stricmp(name, port) == 0)
+				query.port = (int32_t)i;
+		}
+		if (query.port < 0) {
+			printf("%s: %s is not in the log\n", path, port);
+			event_log_close_reader(reader);
+			return (1);
+		}
+	}
+	if (filter != NULL && !ParseLineFilter(filter, &query)) {
+		printf("%s: unknown line\n", filter);
+		event_log_close_reader(reader);
+		return (1);
+	}
+
+	count = event_log_replay(reader, &query, PrintLoggedEvent, reader);
+	if (count < 0 || event_log_summarize(reader, &query, &summary) != 0) {
+		printf("%s: damaged\n", path);
+		event_log_close_reader(reader);
+		return (1);
+	}
+	printf("%llu events in %.3f ms; rises CTS %llu DSR %llu RI %llu DCD %llu; falls CTS %llu DSR %llu RI %llu DCD %llu\n",
+		summary.events, (modem_time_us() - start) / 1e3,
+		summary.rises[0], summary.rises[1], summary.rises[2], summary.rises[3],
+		summary.falls[0], summary.falls[1], summary.falls[2], summary.falls[3]);
+	event_log_close_reader(reader);
+	return (0);
+}
+
+static void ArgToString(const TCHAR *arg, char *buf, size_t len)
+{
+#ifdef _UNICODE
+	WideCharToMultiByte(CP_ACP, 0, arg, -1, buf, (int)len, NULL, NULL);
+#else
+	strncpy_s(buf, len, arg, _TRUNCATE);
+#endif
+}
+
+// testcom -R port [-b baud]: dump the syscfg of the unit at the far end of port
+static int DumpRemoteSyscfg(const char *port, uint32_t baud)
+{
+	struct modem_line *line = modem_line_open(port);
+	if (line == NULL)
+		return (1);
+	if (line->raw_hook(line, baud) != 0) {
+		modem_line_close(line);
+		return (1);
+	}
+
+	struct blockdev *dev = create_serial_blockdev("serial", line);
+	if (dev == NULL) {
+		modem_line_close(line);
+		return (1);
+	}
+	register_blockdev(dev);
+
+	int result = 1;
+	struct syscfg_ctx *ctx = syscfg_ctx_open_bdev("serial");
+	if (ctx != NULL) {
+		syscfg_ctx_dump(ctx, 0, NULL);
+		syscfg_ctx_close(ctx);
+		result = 0;
+	}
+
+	struct serial_blockdev_stats stats;
+	serial_blockdev_get_stats(dev, &stats);
+	printf("serial: %llu bytes in %llu requests, %llu resent, %llu bad frames\n",
+		stats.bytes, stats.requests, stats.retransmits, stats.badFrames);
+
+	unregister_blockdev(dev);
+	free_serial_blockdev(dev);
+	return (result);
+}
+
+// testcom -S file [-b baud] port: answer for that unit from file until Ctrl+C
+static int ServeSyscfg(const char *path, const char *port, uint32_t baud)
+{
+	struct modem_line *line = modem_line_open(port);
+	if (line == NULL)
+		return (1);
+	if (line->raw_hook(line, baud) != 0) {
+		modem_line_close(line);
+		return (1);
+	}
+
+	servedLine = line;
+	SetConsoleCtrlHandler(StopMonitor, TRUE);
+	int result = serial_blockdev_serve_file(line, path, 512);
+	SetConsoleCtrlHandler(StopMonitor, FALSE);
+	servedLine = NULL;
+
+	modem_line_close(line);
+	return (result == 0 ? 0 : 1);
+}
 
 int _tmain(int argc, TCHAR *argv[])
 {
@@ -28,47 +251,157 @@ int _tmain(int argc, TCHAR *argv[])
 	}
 //*/
 //*
-	TCHAR comName[MAX_PATH] = { 0 };
-	_stprintf_s(comName, _T("\\\\.\\%s"), argv[1]);
-
-	HANDLE h = CreateFile(comName,//_T("\\\\.\\COM4"),
-		GENERIC_READ | GENERIC_WRITE,           // access (read-write) mode
-		0,                  // share mode
-		NULL,               // address of security descriptor
-		OPEN_EXISTING,      // how to create
-		0,                  // file attributes
-		NULL                // handle of file with attributes to copy
-	);
-	if (h == INVALID_HANDLE_VALUE)
-	{
-		//  Handle the error.
-		printf("CreateFile failed with error %d.\n", GetLastError());
-		return (1);
+	// testcom [-i seconds] [-c file [-b baud] [-m]] [-l file] port|pattern ...
+	// testcom -r file [-p port] [-w line[+|-]]
+	// testcom -R port [-b baud] [-t trace.json] | -S file [-b baud] port
+	uint32_t interval = 0;
+	uint32_t baud = 0;
+	uint32_t captureFlags = 0;
+	TCHAR *capturePath = NULL;
+	TCHAR *logPath = NULL;
+	TCHAR *replayPath = NULL;
+	TCHAR *replayPort = NULL;
+	TCHAR *replayFilter = NULL;
+	TCHAR *remotePort = NULL;
+	TCHAR *servePath = NULL;
+	TCHAR *tracePath = NULL;
+	int first = 1;
+	for (; first < argc && argv[first][0] == _T('-'); first++) {
+		if (_tcscmp(argv[first], _T("-m")) == 0) {
+			captureFlags |= CAPTURE_MMAP;
+			continue;
+		}
+		if (first + 1 >= argc)
+			break;
+		if (_tcscmp(argv[first], _T("-i")) == 0)
+			interval = (uint32_t)_tstoi(argv[++first]) * 1000;
+		else if (_tcscmp(argv[first], _T("-b")) == 0)
+			baud = (uint32_t)_tstoi(argv[++first]);
+		else if (_tcscmp(argv[first], _T("-c")) == 0)
+			capturePath = argv[++first];
+		else if (_tcscmp(argv[first], _T("-l")) == 0)
+			logPath = argv[++first];
+		else if (_tcscmp(argv[first], _T("-r")) == 0)
+			replayPath = argv[++first];
+		else if (_tcscmp(argv[first], _T("-p")) == 0)
+			replayPort = argv[++first];
+		else if (_tcscmp(argv[first], _T("-w")) == 0)
+			replayFilter = argv[++first];
+		else if (_tcscmp(argv[first], _T("-R")) == 0)
+			remotePort = argv[++first];
+		else if (_tcscmp(argv[first], _T("-S")) == 0)
+			servePath = argv[++first];
+		else if (_tcscmp(argv[first], _T("-t")) == 0)
+			tracePath = argv[++first];
+		else
+			break;
 	}
-	DWORD  ModemStat = 0;
-	while (true)
-	{
-		BOOL b = GetCommModemStatus(
-			h,
-			&ModemStat
-		);
-		if (!b) {
-			printf(" failed with error %d.\n", GetLastError());
+	if (replayPath != NULL) {
+		char path[MAX_PATH], port[MAX_PATH], filter[32];
+		ArgToString(replayPath, path, sizeof(path));
+		if (replayPort != NULL)
+			ArgToString(replayPort, port, sizeof(port));
+		if (replayFilter != NULL)
+			ArgToString(replayFilter, filter, sizeof(filter));
+		return ReplayEventLog(path, replayPort != NULL ? port : NULL, replayFilter != NULL ? filter : NULL);
+	}
+	if (remotePort != NULL) {
+		char port[MAX_PATH];
+		ArgToString(remotePort, port, sizeof(port));
+		int result = DumpRemoteSyscfg(port, baud);
+		// a timeline of the block reads and lookups, in a WITH_TRACE=1 build
+		if (tracePath != NULL) {
+			char path[MAX_PATH];
+			ArgToString(tracePath, path, sizeof(path));
+			if (trace_dump_json(path) != 0)
+				result = 1;
 		}
-		printf("STATUS %x.\n", ModemStat);
+		return result;
+	}
+	if (servePath != NULL && first < argc) {
+		char path[MAX_PATH], port[MAX_PATH];
+		ArgToString(servePath, path, sizeof(path));
+		ArgToString(argv[first], port, sizeof(port));
+		return ServeSyscfg(path, port, baud);
+	}
+	if (first >= argc) {
+		printf("usage: testcom [-i seconds] [-c file [-b baud] [-m]] [-l file] <port|pattern> ...\n");
+		printf("       testcom -r file [-p port] [-w line[+|-]]\n");
+		printf("       testcom -R port [-b baud] [-t trace.json]\n");
+		printf("       testcom -S file [-b baud] port\n");
+		return (1);
+	}
 
-		Sleep(1000);
+	struct modem_set *set = modem_set_create(MODEM_LINE_ALL);
+	if (set == NULL)
+		return (1);
 
-		/*DCB dcb;
-		dcb.DCBlength = sizeof(DCB);
+	for (int i = first; i < argc; i++) {
+		char port[MAX_PATH];
+		ArgToString(argv[i], port, sizeof(port));
+		if (modem_set_open(set, port) == 0)
+			printf("%s: no ports opened\n", port);
+	}
+	if (modem_set_count(set) == 0) {
+		modem_set_free(set);
+		return (1);
+	}
+
+	// capture the data from the same ports while the set watches their lines
+	struct capture *capture = NULL;
+	if (capturePath != NULL) {
+		char path[MAX_PATH];
+		ArgToString(capturePath, path, sizeof(path));
+		capture = capture_create(path, 1 << 20, captureFlags);
+		for (uint32_t port = 0; port < modem_set_count(set); port++) {
+			struct modem_line *line = modem_set_line(set, port);
+			if (line->raw_hook(line, baud) != 0 || capture_add(capture, line) < 0)
+				printf("%s: not captured\n", line->name);
+		}
+		if (capture_start(capture) != 0) {
+			capture_free(capture);
+			modem_set_free(set);
+			return (1);
+		}
+	}
 
-		b = GetCommState(h, &dcb);
-		if (!b) {
-			printf(" failed with error %d.\n", GetLastError());
-		}*/
+	// log transitions under the names the ports were opened by
+	struct event_log *log = NULL;
+	if (logPath != NULL) {
+		char path[MAX_PATH];
+		std::vector<const char *> names;
+		ArgToString(logPath, path, sizeof(path));
+		for (uint32_t port = 0; port < modem_set_count(set); port++)
+			names.push_back(modem_set_line(set, port)->name);
+		log = event_log_create(path, modem_set_count(set), names.data());
+		if (log == NULL) {
+			if (capture != NULL) {
+				capture_stop(capture);
+				capture_free(capture);
+			}
+			modem_set_free(set);
+			return (1);
+		}
 	}
 
-	CloseHandle(h);
+	// Ctrl+C stops the monitor rather than killing it mid-wait
+	monitoredSet = set;
+	SetConsoleCtrlHandler(StopMonitor, TRUE);
+
+	struct MonitorOutputs outputs = { capture, log };
+	int result = modem_set_run(set, PrintModemEvent, PrintModemStats, interval, &outputs);
+
+	SetConsoleCtrlHandler(StopMonitor, FALSE);
+	if (capture != NULL) {
+		if (capture_stop(capture) != 0)
+			result = -1;
+		PrintCaptureStats(capture);
+		capture_free(capture);
+	}
+	if (log != NULL && event_log_close(log) != 0)
+		result = -1;
+	modem_set_free(set);
+	return (result == 0 ? 0 : 1);
 //*/
 }
 
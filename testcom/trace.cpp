@@ -0,0 +1,198 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include "trace.h"
+#include "compat.h"
+
+#if WITH_TRACE
+
+/* rings live as long as the process, so a thread's events outlast it */
+static std::mutex		trace_lock;
+static struct trace_ring	*trace_rings = NULL;
+static uint32_t			trace_threads = 0;
+static uint64_t			trace_origin_ticks;	/* trace_ticks() and trace_clock() at the first attach */
+static uint64_t			trace_origin_ns;
+
+thread_local struct trace_ring	*trace_current = NULL;
+
+uint64_t trace_clock(void)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct trace_ring *trace_attach(void)
+{
+	struct trace_ring *ring;
+
+	ring = new struct trace_ring;
+	ring->head.store(0, std::memory_order_relaxed);
+
+	{
+		std::lock_guard<std::mutex> guard(trace_lock);
+
+		if (trace_rings == NULL) {
+			trace_origin_ticks = trace_ticks();
+			trace_origin_ns = trace_clock();
+		}
+		ring->thread = ++trace_threads;
+		ring->next = trace_rings;
+		trace_rings = ring;
+	}
+
+	trace_current = ring;
+	return ring;
+}
+
+/* how each trace point appears in the timeline; NULL arguments are left out */
+static const struct {
+	const char	*name;
+	const char	*arg0;
+	const char	*arg1;
+	const char	*result;
+} trace_names[TRACE_ID_COUNT] = {
+	{ NULL, NULL, NULL, NULL },
+	{ "blockdev_read", "offset", "length", "result" },
+	{ "blockdev_read_block", "block", "count", "result" },
+	{ "blockdev_write", "offset", "length", "result" },
+	{ "blockdev_write_block", "block", "count", "result" },
+	{ "blockdev_erase", "offset", "length", "result" },
+	{ "bounce_alloc", "size", "alignment", NULL },
+	{ "syscfgFindByTag", "tag", NULL, "found" },
+	{ "syscfgFindByIndex", "index", NULL, "found" },
+	{ "syscfgLoadBdev", "lazy", NULL, "loaded" },
+	{ "syscfg_ctx_open_buffer", "length", NULL, "opened" },
+	{ "syscfg_ctx_iter_next", "index", NULL, "found" },
+};
+
+static void trace_json_arg(FILE *fp, bool *first, const char *name, uint64_t value)
+{
+	char	fourcc[5];
+	int	i;
+
+	if (name == NULL)
+		return;
+	fprintf(fp, "%s\"%s\":", *first ? "" : ",", name);
+	*first = false;
+
+	/* tags read better as their four characters */
+	if (strcmp(name, "tag") == 0) {
+		for (i = 0; i < 4; i++) {
+			fourcc[i] = (char)(value >> (24 - 8 * i));
+			if (fourcc[i] < ' ' || fourcc[i] > '~' || fourcc[i] == '"' || fourcc[i] == '\\')
+				break;
+		}
+		if (i == 4) {
+			fourcc[4] = 0;
+			fprintf(fp, "\"%s\"", fourcc);
+			return;
+		}
+	}
+	fprintf(fp, "%llu", (unsigned long long)value);
+}
+
+#endif
+
+int trace_dump_json(const char *path)
+{
+	FILE		*fp;
+	int		result;
+
+	fp = compat_fopen(path, "w");
+	if (fp == NULL) {
+		printf("trace: can't create %s\n", path);
+		return -1;
+	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"blockdev/syscfg\"}}");
+
+#if WITH_TRACE
+	{
+		std::vector<struct trace_record>	records;
+		struct trace_ring			*ring;
+		struct trace_ring			*rings;
+		uint64_t				start, first, last, after, i;
+		uint64_t				ticks, ns;
+		double					nsPerTick;
+		uint32_t				depth;
+		bool					firstArg;
+
+		{
+			std::lock_guard<std::mutex> guard(trace_lock);
+			rings = trace_rings;
+		}
+
+		/* the TSC rate is measured over the life of the trace */
+		ticks = trace_ticks() - (rings != NULL ? trace_origin_ticks : 0);
+		ns = trace_clock() - (rings != NULL ? trace_origin_ns : 0);
+#ifdef TRACE_HAVE_TSC
+		nsPerTick = ticks != 0 ? (double)ns / ticks : 1.0;
+#else
+		nsPerTick = 1.0;
+#endif
+
+		/* rings are only ever pushed on the front, so the list from here on is stable */
+		for (ring = rings; ring != NULL; ring = ring->next) {
+			fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+				ring->thread, ring->thread);
+
+			last = ring->head.load(std::memory_order_acquire);
+			start = last > TRACE_RING_RECORDS ? last - TRACE_RING_RECORDS : 0;
+			records.resize((size_t)(last - start));
+			for (i = start; i < last; i++)
+				records[(size_t)(i - start)] = ring->records[i & (TRACE_RING_RECORDS - 1)];
+
+			/* the owner may have lapped the copy; its next record may be half written too */
+			after = ring->head.load(std::memory_order_acquire);
+			first = start;
+			if (after + 1 > start + TRACE_RING_RECORDS)
+				first = __min(last, after + 1 - TRACE_RING_RECORDS);
+
+			depth = 0;
+			for (i = first; i < last; i++) {
+				const struct trace_record *record = &records[(size_t)(i - start)];
+
+				if (record->id == 0 || record->id >= TRACE_ID_COUNT)
+					continue;
+				/* an end whose begin has been overwritten would close the wrong slice */
+				if (record->phase == TRACE_PHASE_END) {
+					if (depth == 0)
+						continue;
+					depth--;
+				}
+				else if (record->phase == TRACE_PHASE_BEGIN) {
+					depth++;
+				}
+
+				fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u%s\"args\":{",
+					trace_names[record->id].name, record->phase,
+					(int64_t)(record->timestamp - trace_origin_ticks) * nsPerTick / 1000.0, ring->thread,
+					record->phase == TRACE_PHASE_INSTANT ? ",\"s\":\"t\"," : ",");
+				firstArg = true;
+				if (record->phase == TRACE_PHASE_END) {
+					trace_json_arg(fp, &firstArg, trace_names[record->id].result, record->arg0);
+				}
+				else {
+					trace_json_arg(fp, &firstArg, trace_names[record->id].arg0, record->arg0);
+					trace_json_arg(fp, &firstArg, trace_names[record->id].arg1, record->arg1);
+				}
+				fprintf(fp, "}}");
+			}
+		}
+	}
+#endif
+
+	fprintf(fp, "\n]}\n");
+	result = ferror(fp) ? -1 : 0;
+	if (fclose(fp) != 0)
+		result = -1;
+	if (result != 0)
+		printf("trace: can't write %s\n", path);
+	return result;
+}
@@ -0,0 +1,133 @@
+/*
+ * Trace points.
+ *
+ * Build with WITH_TRACE=1 to record blockdev hook dispatch, bounce buffer
+ * allocation and syscfg lookups. Each thread writes fixed-size records into
+ * its own ring, with no locks or shared cache lines, so an event costs a
+ * timestamp read and a few stores; the oldest records are overwritten.
+ * trace_dump_json() turns every ring into a Chrome trace / Perfetto timeline.
+ *
+ * Without WITH_TRACE the trace points compile to nothing.
+ */
+
+#ifndef __LIB_TRACE_H
+#define __LIB_TRACE_H
+
+#include <stdio.h>
+#include "types.h"
+
+#ifndef WITH_TRACE
+#define WITH_TRACE 0
+#endif
+
+#if WITH_TRACE
+#include <atomic>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define TRACE_HAVE_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_HAVE_TSC 1
+#endif
+#endif
+
+__BEGIN_DECLS
+
+enum trace_id {
+	TRACE_BLOCKDEV_READ = 1,		/* arg0 offset, arg1 length; end: arg0 result */
+	TRACE_BLOCKDEV_READ_BLOCK,		/* arg0 block, arg1 count; end: arg0 result */
+	TRACE_BLOCKDEV_WRITE,
+	TRACE_BLOCKDEV_WRITE_BLOCK,
+	TRACE_BLOCKDEV_ERASE,
+	TRACE_BOUNCE_ALLOC,			/* arg0 size, arg1 alignment */
+	TRACE_SYSCFG_FIND_BY_TAG,		/* arg0 tag; end: arg0 found */
+	TRACE_SYSCFG_FIND_BY_INDEX,		/* arg0 index; end: arg0 found */
+	TRACE_SYSCFG_LOAD_BDEV,			/* arg0 lazy; end: arg0 loaded */
+	TRACE_SYSCFG_OPEN_BUFFER,		/* arg0 length; end: arg0 opened */
+	TRACE_SYSCFG_ITER_NEXT,			/* arg0 index; end: arg0 found */
+	TRACE_ID_COUNT
+};
+
+#define TRACE_PHASE_BEGIN	'B'
+#define TRACE_PHASE_END		'E'
+#define TRACE_PHASE_INSTANT	'i'
+
+struct trace_record {
+	uint64_t	timestamp;	/* trace_ticks() */
+	uint16_t	id;
+	uint8_t		phase;
+	uint8_t		reserved[5];
+	uint64_t	arg0;
+	uint64_t	arg1;
+};
+
+/*
+ * Write a Chrome trace event file of everything still in the rings. Safe
+ * while other threads trace; records they overwrite during the dump are
+ * left out. Returns 0, or -1 if the file could not be written.
+ */
+int trace_dump_json(const char *path);
+
+#if WITH_TRACE
+
+#define TRACE_RING_RECORDS	(1 << 14)	/* per thread, a power of two */
+
+struct trace_ring {
+	struct trace_record	records[TRACE_RING_RECORDS];
+	std::atomic<uint64_t>	head;		/* records ever written; only the owning thread stores */
+	struct trace_ring	*next;
+	uint32_t		thread;
+};
+
+extern thread_local struct trace_ring *trace_current;
+
+/* give the calling thread a ring */
+struct trace_ring *trace_attach(void);
+
+uint64_t trace_clock(void);
+
+static inline uint64_t
+trace_ticks(void)
+{
+#ifdef TRACE_HAVE_TSC
+	return __rdtsc();
+#else
+	return trace_clock();
+#endif
+}
+
+static inline void
+trace_emit(uint16_t id, uint8_t phase, uint64_t arg0, uint64_t arg1)
+{
+	struct trace_ring	*ring = trace_current;
+	struct trace_record	*record;
+	uint64_t		head;
+
+	if (ring == NULL)
+		ring = trace_attach();
+
+	head = ring->head.load(std::memory_order_relaxed);
+	record = &ring->records[head & (TRACE_RING_RECORDS - 1)];
+	record->timestamp = trace_ticks();
+	record->id = id;
+	record->phase = phase;
+	record->arg0 = arg0;
+	record->arg1 = arg1;
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+#define TRACE_BEGIN(id, arg0, arg1)	trace_emit((id), TRACE_PHASE_BEGIN, (uint64_t)(arg0), (uint64_t)(arg1))
+#define TRACE_END(id, arg0)		trace_emit((id), TRACE_PHASE_END, (uint64_t)(arg0), 0)
+#define TRACE_INSTANT(id, arg0, arg1)	trace_emit((id), TRACE_PHASE_INSTANT, (uint64_t)(arg0), (uint64_t)(arg1))
+
+#else
+
+#define TRACE_BEGIN(id, arg0, arg1)	do { } while (0)
+#define TRACE_END(id, arg0)		do { } while (0)
+#define TRACE_INSTANT(id, arg0, arg1)	do { } while (0)
+
+#endif
+
+__END_DECLS
+
+#endif
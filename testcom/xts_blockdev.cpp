@@ -0,0 +1,160 @@
+#include "pch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <mutex>
+#include <new>
+#include "blockdev.h"
+#include "xts_blockdev.h"
+#include "aes.h"
+
+/* how much goes to or from the parent at once: small enough to stay in cache between the copy and the cipher */
+#define XTS_BATCH_BYTES		(64 * 1024)
+
+struct xts_blockdev {
+	struct blockdev		bdev;
+	struct blockdev		*parent;
+	struct aes_xts_key	key;
+	uint32_t		batch_blocks;
+
+	/* writes are encrypted into the scratch batch, never the caller's buffer; the lock covers it */
+	std::mutex		*scratch_lock;
+	uint8_t			*scratch;
+	void			*scratch_alloc;
+};
+
+/* reads decrypt in place in the caller's buffer, a batch at a time as the parent fills it */
+static int xts_read_block(struct blockdev *_dev, void *ptr, block_addr block, uint32_t count)
+{
+	struct xts_blockdev	*dev = (struct xts_blockdev *)_dev;
+	uint8_t			*dst = (uint8_t *)ptr;
+	uint32_t		done, n;
+	int			got;
+
+	if (block >= _dev->block_count)
+		return 0;
+	if (count > _dev->block_count - block)
+		count = _dev->block_count - block;
+
+	for (done = 0; done < count; done += (uint32_t)got) {
+		n = __min(dev->batch_blocks, count - done);
+
+		got = blockdev_read_block(dev->parent, dst, block + done, n);
+		if (got <= 0)
+			return done > 0 ? (int)done : got;
+
+		aes_xts_decrypt(&dev->key, block + done, _dev->block_size, dst, dst, (uint32_t)got);
+		dst += (size_t)got << _dev->block_shift;
+
+		if ((uint32_t)got < n)
+			return (int)(done + got);
+	}
+
+	return (int)done;
+}
+
+static int xts_write_block(struct blockdev *_dev, const void *ptr, block_addr block, uint32_t count)
+{
+	struct xts_blockdev	*dev = (struct xts_blockdev *)_dev;
+	const uint8_t		*src = (const uint8_t *)ptr;
+	uint32_t		done, n;
+	int			got;
+
+	if (block >= _dev->block_count)
+		return 0;
+	if (count > _dev->block_count - block)
+		count = _dev->block_count - block;
+
+	std::lock_guard<std::mutex> guard(*dev->scratch_lock);
+
+	for (done = 0; done < count; done += (uint32_t)got) {
+		n = __min(dev->batch_blocks, count - done);
+
+		aes_xts_encrypt(&dev->key, block + done, _dev->block_size, src, dev->scratch, n);
+		got = blockdev_write_block(dev->parent, dev->scratch, block + done, n);
+		if (got <= 0)
+			return done > 0 ? (int)done : got;
+
+		src += (size_t)got << _dev->block_shift;
+
+		if ((uint32_t)got < n)
+			return (int)(done + got);
+	}
+
+	return (int)done;
+}
+
+/* clear key material in a way the compiler can't drop as a dead store */
+static void xts_wipe(void *ptr, size_t len)
+{
+	volatile uint8_t *p = (volatile uint8_t *)ptr;
+
+	while (len-- > 0)
+		*p++ = 0;
+}
+
+struct blockdev *create_xts_blockdev(const char *name, struct blockdev *parent, const void *key, size_t key_length)
+{
+	struct xts_blockdev	*dev;
+	uint32_t		align;
+	size_t			half = key_length / 2;
+
+	if (parent == NULL)
+		return NULL;
+
+	/* a block is one XTS data unit, and without ciphertext stealing that must be whole AES blocks */
+	if (parent->block_size < AES_BLOCK_LENGTH || (parent->block_size % AES_BLOCK_LENGTH) != 0) {
+		printf("xts_blockdev: block size %u of %s is not a multiple of %u\n",
+		       parent->block_size, parent->name, AES_BLOCK_LENGTH);
+		return NULL;
+	}
+
+	/* IEEE 1619 wants the data and tweak keys independent; equal halves are a mistake, not a key */
+	if ((key_length == 32 || key_length == 64) && memcmp(key, (const uint8_t *)key + half, half) == 0) {
+		printf("xts_blockdev: the two halves of the key are the same\n");
+		return NULL;
+	}
+
+	dev = (struct xts_blockdev *)calloc(1, sizeof(*dev));
+	if (dev == NULL)
+		return NULL;
+
+	if (aes_xts_set_key(&dev->key, key, key_length) != 0) {
+		printf("xts_blockdev: key must be 32 or 64 bytes, not %u\n", (unsigned)key_length);
+		free(dev);
+		return NULL;
+	}
+
+	/* only whole blocks of the parent can be encrypted */
+	construct_blockdev(&dev->bdev, name, (uint64_t)parent->block_count << parent->block_shift, parent->block_size);
+	dev->parent = parent;
+	dev->batch_blocks = __max(1u, (uint32_t)(XTS_BATCH_BYTES >> parent->block_shift));
+
+	/* reads land in the caller's buffer straight from the parent, so callers need the parent's alignment */
+	if (parent->alignment > 1)
+		blockdev_set_buffer_alignment(&dev->bdev, parent->alignment);
+
+	align = __max(parent->alignment, 16u);
+	dev->scratch_alloc = malloc(((size_t)dev->batch_blocks << parent->block_shift) + align);
+	dev->scratch_lock = new (std::nothrow) std::mutex;
+	if (dev->scratch_alloc == NULL || dev->scratch_lock == NULL) {
+		free_xts_blockdev(&dev->bdev);
+		return NULL;
+	}
+	dev->scratch = (uint8_t *)(((uintptr_t)dev->scratch_alloc + align - 1) & ~(uintptr_t)(align - 1));
+
+	dev->bdev.read_block_hook = &xts_read_block;
+	dev->bdev.write_block_hook = &xts_write_block;
+
+	return &dev->bdev;
+}
+
+void free_xts_blockdev(struct blockdev *_dev)
+{
+	struct xts_blockdev *dev = (struct xts_blockdev *)_dev;
+
+	xts_wipe(&dev->key, sizeof(dev->key));
+	delete dev->scratch_lock;
+	free(dev->scratch_alloc);
+	free(dev);
+}
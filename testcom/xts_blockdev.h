@@ -0,0 +1,25 @@
+/*
+ * Encrypting block device.
+ *
+ * Sits over another device and keeps everything stored there encrypted with
+ * AES-XTS (see aes.h): each block is one data unit and its block number is
+ * the tweak, so any block can be read or written on its own. Reads go to the
+ * parent in batches, each decrypted in place while it is still in cache, and
+ * only the blocks asked for are read or decrypted.
+ */
+
+#ifndef __LIB_XTS_BLOCKDEV_H
+#define __LIB_XTS_BLOCKDEV_H
+
+#include "blockdev.h"
+
+__BEGIN_DECLS
+
+/* create_xts_blockdev() is declared in blockdev.h next to the other backends */
+
+/* drop an xts device, leaving its parent alone; unregister it first */
+void free_xts_blockdev(struct blockdev *dev);
+
+__END_DECLS
+
+#endif
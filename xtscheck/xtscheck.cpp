@@ -0,0 +1,159 @@
+// xtscheck.cpp : Checks the AES-XTS code against the IEEE 1619 test vectors.
+//
+// usage: xtscheck
+//
+// Runs XTS-AES-128 vectors 1 and 4 of IEEE 1619-2007 through aes_xts_encrypt
+// and aes_xts_decrypt, on the AES-NI path when the CPU has it and then on the
+// table path, and compares the results with the ciphertext the standard gives.
+// Prints each failed check and exits with 1 if there were any, 0 otherwise.
+
+#include "pch.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "aes.h"
+
+struct XtsVector {
+	const char	*name;
+	const char	*key;		/* key 1 then key 2, in hex */
+	uint64_t	unit;		/* data unit number, the tweak */
+	uint32_t	length;		/* of the one data unit */
+	bool		counting;	/* plaintext bytes count up from 0; otherwise all zero */
+	const char	*ciphertext;	/* in hex */
+};
+
+static const struct XtsVector kVectors[] = {
+	{
+		"vector 1",
+		"00000000000000000000000000000000"
+		"00000000000000000000000000000000",
+		0, 32, false,
+		"917cf69ebd68b2ec9b9fe9a3eadda692cd43d2f59598ed858c02c2652fbf922e"
+	},
+	{
+		"vector 4",
+		"27182818284590452353602874713526"
+		"31415926535897932384626433832795",
+		0, 512, true,
+		"27a7479befa1d476489f308cd4cfa6e2a96e4bbe3208ff25287dd3819616e89c"
+		"c78cf7f5e543445f8333d8fa7f56000005279fa5d8b5e4ad40e736ddb4d35412"
+		"328063fd2aab53e5ea1e0a9f332500a5df9487d07a5c92cc512c8866c7e860ce"
+		"93fdf166a24912b422976146ae20ce846bb7dc9ba94a767aaef20c0d61ad0265"
+		"5ea92dc4c4e41a8952c651d33174be51a10c421110e6d81588ede82103a252d8"
+		"a750e8768defffed9122810aaeb99f9172af82b604dc4b8e51bcb08235a6f434"
+		"1332e4ca60482a4ba1a03b3e65008fc5da76b70bf1690db4eae29c5f1badd03c"
+		"5ccf2a55d705ddcd86d449511ceb7ec30bf12b1fa35b913f9f747a8afd1b130e"
+		"94bff94effd01a91735ca1726acd0b197c4e5b03393697e126826fb6bbde8ecc"
+		"1e08298516e2c9ed03ff3c1b7860f6de76d4cecd94c8119855ef5297ca67e9f3"
+		"e7ff72b1e99785ca0a7e7720c5b36dc6d72cac9574c8cbbc2f801e23e56fd344"
+		"b07f22154beba0f08ce8891e643ed995c94d9a69c9f1b5f499027a78572aeebd"
+		"74d20cc39881c213ee770b1010e4bea718846977ae119f7a023ab58cca0ad752"
+		"afe656bb3c17256a9f6e9bf19fdd5a38fc82bbe872c5539edb609ef4f79c203e"
+		"bb140f2e583cb2ad15b4aa5b655016a8449277dbd477ef2c8d6c017db738b18d"
+		"eb4a427d1923ce3ff262735779a418f20a282df920147beabe421ee5319d0568"
+	},
+};
+
+static int failures;
+
+static int HexDigit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* the vectors are ours, so a malformed one is a bug here; it fails the check rather than passing silently */
+static bool FromHex(const char *hex, std::vector<uint8_t> &bytes)
+{
+	int	high, low;
+
+	bytes.clear();
+	for (; hex[0] != '\0'; hex += 2) {
+		high = HexDigit(hex[0]);
+		low = high < 0 ? -1 : HexDigit(hex[1]);
+		if (low < 0)
+			return false;
+		bytes.push_back((uint8_t)(high << 4 | low));
+	}
+	return true;
+}
+
+/* report where got first differs from expected, if it does */
+static void Compare(const char *path, const char *name, const char *step, const uint8_t *got,
+		    const uint8_t *expected, uint32_t length)
+{
+	uint32_t	i;
+
+	for (i = 0; i < length; i++) {
+		if (got[i] != expected[i]) {
+			printf("FAIL: %s, %s: %s: byte %u is 0x%02x, expected 0x%02x\n", path, name, step,
+			       i, got[i], expected[i]);
+			failures++;
+			return;
+		}
+	}
+}
+
+static void CheckVector(const char *path, const struct XtsVector *vector)
+{
+	std::vector<uint8_t>	key, expected, plaintext(vector->length), buffer(vector->length);
+	struct aes_xts_key	xts;
+	uint32_t		i;
+
+	if (!FromHex(vector->key, key) || !FromHex(vector->ciphertext, expected) || expected.size() != vector->length) {
+		printf("FAIL: %s: the vector is malformed\n", vector->name);
+		failures++;
+		return;
+	}
+	for (i = 0; i < vector->length; i++)
+		plaintext[i] = vector->counting ? (uint8_t)i : 0;
+
+	if (aes_xts_set_key(&xts, key.data(), key.size()) != 0) {
+		printf("FAIL: %s, %s: aes_xts_set_key refused a %u byte key\n", path, vector->name, (unsigned)key.size());
+		failures++;
+		return;
+	}
+
+	/* encrypt into a separate buffer, then decrypt that in place */
+	aes_xts_encrypt(&xts, vector->unit, vector->length, plaintext.data(), buffer.data(), 1);
+	Compare(path, vector->name, "encrypt", buffer.data(), expected.data(), vector->length);
+
+	aes_xts_decrypt(&xts, vector->unit, vector->length, buffer.data(), buffer.data(), 1);
+	Compare(path, vector->name, "decrypt", buffer.data(), plaintext.data(), vector->length);
+}
+
+static void CheckVectors(const char *path)
+{
+	for (const struct XtsVector &vector : kVectors)
+		CheckVector(path, &vector);
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argv;
+	if (argc > 1) {
+		printf("usage: xtscheck\n");
+		return 1;
+	}
+
+	/* each path sets up its own keys, so a schedule one of them gets wrong can't hide */
+	if (aes_set_accelerated(true))
+		CheckVectors("AES-NI");
+	else
+		printf("xtscheck: no AES-NI on this CPU, checking the table path only\n");
+
+	aes_set_accelerated(false);
+	CheckVectors("table");
+	aes_set_accelerated(true);
+
+	if (failures != 0) {
+		printf("xtscheck: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("xtscheck: all checks passed\n");
+	return 0;
+}